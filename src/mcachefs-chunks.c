@@ -0,0 +1,537 @@
+#include "mcachefs.h"
+#include "mcachefs-chunks.h"
+
+/**
+ * Chunk map file : a fixed header followed by one bit per chunk
+ * The header records the size and modification time of the source when the backup started, so that an
+ * interrupted backup is only resumed if the source has not changed since.
+ */
+#define MCACHEFS_CHUNKS_MAGIC "mcachefs-chunks-2"
+
+struct mcachefs_chunks_header_t
+{
+    char magic[24];
+    off_t chunk_size;
+    off_t size;
+    off_t mtime;
+};
+
+static char *
+mcachefs_chunks_makepath(const char *path)
+{
+    char *chunkspath, *mappath;
+
+    chunkspath = mcachefs_makepath(path, MCACHEFS_CHUNKS_DIR);
+    if (!chunkspath)
+        return NULL;
+    mappath = mcachefs_makepath_cache(chunkspath);
+    free(chunkspath);
+    return mappath;
+}
+
+static int
+mcachefs_chunks_create(const char *path)
+{
+    char *chunkspath;
+    int res;
+
+    chunkspath = mcachefs_makepath(path, MCACHEFS_CHUNKS_DIR);
+    if (!chunkspath)
+        return -ENOMEM;
+    res = mcachefs_createpath_cache(chunkspath, 0);
+    free(chunkspath);
+    return res;
+}
+
+static off_t
+mcachefs_chunks_count_present(struct mcachefs_file_t *mfile)
+{
+    off_t chunk, present = 0;
+    for (chunk = 0; chunk < mfile->chunks.nb; chunk++)
+    {
+        if (mfile->chunks.map[chunk >> 3] & (1 << (chunk & 7)))
+            present++;
+    }
+    return present;
+}
+
+int
+mcachefs_chunks_open(struct mcachefs_file_t *mfile, off_t size, time_t mtime)
+{
+    struct mcachefs_chunks_header_t header;
+    off_t chunk_size = mcachefs_config_get_chunk_size();
+    off_t nb = (size + chunk_size - 1) / chunk_size;
+    size_t mapsize = (nb + 7) >> 3;
+    char *mappath;
+    int fd, res;
+
+    mcachefs_file_check_locked_file(mfile);
+
+    if (mfile->chunks.map)
+    {
+        if (mfile->chunks.size == size && mfile->chunks.chunk_size == chunk_size && mfile->chunks.mtime == mtime)
+            return 1;
+        mcachefs_chunks_close(mfile);
+    }
+
+    if ((res = mcachefs_chunks_create(mfile->path)) != 0)
+    {
+        Err("Could not create chunk map path for '%s' : err=%d\n", mfile->path, res);
+        return res < 0 ? res : -EIO;
+    }
+    mappath = mcachefs_chunks_makepath(mfile->path);
+    if (!mappath)
+        return -ENOMEM;
+
+    fd = open(mappath, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        res = -errno;
+        Err("Could not open chunk map '%s' : err=%d:%s\n", mappath, errno, strerror(errno));
+        free(mappath);
+        return res;
+    }
+
+    mfile->chunks.map = (unsigned char *) malloc(mapsize ? mapsize : 1);
+    mfile->chunks.inflight = (unsigned char *) calloc(mapsize ? mapsize : 1, 1);
+    if (!mfile->chunks.map || !mfile->chunks.inflight)
+    {
+        free(mfile->chunks.map);
+        free(mfile->chunks.inflight);
+        mfile->chunks.map = NULL;
+        mfile->chunks.inflight = NULL;
+        close(fd);
+        free(mappath);
+        return -ENOMEM;
+    }
+
+    mfile->chunks.fd = fd;
+    mfile->chunks.data_fd = -1;
+    mfile->chunks.unsynced = 0;
+    mfile->chunks.chunk_size = chunk_size;
+    mfile->chunks.size = size;
+    mfile->chunks.mtime = mtime;
+    mfile->chunks.nb = nb;
+    mfile->chunks.cursor = 0;
+
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && strncmp(header.magic, MCACHEFS_CHUNKS_MAGIC, sizeof(header.magic)) == 0
+        && header.chunk_size == chunk_size && header.size == size && header.mtime == (off_t) mtime
+        && pread(fd, mfile->chunks.map, mapsize, sizeof(header)) == (ssize_t) mapsize)
+    {
+        mfile->chunks.present = mcachefs_chunks_count_present(mfile);
+        Log("Loaded chunk map '%s' : %lu/%lu chunks present\n", mappath, (unsigned long) mfile->chunks.present,
+            (unsigned long) nb);
+        free(mappath);
+        return 1;
+    }
+
+    Log("Creating chunk map '%s' : size=%lu, chunk_size=%lu, nb=%lu\n", mappath, (unsigned long) size,
+        (unsigned long) chunk_size, (unsigned long) nb);
+
+    memset(mfile->chunks.map, 0, mapsize ? mapsize : 1);
+    mfile->chunks.present = 0;
+
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, MCACHEFS_CHUNKS_MAGIC, sizeof(header.magic));
+    header.chunk_size = chunk_size;
+    header.size = size;
+    header.mtime = (off_t) mtime;
+
+    if (ftruncate(fd, 0) || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+        || ftruncate(fd, sizeof(header) + mapsize))
+    {
+        res = errno ? -errno : -EIO;
+        Err("Could not initialize chunk map '%s' : err=%d:%s\n", mappath, errno, strerror(errno));
+        mcachefs_chunks_close(mfile);
+        unlink(mappath);
+        free(mappath);
+        return res;
+    }
+    free(mappath);
+    return 0;
+}
+
+static int mcachefs_chunks_do_sync(struct mcachefs_file_t *mfile, int unlock);
+
+void
+mcachefs_chunks_close(struct mcachefs_file_t *mfile)
+{
+    if (!mfile->chunks.map)
+        return;
+    mcachefs_chunks_do_sync(mfile, 0);
+    if (mfile->chunks.data_fd != -1)
+        close(mfile->chunks.data_fd);
+    close(mfile->chunks.fd);
+    free(mfile->chunks.map);
+    free(mfile->chunks.inflight);
+    memset(&(mfile->chunks), 0, sizeof(struct mcachefs_file_chunks_t));
+    mfile->chunks.fd = -1;
+    mfile->chunks.data_fd = -1;
+}
+
+int
+mcachefs_chunks_is_present(struct mcachefs_file_t *mfile, off_t chunk)
+{
+    mcachefs_file_check_locked_file(mfile);
+    if (!mfile->chunks.map || chunk < 0 || chunk >= mfile->chunks.nb)
+        return 0;
+    return (mfile->chunks.map[chunk >> 3] & (1 << (chunk & 7))) != 0;
+}
+
+int
+mcachefs_chunks_has_range(struct mcachefs_file_t *mfile, off_t offset, size_t size)
+{
+    off_t chunk, last;
+
+    mcachefs_file_check_locked_file(mfile);
+    if (!mfile->chunks.map)
+        return 0;
+    if (offset >= mfile->chunks.size || size == 0)
+        return 1;
+
+    chunk = offset / mfile->chunks.chunk_size;
+    last = (offset + (off_t) size - 1) / mfile->chunks.chunk_size;
+    if (last >= mfile->chunks.nb)
+        last = mfile->chunks.nb - 1;
+
+    for (; chunk <= last; chunk++)
+    {
+        if (!mcachefs_chunks_is_present(mfile, chunk))
+            return 0;
+    }
+    return 1;
+}
+
+off_t
+mcachefs_chunks_next_missing(struct mcachefs_file_t *mfile, off_t from)
+{
+    off_t chunk;
+
+    mcachefs_file_check_locked_file(mfile);
+    if (!mfile->chunks.map || mfile->chunks.present == mfile->chunks.nb)
+        return -1;
+
+    for (chunk = from < 0 ? 0 : from; chunk < mfile->chunks.nb; chunk++)
+    {
+        if (mfile->chunks.map[chunk >> 3] == 0xff)
+        {
+            chunk |= 7;
+            continue;
+        }
+        if (!(mfile->chunks.map[chunk >> 3] & (1 << (chunk & 7))))
+            return chunk;
+    }
+    return -1;
+}
+
+int
+mcachefs_chunks_post_urgent(struct mcachefs_file_t *mfile, off_t offset, size_t size)
+{
+    off_t first, last;
+    int cur;
+
+    mcachefs_file_check_locked_file(mfile);
+    if (!mfile->chunks.map || size == 0)
+        return -EINVAL;
+
+    first = offset / mfile->chunks.chunk_size;
+    last = (offset + (off_t) size - 1) / mfile->chunks.chunk_size;
+    if (last >= mfile->chunks.nb)
+        last = mfile->chunks.nb - 1;
+
+    for (cur = 0; cur < mfile->chunks.urgent_nb; cur++)
+    {
+        if (mfile->chunks.urgent[cur].first <= first && last <= mfile->chunks.urgent[cur].last)
+            return 0;
+    }
+    if (mfile->chunks.urgent_nb == MCACHEFS_FILE_CHUNKS_URGENT_MAX)
+    {
+        Log("Too many urgent ranges for '%s'\n", mfile->path);
+        return -EBUSY;
+    }
+    mfile->chunks.urgent[mfile->chunks.urgent_nb].first = first;
+    mfile->chunks.urgent[mfile->chunks.urgent_nb].last = last;
+    mfile->chunks.urgent_nb++;
+    Log("Urgent range for '%s' : chunks %lu-%lu\n", mfile->path, (unsigned long) first, (unsigned long) last);
+    return 0;
+}
+
+/**
+ * Get the first chunk starting from chunk from which is neither present nor being copied
+ */
+static off_t
+mcachefs_chunks_next_free(struct mcachefs_file_t *mfile, off_t from)
+{
+    off_t chunk;
+
+    for (chunk = from < 0 ? 0 : from; chunk < mfile->chunks.nb; chunk++)
+    {
+        if ((mfile->chunks.map[chunk >> 3] | mfile->chunks.inflight[chunk >> 3]) == 0xff)
+        {
+            chunk |= 7;
+            continue;
+        }
+        if (!((mfile->chunks.map[chunk >> 3] | mfile->chunks.inflight[chunk >> 3]) & (1 << (chunk & 7))))
+            return chunk;
+    }
+    return -1;
+}
+
+off_t
+mcachefs_chunks_claim(struct mcachefs_file_t *mfile)
+{
+    off_t chunk;
+    int cur;
+
+    mcachefs_file_check_locked_file(mfile);
+    if (!mfile->chunks.map)
+        return -1;
+
+    /**
+     * Drop the urgent ranges already present
+     */
+    for (cur = 0; cur < mfile->chunks.urgent_nb;)
+    {
+        chunk = mcachefs_chunks_next_missing(mfile, mfile->chunks.urgent[cur].first);
+        if (chunk != -1 && chunk <= mfile->chunks.urgent[cur].last)
+        {
+            mfile->chunks.urgent[cur].first = chunk;
+            cur++;
+            continue;
+        }
+        mfile->chunks.urgent_nb--;
+        memmove(&(mfile->chunks.urgent[cur]), &(mfile->chunks.urgent[cur + 1]),
+                (mfile->chunks.urgent_nb - cur) * sizeof(struct mcachefs_file_chunks_urgent_t));
+    }
+
+    for (cur = 0; cur < mfile->chunks.urgent_nb; cur++)
+    {
+        chunk = mcachefs_chunks_next_free(mfile, mfile->chunks.urgent[cur].first);
+        if (chunk != -1 && chunk <= mfile->chunks.urgent[cur].last)
+            goto claim;
+    }
+
+    chunk = mcachefs_chunks_next_free(mfile, mfile->chunks.cursor);
+    if (chunk == -1)
+        chunk = mcachefs_chunks_next_free(mfile, 0);
+    if (chunk == -1)
+        return -1;
+    mfile->chunks.cursor = chunk + 1;
+
+  claim:
+    mfile->chunks.inflight[chunk >> 3] |= (1 << (chunk & 7));
+    return chunk;
+}
+
+void
+mcachefs_chunks_unclaim(struct mcachefs_file_t *mfile, off_t chunk)
+{
+    mcachefs_file_check_locked_file(mfile);
+    if (!mfile->chunks.map || chunk < 0 || chunk >= mfile->chunks.nb)
+        return;
+    mfile->chunks.inflight[chunk >> 3] &= ~(1 << (chunk & 7));
+}
+
+void
+mcachefs_chunks_set_present(struct mcachefs_file_t *mfile, off_t chunk)
+{
+    off_t index = chunk >> 3;
+
+    mcachefs_file_check_locked_file(mfile);
+    if (!mfile->chunks.map || chunk < 0 || chunk >= mfile->chunks.nb)
+    {
+        Err("Invalid chunk %lu for '%s' (nb=%lu)\n", (unsigned long) chunk, mfile->path, (unsigned long) mfile->chunks.nb);
+        return;
+    }
+    if (mfile->chunks.map[index] & (1 << (chunk & 7)))
+        return;
+
+    mfile->chunks.map[index] |= (1 << (chunk & 7));
+    mfile->chunks.present++;
+    mcachefs_file_notify_file(mfile);
+
+    if (!mfile->chunks.unsynced || index < mfile->chunks.unsynced_first)
+        mfile->chunks.unsynced_first = index;
+    if (!mfile->chunks.unsynced || index > mfile->chunks.unsynced_last)
+        mfile->chunks.unsynced_last = index;
+    mfile->chunks.unsynced++;
+
+    if (mfile->chunks.unsynced * mfile->chunks.chunk_size >= MCACHEFS_CHUNKS_SYNC_SIZE)
+        mcachefs_chunks_sync(mfile);
+}
+
+/**
+ * Persist the chunks marked present since the last sync, once the backing file holds them on disk - mfile lock HELD
+ * @param unlock set to release the mfile lock while syncing the backing file, the chunks persisted are then those
+ * marked present when the sync started. The map is neither closed nor synced by others meanwhile.
+ */
+static int
+mcachefs_chunks_do_sync(struct mcachefs_file_t *mfile, int unlock)
+{
+    off_t first, last, nb, length;
+    unsigned char *map = NULL;
+    char *backingpath;
+    int res = 0;
+
+    mcachefs_file_check_locked_file(mfile);
+    while (mfile->chunks.syncing)
+        mcachefs_file_wait_file(mfile, NULL);
+    if (!mfile->chunks.map || !mfile->chunks.unsynced)
+        return 0;
+
+    /**
+     * The backing file is opened on its own : the fds of the transfers come and go while the map is loaded
+     */
+    if (mfile->chunks.data_fd == -1 && (backingpath = mcachefs_makepath_cache(mfile->path)) != NULL)
+    {
+        mfile->chunks.data_fd = open(backingpath, O_RDONLY);
+        free(backingpath);
+    }
+    if (mfile->chunks.data_fd == -1)
+    {
+        res = -errno;
+        Err("Could not open backing file of '%s', chunks not persisted : err=%d:%s\n", mfile->path, errno, strerror(errno));
+        return res ? res : -EIO;
+    }
+
+    first = mfile->chunks.unsynced_first;
+    last = mfile->chunks.unsynced_last;
+    nb = mfile->chunks.unsynced;
+    length = last - first + 1;
+    if (unlock && (map = (unsigned char *) malloc(length)) != NULL)
+    {
+        memcpy(map, &(mfile->chunks.map[first]), length);
+        mfile->chunks.unsynced = 0;
+        mfile->chunks.syncing = 1;
+        mcachefs_file_unlock_file(mfile);
+
+        res = fdatasync(mfile->chunks.data_fd) ? -errno : 0;
+
+        mcachefs_file_lock_file(mfile);
+        mfile->chunks.syncing = 0;
+        mcachefs_file_notify_file(mfile);
+        if (res)
+        {
+            if (!mfile->chunks.unsynced || first < mfile->chunks.unsynced_first)
+                mfile->chunks.unsynced_first = first;
+            if (!mfile->chunks.unsynced || last > mfile->chunks.unsynced_last)
+                mfile->chunks.unsynced_last = last;
+            mfile->chunks.unsynced += nb;
+        }
+    }
+    else
+    {
+        res = fdatasync(mfile->chunks.data_fd) ? -errno : 0;
+        if (!res)
+            mfile->chunks.unsynced = 0;
+    }
+    if (res)
+    {
+        Err("Could not sync backing file of '%s', chunks not persisted : err=%d:%s\n", mfile->path, -res, strerror(-res));
+        free(map);
+        return res;
+    }
+
+    if (pwrite(mfile->chunks.fd, map ? map : &(mfile->chunks.map[first]), length, sizeof(struct mcachefs_chunks_header_t) + first)
+        != length)
+    {
+        Err("Could not update chunk map of '%s' : err=%d:%s\n", mfile->path, errno, strerror(errno));
+    }
+    free(map);
+    return 0;
+}
+
+int
+mcachefs_chunks_sync(struct mcachefs_file_t *mfile)
+{
+    return mcachefs_chunks_do_sync(mfile, 1);
+}
+
+void
+mcachefs_chunks_get_range(struct mcachefs_file_t *mfile, off_t chunk, off_t *offset, off_t *length)
+{
+    *offset = chunk * mfile->chunks.chunk_size;
+    *length = mfile->chunks.size - *offset;
+    if (*length > mfile->chunks.chunk_size)
+        *length = mfile->chunks.chunk_size;
+    if (*length < 0)
+        *length = 0;
+}
+
+off_t
+mcachefs_chunks_get_present_size(struct mcachefs_file_t *mfile)
+{
+    off_t size;
+
+    if (!mfile->chunks.map)
+        return 0;
+    size = mfile->chunks.present * mfile->chunks.chunk_size;
+    return size < mfile->chunks.size ? size : mfile->chunks.size;
+}
+
+int
+mcachefs_chunks_exist(const char *path)
+{
+    char *mappath;
+    struct stat st;
+    int res;
+
+    mappath = mcachefs_chunks_makepath(path);
+    if (!mappath)
+        return 0;
+    res = lstat(mappath, &st);
+    free(mappath);
+    return res == 0 && S_ISREG(st.st_mode);
+}
+
+int
+mcachefs_chunks_remove(const char *path)
+{
+    char *mappath;
+    int res = 0;
+
+    mappath = mcachefs_chunks_makepath(path);
+    if (!mappath)
+        return -ENOMEM;
+    if (remove(mappath) && errno != ENOENT)
+    {
+        res = -errno;
+        Err("Could not remove chunk map '%s' : err=%d:%s\n", mappath, errno, strerror(errno));
+    }
+    free(mappath);
+    return res;
+}
+
+int
+mcachefs_chunks_rename(const char *path, const char *to)
+{
+    char *mappath, *mapto;
+    struct stat st;
+    int res = 0;
+
+    mappath = mcachefs_chunks_makepath(path);
+    if (!mappath)
+        return -ENOMEM;
+    if (lstat(mappath, &st))
+    {
+        free(mappath);
+        return 0;
+    }
+    mapto = mcachefs_chunks_makepath(to);
+    if (!mapto || mcachefs_chunks_create(to))
+    {
+        Err("Could not create chunk map path for '%s'\n", to);
+        free(mappath);
+        free(mapto);
+        return -EIO;
+    }
+    if (rename(mappath, mapto))
+    {
+        res = -errno;
+        Err("Could not rename chunk map '%s' to '%s' : err=%d:%s\n", mappath, mapto, errno, strerror(errno));
+    }
+    free(mappath);
+    free(mapto);
+    return res;
+}
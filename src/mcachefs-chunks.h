@@ -0,0 +1,118 @@
+#ifndef __MCACHEFS_CHUNKS_H
+#define __MCACHEFS_CHUNKS_H
+
+/**
+ * ********************* CHUNKS *****************************
+ * Backing files are sparse files filled chunk by chunk. The presence of each chunk is recorded in a
+ * persistent map stored under MCACHEFS_CHUNKS_DIR in the cache, with the same path as the backing file.
+ * The map only exists while the backing file is partial : a backing file without map is complete.
+ * Chunks are persisted as present by batches, once their data has been synced to the backing file, so that a chunk
+ * found present after a crash is never a hole.
+ */
+
+/**
+ * Where chunk maps are stored, relative to the cache root.
+ * This lives under the vops dir, which is never backed up, so it can not collide with a real file.
+ */
+#define MCACHEFS_CHUNKS_DIR "/.mcachefs/chunks"
+
+/**
+ * Bytes of chunks marked present between two syncs of the backing file
+ */
+#define MCACHEFS_CHUNKS_SYNC_SIZE (64 << 20)
+
+/**
+ * Load (or create) the chunk map of a file to be backed up - mfile lock HELD
+ * A map is only reused when it has been built for the same source size and mtime, and the same chunk size :
+ * this is how an interrupted backup is resumed, after a retry or a remount.
+ * @return 1 if an existing map has been loaded, 0 if a fresh (empty) map was created, -errno on error
+ */
+int mcachefs_chunks_open(struct mcachefs_file_t *mfile, off_t size, time_t mtime);
+
+/**
+ * Release the in-memory chunk map, keeping the persistent one with the chunks present so far - mfile lock HELD
+ */
+void mcachefs_chunks_close(struct mcachefs_file_t *mfile);
+
+/**
+ * Check if a given chunk is present in the backing file - mfile lock HELD
+ */
+int mcachefs_chunks_is_present(struct mcachefs_file_t *mfile, off_t chunk);
+
+/**
+ * Check if all the chunks covering [offset, offset+size[ are present - mfile lock HELD
+ */
+int mcachefs_chunks_has_range(struct mcachefs_file_t *mfile, off_t offset, size_t size);
+
+/**
+ * Get the first missing chunk starting from chunk from - mfile lock HELD
+ * @return the index of the chunk, or -1 if all chunks from there are present
+ */
+off_t mcachefs_chunks_next_missing(struct mcachefs_file_t *mfile, off_t from);
+
+/**
+ * Ask the backup thread to fetch the chunks covering [offset, offset+size[ before going on with sequential fill - mfile lock HELD
+ * @return 0 if the range is queued, -EBUSY if too many ranges are pending
+ */
+int mcachefs_chunks_post_urgent(struct mcachefs_file_t *mfile, off_t offset, size_t size);
+
+/**
+ * Claim the next chunk to back up, which no other transfer is copying - mfile lock HELD
+ * Chunks of the pending urgent ranges come first, then chunks are taken sequentially.
+ * @return the index of the chunk, or -1 if no chunk is left to claim
+ */
+off_t mcachefs_chunks_claim(struct mcachefs_file_t *mfile);
+
+/**
+ * Release a claimed chunk, after it has been copied or when its copy failed - mfile lock HELD
+ */
+void mcachefs_chunks_unclaim(struct mcachefs_file_t *mfile, off_t chunk);
+
+/**
+ * Mark a chunk as present and wake up waiters of the file, persisting it in the map with the next batch - mfile lock HELD,
+ * released while a batch is synced
+ */
+void mcachefs_chunks_set_present(struct mcachefs_file_t *mfile, off_t chunk);
+
+/**
+ * Sync the backing file, then persist the chunks marked present since the last sync - mfile lock HELD, released while
+ * the backing file is synced
+ * @return 0, or -errno if the backing file could not be synced and the chunks were not persisted
+ */
+int mcachefs_chunks_sync(struct mcachefs_file_t *mfile);
+
+/**
+ * Get the byte range covered by a chunk, clipped to the size of the file - mfile lock HELD
+ */
+void mcachefs_chunks_get_range(struct mcachefs_file_t *mfile, off_t chunk, off_t *offset, off_t *length);
+
+/**
+ * Number of bytes present in the backing file - mfile lock HELD
+ */
+off_t mcachefs_chunks_get_present_size(struct mcachefs_file_t *mfile);
+
+/**
+ * Check if all the chunks are present - mfile lock HELD
+ */
+static inline int
+mcachefs_chunks_complete(struct mcachefs_file_t *mfile)
+{
+    return mfile->chunks.map != NULL && mfile->chunks.present == mfile->chunks.nb;
+}
+
+/**
+ * Check if a chunk map exists for this path, ie if the backing file is partial
+ */
+int mcachefs_chunks_exist(const char *path);
+
+/**
+ * Remove the chunk map of a path (or the chunk map directory of a directory), if any
+ */
+int mcachefs_chunks_remove(const char *path);
+
+/**
+ * Rename the chunk map of a path (or the chunk map directory of a directory), if any
+ */
+int mcachefs_chunks_rename(const char *path, const char *to);
+
+#endif // __MCACHEFS_CHUNKS_H
@@ -1,4 +1,7 @@
 #include "mcachefs.h"
+#include "mcachefs-chunks.h"
+#include "mcachefs-dedup.h"
+#include "mcachefs-signatures.h"
 #include "mcachefs-vops.h"
 
 #include <sys/types.h>
@@ -79,7 +82,14 @@ mcachefs_build_backing_files(struct mcachefs_backing_files *filelist, const char
         }
 
         Log("Prefix=%s, file=%s => %s, type=%u\n", prefix, de->d_name, path, st.st_mode);
-        if (S_ISDIR(st.st_mode))
+        if (S_ISDIR(st.st_mode) && strcmp(path, MCACHEFS_VOPS_DIR) == 0)
+        {
+            /**
+             * Internal mcachefs data (chunk maps), not backing files
+             */
+            free(path);
+        }
+        else if (S_ISDIR(st.st_mode))
         {
             strcat(path, "/");
             fd = openat(dirfd, de->d_name, O_RDONLY);
@@ -250,6 +260,8 @@ mcachefs_cleanup_backing()      // struct mcachefs_file_t *mvops, int simulate)
             {
                 Err("Could not unlink '%s' : err=%d:%s\n", file->path, errno, strerror(errno));
             }
+            mcachefs_chunks_remove(file->path);
+            mcachefs_signatures_remove(file->path);
 #if 0
         }
 #endif
@@ -274,4 +286,6 @@ mcachefs_cleanup_backing()      // struct mcachefs_file_t *mvops, int simulate)
     close(rootfd);
     if (backingfd != rootfd)
         close(backingfd);
+
+    mcachefs_dedup_collect();
 }
@@ -0,0 +1,1114 @@
+#include "mcachefs.h"
+#include "mcachefs-compress.h"
+#include "mcachefs-vops.h"
+
+#include <dlfcn.h>
+#include <sys/xattr.h>
+
+#define MCACHEFS_COMPRESS_MAGIC      "mcachefs.zfile.1"
+#define MCACHEFS_COMPRESS_XATTR      "user.mcachefs.compressed"
+#define MCACHEFS_COMPRESS_TMP_PREFIX "/.mcachefs/compress"
+#define MCACHEFS_COMPRESS_HASH_SIZE  4096
+#define MCACHEFS_COMPRESS_INDEXES    32
+#define MCACHEFS_COMPRESS_ZSTD_LEVEL 3
+
+#define MCACHEFS_COMPRESS_CODEC_UNLOADED 0
+#define MCACHEFS_COMPRESS_CODEC_READY    1
+#define MCACHEFS_COMPRESS_CODEC_MISSING  2
+
+const char *mcachefs_compress_names[] = { "none", "lz4", "zstd", NULL };
+
+/**
+ * Compressed backing file layout : the header, the frames of the blocks, then the index of the frames.
+ * The header is written last, so that a file interrupted while being written is never taken for a compressed one.
+ */
+struct mcachefs_compress_header_t
+{
+    char magic[24];
+    int codec;
+    int block_size;
+    off_t size;                 //< Size of the plain file
+    off_t blocks;
+    off_t index;                //< Offset of the index, right after the last frame
+};
+
+struct mcachefs_compress_frame_t
+{
+    off_t offset;
+    int length;
+    int raw;                    //< Set when the block did not shrink, and is stored as is
+};
+
+/**
+ * Codec entry points, resolved by dlopen() the first time the codec is needed
+ */
+struct mcachefs_compress_codec_t
+{
+    const char *library;
+    const char *compress_symbol;
+    const char *decompress_symbol;
+    int state;
+    void *handle;
+    void *compress;
+    void *decompress;
+};
+
+/**
+ * A compressed backing file is identified by its inode and change time, which rename() and inflate() both change
+ */
+struct mcachefs_compress_key_t
+{
+    dev_t dev;
+    ino_t ino;
+    time_t ctime;
+    long ctime_nsec;
+};
+
+struct mcachefs_compress_index_t
+{
+    struct mcachefs_compress_key_t key;
+    struct mcachefs_compress_header_t header;
+    struct mcachefs_compress_frame_t *frames;   //< NULL when the slot is free
+    unsigned long used;         //< Tick of the last lookup, the least recently used slot is recycled
+};
+
+struct mcachefs_compress_block_t
+{
+    struct mcachefs_compress_key_t key;
+    off_t block;
+    char *data;
+    struct mcachefs_compress_block_t *hnext;
+    struct mcachefs_compress_block_t *previous; //< LRU list, most recently used first
+    struct mcachefs_compress_block_t *next;
+};
+
+struct mcachefs_compress_queue_t
+{
+    struct mcachefs_file_t *mfile;
+    struct mcachefs_compress_queue_t *next;
+};
+
+struct mcachefs_compress_stats_t
+{
+    unsigned long files_compressed;
+    unsigned long files_bypassed;
+    unsigned long files_skipped;
+    unsigned long files_failed;
+    unsigned long files_inflated;
+    unsigned long files_dropped;
+    unsigned long long bytes_plain;
+    unsigned long long bytes_compressed;
+    unsigned long long hits;
+    unsigned long long misses;
+};
+
+static struct mcachefs_compress_codec_t mcachefs_compress_codecs[] = {
+    {NULL, NULL, NULL, MCACHEFS_COMPRESS_CODEC_MISSING, NULL, NULL, NULL},
+    {"liblz4.so.1", "LZ4_compress_default", "LZ4_decompress_safe", MCACHEFS_COMPRESS_CODEC_UNLOADED, NULL, NULL, NULL},
+    {"libzstd.so.1", "ZSTD_compress", "ZSTD_decompress", MCACHEFS_COMPRESS_CODEC_UNLOADED, NULL, NULL, NULL},
+};
+
+typedef int (*mcachefs_compress_lz4_compress_t) (const char *src, char *dst, int size, int capacity);
+typedef int (*mcachefs_compress_lz4_decompress_t) (const char *src, char *dst, int size, int capacity);
+typedef size_t(*mcachefs_compress_zstd_compress_t) (void *dst, size_t capacity, const void *src, size_t size, int level);
+typedef size_t(*mcachefs_compress_zstd_decompress_t) (void *dst, size_t capacity, const void *src, size_t size);
+
+/**
+ * The compress mutex is the innermost lock : no other lock is taken with it held
+ */
+static struct mcachefs_mutex_t mcachefs_compress_mutex;
+static sem_t mcachefs_compress_sem;
+static pthread_t mcachefs_compress_threadid;
+static int mcachefs_compress_quit = 0;
+
+static struct mcachefs_compress_queue_t *mcachefs_compress_queue_head = NULL;
+static struct mcachefs_compress_queue_t *mcachefs_compress_queue_tail = NULL;
+static int mcachefs_compress_queue_nb = 0;
+
+static struct mcachefs_compress_index_t mcachefs_compress_indexes[MCACHEFS_COMPRESS_INDEXES];
+static unsigned long mcachefs_compress_tick = 0;
+
+static struct mcachefs_compress_block_t *mcachefs_compress_blocks[MCACHEFS_COMPRESS_HASH_SIZE];
+static struct mcachefs_compress_block_t *mcachefs_compress_lru_head = NULL;
+static struct mcachefs_compress_block_t *mcachefs_compress_lru_tail = NULL;
+static off_t mcachefs_compress_cache_used = 0;
+static int mcachefs_compress_cache_nb = 0;
+
+static struct mcachefs_compress_stats_t mcachefs_compress_stats;
+
+static void
+mcachefs_compress_lock()
+{
+    mcachefs_mutex_lock(&mcachefs_compress_mutex, "compress", __CONTEXT);
+}
+
+static void
+mcachefs_compress_unlock()
+{
+    mcachefs_mutex_unlock(&mcachefs_compress_mutex, "compress", __CONTEXT);
+}
+
+/**
+ * Resolve the entry points of codec - compress lock HELD
+ * @return 0 if the codec may be used, -ENOSYS if its library is missing
+ */
+static int
+mcachefs_compress_codec_load_locked(int codec)
+{
+    struct mcachefs_compress_codec_t *entry;
+
+    if (codec <= MCACHEFS_COMPRESS_NONE || codec > MCACHEFS_COMPRESS_ZSTD)
+        return -ENOSYS;
+
+    entry = &(mcachefs_compress_codecs[codec]);
+    if (entry->state != MCACHEFS_COMPRESS_CODEC_UNLOADED)
+        return entry->state == MCACHEFS_COMPRESS_CODEC_READY ? 0 : -ENOSYS;
+
+    entry->state = MCACHEFS_COMPRESS_CODEC_MISSING;
+    entry->handle = dlopen(entry->library, RTLD_NOW | RTLD_LOCAL);
+    if (!entry->handle)
+    {
+        Err("Could not load %s for codec %s : %s\n", entry->library, mcachefs_compress_names[codec], dlerror());
+        return -ENOSYS;
+    }
+    entry->compress = dlsym(entry->handle, entry->compress_symbol);
+    entry->decompress = dlsym(entry->handle, entry->decompress_symbol);
+    if (!entry->compress || !entry->decompress)
+    {
+        Err("Could not find %s and %s in %s\n", entry->compress_symbol, entry->decompress_symbol, entry->library);
+        dlclose(entry->handle);
+        entry->handle = NULL;
+        return -ENOSYS;
+    }
+    Info("Loaded %s for codec %s\n", entry->library, mcachefs_compress_names[codec]);
+    entry->state = MCACHEFS_COMPRESS_CODEC_READY;
+    return 0;
+}
+
+static int
+mcachefs_compress_codec_load(int codec)
+{
+    int res;
+
+    mcachefs_compress_lock();
+    res = mcachefs_compress_codec_load_locked(codec);
+    mcachefs_compress_unlock();
+    return res;
+}
+
+/**
+ * Compress size bytes of src into dst - codec loaded
+ * @return the length of the frame, or 0 if it would not fit in capacity
+ */
+static int
+mcachefs_compress_encode(int codec, const char *src, int size, char *dst, int capacity)
+{
+    struct mcachefs_compress_codec_t *entry = &(mcachefs_compress_codecs[codec]);
+    size_t res;
+
+    if (capacity <= 0)
+        return 0;
+
+    switch (codec)
+    {
+    case MCACHEFS_COMPRESS_LZ4:
+        return ((mcachefs_compress_lz4_compress_t) entry->compress) (src, dst, size, capacity);
+    case MCACHEFS_COMPRESS_ZSTD:
+        /*
+         * zstd errors are reported as values larger than any valid length
+         */
+        res = ((mcachefs_compress_zstd_compress_t) entry->compress) (dst, capacity, src, size, MCACHEFS_COMPRESS_ZSTD_LEVEL);
+        return res > (size_t) capacity ? 0 : (int) res;
+    }
+    return 0;
+}
+
+/**
+ * Decompress a frame of size bytes into exactly length bytes of dst - codec loaded
+ */
+static int
+mcachefs_compress_decode(int codec, const char *src, int size, char *dst, int length)
+{
+    struct mcachefs_compress_codec_t *entry = &(mcachefs_compress_codecs[codec]);
+    size_t res;
+    int ires;
+
+    switch (codec)
+    {
+    case MCACHEFS_COMPRESS_LZ4:
+        ires = ((mcachefs_compress_lz4_decompress_t) entry->decompress) (src, dst, size, length);
+        return ires == length ? 0 : -EIO;
+    case MCACHEFS_COMPRESS_ZSTD:
+        res = ((mcachefs_compress_zstd_decompress_t) entry->decompress) (dst, length, src, size);
+        return res == (size_t) length ? 0 : -EIO;
+    }
+    return -EIO;
+}
+
+static int
+mcachefs_compress_get_key(int fd, struct mcachefs_compress_key_t *key, struct stat *st)
+{
+    memset(key, 0, sizeof(*key));
+    if (fstat(fd, st))
+        return -errno;
+    key->dev = st->st_dev;
+    key->ino = st->st_ino;
+    key->ctime = st->st_ctim.tv_sec;
+    key->ctime_nsec = st->st_ctim.tv_nsec;
+    return 0;
+}
+
+static int
+mcachefs_compress_key_equals(struct mcachefs_compress_key_t *a, struct mcachefs_compress_key_t *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->ctime == b->ctime && a->ctime_nsec == b->ctime_nsec;
+}
+
+/**
+ * Read and check the header of a compressed backing file of st_size bytes
+ * @return 0 if fd is a compressed backing file, -EINVAL otherwise
+ */
+static int
+mcachefs_compress_read_header(int fd, off_t st_size, struct mcachefs_compress_header_t *header)
+{
+    if (st_size < (off_t) sizeof(*header))
+        return -EINVAL;
+    if (pread(fd, header, sizeof(*header), 0) != (ssize_t) sizeof(*header))
+        return -EINVAL;
+    if (strncmp(header->magic, MCACHEFS_COMPRESS_MAGIC, sizeof(header->magic)))
+        return -EINVAL;
+    if (header->codec <= MCACHEFS_COMPRESS_NONE || header->codec > MCACHEFS_COMPRESS_ZSTD)
+        return -EINVAL;
+    if (header->block_size < 4096 || header->block_size > (16 << 20) || header->size < 0)
+        return -EINVAL;
+    if (header->blocks != (header->size + header->block_size - 1) / header->block_size)
+        return -EINVAL;
+    if (header->index < (off_t) sizeof(*header)
+        || header->index + header->blocks * (off_t) sizeof(struct mcachefs_compress_frame_t) != st_size)
+        return -EINVAL;
+    return 0;
+}
+
+static struct mcachefs_compress_frame_t *
+mcachefs_compress_read_frames(int fd, struct mcachefs_compress_header_t *header)
+{
+    struct mcachefs_compress_frame_t *frames;
+    size_t size = header->blocks * sizeof(struct mcachefs_compress_frame_t);
+    off_t block;
+
+    frames = (struct mcachefs_compress_frame_t *) malloc(size ? size : 1);
+    if (!frames)
+        return NULL;
+    if (size && pread(fd, frames, size, header->index) != (ssize_t) size)
+    {
+        free(frames);
+        return NULL;
+    }
+    for (block = 0; block < header->blocks; block++)
+    {
+        if (frames[block].offset < (off_t) sizeof(*header) || frames[block].length <= 0
+            || frames[block].length > header->block_size || frames[block].offset + frames[block].length > header->index)
+        {
+            Err("Invalid frame %ld in compressed index\n", (long) block);
+            free(frames);
+            return NULL;
+        }
+    }
+    return frames;
+}
+
+int
+mcachefs_compress_is_compressed(int fd)
+{
+    return fgetxattr(fd, MCACHEFS_COMPRESS_XATTR, NULL, 0) >= 0;
+}
+
+/**
+ * Length of the plain contents of block
+ */
+static int
+mcachefs_compress_block_length(struct mcachefs_compress_header_t *header, off_t block)
+{
+    off_t left = header->size - block * header->block_size;
+    return left < header->block_size ? (int) left : header->block_size;
+}
+
+/**
+ * Read and decompress block into data, which holds at least a block - no lock HELD
+ */
+static int
+mcachefs_compress_load_block(int fd, struct mcachefs_compress_header_t *header, struct mcachefs_compress_frame_t *frame,
+                             off_t block, char *data)
+{
+    int length = mcachefs_compress_block_length(header, block);
+    char *buf;
+    int res;
+
+    if (frame->raw)
+    {
+        if (frame->length != length)
+            return -EIO;
+        return pread(fd, data, length, frame->offset) == length ? 0 : -EIO;
+    }
+
+    buf = (char *) malloc(frame->length);
+    if (!buf)
+        return -ENOMEM;
+    if (pread(fd, buf, frame->length, frame->offset) != frame->length)
+        res = -EIO;
+    else
+        res = mcachefs_compress_decode(header->codec, buf, frame->length, data, length);
+    free(buf);
+    return res;
+}
+
+/**
+ * Find, or load, the index of a compressed backing file - compress lock HELD
+ */
+static struct mcachefs_compress_index_t *
+mcachefs_compress_index_get_locked(int fd, struct mcachefs_compress_key_t *key, off_t st_size)
+{
+    struct mcachefs_compress_index_t *index, *victim = NULL;
+    struct mcachefs_compress_header_t header;
+    struct mcachefs_compress_frame_t *frames;
+    int cur;
+
+    mcachefs_compress_tick++;
+    for (cur = 0; cur < MCACHEFS_COMPRESS_INDEXES; cur++)
+    {
+        index = &(mcachefs_compress_indexes[cur]);
+        if (index->frames && mcachefs_compress_key_equals(&(index->key), key))
+        {
+            index->used = mcachefs_compress_tick;
+            return index;
+        }
+        if (!victim || !index->frames || (victim->frames && index->used < victim->used))
+            victim = index;
+    }
+
+    if (mcachefs_compress_read_header(fd, st_size, &header))
+        return NULL;
+    if (mcachefs_compress_codec_load_locked(header.codec))
+        return NULL;
+    if ((frames = mcachefs_compress_read_frames(fd, &header)) == NULL)
+        return NULL;
+
+    free(victim->frames);
+    victim->key = *key;
+    victim->header = header;
+    victim->frames = frames;
+    victim->used = mcachefs_compress_tick;
+    return victim;
+}
+
+static unsigned int
+mcachefs_compress_block_hash(struct mcachefs_compress_key_t *key, off_t block)
+{
+    unsigned long long h = (unsigned long long) key->ino * 0x9E3779B97F4A7C15ULL;
+    h ^= (unsigned long long) key->dev + (unsigned long long) block * 0xC2B2AE3D27D4EB4FULL;
+    return (unsigned int) ((h >> 32) ^ h) % MCACHEFS_COMPRESS_HASH_SIZE;
+}
+
+static void
+mcachefs_compress_lru_unlink_locked(struct mcachefs_compress_block_t *cached)
+{
+    if (cached->previous)
+        cached->previous->next = cached->next;
+    else
+        mcachefs_compress_lru_head = cached->next;
+    if (cached->next)
+        cached->next->previous = cached->previous;
+    else
+        mcachefs_compress_lru_tail = cached->previous;
+    cached->previous = cached->next = NULL;
+}
+
+static void
+mcachefs_compress_lru_push_locked(struct mcachefs_compress_block_t *cached)
+{
+    cached->previous = NULL;
+    cached->next = mcachefs_compress_lru_head;
+    if (mcachefs_compress_lru_head)
+        mcachefs_compress_lru_head->previous = cached;
+    else
+        mcachefs_compress_lru_tail = cached;
+    mcachefs_compress_lru_head = cached;
+}
+
+static struct mcachefs_compress_block_t *
+mcachefs_compress_block_find_locked(struct mcachefs_compress_key_t *key, off_t block)
+{
+    struct mcachefs_compress_block_t *cached;
+
+    for (cached = mcachefs_compress_blocks[mcachefs_compress_block_hash(key, block)]; cached; cached = cached->hnext)
+    {
+        if (cached->block == block && mcachefs_compress_key_equals(&(cached->key), key))
+        {
+            mcachefs_compress_lru_unlink_locked(cached);
+            mcachefs_compress_lru_push_locked(cached);
+            return cached;
+        }
+    }
+    return NULL;
+}
+
+static void
+mcachefs_compress_block_evict_locked(struct mcachefs_compress_block_t *cached)
+{
+    struct mcachefs_compress_block_t **pcur;
+
+    for (pcur = &(mcachefs_compress_blocks[mcachefs_compress_block_hash(&(cached->key), cached->block)]); *pcur;
+         pcur = &((*pcur)->hnext))
+    {
+        if (*pcur == cached)
+        {
+            *pcur = cached->hnext;
+            break;
+        }
+    }
+    mcachefs_compress_lru_unlink_locked(cached);
+    mcachefs_compress_cache_used -= MCACHEFS_COMPRESS_BLOCK_SIZE;
+    mcachefs_compress_cache_nb--;
+    free(cached->data);
+    free(cached);
+}
+
+/**
+ * Keep a decompressed block, taking ownership of data - compress lock HELD
+ */
+static void
+mcachefs_compress_block_insert_locked(struct mcachefs_compress_key_t *key, off_t block, char *data)
+{
+    struct mcachefs_compress_block_t *cached;
+    unsigned int h;
+
+    if (mcachefs_compress_block_find_locked(key, block))
+    {
+        free(data);
+        return;
+    }
+    while (mcachefs_compress_lru_tail
+           && mcachefs_compress_cache_used + MCACHEFS_COMPRESS_BLOCK_SIZE > mcachefs_config_get_compress_cache_size())
+    {
+        mcachefs_compress_block_evict_locked(mcachefs_compress_lru_tail);
+    }
+    cached = (struct mcachefs_compress_block_t *) malloc(sizeof(struct mcachefs_compress_block_t));
+    if (!cached)
+    {
+        free(data);
+        return;
+    }
+    cached->key = *key;
+    cached->block = block;
+    cached->data = data;
+    h = mcachefs_compress_block_hash(key, block);
+    cached->hnext = mcachefs_compress_blocks[h];
+    mcachefs_compress_blocks[h] = cached;
+    mcachefs_compress_lru_push_locked(cached);
+    mcachefs_compress_cache_used += MCACHEFS_COMPRESS_BLOCK_SIZE;
+    mcachefs_compress_cache_nb++;
+}
+
+ssize_t
+mcachefs_compress_pread(int fd, char *buf, size_t size, off_t offset)
+{
+    struct mcachefs_compress_key_t key;
+    struct mcachefs_compress_index_t *index;
+    struct mcachefs_compress_header_t header;
+    struct mcachefs_compress_frame_t frame;
+    struct mcachefs_compress_block_t *cached;
+    struct stat st;
+    off_t end, block;
+    size_t done = 0;
+    int res, skip, length;
+    char *data;
+
+    if ((res = mcachefs_compress_get_key(fd, &key, &st)))
+        return res;
+
+    mcachefs_compress_lock();
+    index = mcachefs_compress_index_get_locked(fd, &key, st.st_size);
+    if (!index)
+    {
+        mcachefs_compress_unlock();
+        Err("Could not read the index of compressed fd=%d\n", fd);
+        return -EIO;
+    }
+    header = index->header;
+    end = offset + (off_t) size;
+    if (end > header.size)
+        end = header.size;
+
+    while (offset + (off_t) done < end)
+    {
+        block = (offset + (off_t) done) / header.block_size;
+        skip = (int) (offset + (off_t) done - block * header.block_size);
+        length = header.block_size - skip;
+        if ((off_t) length > end - offset - (off_t) done)
+            length = (int) (end - offset - (off_t) done);
+
+        if ((cached = mcachefs_compress_block_find_locked(&key, block)) != NULL)
+        {
+            mcachefs_compress_stats.hits++;
+            memcpy(buf + done, cached->data + skip, length);
+            done += length;
+            continue;
+        }
+        mcachefs_compress_stats.misses++;
+        frame = index->frames[block];
+
+        /*
+         * Decompress without the lock, the index slot may be recycled meanwhile
+         */
+        mcachefs_compress_unlock();
+        data = (char *) malloc(MCACHEFS_COMPRESS_BLOCK_SIZE > header.block_size ? MCACHEFS_COMPRESS_BLOCK_SIZE : header.block_size);
+        res = data ? mcachefs_compress_load_block(fd, &header, &frame, block, data) : -ENOMEM;
+        if (res)
+        {
+            Err("Could not decompress block %ld of fd=%d : err=%d:%s\n", (long) block, fd, -res, strerror(-res));
+            free(data);
+            return done ? (ssize_t) done : -EIO;
+        }
+        memcpy(buf + done, data + skip, length);
+        done += length;
+
+        mcachefs_compress_lock();
+        if (header.block_size <= MCACHEFS_COMPRESS_BLOCK_SIZE)
+            mcachefs_compress_block_insert_locked(&key, block, data);
+        else
+            free(data);
+        index = mcachefs_compress_index_get_locked(fd, &key, st.st_size);
+        if (!index)
+            break;
+    }
+    mcachefs_compress_unlock();
+    return (ssize_t) done;
+}
+
+/**
+ * Forget the index and blocks of a compressed backing file replaced by inflate()
+ */
+static void
+mcachefs_compress_forget(struct mcachefs_compress_key_t *key)
+{
+    struct mcachefs_compress_block_t *cached, *next;
+    int cur;
+
+    mcachefs_compress_lock();
+    for (cur = 0; cur < MCACHEFS_COMPRESS_INDEXES; cur++)
+    {
+        if (mcachefs_compress_indexes[cur].frames && mcachefs_compress_key_equals(&(mcachefs_compress_indexes[cur].key), key))
+        {
+            free(mcachefs_compress_indexes[cur].frames);
+            mcachefs_compress_indexes[cur].frames = NULL;
+        }
+    }
+    for (cached = mcachefs_compress_lru_head; cached; cached = next)
+    {
+        next = cached->next;
+        if (mcachefs_compress_key_equals(&(cached->key), key))
+            mcachefs_compress_block_evict_locked(cached);
+    }
+    mcachefs_compress_unlock();
+}
+
+static char *
+mcachefs_compress_tmppath(const char *what)
+{
+    char tmpname[64];
+
+    snprintf(tmpname, sizeof(tmpname), MCACHEFS_COMPRESS_TMP_PREFIX "/%s.%lx", what, (unsigned long) pthread_self());
+    if (mcachefs_createpath_cache(tmpname, 0))
+        return NULL;
+    return mcachefs_makepath_cache(tmpname);
+}
+
+/**
+ * Give tmpfd the mode and times of the backing file it replaces, and flush it
+ */
+static int
+mcachefs_compress_finish(int tmpfd, struct stat *st)
+{
+    struct timespec times[2];
+
+    times[0] = st->st_atim;
+    times[1] = st->st_mtim;
+    if (fchmod(tmpfd, st->st_mode & 07777) || futimens(tmpfd, times) || fdatasync(tmpfd))
+        return -errno;
+    return 0;
+}
+
+int
+mcachefs_compress_inflate(const char *path)
+{
+    struct mcachefs_compress_header_t header;
+    struct mcachefs_compress_frame_t *frames = NULL;
+    struct mcachefs_compress_key_t key;
+    struct stat st;
+    char *backingpath, *tmppath = NULL, *data = NULL;
+    int fd, tmpfd = -1, res = 0, length;
+    off_t block;
+
+    backingpath = mcachefs_makepath_cache(path);
+    if (!backingpath)
+        return -ENOMEM;
+    fd = open(backingpath, O_RDONLY);
+    if (fd == -1)
+    {
+        res = (errno == ENOENT) ? 0 : -errno;
+        free(backingpath);
+        return res;
+    }
+    if (!mcachefs_compress_is_compressed(fd) || (res = mcachefs_compress_get_key(fd, &key, &st)) || !S_ISREG(st.st_mode)
+        || mcachefs_compress_read_header(fd, st.st_size, &header))
+    {
+        close(fd);
+        free(backingpath);
+        return res;
+    }
+
+    Log("Inflating compressed backing file '%s' (%luk)\n", path, (unsigned long) header.size >> 10);
+    if ((res = mcachefs_compress_codec_load(header.codec)))
+        goto out;
+    if ((frames = mcachefs_compress_read_frames(fd, &header)) == NULL
+        || (data = (char *) malloc(header.block_size)) == NULL || (tmppath = mcachefs_compress_tmppath("inflate")) == NULL)
+    {
+        res = -EIO;
+        goto out;
+    }
+    tmpfd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    if (tmpfd == -1)
+    {
+        res = -errno;
+        goto out;
+    }
+    for (block = 0; block < header.blocks && !res; block++)
+    {
+        length = mcachefs_compress_block_length(&header, block);
+        if ((res = mcachefs_compress_load_block(fd, &header, &(frames[block]), block, data)) == 0
+            && pwrite(tmpfd, data, length, block * header.block_size) != length)
+            res = -EIO;
+    }
+    if (!res && ftruncate(tmpfd, header.size))
+        res = -errno;
+    if (!res)
+        res = mcachefs_compress_finish(tmpfd, &st);
+    if (close(tmpfd) && !res)
+        res = -EIO;
+    tmpfd = -1;
+    if (!res && rename(tmppath, backingpath))
+        res = -errno;
+
+  out:
+    if (res)
+    {
+        Err("Could not inflate compressed backing file '%s' : err=%d:%s\n", path, -res, strerror(-res));
+        if (tmppath)
+            unlink(tmppath);
+    }
+    else
+    {
+        mcachefs_compress_forget(&key);
+        mcachefs_compress_lock();
+        mcachefs_compress_stats.files_inflated++;
+        mcachefs_compress_unlock();
+    }
+    if (tmpfd != -1)
+        close(tmpfd);
+    close(fd);
+    free(frames);
+    free(data);
+    free(tmppath);
+    free(backingpath);
+    return res;
+}
+
+/**
+ * Compress a sample of the blocks of fd, to tell whether the file is worth compressing
+ */
+static int
+mcachefs_compress_worth(int fd, off_t size, int codec, char *plain, char *frame)
+{
+    off_t blocks = (size + MCACHEFS_COMPRESS_BLOCK_SIZE - 1) / MCACHEFS_COMPRESS_BLOCK_SIZE, block;
+    off_t sample = blocks < MCACHEFS_COMPRESS_SAMPLE_BLOCKS ? blocks : MCACHEFS_COMPRESS_SAMPLE_BLOCKS, cur;
+    unsigned long long total = 0, compressed = 0;
+    int length, res;
+
+    for (cur = 0; cur < sample; cur++)
+    {
+        block = cur * blocks / sample;
+        length = size - block * MCACHEFS_COMPRESS_BLOCK_SIZE < MCACHEFS_COMPRESS_BLOCK_SIZE ?
+            (int) (size - block * MCACHEFS_COMPRESS_BLOCK_SIZE) : MCACHEFS_COMPRESS_BLOCK_SIZE;
+        if (pread(fd, plain, length, block * MCACHEFS_COMPRESS_BLOCK_SIZE) != length)
+            return 0;
+        res = mcachefs_compress_encode(codec, plain, length, frame, length - 1);
+        total += length;
+        compressed += res > 0 ? res : length;
+    }
+    return compressed * 100 <= total * (100 - mcachefs_config_get_compress_min_gain());
+}
+
+/**
+ * Write the compressed form of fd to tmpfd
+ */
+static int
+mcachefs_compress_write(int fd, int tmpfd, off_t size, int codec, char *plain, char *frame, off_t *compressed)
+{
+    struct mcachefs_compress_header_t header;
+    struct mcachefs_compress_frame_t *frames;
+    off_t block, position = sizeof(header);
+    size_t index_size;
+    int length, res = 0;
+
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, MCACHEFS_COMPRESS_MAGIC, sizeof(header.magic));
+    header.codec = codec;
+    header.block_size = MCACHEFS_COMPRESS_BLOCK_SIZE;
+    header.size = size;
+    header.blocks = (size + MCACHEFS_COMPRESS_BLOCK_SIZE - 1) / MCACHEFS_COMPRESS_BLOCK_SIZE;
+
+    index_size = header.blocks * sizeof(struct mcachefs_compress_frame_t);
+    frames = (struct mcachefs_compress_frame_t *) malloc(index_size);
+    if (!frames)
+        return -ENOMEM;
+    memset(frames, 0, index_size);
+
+    for (block = 0; block < header.blocks && !res; block++)
+    {
+        if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
+        {
+            res = -ECANCELED;
+            break;
+        }
+        length = mcachefs_compress_block_length(&header, block);
+        if (pread(fd, plain, length, block * MCACHEFS_COMPRESS_BLOCK_SIZE) != length)
+        {
+            res = -EIO;
+            break;
+        }
+        frames[block].offset = position;
+        frames[block].length = mcachefs_compress_encode(codec, plain, length, frame, length - 1);
+        if (frames[block].length <= 0)
+        {
+            frames[block].length = length;
+            frames[block].raw = 1;
+        }
+        if (pwrite(tmpfd, frames[block].raw ? plain : frame, frames[block].length, position) != frames[block].length)
+            res = -EIO;
+        position += frames[block].length;
+    }
+
+    header.index = position;
+    if (!res && pwrite(tmpfd, frames, index_size, position) != (ssize_t) index_size)
+        res = -EIO;
+    if (!res && pwrite(tmpfd, &header, sizeof(header), 0) != (ssize_t) sizeof(header))
+        res = -EIO;
+    *compressed = position + index_size;
+    free(frames);
+    return res;
+}
+
+/**
+ * Whether the backing file of mfile may be replaced - mfile lock HELD
+ */
+static int
+mcachefs_compress_may_replace(struct mcachefs_file_t *mfile)
+{
+    return mfile->cache_status == MCACHEFS_FILE_BACKING_DONE && !mfile->dirty && !mfile->passthrough_opens
+        && !(mfile->sources[MCACHEFS_FILE_SOURCE_BACKING].fd != -1 && mfile->sources[MCACHEFS_FILE_SOURCE_BACKING].wr);
+}
+
+/**
+ * Replace the backing file of mfile by its compressed form
+ * @return 1 if compressed, 0 if left as is, a negative errno on failure
+ */
+static int
+mcachefs_compress_file(struct mcachefs_file_t *mfile, int codec, char *plain, char *frame)
+{
+    struct mcachefs_file_source_t *source;
+    char *backingpath, *tmppath = NULL;
+    struct stat st, current;
+    off_t compressed = 0;
+    int fd, tmpfd, res, replaced = 0;
+
+    mcachefs_file_lock_file(mfile);
+    source = &(mfile->sources[MCACHEFS_FILE_SOURCE_BACKING]);
+    if (mfile->cache_status == MCACHEFS_FILE_BACKING_DONE && !mfile->dirty && source->fd != -1 && source->wr && !source->use)
+    {
+        /**
+         * Left open read-write by the backup
+         */
+        close(source->fd);
+        source->fd = -1;
+    }
+    res = mcachefs_compress_may_replace(mfile);
+    mcachefs_file_unlock_file(mfile);
+    if (!res)
+    {
+        Log("Not compressing '%s' : backing not done or open for write\n", mfile->path);
+        return 0;
+    }
+
+    backingpath = mcachefs_makepath_cache(mfile->path);
+    if (!backingpath)
+        return -ENOMEM;
+    fd = open(backingpath, O_RDONLY);
+    if (fd == -1)
+    {
+        free(backingpath);
+        return 0;
+    }
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_nlink > 1 || st.st_size < MCACHEFS_COMPRESS_MIN_SIZE
+        || mcachefs_compress_is_compressed(fd))
+    {
+        close(fd);
+        free(backingpath);
+        return 0;
+    }
+    if (!mcachefs_compress_worth(fd, st.st_size, codec, plain, frame))
+    {
+        Log("Not compressing '%s' : sample does not shrink by %d%%\n", mfile->path, mcachefs_config_get_compress_min_gain());
+        close(fd);
+        free(backingpath);
+        return -EAGAIN;
+    }
+
+    res = -EIO;
+    if ((tmppath = mcachefs_compress_tmppath("compress")) != NULL
+        && (tmpfd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR)) != -1)
+    {
+        res = mcachefs_compress_write(fd, tmpfd, st.st_size, codec, plain, frame, &compressed);
+        if (!res && fsetxattr(tmpfd, MCACHEFS_COMPRESS_XATTR, mcachefs_compress_names[codec], strlen(mcachefs_compress_names[codec]), 0))
+            res = -errno;
+        if (!res)
+            res = mcachefs_compress_finish(tmpfd, &st);
+        if (close(tmpfd) && !res)
+            res = -EIO;
+    }
+    close(fd);
+
+    if (!res)
+    {
+        /*
+         * The backing file may have been written, truncated or replaced while being compressed
+         */
+        mcachefs_file_lock_file(mfile);
+        if (mcachefs_compress_may_replace(mfile) && lstat(backingpath, &current) == 0 && current.st_ino == st.st_ino
+            && current.st_dev == st.st_dev && current.st_size == st.st_size
+            && current.st_mtim.tv_sec == st.st_mtim.tv_sec && current.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            if (rename(tmppath, backingpath))
+                res = -errno;
+            else
+                replaced = 1;
+        }
+        mcachefs_file_unlock_file(mfile);
+    }
+    if (!replaced && tmppath)
+        unlink(tmppath);
+
+    if (replaced)
+    {
+        Log("Compressed '%s' : %luk => %luk\n", mfile->path, (unsigned long) st.st_size >> 10, (unsigned long) compressed >> 10);
+        mcachefs_compress_lock();
+        mcachefs_compress_stats.bytes_plain += st.st_size;
+        mcachefs_compress_stats.bytes_compressed += compressed;
+        mcachefs_compress_unlock();
+    }
+    else if (res && res != -ECANCELED)
+    {
+        Err("Could not compress '%s' : err=%d:%s\n", mfile->path, -res, strerror(-res));
+    }
+    free(tmppath);
+    free(backingpath);
+    return res ? res : replaced;
+}
+
+static struct mcachefs_file_t *
+mcachefs_compress_dequeue()
+{
+    struct mcachefs_compress_queue_t *entry;
+    struct mcachefs_file_t *mfile = NULL;
+
+    mcachefs_compress_lock();
+    if ((entry = mcachefs_compress_queue_head) != NULL)
+    {
+        mcachefs_compress_queue_head = entry->next;
+        if (!mcachefs_compress_queue_head)
+            mcachefs_compress_queue_tail = NULL;
+        mcachefs_compress_queue_nb--;
+        mfile = entry->mfile;
+        free(entry);
+    }
+    mcachefs_compress_unlock();
+    return mfile;
+}
+
+static void *
+mcachefs_compress_thread(void *arg)
+{
+    struct mcachefs_file_t *mfile;
+    char *plain, *frame;
+    int codec, res;
+
+    (void) arg;
+    Info("Compress thread %lx up and running.\n", (unsigned long) pthread_self());
+
+    plain = (char *) malloc(MCACHEFS_COMPRESS_BLOCK_SIZE);
+    frame = (char *) malloc(MCACHEFS_COMPRESS_BLOCK_SIZE);
+    if (!plain || !frame)
+    {
+        Bug("Could not allocate compress buffers\n");
+    }
+
+    while (1)
+    {
+        sem_wait(&mcachefs_compress_sem);
+        if (mcachefs_compress_quit)
+            break;
+        if ((mfile = mcachefs_compress_dequeue()) == NULL)
+            continue;
+
+        codec = mcachefs_config_get_compress();
+        if (codec == MCACHEFS_COMPRESS_NONE || mcachefs_compress_codec_load(codec))
+            res = 0;
+        else
+            res = mcachefs_compress_file(mfile, codec, plain, frame);
+        mcachefs_file_release(mfile);
+
+        mcachefs_compress_lock();
+        if (res == 1)
+            mcachefs_compress_stats.files_compressed++;
+        else if (res == -EAGAIN)
+            mcachefs_compress_stats.files_bypassed++;
+        else if (res == 0 || res == -ECANCELED)
+            mcachefs_compress_stats.files_skipped++;
+        else
+            mcachefs_compress_stats.files_failed++;
+        mcachefs_compress_unlock();
+    }
+
+    free(plain);
+    free(frame);
+    Log("Interrupting compress thread %lx\n", (unsigned long) pthread_self());
+    return NULL;
+}
+
+void
+mcachefs_compress_queue(struct mcachefs_file_t *mfile)
+{
+    struct mcachefs_compress_queue_t *entry;
+
+    if (mcachefs_config_get_compress() == MCACHEFS_COMPRESS_NONE || mfile->type != mcachefs_file_type_file)
+        return;
+
+    entry = (struct mcachefs_compress_queue_t *) malloc(sizeof(struct mcachefs_compress_queue_t));
+    if (!entry)
+        return;
+
+    mcachefs_file_lock_file(mfile);
+    mfile->use++;
+    mcachefs_file_unlock_file(mfile);
+
+    entry->mfile = mfile;
+    entry->next = NULL;
+
+    mcachefs_compress_lock();
+    if (mcachefs_compress_queue_nb >= MCACHEFS_COMPRESS_QUEUE_MAX)
+    {
+        mcachefs_compress_stats.files_dropped++;
+        mcachefs_compress_unlock();
+        Log("Compress queue full, leaving '%s' plain\n", mfile->path);
+        free(entry);
+        mcachefs_file_release(mfile);
+        return;
+    }
+    if (mcachefs_compress_queue_tail)
+        mcachefs_compress_queue_tail->next = entry;
+    else
+        mcachefs_compress_queue_head = entry;
+    mcachefs_compress_queue_tail = entry;
+    mcachefs_compress_queue_nb++;
+    mcachefs_compress_unlock();
+
+    sem_post(&mcachefs_compress_sem);
+}
+
+void
+mcachefs_compress_start_thread()
+{
+    pthread_attr_t attrs;
+
+    mcachefs_mutex_init(&mcachefs_compress_mutex);
+    sem_init(&mcachefs_compress_sem, 0, 0);
+    memset(&mcachefs_compress_stats, 0, sizeof(mcachefs_compress_stats));
+    mcachefs_compress_quit = 0;
+
+    if (mcachefs_config_get_compress() != MCACHEFS_COMPRESS_NONE && mcachefs_compress_codec_load(mcachefs_config_get_compress()))
+    {
+        Err("Codec %s not available, backing files will not be compressed\n", mcachefs_compress_names[mcachefs_config_get_compress()]);
+        mcachefs_config_set_compress(MCACHEFS_COMPRESS_NONE);
+    }
+
+    pthread_attr_init(&attrs);
+    pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_JOINABLE);
+    pthread_create(&mcachefs_compress_threadid, &attrs, mcachefs_compress_thread, NULL);
+}
+
+void
+mcachefs_compress_stop_thread()
+{
+    struct mcachefs_file_t *mfile;
+    struct mcachefs_compress_block_t *cached;
+    int res, cur;
+    void *arg;
+
+    mcachefs_compress_quit = 1;
+    sem_post(&mcachefs_compress_sem);
+    if ((res = pthread_join(mcachefs_compress_threadid, &arg)) != 0)
+    {
+        Err("Could not join compress thread %lx : err=%d:%s\n", mcachefs_compress_threadid, res, strerror(res));
+    }
+    Info("Compress thread interrupted.\n");
+
+    while ((mfile = mcachefs_compress_dequeue()) != NULL)
+    {
+        mcachefs_file_release(mfile);
+    }
+
+    mcachefs_compress_lock();
+    while ((cached = mcachefs_compress_lru_tail) != NULL)
+    {
+        mcachefs_compress_block_evict_locked(cached);
+    }
+    for (cur = 0; cur < MCACHEFS_COMPRESS_INDEXES; cur++)
+    {
+        free(mcachefs_compress_indexes[cur].frames);
+        mcachefs_compress_indexes[cur].frames = NULL;
+    }
+    mcachefs_compress_unlock();
+}
+
+void
+mcachefs_compress_dump(struct mcachefs_file_t *mvops)
+{
+    struct mcachefs_compress_stats_t *stats = &mcachefs_compress_stats;
+    int codec = mcachefs_config_get_compress();
+
+    mcachefs_compress_lock();
+    __VOPS_WRITE(mvops, "Codec : %s", mcachefs_compress_names[codec]);
+    if (codec != MCACHEFS_COMPRESS_NONE)
+        __VOPS_WRITE(mvops, " (%s), minimal gain %d%%", mcachefs_compress_codecs[codec].library, mcachefs_config_get_compress_min_gain());
+    __VOPS_WRITE(mvops, "\n");
+    __VOPS_WRITE(mvops, "Files : %lu compressed, %lu bypassed, %lu skipped, %lu failed, %lu dropped, %lu inflated, %d queued\n",
+                 stats->files_compressed, stats->files_bypassed, stats->files_skipped, stats->files_failed,
+                 stats->files_dropped, stats->files_inflated, mcachefs_compress_queue_nb);
+    __VOPS_WRITE(mvops, "Bytes : %lluk compressed to %lluk", stats->bytes_plain >> 10, stats->bytes_compressed >> 10);
+    if (stats->bytes_plain)
+        __VOPS_WRITE(mvops, " (%llu%%)", stats->bytes_compressed * 100 / stats->bytes_plain);
+    __VOPS_WRITE(mvops, "\n");
+    __VOPS_WRITE(mvops, "Cache : %d blocks, %luk out of %luk, %llu hits, %llu misses\n", mcachefs_compress_cache_nb,
+                 (unsigned long) mcachefs_compress_cache_used >> 10, (unsigned long) mcachefs_config_get_compress_cache_size() >> 10,
+                 stats->hits, stats->misses);
+    mcachefs_compress_unlock();
+}
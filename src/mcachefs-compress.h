@@ -0,0 +1,59 @@
+#ifndef __MCACHEFS_COMPRESS_H
+#define __MCACHEFS_COMPRESS_H
+
+/**
+ * ********************* COMPRESS *****************************
+ * Compressed backing files : once a backup is complete, the compress thread rewrites the backing file as a header,
+ * the frames of each MCACHEFS_COMPRESS_BLOCK_SIZE block compressed with lz4 or zstd, and the index of the frames.
+ * The codecs are loaded with dlopen(), so that mcachefs neither needs nor links their libraries.
+ * Compressed backing files are marked with an extended attribute, so that telling them apart on open neither reads
+ * their contents nor mistakes a plain file starting with the header magic for one.
+ * A sample of MCACHEFS_COMPRESS_SAMPLE_BLOCKS blocks is compressed first : files which do not shrink by
+ * compress-min-gain (already compressed media) are left as they are, as are blocks which do not shrink.
+ * Reads decompress the blocks they cover, and keep them in a cache of compress-cache-size, shared by all files.
+ * A compressed backing file opened for write is inflated back first, so that writes, writeback and truncate only
+ * ever see plain backing files. Backing files shared by hard links (see mcachefs-dedup.h) are left plain.
+ */
+
+#define MCACHEFS_COMPRESS_BLOCK_SIZE    (64 << 10)
+#define MCACHEFS_COMPRESS_MIN_SIZE      (8 << 10)
+#define MCACHEFS_COMPRESS_SAMPLE_BLOCKS 4
+
+/**
+ * Maximal number of files waiting for the compress thread, further files are left plain
+ */
+#define MCACHEFS_COMPRESS_QUEUE_MAX     1024
+
+extern const char *mcachefs_compress_names[];
+
+void mcachefs_compress_start_thread();
+
+/**
+ * Stop the compress thread, and release the files still queued
+ */
+void mcachefs_compress_stop_thread();
+
+/**
+ * Queue a file whose backup is complete for compression - no lock HELD
+ */
+void mcachefs_compress_queue(struct mcachefs_file_t *mfile);
+
+/**
+ * Check whether fd is a compressed backing file
+ */
+int mcachefs_compress_is_compressed(int fd);
+
+/**
+ * Read from a compressed backing file, as pread() would from the plain one
+ */
+ssize_t mcachefs_compress_pread(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * Rewrite the backing file of path as a plain file, if it is compressed
+ * @return 0 if the backing file is plain, a negative errno otherwise
+ */
+int mcachefs_compress_inflate(const char *path);
+
+void mcachefs_compress_dump(struct mcachefs_file_t *mvops);
+
+#endif // __MCACHEFS_COMPRESS_H
@@ -46,6 +46,7 @@ static struct fuse_opt mcachefs_opts[] = {
     {"cache=%s", offsetof(struct mcachefs_config, cache), 0},
     {"metafile=%s", offsetof(struct mcachefs_config, metafile), 0},
     {"journal=%s", offsetof(struct mcachefs_config, journal), 0},
+    {"history=%s", offsetof(struct mcachefs_config, history), 0},
     {"verbose=%lu", offsetof(struct mcachefs_config, verbose), 0},
     {"backup-threads=%lu", offsetof(struct mcachefs_config, transfer_threads_type_nb[MCACHEFS_TRANSFER_TYPE_BACKUP]),
      0},
@@ -53,6 +54,37 @@ static struct fuse_opt mcachefs_opts[] = {
      0},
     {"metadata-threads=%lu",
      offsetof(struct mcachefs_config, transfer_threads_type_nb[MCACHEFS_TRANSFER_TYPE_METADATA]), 0},
+    {"backup-threads-min=%d", offsetof(struct mcachefs_config, transfer_threads_type_min[MCACHEFS_TRANSFER_TYPE_BACKUP]), 0},
+    {"write-threads-min=%d", offsetof(struct mcachefs_config, transfer_threads_type_min[MCACHEFS_TRANSFER_TYPE_WRITEBACK]), 0},
+    {"metadata-threads-min=%d", offsetof(struct mcachefs_config, transfer_threads_type_min[MCACHEFS_TRANSFER_TYPE_METADATA]),
+     0},
+    {"chunk-size=%d", offsetof(struct mcachefs_config, chunk_size), 0},
+    {"backup-streams=%d", offsetof(struct mcachefs_config, backup_streams), 0},
+    {"stream-min-size=%d", offsetof(struct mcachefs_config, stream_min_size), 0},
+    {"delta-min-size=%d", offsetof(struct mcachefs_config, delta_min_size), 0},
+    {"prefetch-files=%d", offsetof(struct mcachefs_config, prefetch_files), 0},
+    {"prefetch-max-size=%d", offsetof(struct mcachefs_config, prefetch_max_size), 0},
+    {"abandon-percent=%d", offsetof(struct mcachefs_config, abandon_percent), 0},
+    {"warmup-files=%d", offsetof(struct mcachefs_config, warmup_files), 0},
+    {"warmup-max-size=%d", offsetof(struct mcachefs_config, warmup_max_size), 0},
+    {"warmup-max-time=%d", offsetof(struct mcachefs_config, warmup_max_time), 0},
+    {"transfer-engine=%s", offsetof(struct mcachefs_config, transfer_engine_name), 0},
+    {"uring-depth=%d", offsetof(struct mcachefs_config, uring_depth), 0},
+    {"compress=%s", offsetof(struct mcachefs_config, compress_name), 0},
+    {"compress-cache-size=%d", offsetof(struct mcachefs_config, compress_cache_size), 0},
+    {"compress-min-gain=%d", offsetof(struct mcachefs_config, compress_min_gain), 0},
+    {"dedup=%d", offsetof(struct mcachefs_config, dedup), 0},
+    {"dedup-min-size=%d", offsetof(struct mcachefs_config, dedup_min_size), 0},
+    {"passthrough=%d", offsetof(struct mcachefs_config, passthrough), 0},
+    {"kernel-entry-timeout=%d", offsetof(struct mcachefs_config, kernel_entry_timeout), 0},
+    {"kernel-attr-timeout=%d", offsetof(struct mcachefs_config, kernel_attr_timeout), 0},
+    {"kernel-keep-cache=%d", offsetof(struct mcachefs_config, kernel_keep_cache), 0},
+    {"max-read=%d", offsetof(struct mcachefs_config, max_read), 0},
+    {"max-write=%d", offsetof(struct mcachefs_config, max_write), 0},
+    {"max-background=%d", offsetof(struct mcachefs_config, max_background), 0},
+    {"splice=%d", offsetof(struct mcachefs_config, splice), 0},
+    {"transfer-max-rate=%d", offsetof(struct mcachefs_config, transfer_max_rate), 0},
+    {"writeback-max-rate=%d", offsetof(struct mcachefs_config, writeback_max_rate), 0},
     {"pre-mount-cmd=%s", offsetof(struct mcachefs_config, pre_mount_cmd), 0},
     {"post-umount-cmd=%s", offsetof(struct mcachefs_config, post_umount_cmd), 0},
     FUSE_OPT_END
@@ -70,9 +102,39 @@ print_usage(const char *program_name)
     Info("\tcache\t\t: local cache path (must be a directory), defaults to %s/{mount point}/cache/\n", DEFAULT_PREFIX);
     Info("\tmetafile\t: local cache directory structure file, defaults to %s/{mount point}/metafile\n", DEFAULT_PREFIX);
     Info("\tjournal\t\t: local cache update journal, defaults to %s/{mount point}/journal\n", DEFAULT_PREFIX);
-    Info("\tbackup-threads\t: number of threads to use for backup of files (download from source to target)\n");
-    Info("\twrite-threads\t: number of threads to use for write files back to source (when 'apply_journal' is called)\n");
-    Info("\tmetadata-threads: number of threads to use for retrieving metadata from source (retrieving folders and files information)\n");
+    Info("\thistory\t\t: access history of files, defaults to {metafile}.history\n");
+    Info("\tbackup-threads\t: maximal number of threads to use for backup of files (download from source to target), defaults to 8\n");
+    Info("\twrite-threads\t: maximal number of threads to use for write files back to source (when 'apply_journal' is called), defaults to 4\n");
+    Info("\tmetadata-threads: maximal number of threads to use for retrieving metadata from source (retrieving folders and files information), defaults to 4\n");
+    Info("\tbackup-threads-min, write-threads-min, metadata-threads-min : number of threads kept when idle, defaults to 1\n");
+    Info("\tchunk-size\t: size in kilobytes of the chunks backing files are filled by, defaults to 1024\n");
+    Info("\tbackup-streams\t: number of backup threads copying a single large file concurrently, defaults to 1\n");
+    Info("\tstream-min-size\t: minimal size in megabytes of a file to be copied by several streams, defaults to 64\n");
+    Info("\tdelta-min-size\t: minimal size in megabytes of a file to only write back the blocks which differ from the target, defaults to 0 (disabled)\n");
+    Info("\tabandon-percent\t: the backup of a file closed by its last opener is abandoned while less than this percentage is in cache (0 to disable), defaults to 25\n");
+    Info("\tprefetch-files\t: number of files backed up ahead of a sequential scan of a directory (0 to disable), defaults to 4\n");
+    Info("\tprefetch-max-size\t: maximal size in megabytes of the prefetched files not backed up yet, defaults to 256\n");
+    Info("\twarmup-files\t: number of the most accessed files backed up at mount time (0 to disable), defaults to 64\n");
+    Info("\twarmup-max-size\t: maximal size in megabytes of the files backed up at mount time, defaults to 1024\n");
+    Info("\twarmup-max-time\t: maximal duration in seconds of the warmup, defaults to 600\n");
+    Info("\ttransfer-engine\t: engine used by backup threads, 'sync' (default) or 'uring' to keep many reads and writes in flight\n");
+    Info("\turing-depth\t: number of reads and writes kept in flight by each backup thread with the uring engine, defaults to 32\n");
+    Info("\tcompress\t: codec of compressed backing files, 'none' (default), 'lz4' or 'zstd'\n");
+    Info("\tcompress-cache-size\t: size in megabytes of the cache of decompressed blocks, defaults to 64\n");
+    Info("\tcompress-min-gain\t: minimal gain in percent on a sample of a file for the file to be compressed, defaults to 10\n");
+    Info("\tdedup\t: set to 1 to store identical backing files once, in a content-addressed object store, defaults to 0\n");
+    Info("\tdedup-min-size\t: size in kilobytes under which backing files are not deduplicated, defaults to 64\n");
+    Info("\tpassthrough\t: set to 0 not to let the kernel read fully cached files directly, when it supports passthrough, defaults to 1\n");
+    Info("\tkernel-entry-timeout\t: time in seconds the kernel caches entries, in the normal and full states, defaults to 60\n");
+    Info("\tkernel-attr-timeout\t: time in seconds the kernel caches the attributes of stable files, in the normal and full states, defaults to 60\n");
+    Info("\tkernel-keep-cache\t: set to 0 to flush the page cache of fully cached files at each open, defaults to 1\n");
+    Info("\tmax-read\t: maximal size of read requests, in kilobytes, defaults to 1024\n");
+    Info("\tmax-write\t: maximal size of write requests, in kilobytes, defaults to 1024\n");
+    Info("\tmax-background\t: maximal number of asynchronous requests (readahead) in flight, 0 for the kernel default, defaults to 0\n");
+    Info("\tsplice\t: set to 0 not to move request and reply data through pipes with splice(), defaults to 1\n");
+    Info("\tmax_threads, max_idle_threads, clone_fd\t: libfuse options tuning the threads serving requests (see -h)\n");
+    Info("\ttransfer-max-rate\t: aggregate rate of all backup threads, in kilobytes per second (0 for unlimited), defaults to 100000\n");
+    Info("\twriteback-max-rate\t: aggregate rate of all write threads, in kilobytes per second (0 for unlimited), defaults to 100000\n");
     Info("\tpre-mount-cmd\t: run a command right before mounting. This can be used to auto-mount the source folder.\n");
     Info("\tpost-umount-cmd\t: run a command right after unmounting. If you used pre-mount-cmd to mount the source, use this to umount it.\n");
     Info("\n");
@@ -100,11 +162,38 @@ mcachefs_parse_config(int argc, char *argv[])
      * Init default config values
      */
     config->read_state = MCACHEFS_STATE_NORMAL;
+    config->transfer_threads_type_min[MCACHEFS_TRANSFER_TYPE_BACKUP] = -1;
+    config->transfer_threads_type_min[MCACHEFS_TRANSFER_TYPE_WRITEBACK] = -1;
+    config->transfer_threads_type_min[MCACHEFS_TRANSFER_TYPE_METADATA] = -1;
     config->write_state = MCACHEFS_WRSTATE_CACHE;
     config->file_thread_interval = 1;
     config->file_ttl = 300;
     config->metadata_map_ttl = 1800;
     config->transfer_max_rate = 100000;
+    config->writeback_max_rate = 100000;
+    config->chunk_size = 1024;
+    config->backup_streams = 1;
+    config->stream_min_size = 64;
+    config->abandon_percent = 25;
+    config->prefetch_files = 4;
+    config->prefetch_max_size = 256;
+    config->warmup_files = 64;
+    config->warmup_max_size = 1024;
+    config->warmup_max_time = 600;
+    config->transfer_engine = MCACHEFS_TRANSFER_ENGINE_SYNC;
+    config->uring_depth = 32;
+    config->compress_cache_size = 64;
+    config->compress_min_gain = 10;
+    config->dedup = 0;
+    config->dedup_min_size = 64;
+    config->passthrough = 1;
+    config->kernel_entry_timeout = 60;
+    config->kernel_attr_timeout = 60;
+    config->kernel_keep_cache = 1;
+    config->max_read = 1024;
+    config->max_write = 1024;
+    config->max_background = 0;
+    config->splice = 1;
     config->cleanup_cache_age = 30 * 24 * 3600;
     config->cleanup_cache_prefix = NULL;
     config->cache_prefix = strdup("/");
@@ -186,6 +275,11 @@ set_default_config(struct mcachefs_config *config)
         config->journal = (char *) malloc(PATH_MAX);
         snprintf(config->journal, PATH_MAX, "%s/%s/%s", DEFAULT_PREFIX, normalized_mp, "journal");
     }
+
+    if (config->history == NULL)
+    {
+        config->history = mcachefs_makepath(".history", config->metafile);
+    }
 }
 
 void
@@ -197,9 +291,29 @@ mcachefs_dump_config(struct mcachefs_config *config)
     Info("* Cache %s\n", config->cache);
     Info("* Metafile %s\n", config->metafile);
     Info("* Journal %s\n", config->journal);
+    Info("* History %s\n", config->history);
     Info("* Backup Threads %d\n", config->transfer_threads_type_nb[MCACHEFS_TRANSFER_TYPE_BACKUP]);
     Info("* Write Back Threads %d\n", config->transfer_threads_type_nb[MCACHEFS_TRANSFER_TYPE_WRITEBACK]);
     Info("* Metadata Threads %d\n", config->transfer_threads_type_nb[MCACHEFS_TRANSFER_TYPE_METADATA]);
+    Info("* Chunk Size %dk\n", config->chunk_size);
+    Info("* Backup Streams %d (files over %dM)\n", config->backup_streams, config->stream_min_size);
+    if (config->delta_min_size > 0)
+        Info("* Delta Writeback (files over %dM)\n", config->delta_min_size);
+    if (config->abandon_percent > 0)
+        Info("* Abandon backups of closed files under %d%%\n", config->abandon_percent);
+    Info("* Prefetch %d files (up to %dM)\n", config->prefetch_files, config->prefetch_max_size);
+    Info("* Warmup %d files (up to %dM, %ds)\n", config->warmup_files, config->warmup_max_size, config->warmup_max_time);
+    Info("* Transfer Engine %s, uring depth %d\n", config->transfer_engine_name ? config->transfer_engine_name : "sync", config->uring_depth);
+    if (config->compress_name)
+        Info("* Compress %s (gain over %d%%, cache %dM)\n", config->compress_name, config->compress_min_gain, config->compress_cache_size);
+    if (config->dedup)
+        Info("* Deduplicate backing files over %dk\n", config->dedup_min_size);
+    Info("* Passthrough %s\n", config->passthrough ? "enabled" : "disabled");
+    Info("* Kernel cache entries %ds, attributes %ds, keep cache %s\n", config->kernel_entry_timeout, config->kernel_attr_timeout,
+         config->kernel_keep_cache ? "enabled" : "disabled");
+    Info("* Requests max read %dk, max write %dk, max background %d, splice %s\n", config->max_read, config->max_write,
+         config->max_background, config->splice ? "enabled" : "disabled");
+    Info("* Max Rate backup %dkb/s, writeback %dkb/s\n", config->transfer_max_rate, config->writeback_max_rate);
     if (config->pre_mount_cmd != NULL)
         Info("* Pre Mount Command %s\n", config->pre_mount_cmd);
     if (config->post_umount_cmd != NULL)
@@ -222,11 +336,100 @@ mcachefs_set_current_config(struct mcachefs_config *config)
     config->verbose = DEFAULT_VERBOSE;
 
     int threadtype;
+    static const int threads_default[MCACHEFS_TRANSFER_TYPES] = { 8, 4, 4 };
     for (threadtype = 0; threadtype < MCACHEFS_TRANSFER_TYPES; threadtype++)
     {
-        if (!config->transfer_threads_type_nb[threadtype])
-            config->transfer_threads_type_nb[threadtype] = 1;
+        if (config->transfer_threads_type_nb[threadtype] <= 0)
+            config->transfer_threads_type_nb[threadtype] = threads_default[threadtype];
+        if (config->transfer_threads_type_nb[threadtype] > MCACHEFS_TRANSFER_THREADS_MAX_NUMBER)
+            config->transfer_threads_type_nb[threadtype] = MCACHEFS_TRANSFER_THREADS_MAX_NUMBER;
+        if (config->transfer_threads_type_min[threadtype] < 0)
+            config->transfer_threads_type_min[threadtype] = 1;
+        if (config->transfer_threads_type_min[threadtype] > config->transfer_threads_type_nb[threadtype])
+            config->transfer_threads_type_min[threadtype] = config->transfer_threads_type_nb[threadtype];
+    }
+
+    if (config->chunk_size <= 0)
+    {
+        Err("Invalid chunk size %dk, using 1024k\n", config->chunk_size);
+        config->chunk_size = 1024;
+    }
+
+    if (config->backup_streams <= 0)
+        config->backup_streams = 1;
+    if (config->backup_streams > config->transfer_threads_type_nb[MCACHEFS_TRANSFER_TYPE_BACKUP])
+    {
+        Info("Limiting backup streams to the %d backup threads\n", config->transfer_threads_type_nb[MCACHEFS_TRANSFER_TYPE_BACKUP]);
+        config->backup_streams = config->transfer_threads_type_nb[MCACHEFS_TRANSFER_TYPE_BACKUP];
     }
+    if (config->stream_min_size < 0)
+        config->stream_min_size = 64;
+    if (config->delta_min_size < 0)
+        config->delta_min_size = 0;
+    if (config->abandon_percent < 0)
+        config->abandon_percent = 0;
+    if (config->abandon_percent > 100)
+        config->abandon_percent = 100;
+    if (config->prefetch_files < 0)
+        config->prefetch_files = 0;
+    if (config->prefetch_max_size <= 0)
+        config->prefetch_max_size = 256;
+    if (config->warmup_files < 0)
+        config->warmup_files = 0;
+    if (config->warmup_max_size <= 0)
+        config->warmup_max_size = 1024;
+    if (config->warmup_max_time <= 0)
+        config->warmup_max_time = 600;
+
+    if (config->transfer_engine_name == NULL || strcmp(config->transfer_engine_name, "sync") == 0)
+        config->transfer_engine = MCACHEFS_TRANSFER_ENGINE_SYNC;
+    else if (strcmp(config->transfer_engine_name, "uring") == 0)
+        config->transfer_engine = MCACHEFS_TRANSFER_ENGINE_URING;
+    else
+    {
+        Err("Invalid transfer engine '%s', using sync\n", config->transfer_engine_name);
+        config->transfer_engine = MCACHEFS_TRANSFER_ENGINE_SYNC;
+    }
+    if (config->uring_depth <= 0)
+        config->uring_depth = 32;
+
+    if (config->compress_name == NULL || strcmp(config->compress_name, "none") == 0)
+        config->compress = MCACHEFS_COMPRESS_NONE;
+    else if (strcmp(config->compress_name, "lz4") == 0)
+        config->compress = MCACHEFS_COMPRESS_LZ4;
+    else if (strcmp(config->compress_name, "zstd") == 0)
+        config->compress = MCACHEFS_COMPRESS_ZSTD;
+    else
+    {
+        Err("Invalid compress codec '%s', not compressing\n", config->compress_name);
+        config->compress = MCACHEFS_COMPRESS_NONE;
+    }
+    if (config->compress_cache_size <= 0)
+        config->compress_cache_size = 64;
+    if (config->compress_min_gain < 0)
+        config->compress_min_gain = 10;
+    if (config->compress_min_gain > 99)
+        config->compress_min_gain = 99;
+    config->dedup = config->dedup ? 1 : 0;
+    if (config->dedup_min_size < 0)
+        config->dedup_min_size = 64;
+    config->passthrough = config->passthrough ? 1 : 0;
+    if (config->kernel_entry_timeout < 0)
+        config->kernel_entry_timeout = 60;
+    if (config->kernel_attr_timeout < 0)
+        config->kernel_attr_timeout = 60;
+    config->kernel_keep_cache = config->kernel_keep_cache ? 1 : 0;
+    if (config->max_read <= 0)
+        config->max_read = 1024;
+    if (config->max_write <= 0)
+        config->max_write = 1024;
+    if (config->max_background < 0)
+        config->max_background = 0;
+    config->splice = config->splice ? 1 : 0;
+    if (config->transfer_max_rate < 0)
+        config->transfer_max_rate = 0;
+    if (config->writeback_max_rate < 0)
+        config->writeback_max_rate = 0;
 
     current_config = config;
 }
@@ -311,12 +514,24 @@ mcachefs_config_get_journal()
     return current_config->journal;
 }
 
+const char *
+mcachefs_config_get_history()
+{
+    return current_config->history;
+}
+
 int
 mcachefs_config_get_transfer_threads_nb(int type)
 {
     return current_config->transfer_threads_type_nb[type];
 }
 
+int
+mcachefs_config_get_transfer_threads_min(int type)
+{
+    return current_config->transfer_threads_type_min[type];
+}
+
 void
 mcachefs_config_set_read_state(int rdstate)
 {
@@ -398,6 +613,192 @@ mcachefs_config_set_transfer_max_rate(int rate)
     current_config->transfer_max_rate = rate;
 }
 
+int
+mcachefs_config_get_writeback_max_rate()
+{
+    return current_config->writeback_max_rate;
+}
+
+void
+mcachefs_config_set_writeback_max_rate(int rate)
+{
+    current_config->writeback_max_rate = rate;
+}
+
+off_t
+mcachefs_config_get_chunk_size()
+{
+    return ((off_t) current_config->chunk_size) << 10;
+}
+
+int
+mcachefs_config_get_backup_streams()
+{
+    return current_config->backup_streams;
+}
+
+off_t
+mcachefs_config_get_stream_min_size()
+{
+    return ((off_t) current_config->stream_min_size) << 20;
+}
+
+off_t
+mcachefs_config_get_delta_min_size()
+{
+    return ((off_t) current_config->delta_min_size) << 20;
+}
+
+int
+mcachefs_config_get_abandon_percent()
+{
+    return current_config->abandon_percent;
+}
+
+void
+mcachefs_config_set_abandon_percent(int percent)
+{
+    current_config->abandon_percent = percent < 0 ? 0 : (percent > 100 ? 100 : percent);
+}
+
+int
+mcachefs_config_get_prefetch_files()
+{
+    return current_config->prefetch_files;
+}
+
+void
+mcachefs_config_set_prefetch_files(int files)
+{
+    current_config->prefetch_files = files < 0 ? 0 : files;
+}
+
+off_t
+mcachefs_config_get_prefetch_max_size()
+{
+    return ((off_t) current_config->prefetch_max_size) << 20;
+}
+
+int
+mcachefs_config_get_warmup_files()
+{
+    return current_config->warmup_files;
+}
+
+off_t
+mcachefs_config_get_warmup_max_size()
+{
+    return ((off_t) current_config->warmup_max_size) << 20;
+}
+
+int
+mcachefs_config_get_warmup_max_time()
+{
+    return current_config->warmup_max_time;
+}
+
+int
+mcachefs_config_get_transfer_engine()
+{
+    return current_config->transfer_engine;
+}
+
+void
+mcachefs_config_set_transfer_engine(int engine)
+{
+    current_config->transfer_engine = engine;
+}
+
+int
+mcachefs_config_get_uring_depth()
+{
+    return current_config->uring_depth;
+}
+
+int
+mcachefs_config_get_compress()
+{
+    return current_config->compress;
+}
+
+void
+mcachefs_config_set_compress(int codec)
+{
+    current_config->compress = codec;
+}
+
+off_t
+mcachefs_config_get_compress_cache_size()
+{
+    return ((off_t) current_config->compress_cache_size) << 20;
+}
+
+int
+mcachefs_config_get_compress_min_gain()
+{
+    return current_config->compress_min_gain;
+}
+
+int
+mcachefs_config_get_dedup()
+{
+    return current_config->dedup;
+}
+
+off_t
+mcachefs_config_get_dedup_min_size()
+{
+    return ((off_t) current_config->dedup_min_size) << 10;
+}
+
+int
+mcachefs_config_get_passthrough()
+{
+    return current_config->passthrough;
+}
+
+int
+mcachefs_config_get_kernel_entry_timeout()
+{
+    return current_config->kernel_entry_timeout;
+}
+
+int
+mcachefs_config_get_kernel_attr_timeout()
+{
+    return current_config->kernel_attr_timeout;
+}
+
+int
+mcachefs_config_get_kernel_keep_cache()
+{
+    return current_config->kernel_keep_cache;
+}
+
+unsigned int
+mcachefs_config_get_max_read()
+{
+    return ((unsigned int) current_config->max_read) << 10;
+}
+
+unsigned int
+mcachefs_config_get_max_write()
+{
+    return ((unsigned int) current_config->max_write) << 10;
+}
+
+unsigned int
+mcachefs_config_get_max_background()
+{
+    return (unsigned int) current_config->max_background;
+}
+
+int
+mcachefs_config_get_splice()
+{
+    return current_config->splice;
+}
+
 int
 mcachefs_config_get_cleanup_cache_age()
 {
@@ -9,6 +9,24 @@
 #define MCACHEFS_TRANSFER_TYPE_WRITEBACK 1
 #define MCACHEFS_TRANSFER_TYPE_METADATA  2
 
+/**
+ * Maximum number of concurrent threads per type
+ */
+#define MCACHEFS_TRANSFER_THREADS_MAX_NUMBER 64
+
+/**
+ * Transfer engines for backups
+ */
+#define MCACHEFS_TRANSFER_ENGINE_SYNC  0
+#define MCACHEFS_TRANSFER_ENGINE_URING 1
+
+/**
+ * Codecs of compressed backing files
+ */
+#define MCACHEFS_COMPRESS_NONE 0
+#define MCACHEFS_COMPRESS_LZ4  1
+#define MCACHEFS_COMPRESS_ZSTD 2
+
 struct mcachefs_config
 {
     /*
@@ -36,15 +54,22 @@ struct mcachefs_config
      */
     char *journal;
 
+    /*
+     * Access history file, replayed by the warmup at mount time
+     */
+    char *history;
+
     /*
      * Log verbosity
      */
     int verbose;
 
     /**
-     * Number of threads per thread type
+     * Maximal and minimal number of threads per thread type, threads are started and stopped in between
+     * depending on the transfers queued
      */
     int transfer_threads_type_nb[MCACHEFS_TRANSFER_TYPES];
+    int transfer_threads_type_min[MCACHEFS_TRANSFER_TYPES];
 
     /**
      * The actual fuse arguments as passed to libfuse
@@ -61,7 +86,92 @@ struct mcachefs_config
 
     int metadata_map_ttl;
 
+    /**
+     * Aggregate rate of all backup threads, and of all write threads, in kilobytes per second (0 for unlimited)
+     */
     int transfer_max_rate;
+    int writeback_max_rate;
+
+    /**
+     * Size of backing file chunks, in kilobytes
+     */
+    int chunk_size;
+
+    /**
+     * Number of streams copying a single file to backing, and minimal size (in megabytes) of a file to be split
+     */
+    int backup_streams;
+    int stream_min_size;
+
+    /**
+     * Minimal size (in megabytes) of a file written back by comparing block checksums of the target and the backing file,
+     * 0 disables delta writeback
+     */
+    int delta_min_size;
+
+    /**
+     * Percentage of a file under which its backup is abandoned when its last opener closes it (0 disables abandon)
+     */
+    int abandon_percent;
+
+    /**
+     * Number of files prefetched ahead of a sequential scan of a directory (0 disables prefetch),
+     * and maximal size (in megabytes) of the prefetched files not backed up yet
+     */
+    int prefetch_files;
+    int prefetch_max_size;
+
+    /**
+     * Number of the most accessed files backed up at mount time (0 disables warmup), maximal size (in megabytes)
+     * of these files and maximal duration (in seconds) of the warmup
+     */
+    int warmup_files;
+    int warmup_max_size;
+    int warmup_max_time;
+
+    /**
+     * Transfer engine used by backup threads (sync or uring), and number of reads and writes kept in flight by each uring thread
+     */
+    char *transfer_engine_name;
+    int transfer_engine;
+    int uring_depth;
+
+    /**
+     * Codec of compressed backing files (none, lz4 or zstd), size (in megabytes) of the cache of decompressed blocks,
+     * and minimal gain (percentage) of a sample of a file for the file to be compressed
+     */
+    char *compress_name;
+    int compress;
+    int compress_cache_size;
+    int compress_min_gain;
+
+    /**
+     * Content-addressed store of backing files (0 or 1), and size (in kilobytes) under which files are stored per path
+     */
+    int dedup;
+    int dedup_min_size;
+
+    /**
+     * Kernel passthrough of fully cached files (0 or 1), used when the kernel supports it
+     */
+    int passthrough;
+
+    /**
+     * Timeouts (in seconds) of the entries and attributes cached by the kernel, and whether the page cache of fully
+     * cached files is kept across opens (0 or 1)
+     */
+    int kernel_entry_timeout;
+    int kernel_attr_timeout;
+    int kernel_keep_cache;
+
+    /**
+     * Maximal sizes (in kilobytes) of read and write requests, maximal number of background requests (0 for the kernel
+     * default), and whether request and reply data may be spliced (0 or 1)
+     */
+    int max_read;
+    int max_write;
+    int max_background;
+    int splice;
 
     int cleanup_cache_age;
 
@@ -95,6 +205,8 @@ const char *mcachefs_config_get_metafile();
 
 const char *mcachefs_config_get_journal();
 
+const char *mcachefs_config_get_history();
+
 static inline int
 mcachefs_config_get_verbose()
 {
@@ -106,6 +218,7 @@ mcachefs_config_get_verbose()
 }
 
 int mcachefs_config_get_transfer_threads_nb(int type);
+int mcachefs_config_get_transfer_threads_min(int type);
 
 /**
  * General status and configuration retrival and setting
@@ -128,6 +241,42 @@ void mcachefs_config_set_metadata_map_ttl(int ttl);
 int mcachefs_config_get_transfer_max_rate();
 void mcachefs_config_set_transfer_max_rate(int rate);
 
+int mcachefs_config_get_writeback_max_rate();
+void mcachefs_config_set_writeback_max_rate(int rate);
+
+/**
+ * Size of backing file chunks, in bytes
+ */
+off_t mcachefs_config_get_chunk_size();
+int mcachefs_config_get_backup_streams();
+off_t mcachefs_config_get_stream_min_size();
+off_t mcachefs_config_get_delta_min_size();
+int mcachefs_config_get_abandon_percent();
+void mcachefs_config_set_abandon_percent(int percent);
+int mcachefs_config_get_prefetch_files();
+void mcachefs_config_set_prefetch_files(int files);
+off_t mcachefs_config_get_prefetch_max_size();
+int mcachefs_config_get_warmup_files();
+off_t mcachefs_config_get_warmup_max_size();
+int mcachefs_config_get_warmup_max_time();
+int mcachefs_config_get_transfer_engine();
+void mcachefs_config_set_transfer_engine(int engine);
+int mcachefs_config_get_uring_depth();
+int mcachefs_config_get_compress();
+void mcachefs_config_set_compress(int codec);
+off_t mcachefs_config_get_compress_cache_size();
+int mcachefs_config_get_compress_min_gain();
+int mcachefs_config_get_dedup();
+off_t mcachefs_config_get_dedup_min_size();
+int mcachefs_config_get_passthrough();
+int mcachefs_config_get_kernel_entry_timeout();
+int mcachefs_config_get_kernel_attr_timeout();
+int mcachefs_config_get_kernel_keep_cache();
+unsigned int mcachefs_config_get_max_read();
+unsigned int mcachefs_config_get_max_write();
+unsigned int mcachefs_config_get_max_background();
+int mcachefs_config_get_splice();
+
 /**
  * Cleanup Backing configuration
  */
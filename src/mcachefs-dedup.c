@@ -0,0 +1,798 @@
+#include "mcachefs.h"
+#include "mcachefs-chunks.h"
+#include "mcachefs-compress.h"
+#include "mcachefs-dedup.h"
+#include "mcachefs-hash.h"
+#include "mcachefs-vops.h"
+
+DIR *fdopendir(int __fd);
+
+#define MCACHEFS_DEDUP_LINKED  1
+#define MCACHEFS_DEDUP_CREATED 2
+
+struct mcachefs_dedup_queue_t
+{
+    struct mcachefs_file_t *mfile;
+    struct mcachefs_dedup_queue_t *next;
+};
+
+struct mcachefs_dedup_stats_t
+{
+    unsigned long files_linked;         //< Linked to an existing object after their backup
+    unsigned long files_created;        //< Stored as a new object
+    unsigned long files_skipped;
+    unsigned long files_failed;
+    unsigned long files_dropped;
+    unsigned long files_unshared;
+    unsigned long hints_hit;            //< Backups replaced by a link to a known object
+    unsigned long objects_collected;
+    unsigned long long bytes_hashed;
+    unsigned long long bytes_saved;     //< Backing bytes freed by links to existing objects
+    unsigned long long bytes_skipped;   //< Bytes not copied thanks to hints
+    unsigned long long bytes_collected;
+};
+
+/**
+ * The dedup mutex is the innermost lock : no other lock is taken with it held
+ */
+static struct mcachefs_mutex_t mcachefs_dedup_mutex;
+static sem_t mcachefs_dedup_sem;
+static pthread_t mcachefs_dedup_threadid;
+static int mcachefs_dedup_quit = 0;
+
+static struct mcachefs_dedup_queue_t *mcachefs_dedup_queue_head = NULL;
+static struct mcachefs_dedup_queue_t *mcachefs_dedup_queue_tail = NULL;
+static int mcachefs_dedup_queue_nb = 0;
+
+static struct mcachefs_dedup_stats_t mcachefs_dedup_stats;
+
+static void
+mcachefs_dedup_lock()
+{
+    mcachefs_mutex_lock(&mcachefs_dedup_mutex, "dedup", __CONTEXT);
+}
+
+static void
+mcachefs_dedup_unlock()
+{
+    mcachefs_mutex_unlock(&mcachefs_dedup_mutex, "dedup", __CONTEXT);
+}
+
+/**
+ * Relative path of the object of digest in the cache
+ */
+static void
+mcachefs_dedup_object_path(const unsigned char *digest, char *objpath, size_t size)
+{
+    char hex[MCACHEFS_SHA256_SIZE * 2 + 1];
+    int cur;
+
+    for (cur = 0; cur < MCACHEFS_SHA256_SIZE; cur++)
+    {
+        snprintf(hex + cur * 2, 3, "%02x", digest[cur]);
+    }
+    snprintf(objpath, size, MCACHEFS_DEDUP_OBJECTS "/%.2s/%s", hex, hex);
+}
+
+/**
+ * Relative path of the hint of a source file in the cache : any change to the source file changes its ctime
+ */
+static void
+mcachefs_dedup_hint_path(const struct stat *source, char *hintpath, size_t hintsize)
+{
+    snprintf(hintpath, hintsize, MCACHEFS_DEDUP_HINTS "/%llx-%llx-%llx-%llx.%lx-%llx.%lx", (unsigned long long) source->st_dev,
+             (unsigned long long) source->st_ino, (unsigned long long) source->st_size,
+             (unsigned long long) source->st_mtim.tv_sec, (unsigned long) source->st_mtim.tv_nsec,
+             (unsigned long long) source->st_ctim.tv_sec, (unsigned long) source->st_ctim.tv_nsec);
+}
+
+/**
+ * Relative path of the record of the object whose inode is st
+ */
+static void
+mcachefs_dedup_inode_path(const struct stat *st, char *inodepath, size_t size)
+{
+    snprintf(inodepath, size, MCACHEFS_DEDUP_INODES "/%llx-%llx", (unsigned long long) st->st_dev,
+             (unsigned long long) st->st_ino);
+}
+
+void
+mcachefs_dedup_stat_source(struct mcachefs_file_t *mfile, struct stat *st)
+{
+    char *sourcepath;
+
+    memset(st, 0, sizeof(struct stat));
+    if (!mcachefs_config_get_dedup() || mcachefs_config_get_read_state() == MCACHEFS_STATE_HANDSUP)
+        return;
+    sourcepath = mcachefs_makepath_source(mfile->path);
+    if (!sourcepath)
+        return;
+    if (lstat(sourcepath, st) || !S_ISREG(st->st_mode))
+        memset(st, 0, sizeof(struct stat));
+    free(sourcepath);
+}
+
+/**
+ * Read the relative path of the object recorded in a hint
+ */
+static int
+mcachefs_dedup_read_hint(const char *hintpath, char *objpath, size_t size)
+{
+    ssize_t res;
+    int fd;
+
+    fd = open(hintpath, O_RDONLY);
+    if (fd == -1)
+        return -errno;
+    res = read(fd, objpath, size - 1);
+    close(fd);
+    if (res <= 0)
+        return -EINVAL;
+    objpath[res] = '\0';
+    if (strncmp(objpath, MCACHEFS_DEDUP_OBJECTS "/", strlen(MCACHEFS_DEDUP_OBJECTS "/")) || strstr(objpath, "..")
+        || (size_t) res != strlen(MCACHEFS_DEDUP_OBJECTS "/") + 3 + MCACHEFS_SHA256_SIZE * 2)
+        return -EINVAL;
+    return 0;
+}
+
+static char *
+mcachefs_dedup_tmppath(const char *what)
+{
+    char tmpname[64];
+
+    snprintf(tmpname, sizeof(tmpname), MCACHEFS_DEDUP_OBJECTS "/%s.%lx", what, (unsigned long) pthread_self());
+    if (mcachefs_createpath_cache(tmpname, 0))
+        return NULL;
+    return mcachefs_makepath_cache(tmpname);
+}
+
+/**
+ * Atomically replace backingpath by a link to objectpath
+ */
+static int
+mcachefs_dedup_replace(const char *backingpath, const char *objectpath)
+{
+    char *tmppath;
+    int res = 0;
+
+    if ((tmppath = mcachefs_dedup_tmppath("link")) == NULL)
+        return -EIO;
+    unlink(tmppath);
+    if (link(objectpath, tmppath))
+        res = -errno;
+    else if (rename(tmppath, backingpath))
+    {
+        res = -errno;
+        unlink(tmppath);
+    }
+    free(tmppath);
+    return res;
+}
+
+/**
+ * Atomically write recordpath (a hint, or the record of an inode) with the relative path of its object
+ */
+static int
+mcachefs_dedup_write_record(const char *recordpath, const char *objpath)
+{
+    char *recordabs, *tmppath;
+    int fd, res = 0;
+
+    if (mcachefs_createpath_cache(recordpath, 0) || (tmppath = mcachefs_dedup_tmppath("record")) == NULL)
+        return -EIO;
+    recordabs = mcachefs_makepath_cache(recordpath);
+
+    fd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    if (fd == -1 || write(fd, objpath, strlen(objpath)) != (ssize_t) strlen(objpath))
+        res = -EIO;
+    if (fd != -1 && close(fd))
+        res = -EIO;
+    if (res || !recordabs || rename(tmppath, recordabs))
+    {
+        res = -EIO;
+        unlink(tmppath);
+    }
+    free(recordabs);
+    free(tmppath);
+    return res;
+}
+
+static void
+mcachefs_dedup_write_hint(const char *path, const struct stat *source, const char *objpath)
+{
+    char hintpath[256];
+
+    mcachefs_dedup_hint_path(source, hintpath, sizeof(hintpath));
+    if (mcachefs_dedup_write_record(hintpath, objpath))
+        Err("Could not write hint for '%s'\n", path);
+}
+
+int
+mcachefs_dedup_link_known(struct mcachefs_file_t *mfile)
+{
+    char hintpath[256], objpath[256];
+    char *hintabs, *objabs, *backingpath;
+    off_t size = mfile->transfer.total_size;
+    struct stat *source = &(mfile->transfer.source);
+    struct stat st;
+    int res;
+
+    if (!mcachefs_config_get_dedup() || size < mcachefs_config_get_dedup_min_size())
+        return 0;
+
+    /**
+     * The source shall be the one described by the metadata, as it is the one the hint was recorded for
+     */
+    if (!source->st_ino || source->st_size != size || source->st_mtime != mfile->transfer.mtime)
+        return 0;
+
+    /**
+     * Readers of a partial backing file keep reading from it, it can not be replaced under their feet
+     */
+    if (mfile->sources[MCACHEFS_FILE_SOURCE_BACKING].fd != -1)
+        return 0;
+
+    mcachefs_dedup_hint_path(source, hintpath, sizeof(hintpath));
+    hintabs = mcachefs_makepath_cache(hintpath);
+    if (!hintabs)
+        return 0;
+    if (mcachefs_dedup_read_hint(hintabs, objpath, sizeof(objpath)))
+    {
+        free(hintabs);
+        return 0;
+    }
+    objabs = mcachefs_makepath_cache(objpath);
+    if (!objabs || lstat(objabs, &st) || !S_ISREG(st.st_mode) || st.st_size != size)
+    {
+        Log("Stale hint for '%s' : %s\n", mfile->path, objpath);
+        unlink(hintabs);
+        free(objabs);
+        free(hintabs);
+        return 0;
+    }
+    free(hintabs);
+
+    mcachefs_createpath_cache(mfile->path, 0);
+    backingpath = mcachefs_makepath_cache(mfile->path);
+    res = backingpath ? mcachefs_dedup_replace(backingpath, objabs) : -ENOMEM;
+    free(backingpath);
+    free(objabs);
+    if (res)
+    {
+        Err("Could not link '%s' to %s : err=%d:%s\n", mfile->path, objpath, -res, strerror(-res));
+        return 0;
+    }
+
+    /**
+     * The partial backing file, if any, has just been replaced
+     */
+    mcachefs_chunks_close(mfile);
+    mcachefs_chunks_remove(mfile->path);
+
+    Log("Linked '%s' to %s, skipping its backup\n", mfile->path, objpath);
+    mcachefs_dedup_lock();
+    mcachefs_dedup_stats.hints_hit++;
+    mcachefs_dedup_stats.bytes_skipped += size;
+    mcachefs_dedup_unlock();
+    return 1;
+}
+
+/**
+ * Check whether st is the inode of an object : hard links made by the user have more than one link too
+ */
+static int
+mcachefs_dedup_is_object(const struct stat *st)
+{
+    char inodepath[128], objpath[256];
+    struct stat object;
+    char *inodeabs, *objabs;
+    int res = 0;
+
+    if (!S_ISREG(st->st_mode) || st->st_nlink <= 1)
+        return 0;
+    mcachefs_dedup_inode_path(st, inodepath, sizeof(inodepath));
+    if ((inodeabs = mcachefs_makepath_cache(inodepath)) == NULL)
+        return 0;
+    if (mcachefs_dedup_read_hint(inodeabs, objpath, sizeof(objpath)) == 0 && (objabs = mcachefs_makepath_cache(objpath)) != NULL)
+    {
+        res = lstat(objabs, &object) == 0 && object.st_dev == st->st_dev && object.st_ino == st->st_ino;
+        free(objabs);
+    }
+    free(inodeabs);
+    return res;
+}
+
+int
+mcachefs_dedup_is_shared(int fd)
+{
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && mcachefs_dedup_is_object(&st);
+}
+
+int
+mcachefs_dedup_unshare(const char *path)
+{
+    struct timespec times[2];
+    struct stat st;
+    char *backingpath, *tmppath = NULL, *buffer = NULL;
+    int fd, tmpfd = -1, res = 0;
+    ssize_t bytes;
+    off_t offset;
+
+    backingpath = mcachefs_makepath_cache(path);
+    if (!backingpath)
+        return -ENOMEM;
+    fd = open(backingpath, O_RDONLY);
+    if (fd == -1)
+    {
+        res = (errno == ENOENT) ? 0 : -errno;
+        free(backingpath);
+        return res;
+    }
+    if (fstat(fd, &st) || !mcachefs_dedup_is_object(&st))
+    {
+        close(fd);
+        free(backingpath);
+        return 0;
+    }
+
+    Log("Copying shared backing file '%s' (%luk) before write\n", path, (unsigned long) st.st_size >> 10);
+    if ((buffer = (char *) malloc(MCACHEFS_DEDUP_BUFFER_SIZE)) == NULL || (tmppath = mcachefs_dedup_tmppath("unshare")) == NULL
+        || (tmpfd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR)) == -1)
+    {
+        res = -EIO;
+        goto out;
+    }
+    for (offset = 0; offset < st.st_size && !res; offset += bytes)
+    {
+        bytes = pread(fd, buffer, MCACHEFS_DEDUP_BUFFER_SIZE, offset);
+        if (bytes <= 0 || pwrite(tmpfd, buffer, bytes, offset) != bytes)
+            res = -EIO;
+    }
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    if (!res && (fchmod(tmpfd, st.st_mode & 07777) || futimens(tmpfd, times) || fdatasync(tmpfd)))
+        res = -errno;
+    if (close(tmpfd) && !res)
+        res = -EIO;
+    tmpfd = -1;
+    if (!res && rename(tmppath, backingpath))
+        res = -errno;
+
+  out:
+    if (res)
+    {
+        Err("Could not copy shared backing file '%s' : err=%d:%s\n", path, -res, strerror(-res));
+        if (tmppath)
+            unlink(tmppath);
+    }
+    else
+    {
+        mcachefs_dedup_lock();
+        mcachefs_dedup_stats.files_unshared++;
+        mcachefs_dedup_unlock();
+    }
+    if (tmpfd != -1)
+        close(tmpfd);
+    close(fd);
+    free(buffer);
+    free(tmppath);
+    free(backingpath);
+    return res;
+}
+
+/**
+ * Whether the backing file of mfile may be linked to an object - mfile lock HELD
+ */
+static int
+mcachefs_dedup_may_link(struct mcachefs_file_t *mfile)
+{
+    struct mcachefs_file_source_t *source = &(mfile->sources[MCACHEFS_FILE_SOURCE_BACKING]);
+
+    if (mfile->cache_status != MCACHEFS_FILE_BACKING_DONE || mfile->dirty || mfile->passthrough_opens)
+        return 0;
+    if (source->fd != -1 && source->wr)
+    {
+        if (source->use)
+            return 0;
+        /**
+         * Left open read-write by the backup : writes through it would reach the object
+         */
+        close(source->fd);
+        source->fd = -1;
+    }
+    return 1;
+}
+
+/**
+ * Hash the backing file of mfile, and link it with its object
+ * @return MCACHEFS_DEDUP_LINKED or MCACHEFS_DEDUP_CREATED, 0 if left as is, a negative errno on failure
+ */
+static int
+mcachefs_dedup_file(struct mcachefs_file_t *mfile, char *buffer)
+{
+    struct mcachefs_metadata_t *mdata;
+    struct mcachefs_sha256_t sha;
+    unsigned char digest[MCACHEFS_SHA256_SIZE];
+    char objpath[256], inodepath[128];
+    char *backingpath, *objabs = NULL;
+    struct stat st, current, object, source;
+    off_t size, offset;
+    time_t mtime;
+    ssize_t bytes;
+    int fd, res = 0;
+
+    mdata = mcachefs_file_get_metadata(mfile);
+    if (!mdata)
+        return 0;
+    size = mdata->st.st_size;
+    mtime = mdata->st.st_mtime;
+    mcachefs_metadata_release(mdata);
+
+    mcachefs_file_lock_file(mfile);
+    res = mcachefs_dedup_may_link(mfile);
+    source = mfile->transfer.source;
+    mcachefs_file_unlock_file(mfile);
+    if (!res)
+    {
+        Log("Not hashing '%s' : backing not done or open for write\n", mfile->path);
+        return 0;
+    }
+
+    backingpath = mcachefs_makepath_cache(mfile->path);
+    if (!backingpath)
+        return -ENOMEM;
+    fd = open(backingpath, O_RDONLY);
+    if (fd == -1)
+    {
+        free(backingpath);
+        return 0;
+    }
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_nlink > 1 || st.st_size != size
+        || st.st_size < mcachefs_config_get_dedup_min_size() || mcachefs_compress_is_compressed(fd))
+    {
+        close(fd);
+        free(backingpath);
+        return 0;
+    }
+
+    res = 0;
+    mcachefs_sha256_init(&sha);
+    for (offset = 0; offset < st.st_size && !res; offset += bytes)
+    {
+        if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
+            res = -ECANCELED;
+        else if ((bytes = pread(fd, buffer, MCACHEFS_DEDUP_BUFFER_SIZE, offset)) <= 0)
+            res = -EIO;
+        else
+            mcachefs_sha256_update(&sha, buffer, bytes);
+    }
+    close(fd);
+    if (res)
+    {
+        free(backingpath);
+        return res;
+    }
+    mcachefs_sha256_final(&sha, digest);
+    mcachefs_dedup_object_path(digest, objpath, sizeof(objpath));
+
+    mcachefs_dedup_lock();
+    mcachefs_dedup_stats.bytes_hashed += st.st_size;
+    mcachefs_dedup_unlock();
+
+    if (mcachefs_createpath_cache(objpath, 0) || (objabs = mcachefs_makepath_cache(objpath)) == NULL)
+    {
+        free(backingpath);
+        return -EIO;
+    }
+
+    /*
+     * The backing file may have been written, truncated or replaced while being hashed
+     */
+    mcachefs_file_lock_file(mfile);
+    if (!mcachefs_dedup_may_link(mfile) || lstat(backingpath, &current) || current.st_ino != st.st_ino
+        || current.st_dev != st.st_dev || current.st_size != st.st_size || current.st_mtim.tv_sec != st.st_mtim.tv_sec
+        || current.st_mtim.tv_nsec != st.st_mtim.tv_nsec)
+    {
+        res = 0;
+    }
+    else if (lstat(objabs, &object) == 0 && S_ISREG(object.st_mode) && object.st_size == st.st_size)
+    {
+        if (object.st_ino == st.st_ino)
+            res = 0;
+        else if ((res = mcachefs_dedup_replace(backingpath, objabs)) == 0)
+            res = MCACHEFS_DEDUP_LINKED;
+    }
+    else
+    {
+        /**
+         * Record the inode first : once linked, the backing file must be known as an object
+         */
+        mcachefs_dedup_inode_path(&st, inodepath, sizeof(inodepath));
+        unlink(objabs);
+        if ((res = mcachefs_dedup_write_record(inodepath, objpath)) == 0)
+            res = link(backingpath, objabs) ? -errno : MCACHEFS_DEDUP_CREATED;
+    }
+    mcachefs_file_unlock_file(mfile);
+
+    if (res > 0)
+    {
+        Log("%s '%s' as %s\n", res == MCACHEFS_DEDUP_LINKED ? "Linked" : "Stored", mfile->path, objpath);
+        /**
+         * Only contents backed up as is from the source are hinted, not contents written since
+         */
+        if (source.st_ino && source.st_size == size && source.st_mtime == mtime)
+            mcachefs_dedup_write_hint(mfile->path, &source, objpath);
+        if (res == MCACHEFS_DEDUP_LINKED)
+        {
+            mcachefs_dedup_lock();
+            mcachefs_dedup_stats.bytes_saved += st.st_size;
+            mcachefs_dedup_unlock();
+        }
+    }
+    else if (res < 0)
+    {
+        Err("Could not link '%s' with %s : err=%d:%s\n", mfile->path, objpath, -res, strerror(-res));
+    }
+    free(objabs);
+    free(backingpath);
+    return res;
+}
+
+static struct mcachefs_file_t *
+mcachefs_dedup_dequeue()
+{
+    struct mcachefs_dedup_queue_t *entry;
+    struct mcachefs_file_t *mfile = NULL;
+
+    mcachefs_dedup_lock();
+    if ((entry = mcachefs_dedup_queue_head) != NULL)
+    {
+        mcachefs_dedup_queue_head = entry->next;
+        if (!mcachefs_dedup_queue_head)
+            mcachefs_dedup_queue_tail = NULL;
+        mcachefs_dedup_queue_nb--;
+        mfile = entry->mfile;
+        free(entry);
+    }
+    mcachefs_dedup_unlock();
+    return mfile;
+}
+
+static void *
+mcachefs_dedup_thread(void *arg)
+{
+    struct mcachefs_file_t *mfile;
+    char *buffer;
+    int res;
+
+    (void) arg;
+    Info("Dedup thread %lx up and running.\n", (unsigned long) pthread_self());
+
+    buffer = (char *) malloc(MCACHEFS_DEDUP_BUFFER_SIZE);
+    if (!buffer)
+    {
+        Bug("Could not allocate dedup buffer\n");
+    }
+
+    while (1)
+    {
+        sem_wait(&mcachefs_dedup_sem);
+        if (mcachefs_dedup_quit)
+            break;
+        if ((mfile = mcachefs_dedup_dequeue()) == NULL)
+            continue;
+
+        res = mcachefs_dedup_file(mfile, buffer);
+        if (res <= 0 && res != -ECANCELED)
+        {
+            /**
+             * Files stored per path may still be compressed
+             */
+            mcachefs_compress_queue(mfile);
+        }
+        mcachefs_file_release(mfile);
+
+        mcachefs_dedup_lock();
+        if (res == MCACHEFS_DEDUP_LINKED)
+            mcachefs_dedup_stats.files_linked++;
+        else if (res == MCACHEFS_DEDUP_CREATED)
+            mcachefs_dedup_stats.files_created++;
+        else if (res == 0 || res == -ECANCELED)
+            mcachefs_dedup_stats.files_skipped++;
+        else
+            mcachefs_dedup_stats.files_failed++;
+        mcachefs_dedup_unlock();
+    }
+
+    free(buffer);
+    Log("Interrupting dedup thread %lx\n", (unsigned long) pthread_self());
+    return NULL;
+}
+
+void
+mcachefs_dedup_queue(struct mcachefs_file_t *mfile)
+{
+    struct mcachefs_dedup_queue_t *entry;
+
+    if (!mcachefs_config_get_dedup() || mfile->type != mcachefs_file_type_file)
+        return;
+
+    entry = (struct mcachefs_dedup_queue_t *) malloc(sizeof(struct mcachefs_dedup_queue_t));
+    if (!entry)
+        return;
+
+    mcachefs_file_lock_file(mfile);
+    mfile->use++;
+    mcachefs_file_unlock_file(mfile);
+
+    entry->mfile = mfile;
+    entry->next = NULL;
+
+    mcachefs_dedup_lock();
+    if (mcachefs_dedup_queue_nb >= MCACHEFS_DEDUP_QUEUE_MAX)
+    {
+        mcachefs_dedup_stats.files_dropped++;
+        mcachefs_dedup_unlock();
+        Log("Dedup queue full, storing '%s' per path\n", mfile->path);
+        free(entry);
+        mcachefs_file_release(mfile);
+        return;
+    }
+    if (mcachefs_dedup_queue_tail)
+        mcachefs_dedup_queue_tail->next = entry;
+    else
+        mcachefs_dedup_queue_head = entry;
+    mcachefs_dedup_queue_tail = entry;
+    mcachefs_dedup_queue_nb++;
+    mcachefs_dedup_unlock();
+
+    sem_post(&mcachefs_dedup_sem);
+}
+
+/**
+ * Remove the entries of a directory of the object store which are not linked anymore
+ * @param records the relative path of the hints or inodes directory, whose entries are removed when their object is gone,
+ * NULL for a directory of objects
+ */
+static void
+mcachefs_dedup_collect_dir(int dirfd, const char *records)
+{
+    char objpath[256], hintpath[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    char *hintabs, *objabs;
+    DIR *dp;
+
+    if ((dp = fdopendir(dirfd)) == NULL)
+    {
+        close(dirfd);
+        return;
+    }
+    while ((de = readdir(dp)) != NULL)
+    {
+        if (de->d_name[0] == '.' || fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode))
+            continue;
+        if (!records)
+        {
+            if (st.st_nlink > 1 || unlinkat(dirfd, de->d_name, 0))
+                continue;
+            mcachefs_dedup_lock();
+            mcachefs_dedup_stats.objects_collected++;
+            mcachefs_dedup_stats.bytes_collected += st.st_size;
+            mcachefs_dedup_unlock();
+            continue;
+        }
+        snprintf(hintpath, sizeof(hintpath), "%s/%s", records, de->d_name);
+        hintabs = mcachefs_makepath_cache(hintpath);
+        objabs = NULL;
+        if (hintabs && mcachefs_dedup_read_hint(hintabs, objpath, sizeof(objpath)) == 0)
+            objabs = mcachefs_makepath_cache(objpath);
+        if (hintabs && (!objabs || lstat(objabs, &st)))
+            unlinkat(dirfd, de->d_name, 0);
+        else if (objabs && strcmp(records, MCACHEFS_DEDUP_INODES) == 0)
+        {
+            /**
+             * The record of an inode is only valid for the inode currently holding its object
+             */
+            mcachefs_dedup_inode_path(&st, objpath, sizeof(objpath));
+            if (strcmp(objpath, hintpath))
+                unlinkat(dirfd, de->d_name, 0);
+        }
+        free(objabs);
+        free(hintabs);
+    }
+    closedir(dp);
+}
+
+void
+mcachefs_dedup_collect()
+{
+    char *objects;
+    struct dirent *de;
+    int objfd, fd;
+    DIR *dp;
+
+    objects = mcachefs_makepath_cache(MCACHEFS_DEDUP_OBJECTS);
+    if (!objects)
+        return;
+    objfd = open(objects, O_RDONLY);
+    free(objects);
+    if (objfd == -1 || (dp = fdopendir(objfd)) == NULL)
+    {
+        if (objfd != -1)
+            close(objfd);
+        return;
+    }
+
+    Info("Collecting unreferenced objects\n");
+    while ((de = readdir(dp)) != NULL)
+    {
+        if (de->d_name[0] == '.' || strcmp(de->d_name, "hints") == 0 || strcmp(de->d_name, "inodes") == 0)
+            continue;
+        if ((fd = openat(objfd, de->d_name, O_RDONLY | O_DIRECTORY)) != -1)
+            mcachefs_dedup_collect_dir(fd, NULL);
+    }
+    if ((fd = openat(objfd, "hints", O_RDONLY | O_DIRECTORY)) != -1)
+        mcachefs_dedup_collect_dir(fd, MCACHEFS_DEDUP_HINTS);
+    if ((fd = openat(objfd, "inodes", O_RDONLY | O_DIRECTORY)) != -1)
+        mcachefs_dedup_collect_dir(fd, MCACHEFS_DEDUP_INODES);
+    closedir(dp);
+}
+
+void
+mcachefs_dedup_start_thread()
+{
+    pthread_attr_t attrs;
+
+    mcachefs_mutex_init(&mcachefs_dedup_mutex);
+    sem_init(&mcachefs_dedup_sem, 0, 0);
+    memset(&mcachefs_dedup_stats, 0, sizeof(mcachefs_dedup_stats));
+    mcachefs_dedup_quit = 0;
+
+    pthread_attr_init(&attrs);
+    pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_JOINABLE);
+    pthread_create(&mcachefs_dedup_threadid, &attrs, mcachefs_dedup_thread, NULL);
+}
+
+void
+mcachefs_dedup_stop_thread()
+{
+    struct mcachefs_file_t *mfile;
+    int res;
+    void *arg;
+
+    mcachefs_dedup_quit = 1;
+    sem_post(&mcachefs_dedup_sem);
+    if ((res = pthread_join(mcachefs_dedup_threadid, &arg)) != 0)
+    {
+        Err("Could not join dedup thread %lx : err=%d:%s\n", mcachefs_dedup_threadid, res, strerror(res));
+    }
+    Info("Dedup thread interrupted.\n");
+
+    while ((mfile = mcachefs_dedup_dequeue()) != NULL)
+    {
+        mcachefs_file_release(mfile);
+    }
+}
+
+void
+mcachefs_dedup_dump(struct mcachefs_file_t *mvops)
+{
+    struct mcachefs_dedup_stats_t *stats = &mcachefs_dedup_stats;
+
+    mcachefs_dedup_lock();
+    __VOPS_WRITE(mvops, "Dedup : %s", mcachefs_config_get_dedup() ? "enabled" : "disabled");
+    if (mcachefs_config_get_dedup())
+        __VOPS_WRITE(mvops, ", files over %luk", (unsigned long) mcachefs_config_get_dedup_min_size() >> 10);
+    __VOPS_WRITE(mvops, "\n");
+    __VOPS_WRITE(mvops, "Files : %lu linked to existing objects, %lu new objects, %lu skipped, %lu failed, %lu dropped, %d queued\n",
+                 stats->files_linked, stats->files_created, stats->files_skipped, stats->files_failed, stats->files_dropped,
+                 mcachefs_dedup_queue_nb);
+    __VOPS_WRITE(mvops, "Bytes : %lluk hashed, %lluk saved\n", stats->bytes_hashed >> 10, stats->bytes_saved >> 10);
+    __VOPS_WRITE(mvops, "Hints : %lu backups skipped, %lluk not copied\n", stats->hints_hit, stats->bytes_skipped >> 10);
+    __VOPS_WRITE(mvops, "Unshared : %lu files copied before write\n", stats->files_unshared);
+    __VOPS_WRITE(mvops, "Collected : %lu objects, %lluk\n", stats->objects_collected, stats->bytes_collected >> 10);
+    mcachefs_dedup_unlock();
+}
@@ -0,0 +1,70 @@
+#ifndef __MCACHEFS_DEDUP_H
+#define __MCACHEFS_DEDUP_H
+
+/**
+ * ********************* DEDUP *****************************
+ * Content-addressed store of backing files : once a backup is complete, the dedup thread hashes the backing file with
+ * SHA-256 and hard links it as MCACHEFS_DEDUP_OBJECTS/<first byte>/<sha256>. A backing file whose contents are
+ * already there is replaced by a link to the object, so each contents is stored once. The link count of an object is
+ * its reference count : objects no longer linked by any path are removed by the cache cleanup.
+ * Each object is also recorded in a hint named after the identity of the source file it was backed up from (device,
+ * inode, size, modification and change times to the nanosecond) : a backup of the same source file, unchanged, links
+ * the object at once instead of copying the file. Files are never linked on their name or size alone.
+ * Each object is recorded under MCACHEFS_DEDUP_INODES by its inode too, so that a backing file linked with an object
+ * can be told from a hard link made by the user.
+ * A backing file linked with an object is copied before it is opened for write, truncated or hard linked, so that
+ * writes never reach other paths ; hard links made by the user are kept. Shared backing files are not compressed.
+ */
+
+#define MCACHEFS_DEDUP_OBJECTS     "/.mcachefs/objects"
+#define MCACHEFS_DEDUP_HINTS       "/.mcachefs/objects/hints"
+#define MCACHEFS_DEDUP_INODES      "/.mcachefs/objects/inodes"
+#define MCACHEFS_DEDUP_BUFFER_SIZE (1 << 20)
+
+/**
+ * Maximal number of files waiting for the dedup thread, further files are stored per path
+ */
+#define MCACHEFS_DEDUP_QUEUE_MAX   1024
+
+void mcachefs_dedup_start_thread();
+
+/**
+ * Stop the dedup thread, and release the files still queued
+ */
+void mcachefs_dedup_stop_thread();
+
+/**
+ * Queue a file whose backup is complete for hashing - no lock HELD
+ */
+void mcachefs_dedup_queue(struct mcachefs_file_t *mfile);
+
+/**
+ * Link the backing file of mfile to a known object matching its source, instead of copying it - mfile lock HELD
+ * @return 1 if the backing file is complete, 0 if it shall be copied
+ */
+int mcachefs_dedup_link_known(struct mcachefs_file_t *mfile);
+
+/**
+ * Get the identity of the source of mfile keying its hint, with st_ino set to 0 if there is none - no lock HELD
+ */
+void mcachefs_dedup_stat_source(struct mcachefs_file_t *mfile, struct stat *st);
+
+/**
+ * Check whether fd is a backing file linked with an object, whether dedup is enabled or not
+ */
+int mcachefs_dedup_is_shared(int fd);
+
+/**
+ * Give the backing file of path its own copy of its contents, if it is linked with an object
+ * @return 0 on success, a negative errno otherwise
+ */
+int mcachefs_dedup_unshare(const char *path);
+
+/**
+ * Remove the objects no longer linked by any backing file, and the hints to removed objects
+ */
+void mcachefs_dedup_collect();
+
+void mcachefs_dedup_dump(struct mcachefs_file_t *mvops);
+
+#endif // __MCACHEFS_DEDUP_H
@@ -0,0 +1,158 @@
+#include "mcachefs.h"
+#include "mcachefs-extents.h"
+
+void
+mcachefs_extents_init(struct mcachefs_extents_t *set)
+{
+    memset(set, 0, sizeof(struct mcachefs_extents_t));
+}
+
+void
+mcachefs_extents_free(struct mcachefs_extents_t *set)
+{
+    free(set->extents);
+    mcachefs_extents_init(set);
+}
+
+static off_t
+mcachefs_extent_end(struct mcachefs_extent_t *extent)
+{
+    if (extent->length > MCACHEFS_EXTENTS_EOF - extent->offset)
+        return MCACHEFS_EXTENTS_EOF;
+    return extent->offset + extent->length;
+}
+
+/**
+ * Index of the first extent which ends at or after offset, set->nb if none
+ */
+static int
+mcachefs_extents_lookup(struct mcachefs_extents_t *set, off_t offset)
+{
+    int low = 0, high = set->nb, middle;
+
+    while (low < high)
+    {
+        middle = (low + high) / 2;
+        if (mcachefs_extent_end(&(set->extents[middle])) < offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+int
+mcachefs_extents_add(struct mcachefs_extents_t *set, off_t offset, off_t length)
+{
+    struct mcachefs_extent_t *extents, added;
+    off_t end;
+    int first, last;
+
+    if (length <= 0)
+        return 0;
+
+    added.offset = offset;
+    added.length = length;
+    end = mcachefs_extent_end(&added);
+
+    /**
+     * Extents [first, last[ overlap or touch the new one, and are replaced by their union
+     */
+    first = mcachefs_extents_lookup(set, offset);
+    for (last = first; last < set->nb && set->extents[last].offset <= end; last++)
+    {
+        if (set->extents[last].offset < offset)
+            offset = set->extents[last].offset;
+        if (mcachefs_extent_end(&(set->extents[last])) > end)
+            end = mcachefs_extent_end(&(set->extents[last]));
+    }
+
+    if (first == last)
+    {
+        if (set->nb == set->alloced)
+        {
+            extents = (struct mcachefs_extent_t *) realloc(set->extents, sizeof(struct mcachefs_extent_t) * (set->alloced ? set->alloced * 2 : 8));
+            if (!extents)
+            {
+                Err("OOM : could not grow extents from %d\n", set->alloced);
+                return -ENOMEM;
+            }
+            set->extents = extents;
+            set->alloced = set->alloced ? set->alloced * 2 : 8;
+        }
+        memmove(&(set->extents[first + 1]), &(set->extents[first]), sizeof(struct mcachefs_extent_t) * (set->nb - first));
+        set->nb++;
+        last = first + 1;
+    }
+    else if (last > first + 1)
+    {
+        memmove(&(set->extents[first + 1]), &(set->extents[last]), sizeof(struct mcachefs_extent_t) * (set->nb - last));
+        set->nb -= last - first - 1;
+    }
+    set->extents[first].offset = offset;
+    set->extents[first].length = end - offset;
+    return 0;
+}
+
+int
+mcachefs_extents_merge(struct mcachefs_extents_t *set, struct mcachefs_extents_t *from)
+{
+    int cur, res;
+
+    for (cur = 0; cur < from->nb; cur++)
+    {
+        if ((res = mcachefs_extents_add(set, from->extents[cur].offset, from->extents[cur].length)) != 0)
+            return res;
+    }
+    return 0;
+}
+
+int
+mcachefs_extents_contains(struct mcachefs_extents_t *set, off_t offset, off_t length)
+{
+    struct mcachefs_extent_t asked = { offset, length };
+    int index;
+
+    if (length <= 0)
+        return 1;
+    index = mcachefs_extents_lookup(set, offset);
+    if (index == set->nb)
+        return 0;
+    return set->extents[index].offset <= offset && mcachefs_extent_end(&(set->extents[index])) >= mcachefs_extent_end(&asked);
+}
+
+void
+mcachefs_extents_clip(struct mcachefs_extents_t *set, off_t size)
+{
+    while (set->nb && set->extents[set->nb - 1].offset >= size)
+    {
+        set->nb--;
+    }
+    if (set->nb && mcachefs_extent_end(&(set->extents[set->nb - 1])) > size)
+    {
+        set->extents[set->nb - 1].length = size - set->extents[set->nb - 1].offset;
+    }
+}
+
+void
+mcachefs_extents_move(struct mcachefs_extents_t *set, struct mcachefs_extents_t *from)
+{
+    free(set->extents);
+    memcpy(set, from, sizeof(struct mcachefs_extents_t));
+    mcachefs_extents_init(from);
+}
+
+off_t
+mcachefs_extents_get_size(struct mcachefs_extents_t *set)
+{
+    off_t size = 0;
+    int cur;
+
+    for (cur = 0; cur < set->nb; cur++)
+    {
+        if (set->extents[cur].length > MCACHEFS_EXTENTS_EOF - size)
+            return MCACHEFS_EXTENTS_EOF;
+        size += set->extents[cur].length;
+    }
+    return size;
+}
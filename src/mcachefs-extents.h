@@ -0,0 +1,50 @@
+#ifndef __MCACHEFS_EXTENTS_H
+#define __MCACHEFS_EXTENTS_H
+
+/**
+ * ********************* EXTENTS *****************************
+ * Sets of byte ranges, used to track the dirty parts of a file between two writebacks.
+ * Extents are kept sorted and merged, so that the number of extents stays low for usual write patterns.
+ * A set is not protected by any lock : the owner of the set (an mfile) protects it.
+ */
+
+/**
+ * Length of an extent running up to the end of the file, whatever its size
+ */
+#define MCACHEFS_EXTENTS_EOF ((off_t) 0x7fffffffffffffffLL)
+
+void mcachefs_extents_init(struct mcachefs_extents_t *set);
+void mcachefs_extents_free(struct mcachefs_extents_t *set);
+
+/**
+ * Add [offset, offset+length[ to the set, merging it with the extents it overlaps or touches
+ * @return 0 on success, -ENOMEM
+ */
+int mcachefs_extents_add(struct mcachefs_extents_t *set, off_t offset, off_t length);
+
+/**
+ * Add all the extents of from to set
+ */
+int mcachefs_extents_merge(struct mcachefs_extents_t *set, struct mcachefs_extents_t *from);
+
+/**
+ * Check if [offset, offset+length[ is fully covered by the set
+ */
+int mcachefs_extents_contains(struct mcachefs_extents_t *set, off_t offset, off_t length);
+
+/**
+ * Drop everything beyond size
+ */
+void mcachefs_extents_clip(struct mcachefs_extents_t *set, off_t size);
+
+/**
+ * Move the extents of from to set (which is freed first), leaving from empty
+ */
+void mcachefs_extents_move(struct mcachefs_extents_t *set, struct mcachefs_extents_t *from);
+
+/**
+ * Total number of bytes covered by the set
+ */
+off_t mcachefs_extents_get_size(struct mcachefs_extents_t *set);
+
+#endif // __MCACHEFS_EXTENTS_H
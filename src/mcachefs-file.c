@@ -1,6 +1,12 @@
 #include "mcachefs.h"
+#include "mcachefs-chunks.h"
+#include "mcachefs-compress.h"
+#include "mcachefs-dedup.h"
+#include "mcachefs-extents.h"
 #include "mcachefs-hash.h"
 #include "mcachefs-journal.h"
+#include "mcachefs-kcache.h"
+#include "mcachefs-transfer.h"
 
 /**
  * mcachefs File handling
@@ -21,6 +27,7 @@ mcachefs_file_source_init(struct mcachefs_file_source_t *source)
     source->use = 0;
     source->fd = -1;
     source->wr = 0;
+    source->compressed = 0;
     source->bytesrd = 0;
     source->nbrd = 0;
     source->byteswr = 0;
@@ -46,6 +53,8 @@ mcachefs_file_init(mcachefs_fh_t fh, char *path, hash_t hash, mcachefs_file_type
     mcachefs_file_source_init(&(mfile->sources[MCACHEFS_FILE_SOURCE_REAL]));
 
     mfile->cache_status = MCACHEFS_FILE_BACKING_NONE;
+    mfile->chunks.fd = -1;
+    mfile->chunks.data_fd = -1;
 
     mfile->timeslice = -1;
     mfile->timeslice_previous = NULL;
@@ -53,12 +62,13 @@ mcachefs_file_init(mcachefs_fh_t fh, char *path, hash_t hash, mcachefs_file_type
     mfile->type = type;
 
     mcachefs_mutex_init(&(mfile->mutex));
+    mcachefs_cond_init(&(mfile->cond));
 }
 
 struct mcachefs_file_t *
 mcachefs_file_get(mcachefs_fh_t fdi)
 {
-    struct mcachefs_file_t *mfile = (struct mcachefs_file_t *) (unsigned long) fdi;
+    struct mcachefs_file_t *mfile = (struct mcachefs_file_t *) (unsigned long) (fdi & ~MCACHEFS_FH_FLAGS);
     return mfile;
 }
 
@@ -176,6 +186,10 @@ mcachefs_file_remove(struct mcachefs_file_t *mfile)
     {
         Bug("mfile already deleted !!!\n");
     }
+    mcachefs_chunks_close(mfile);
+    mcachefs_extents_free(&(mfile->dirty_extents));
+    mcachefs_extents_free(&(mfile->writeback_extents));
+    mcachefs_cond_destroy(&(mfile->cond), mfile->path);
     mcachefs_mutex_destroy(&(mfile->mutex), mfile->path);
 
     free(mfile->path);
@@ -278,7 +292,7 @@ int
 mcachefs_file_do_open(struct mcachefs_file_t *mfile, int flags, mode_t mode, struct mcachefs_file_source_t *source, char *(*path_translator)(const char *path))
 {
     char *translated_path;
-    int asked_wr = __IS_WRITE(flags) ? 1 : 0;
+    int asked_wr = __IS_WRITE(flags) ? 1 : 0, res;
 
     Log("do_open(%s) : locking\n", mfile->path);
     mcachefs_file_lock_file(mfile);
@@ -321,6 +335,36 @@ mcachefs_file_do_open(struct mcachefs_file_t *mfile, int flags, mode_t mode, str
     }
     free(translated_path);
 
+    source->compressed = 0;
+    if (source == &(mfile->sources[MCACHEFS_FILE_SOURCE_BACKING]) && !(flags & O_CREAT))
+    {
+        source->compressed = mcachefs_compress_is_compressed(source->fd);
+        if (asked_wr && (source->compressed || mcachefs_dedup_is_shared(source->fd)))
+        {
+            /**
+             * Writes only ever go to plain backing files of their own
+             */
+            close(source->fd);
+            source->fd = -1;
+            res = source->compressed ? mcachefs_compress_inflate(mfile->path) : mcachefs_dedup_unshare(mfile->path);
+            source->compressed = 0;
+            if (res != 0)
+            {
+                mcachefs_file_unlock_file(mfile);
+                return res;
+            }
+            translated_path = path_translator(mfile->path);
+            source->fd = translated_path ? open(translated_path, flags) : -1;
+            free(translated_path);
+            if (source->fd == -1)
+            {
+                Err("mcachefs_file_do_open : could not reopen backing of '%s'\n", mfile->path);
+                mcachefs_file_unlock_file(mfile);
+                return -EIO;
+            }
+        }
+    }
+
     Log("=> rfd = %d\n", source->fd);
 
     source->use++;
@@ -470,6 +514,8 @@ mcachefs_file_update_metadata(struct mcachefs_file_t *mfile, off_t size, int mod
     if (modified)
         mdata->st.st_mtime = now;
     mcachefs_metadata_notify_update(mdata);
+    if (modified)
+        mcachefs_kcache_invalidate_hardlinks(mdata, 1);
     mcachefs_metadata_release(mdata);
 }
 
@@ -500,6 +546,9 @@ mcachefs_file_thread(void *arg)
         mcachefs_metadata_lock();
         mcachefs_metadata_unlock();
 
+        // Adapt the transfer thread pools to the queued transfers
+        mcachefs_transfer_pool_adjust();
+
         sleep(mcachefs_config_get_file_thread_interval());
     }
     return NULL;
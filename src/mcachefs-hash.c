@@ -1,6 +1,7 @@
 #include "mcachefs-hash.h"
 
 #include <stdio.h>
+#include <string.h>
 #define Log(...) fprintf(stderr, __VA_ARGS__)
 
 #ifdef __MCACHEFS_HASH_USE_CRC32
@@ -39,9 +40,151 @@ crc32_bitwise(const void *data, size_t length, uint32_t previousCrc32)
 }
 #endif
 
+#include "crc64table.h"
+
+unsigned long long
+mcachefs_crc64(unsigned long long crc, const void *buffer, size_t size)
+{
+    const unsigned char *current = (const unsigned char *) buffer;
+
+    while (size--)
+    {
+        crc = crc64table[((crc >> 56) ^ *current++) & 0xFF] ^ (crc << 8);
+    }
+    return crc;
+}
+
+static const unsigned int mcachefs_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define MCACHEFS_SHA256_ROR(__x, __n) (((__x) >> (__n)) | ((__x) << (32 - (__n))))
+
+static void
+mcachefs_sha256_block(struct mcachefs_sha256_t *sha, const unsigned char *block)
+{
+    unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int cur;
+
+    for (cur = 0; cur < 16; cur++)
+    {
+        w[cur] = ((unsigned int) block[cur * 4] << 24) | ((unsigned int) block[cur * 4 + 1] << 16)
+            | ((unsigned int) block[cur * 4 + 2] << 8) | (unsigned int) block[cur * 4 + 3];
+    }
+    for (cur = 16; cur < 64; cur++)
+    {
+        t1 = MCACHEFS_SHA256_ROR(w[cur - 2], 17) ^ MCACHEFS_SHA256_ROR(w[cur - 2], 19) ^ (w[cur - 2] >> 10);
+        t2 = MCACHEFS_SHA256_ROR(w[cur - 15], 7) ^ MCACHEFS_SHA256_ROR(w[cur - 15], 18) ^ (w[cur - 15] >> 3);
+        w[cur] = t1 + w[cur - 7] + t2 + w[cur - 16];
+    }
+
+    a = sha->state[0];
+    b = sha->state[1];
+    c = sha->state[2];
+    d = sha->state[3];
+    e = sha->state[4];
+    f = sha->state[5];
+    g = sha->state[6];
+    h = sha->state[7];
+    for (cur = 0; cur < 64; cur++)
+    {
+        t1 = h + (MCACHEFS_SHA256_ROR(e, 6) ^ MCACHEFS_SHA256_ROR(e, 11) ^ MCACHEFS_SHA256_ROR(e, 25)) + ((e & f) ^ (~e & g))
+            + mcachefs_sha256_k[cur] + w[cur];
+        t2 = (MCACHEFS_SHA256_ROR(a, 2) ^ MCACHEFS_SHA256_ROR(a, 13) ^ MCACHEFS_SHA256_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    sha->state[0] += a;
+    sha->state[1] += b;
+    sha->state[2] += c;
+    sha->state[3] += d;
+    sha->state[4] += e;
+    sha->state[5] += f;
+    sha->state[6] += g;
+    sha->state[7] += h;
+}
+
+void
+mcachefs_sha256_init(struct mcachefs_sha256_t *sha)
+{
+    static const unsigned int initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(sha->state, initial, sizeof(initial));
+    sha->length = 0;
+    sha->used = 0;
+}
+
+void
+mcachefs_sha256_update(struct mcachefs_sha256_t *sha, const void *buffer, size_t size)
+{
+    const unsigned char *current = (const unsigned char *) buffer;
+    size_t part;
+
+    sha->length += size;
+    if (sha->used)
+    {
+        part = 64 - sha->used;
+        if (part > size)
+            part = size;
+        memcpy(sha->buffer + sha->used, current, part);
+        sha->used += part;
+        current += part;
+        size -= part;
+        if (sha->used < 64)
+            return;
+        mcachefs_sha256_block(sha, sha->buffer);
+        sha->used = 0;
+    }
+    for (; size >= 64; current += 64, size -= 64)
+    {
+        mcachefs_sha256_block(sha, current);
+    }
+    memcpy(sha->buffer, current, size);
+    sha->used = size;
+}
+
+void
+mcachefs_sha256_final(struct mcachefs_sha256_t *sha, unsigned char digest[MCACHEFS_SHA256_SIZE])
+{
+    unsigned long long bits = sha->length << 3;
+    int cur;
+
+    sha->buffer[sha->used++] = 0x80;
+    if (sha->used > 56)
+    {
+        memset(sha->buffer + sha->used, 0, 64 - sha->used);
+        mcachefs_sha256_block(sha, sha->buffer);
+        sha->used = 0;
+    }
+    memset(sha->buffer + sha->used, 0, 56 - sha->used);
+    for (cur = 0; cur < 8; cur++)
+    {
+        sha->buffer[63 - cur] = (unsigned char) (bits >> (cur * 8));
+    }
+    mcachefs_sha256_block(sha, sha->buffer);
+    for (cur = 0; cur < 32; cur++)
+    {
+        digest[cur] = (unsigned char) (sha->state[cur / 4] >> (24 - (cur % 4) * 8));
+    }
+}
+
 #ifdef __MCACHEFS_HASH_USE_CRC64
 
-#include "crc64table.h"
 /**
  * crc64 algorithm, directly taken from Linux crc64.c
  */
@@ -11,4 +11,26 @@ hash_t continueHash(hash_t h, const char *str);
 hash_t doHash(const char *str);
 hash_t doHashPartial(const char *str, int sz);
 
+/**
+ * CRC64 of a binary buffer, chained from crc (0 for the first buffer)
+ */
+unsigned long long mcachefs_crc64(unsigned long long crc, const void *buffer, size_t size);
+
+/**
+ * SHA-256 of a binary stream, fed by mcachefs_sha256_update() between init() and final()
+ */
+#define MCACHEFS_SHA256_SIZE 32
+
+struct mcachefs_sha256_t
+{
+    unsigned int state[8];
+    unsigned long long length;  //< Bytes hashed so far
+    unsigned char buffer[64];
+    int used;                   //< Bytes pending in buffer
+};
+
+void mcachefs_sha256_init(struct mcachefs_sha256_t *sha);
+void mcachefs_sha256_update(struct mcachefs_sha256_t *sha, const void *buffer, size_t size);
+void mcachefs_sha256_final(struct mcachefs_sha256_t *sha, unsigned char digest[MCACHEFS_SHA256_SIZE]);
+
 #endif // __MCACHEFS_HASH_H
@@ -6,12 +6,23 @@
  */
 
 #include "mcachefs.h"
+#include "mcachefs-chunks.h"
+#include "mcachefs-compress.h"
+#include "mcachefs-extents.h"
 #include "mcachefs-journal.h"
+#include "mcachefs-prefetch.h"
 #include "mcachefs-transfer.h"
 #include "mcachefs-vops.h"
+#include "mcachefs-warmup.h"
 
-// Waiting for the cache to be populated, in nanoseconds
-static const int WAIT_CACHE_INTERVAL = 100 * 1000 * 1000;
+// Waiting for urgent chunks to be backed up, in milliseconds
+static const int WAIT_CACHE_TIMEOUT = 1000;
+
+// Interval for writers to re-check mcachefs state while waiting for backing, in milliseconds
+static const int WAIT_BACKING_INTERVAL = 1000;
+
+// Granularity of the dirty extents recorded in the journal, in bytes
+static const off_t MCACHEFS_DIRTY_BLOCK_SIZE = 64 * 1024;
 
 int
 mcachefs_open_mfile(struct mcachefs_file_t *mfile, struct fuse_file_info *info, mcachefs_file_type_t type)
@@ -21,9 +32,17 @@ mcachefs_open_mfile(struct mcachefs_file_t *mfile, struct fuse_file_info *info,
 #if 0
         info->direct_io = 1;
 #endif
+        mcachefs_warmup_record(mfile->path);
+        mcachefs_file_lock_file(mfile);
+        mfile->openers++;
+        mcachefs_file_unlock_file(mfile);
         if (mcachefs_config_get_read_state() != MCACHEFS_STATE_NOCACHE || __IS_WRITE(info->flags))
         {
-            mcachefs_transfer_backfile(mfile);
+            mcachefs_transfer_backfile(mfile, MCACHEFS_TRANSFER_PRIORITY_FOREGROUND);
+            if (!__IS_WRITE(info->flags))
+            {
+                mcachefs_prefetch_open(mfile);
+            }
         }
         else
         {
@@ -75,8 +94,9 @@ static int
 mcachefs_read_wait_accessible(struct mcachefs_file_t *mfile, size_t size, off_t offset)
 {
     int use_real = 1;
-    int waited_backing = 0, waited_backing_max = 10;
-    struct timespec read_wait_time;
+    int fetch = 0;
+    int timedout = 0;
+    struct timespec deadline = { 0, 0 };
 
     mcachefs_file_lock_file(mfile);
     while (1)
@@ -91,33 +111,50 @@ mcachefs_read_wait_accessible(struct mcachefs_file_t *mfile, size_t size, off_t
             use_real = 1;
             break;
         }
-        if (mfile->cache_status == MCACHEFS_FILE_BACKING_NONE
-            || mfile->cache_status == MCACHEFS_FILE_BACKING_ASKED || mfile->cache_status == MCACHEFS_FILE_BACKING_ERROR)
+        if ((mfile->cache_status != MCACHEFS_FILE_BACKING_ASKED
+             && mfile->cache_status != MCACHEFS_FILE_BACKING_IN_PROGRESS) || mfile->chunks.map == NULL)
         {
             use_real = 1;
             break;
         }
-        if (mfile->cache_status == MCACHEFS_FILE_BACKING_IN_PROGRESS && mfile->transfer.transfered_size >= offset + (off_t) size)
+        if (mcachefs_chunks_has_range(mfile, offset, size))
         {
             use_real = 0;
             break;
         }
-        if (waited_backing == waited_backing_max)
+        /**
+         * While a backup thread works on this file, ask it to fetch the range next.
+         * Otherwise (backup still queued, too many ranges asked, or waited too long), fetch it ourselves.
+         */
+        if (mfile->cache_status != MCACHEFS_FILE_BACKING_IN_PROGRESS || timedout
+            || mcachefs_chunks_post_urgent(mfile, offset, size))
         {
-            Err("Sick of waiting '%s' in cache, using source.\n", mfile->path);
-            use_real = 1;
+            fetch = 1;
             break;
         }
-        mcachefs_file_unlock_file(mfile);
-        read_wait_time.tv_sec = 0;
-        read_wait_time.tv_nsec = WAIT_CACHE_INTERVAL;
-        nanosleep(&read_wait_time, NULL);
-        Log("Waiting for end of backing for file '%s', offset=%luk, size=%luk, end of segment=%luk\n", mfile->path,
+        if (!deadline.tv_sec)
+        {
+            mcachefs_cond_get_deadline(&deadline, WAIT_CACHE_TIMEOUT);
+        }
+        Log("Waiting for chunks of file '%s', offset=%luk, size=%luk, end of segment=%luk\n", mfile->path,
             (unsigned long) offset >> 10, (unsigned long) size >> 10, (unsigned long) (offset + (off_t) size) >> 10);
-        mcachefs_file_lock_file(mfile);
-        waited_backing++;
+        timedout = (mcachefs_file_wait_file(mfile, &deadline) == ETIMEDOUT);
     }
     mcachefs_file_unlock_file(mfile);
+
+    if (fetch)
+    {
+        Log("Fetching missing chunks of '%s', offset=%luk, size=%luk\n", mfile->path,
+            (unsigned long) offset >> 10, (unsigned long) size >> 10);
+        if (mcachefs_transfer_fetch_range(mfile, offset, size) == 0)
+        {
+            use_real = 0;
+        }
+        else
+        {
+            Err("Could not fetch chunks of '%s', using source.\n", mfile->path);
+        }
+    }
     Log("Waiting read path='%s' : mfile->backing_status=%d, use_real=%d\n", mfile->path, mfile->cache_status, use_real);
     return use_real;
 }
@@ -138,7 +175,10 @@ mcachefs_read_file(struct mcachefs_file_t *mfile, char *buf, size_t size, off_t
         return -EIO;
     }
 
-    fd = mcachefs_file_getfd(mfile, use_real, O_RDONLY);
+    /**
+     * A partial backing file is shared with the transfers filling it, which open it read-write
+     */
+    fd = mcachefs_file_getfd(mfile, use_real, (use_real || mfile->cache_status == MCACHEFS_FILE_BACKING_DONE) ? O_RDONLY : O_RDWR);
     Log("reading : fd=%d, use_real=%d\n", fd, use_real);
 
     if (fd < 0)
@@ -147,11 +187,13 @@ mcachefs_read_file(struct mcachefs_file_t *mfile, char *buf, size_t size, off_t
         return -EIO;
     }
 
-    res = pread(fd, buf, size, offset);
+    if (!use_real && mfile->sources[MCACHEFS_FILE_SOURCE_BACKING].compressed)
+        res = mcachefs_compress_pread(fd, buf, size, offset);
+    else if ((res = pread(fd, buf, size, offset)) < 0)
+        res = -errno;
     if (res < 0)
     {
-        res = -errno;
-        Err("Error while reading '%s' on fd=%d, real=%d : %d:%s\n", mfile->path, fd, use_real, errno, strerror(errno));
+        Err("Error while reading '%s' on fd=%d, real=%d : %d:%s\n", mfile->path, fd, use_real, -res, strerror(-res));
     }
     else
     {
@@ -188,6 +230,59 @@ mcachefs_read_file(struct mcachefs_file_t *mfile, char *buf, size_t size, off_t
     return res;
 }
 
+int
+mcachefs_read_mfile_getfd(struct mcachefs_file_t *mfile)
+{
+    int done, fd;
+
+    if (mfile->type != mcachefs_file_type_file)
+        return -1;
+
+    mcachefs_file_lock_file(mfile);
+    done = (mfile->cache_status == MCACHEFS_FILE_BACKING_DONE);
+    mcachefs_file_unlock_file(mfile);
+    if (!done)
+        return -1;
+
+    /**
+     * Errors are reported by the copy path, which opens the backing file again
+     */
+    fd = mcachefs_file_getfd(mfile, 0, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (mfile->sources[MCACHEFS_FILE_SOURCE_BACKING].compressed)
+    {
+        mcachefs_file_putfd(mfile, 0);
+        return -1;
+    }
+    Log("reading '%s' from backing fd=%d\n", mfile->path, fd);
+    return fd;
+}
+
+void
+mcachefs_read_mfile_putfd(struct mcachefs_file_t *mfile, size_t size, off_t offset)
+{
+    struct mcachefs_metadata_t *mdata;
+
+    /**
+     * The reply stops at the end of the file : the backing file is stored as is, at the size of the metadata
+     */
+    mdata = mcachefs_file_get_metadata(mfile);
+    if (mdata)
+    {
+        if (offset >= mdata->st.st_size)
+            size = 0;
+        else if ((off_t) size > mdata->st.st_size - offset)
+            size = mdata->st.st_size - offset;
+        mdata->st.st_atime = time(NULL);
+        mcachefs_metadata_notify_update(mdata);
+        mcachefs_metadata_release(mdata);
+    }
+    mfile->sources[MCACHEFS_FILE_SOURCE_BACKING].nbrd++;
+    mfile->sources[MCACHEFS_FILE_SOURCE_BACKING].bytesrd += size;
+    mcachefs_file_putfd(mfile, 0);
+}
+
 int
 mcachefs_read_mfile(struct mcachefs_file_t *mfile, char *buf, size_t size, off_t offset)
 {
@@ -233,38 +328,114 @@ mcachefs_write_vops(struct mcachefs_file_t *mfile, const char *buf, size_t size,
     return size;
 }
 
-int
-mcachefs_write_file(struct mcachefs_file_t *mfile, const char *buf, size_t size, off_t offset)
+/**
+ * Record a write in the journal : an fsync entry the first time the file is written in this journal generation,
+ * then the extents written, rounded to MCACHEFS_DIRTY_BLOCK_SIZE so that small sequential writes are journaled once.
+ * The journal is appended with no lock on the file to prevent deadlocks.
+ */
+static void
+mcachefs_write_file_dirty(struct mcachefs_file_t *mfile, off_t offset, size_t size)
 {
-    ssize_t bytes;
+    int generation = mcachefs_journal_get_generation();
+    int journal_fsync = 0, journal_extent = 0;
+    off_t start, end;
+
+    start = offset - (offset % MCACHEFS_DIRTY_BLOCK_SIZE);
+    end = offset + size + MCACHEFS_DIRTY_BLOCK_SIZE - 1;
+    end -= end % MCACHEFS_DIRTY_BLOCK_SIZE;
+
+    mcachefs_file_lock_file(mfile);
+    if (mfile->dirty != generation)
+    {
+        mfile->dirty = generation;
+        mcachefs_extents_free(&(mfile->dirty_extents));
+        journal_fsync = 1;
+    }
+    if (!mcachefs_extents_contains(&(mfile->dirty_extents), start, end - start))
+    {
+        if (mcachefs_extents_add(&(mfile->dirty_extents), start, end - start))
+        {
+            /**
+             * Could not remember the extent, it will just be journaled again
+             */
+            mcachefs_extents_free(&(mfile->dirty_extents));
+        }
+        journal_extent = 1;
+    }
+    mcachefs_file_unlock_file(mfile);
+
+    if (journal_fsync)
+    {
+        mcachefs_journal_append(mcachefs_journal_op_fsync, mfile->path, NULL, 0, 0, 0, 0, 0, NULL);
+    }
+    if (journal_extent)
+    {
+        mcachefs_journal_append_extent(mfile->path, start, end - start);
+    }
+}
+
+/**
+ * Writes go to the backing file only : wait for it to be complete, then open it for write
+ * @return the backing fd, to put back with mcachefs_file_putfd(), or a negative errno
+ */
+static int
+mcachefs_write_file_getfd(struct mcachefs_file_t *mfile)
+{
+    struct timespec deadline;
     int fd;
-    int use_real = 0;
 
+    mcachefs_file_lock_file(mfile);
     while (mfile->cache_status != MCACHEFS_FILE_BACKING_DONE)
     {
-        mcachefs_file_lock_file(mfile);
         Info("write(%s) : waiting for backing to complete...\n", mfile->path);
-        if (mfile->cache_status == MCACHEFS_FILE_BACKING_ERROR)
+        if (mfile->cache_status == MCACHEFS_FILE_BACKING_ERROR
+            || mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
         {
             Err("write(%s) : backing failed !\n", mfile->path);
             mcachefs_file_unlock_file(mfile);
             return -EIO;
         }
-        mcachefs_file_unlock_file(mfile);
-        sleep(1);
+        mcachefs_cond_get_deadline(&deadline, WAIT_BACKING_INTERVAL);
+        mcachefs_file_wait_file(mfile, &deadline);
     }
+    mcachefs_file_unlock_file(mfile);
 
-    fd = mcachefs_file_getfd(mfile, use_real, O_RDWR);
-    if (fd == -1)
+    fd = mcachefs_file_getfd(mfile, 0, O_RDWR);
+    if (fd < 0)
     {
         Err("Could not get backing fd ?\n");
         return -EIO;
     }
-
     Log("write to '%s', fd=%d\n", mfile->path, fd);
+    return fd;
+}
+
+/**
+ * Account and journal a write of size bytes at offset, once in the backing file
+ */
+static void
+mcachefs_write_file_done(struct mcachefs_file_t *mfile, size_t size, off_t offset)
+{
+    mfile->sources[MCACHEFS_FILE_SOURCE_BACKING].nbwr++;
+    mfile->sources[MCACHEFS_FILE_SOURCE_BACKING].byteswr += size;
+
+    mcachefs_write_file_dirty(mfile, offset, size);
+
+    mcachefs_file_update_metadata(mfile, offset + size, 1);
+    Log("write to '%s' ok : written %ld bytes at offset %ld\n", mfile->path, (long) size, (long) offset);
+}
+
+int
+mcachefs_write_file(struct mcachefs_file_t *mfile, const char *buf, size_t size, off_t offset)
+{
+    ssize_t bytes;
+    int fd;
+
+    if ((fd = mcachefs_write_file_getfd(mfile)) < 0)
+        return fd;
 
     bytes = pwrite(fd, buf, size, offset);
-    mcachefs_file_putfd(mfile, use_real);
+    mcachefs_file_putfd(mfile, 0);
 
     if (bytes != (int) size)
     {
@@ -272,30 +443,39 @@ mcachefs_write_file(struct mcachefs_file_t *mfile, const char *buf, size_t size,
         return -errno;
     }
 
-    mfile->sources[use_real].nbwr++;
-    mfile->sources[use_real].byteswr += bytes;
+    mcachefs_write_file_done(mfile, size, offset);
+    return (int) bytes;
+}
+
+/**
+ * Write the data of bufv to the backing file, spliced from the /dev/fuse pipe when the request came through one
+ */
+static int
+mcachefs_write_file_buf(struct mcachefs_file_t *mfile, struct fuse_bufvec *bufv, off_t offset)
+{
+    size_t size = fuse_buf_size(bufv);
+    struct fuse_bufvec out = FUSE_BUFVEC_INIT(size);
+    ssize_t bytes;
+    int fd;
+
+    if ((fd = mcachefs_write_file_getfd(mfile)) < 0)
+        return fd;
 
-    if (!mfile->dirty)
+    out.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    out.buf[0].fd = fd;
+    out.buf[0].pos = offset;
+
+    bytes = fuse_buf_copy(&out, bufv, 0);
+    mcachefs_file_putfd(mfile, 0);
+
+    if (bytes != (ssize_t) size)
     {
-        mcachefs_file_lock_file(mfile);
-        if (!mfile->dirty)
-        {
-            /**
-             * We have to append the fsync command on the journal
-             * Do it with no lock on the file to prevent deadlocks
-             */
-            mfile->dirty = 1;
-            mcachefs_file_unlock_file(mfile);
-            mcachefs_journal_append(mcachefs_journal_op_fsync, mfile->path, NULL, 0, 0, 0, 0, 0, NULL);
-        }
-        else
-        {
-            mcachefs_file_unlock_file(mfile);
-        }
+        Err("Could not write to '%s' : fd=%d, wrote %ld of %lu, err=%d:%s\n", mfile->path, fd, (long) bytes,
+            (unsigned long) size, bytes < 0 ? (int) -bytes : 0, bytes < 0 ? strerror((int) -bytes) : "short write");
+        return bytes < 0 ? (int) bytes : -EIO;
     }
 
-    mcachefs_file_update_metadata(mfile, offset + size, 1);
-    Log("write to '%s' ok : written %ld bytes at offset %ld\n", mfile->path, (long) bytes, (long) offset);
+    mcachefs_write_file_done(mfile, size, offset);
     return (int) bytes;
 }
 
@@ -317,6 +497,42 @@ mcachefs_write_mfile(struct mcachefs_file_t *mfile, const char *buf, size_t size
     return -ENOSYS;
 }
 
+int
+mcachefs_write_mfile_buf(struct mcachefs_file_t *mfile, struct fuse_bufvec *bufv, off_t offset)
+{
+    struct fuse_bufvec mem;
+    size_t size;
+    char *buf;
+    int res;
+
+    if (mfile->type == mcachefs_file_type_file)
+    {
+#ifdef MCACHEFS_DISABLE_WRITE
+        return -EROFS;
+#endif
+        return mcachefs_write_file_buf(mfile, bufv, offset);
+    }
+    if (bufv->count == 1 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD))
+    {
+        return mcachefs_write_mfile(mfile, (const char *) bufv->buf[0].mem + bufv->off, fuse_buf_size(bufv), offset);
+    }
+
+    /**
+     * Vops contents are kept in memory : copy the data out of the pipe first
+     */
+    size = fuse_buf_size(bufv);
+    buf = (char *) malloc(size);
+    if (!buf)
+        return -ENOMEM;
+    mem = FUSE_BUFVEC_INIT(size);
+    mem.buf[0].mem = buf;
+    res = (int) fuse_buf_copy(&mem, bufv, 0);
+    if (res >= 0)
+        res = mcachefs_write_mfile(mfile, buf, res, offset);
+    free(buf);
+    return res;
+}
+
 int
 mcachefs_fsync_mfile(struct mcachefs_file_t *mfile)
 {
@@ -336,6 +552,8 @@ mcachefs_fsync_mfile(struct mcachefs_file_t *mfile)
 int
 mcachefs_release_mfile(struct mcachefs_file_t *mfile, struct fuse_file_info *info)
 {
+    int last;
+
     if (mfile->type == mcachefs_file_type_vops)
     {
         Log("VOPS release '%s'\n", mfile->path);
@@ -365,6 +583,13 @@ mcachefs_release_mfile(struct mcachefs_file_t *mfile, struct fuse_file_info *inf
             // mcachefs_fsync(mfile->path, 0, info);
             mcachefs_fsync_mfile(mfile);
         }
+        mcachefs_file_lock_file(mfile);
+        last = (--mfile->openers == 0);
+        mcachefs_file_unlock_file(mfile);
+        if (last)
+        {
+            mcachefs_transfer_release(mfile);
+        }
     }
     else
     {
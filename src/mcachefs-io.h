@@ -12,8 +12,25 @@ int mcachefs_open_mfile(struct mcachefs_file_t *mfile, struct fuse_file_info *in
 
 int mcachefs_read_mfile(struct mcachefs_file_t *mfile, char *buf, size_t size, off_t offset);
 
+/**
+ * Get the backing fd of mfile for the kernel to be replied from directly (splice), if mfile is fully cached and stored
+ * as is : reads of files being backed up, compressed or virtual go through mcachefs_read_mfile()
+ * @return the fd, to put back with mcachefs_read_mfile_putfd() once replied, or -1
+ */
+int mcachefs_read_mfile_getfd(struct mcachefs_file_t *mfile);
+
+/**
+ * Put back the backing fd of mfile after a reply of up to size bytes at offset from it
+ */
+void mcachefs_read_mfile_putfd(struct mcachefs_file_t *mfile, size_t size, off_t offset);
+
 int mcachefs_write_mfile(struct mcachefs_file_t *mfile, const char *buf, size_t size, off_t offset);
 
+/**
+ * Write the data of bufv at offset, from memory or from the /dev/fuse pipe
+ */
+int mcachefs_write_mfile_buf(struct mcachefs_file_t *mfile, struct fuse_bufvec *bufv, off_t offset);
+
 int mcachefs_fsync_mfile(struct mcachefs_file_t *mfile);
 
 int mcachefs_release_mfile(struct mcachefs_file_t *mfile, struct fuse_file_info *info);
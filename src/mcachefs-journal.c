@@ -1,4 +1,5 @@
 #include "mcachefs.h"
+#include "mcachefs-extents.h"
 #include "mcachefs-journal.h"
 #include "mcachefs-transfer.h"
 #include "mcachefs-vops.h"
@@ -10,7 +11,7 @@
 
 static const char *mcachefs_journal_op_label[] = { "none", "mknod", "mkdir", "unlink", "rmdir", "symlink", "rename",
     "link",
-    "chmod", "chown", "truncate", "utime", "fsync", "INVALID"
+    "chmod", "chown", "truncate", "utime", "fsync", "extent", "INVALID"
 };
 
 enum mcachefs_journal_action_t
@@ -31,10 +32,106 @@ struct mcachefs_journal_fsync_t mcachefs_journal_fsync;
 
 char *mcachefs_journal_fsync_path = NULL;
 
+static int mcachefs_journal_generation = 1;
+
+/**
+ * Files to write back while applying the fsync journal, with the extents recorded for them
+ */
+struct mcachefs_journal_sync_file_t
+{
+    char *path;
+    int fsync;
+    struct mcachefs_extents_t extents;
+    struct mcachefs_journal_sync_file_t *next;
+};
+
+/**
+ * Write the journal header - fd must point to an empty journal
+ */
+static int
+mcachefs_journal_write_header(int fd)
+{
+    struct mcachefs_journal_header_t header;
+
+    memset(&header, 0, sizeof(struct mcachefs_journal_header_t));
+    strcpy(header.magic, MCACHEFS_JOURNAL_MAGIC);
+    header.version = MCACHEFS_JOURNAL_VERSION;
+    header.entry_size = sizeof(struct mcachefs_journal_entry_t);
+
+    if (write(fd, &header, sizeof(struct mcachefs_journal_header_t)) != (int) sizeof(struct mcachefs_journal_header_t))
+    {
+        Err("Could not write journal header : err=%d:%s\n", errno, strerror(errno));
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * Read and check the journal header, an empty journal has no header
+ */
+static int
+mcachefs_journal_read_header(int fd)
+{
+    struct mcachefs_journal_header_t header;
+    int res;
+
+    res = read(fd, &header, sizeof(struct mcachefs_journal_header_t));
+    if (res == 0)
+        return 0;
+    if (res != (int) sizeof(struct mcachefs_journal_header_t)
+        || strncmp(header.magic, MCACHEFS_JOURNAL_MAGIC, sizeof(header.magic)) != 0)
+    {
+        Err("Invalid journal header, not a journal or written by an older mcachefs.\n");
+        return -EINVAL;
+    }
+    if (header.version != MCACHEFS_JOURNAL_VERSION || header.entry_size != (int) sizeof(struct mcachefs_journal_entry_t))
+    {
+        Err("Unsupported journal version=%d, entry_size=%d (expected version=%d, entry_size=%d)\n",
+            header.version, header.entry_size, MCACHEFS_JOURNAL_VERSION, (int) sizeof(struct mcachefs_journal_entry_t));
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Open a journal : readers get the fd positioned after a checked header,
+ * writers get the header written if the journal is empty
+ * Returns -1 and sets errno on error, as open() does
+ */
+static int
+mcachefs_journal_open(const char *journal, int flags)
+{
+    struct stat st;
+    int fd, res;
+
+    fd = open(journal, flags, 0644);
+    if (fd == -1)
+        return -1;
+
+    if ((flags & O_ACCMODE) == O_RDONLY)
+        res = mcachefs_journal_read_header(fd);
+    else if (fstat(fd, &st))
+        res = -errno;
+    else if (st.st_size == 0)
+        res = mcachefs_journal_write_header(fd);
+    else
+        res = 0;
+
+    if (res)
+    {
+        close(fd);
+        errno = -res;
+        return -1;
+    }
+    return fd;
+}
+
 void
 mcachefs_journal_init()
 {
     struct stat st;
+    int fd;
+
     mcachefs_journal_fsync_path = mcachefs_makepath(".fsync", mcachefs_config_get_journal());
 
     if (mcachefs_journal_fsync_path == NULL)
@@ -45,6 +142,17 @@ mcachefs_journal_init()
         Err("Journal fsync already exist !!!\n");
         Bug("Not implemented yet.\n");
     }
+
+    fd = mcachefs_journal_open(mcachefs_config_get_journal(), O_RDONLY);
+    if (fd == -1)
+    {
+        if (errno == ENOENT)
+            return;
+        Err("Could not use journal '%s' : err=%d:%s\n", mcachefs_config_get_journal(), errno, strerror(errno));
+        Err("Apply it with the mcachefs version which wrote it, or move it away.\n");
+        exit(-1);
+    }
+    close(fd);
 }
 
 enum mcachefs_journal_action_t mcachefs_journal_action = mcachefs_journal_action_none;
@@ -105,6 +213,12 @@ mcachefs_journal_read_entry(int fd, struct mcachefs_journal_entry_t *entry, char
         Err("Could not read journal entry : err=%d:%s\n", errno, strerror(errno));
         return -errno;
     }
+    if (entry->op <= mcachefs_journal_op_none || entry->op >= mcachefs_journal_op_MAX
+        || entry->path_sz <= 0 || entry->path_sz >= PATH_MAX || entry->to_sz < 0 || entry->to_sz >= PATH_MAX)
+    {
+        Err("Corrupted journal entry : op=%x, path_sz=%d, to_sz=%d\n", entry->op, entry->path_sz, entry->to_sz);
+        return -EINVAL;
+    }
     bytes += res;
     res = read(fd, path, entry->path_sz);
     if (res != entry->path_sz)
@@ -143,6 +257,7 @@ mcachefs_journal_append(mcachefs_journal_op op, const char *path,
     entry.uid = uid;
     entry.gid = gid;
     entry.size = size;
+    entry.offset = 0;
 
     if (utimbuf)
         memcpy(&(entry.utimbuf), utimbuf, sizeof(struct utimbuf));
@@ -173,7 +288,7 @@ mcachefs_journal_append(mcachefs_journal_op op, const char *path,
         }
     }
 
-    fd = open(mcachefs_config_get_journal(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    fd = mcachefs_journal_open(mcachefs_config_get_journal(), O_RDWR | O_CREAT | O_APPEND);
 
     if (fd == -1)
     {
@@ -191,6 +306,40 @@ mcachefs_journal_append(mcachefs_journal_op op, const char *path,
     mcachefs_journal_unlock();
 }
 
+void
+mcachefs_journal_append_extent(const char *path, off_t offset, off_t length)
+{
+    struct mcachefs_journal_entry_t entry;
+    int fd, res;
+
+    memset(&entry, 0, sizeof(struct mcachefs_journal_entry_t));
+    entry.op = mcachefs_journal_op_extent;
+    entry.offset = offset;
+    entry.size = length;
+
+    Log("New journal extent : path='%s', offset=%lu, length=%lu\n", path, (unsigned long) offset, (unsigned long) length);
+
+    mcachefs_journal_lock();
+    fd = mcachefs_journal_open(mcachefs_config_get_journal(), O_RDWR | O_CREAT | O_APPEND);
+    if (fd == -1)
+    {
+        Err("Could not open journal '%s' : err=%d:%s\n", mcachefs_config_get_journal(), errno, strerror(errno));
+        exit(-1);
+    }
+    if ((res = mcachefs_journal_append_entry(fd, &entry, path, NULL)) != 0)
+    {
+        Err("Could not write journal : err=%d:%s\n", -res, strerror(-res));
+    }
+    close(fd);
+    mcachefs_journal_unlock();
+}
+
+int
+mcachefs_journal_get_generation()
+{
+    return __atomic_load_n(&mcachefs_journal_generation, __ATOMIC_ACQUIRE);
+}
+
 int
 mcachefs_journal_rebuild(const char *rename_path, const char *rename_to)
 {
@@ -213,7 +362,7 @@ mcachefs_journal_rebuild(const char *rename_path, const char *rename_to)
     memcpy(altered_path, rename_to, rename_to_sz);
     altered_path_suffix = &(altered_path[rename_to_sz]);
 
-    fd_src = open(mcachefs_config_get_journal(), O_RDONLY);
+    fd_src = mcachefs_journal_open(mcachefs_config_get_journal(), O_RDONLY);
     if (fd_src == -1)
     {
         Err("REBUILD : Could not open source journal '%s'\n", mcachefs_config_get_journal());
@@ -224,7 +373,7 @@ mcachefs_journal_rebuild(const char *rename_path, const char *rename_to)
     strcpy(journal_tgt, mcachefs_config_get_journal());
     strcat(journal_tgt, mcachefs_journal_suffix);
 
-    fd_tgt = open(journal_tgt, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    fd_tgt = mcachefs_journal_open(journal_tgt, O_RDWR | O_CREAT | O_TRUNC);
     if (fd_tgt == -1)
     {
         Err("REBUILD : Could not open target journal '%s'\n", journal_tgt);
@@ -238,7 +387,8 @@ mcachefs_journal_rebuild(const char *rename_path, const char *rename_to)
         if (res <= 0)
             break;
 
-        if (entry.op == mcachefs_journal_op_fsync && strncmp(path, rename_path, rename_path_sz) == 0)
+        if ((entry.op == mcachefs_journal_op_fsync || entry.op == mcachefs_journal_op_extent)
+            && strncmp(path, rename_path, rename_path_sz) == 0)
         {
             strncpy(altered_path_suffix, &(path[rename_path_sz]), PATH_MAX - rename_to_sz);
             res = mcachefs_journal_append_entry(fd_tgt, &entry, altered_path, to);
@@ -345,7 +495,7 @@ mcachefs_journal_was_renamed(const char *newpath)
     struct mcachefs_journal_entry_t entry;
 
     mcachefs_journal_lock();
-    fd = open(mcachefs_config_get_journal(), O_RDONLY);
+    fd = mcachefs_journal_open(mcachefs_config_get_journal(), O_RDONLY);
 
     if (fd < 0)
     {
@@ -499,7 +649,7 @@ mcachefs_journal_apply_updates(const char *journal)
     char path[PATH_MAX], to[PATH_MAX];
     struct mcachefs_journal_entry_t entry;
 
-    fd = open(journal, O_RDONLY);
+    fd = mcachefs_journal_open(journal, O_RDONLY);
 
     if (fd == -1)
     {
@@ -520,7 +670,7 @@ mcachefs_journal_apply_updates(const char *journal)
             Bug("Could not read entry : err=%d:%s\n", -res, strerror(-res));
             mcachefs_journal_unlock();
         }
-        if (entry.op == mcachefs_journal_op_fsync)
+        if (entry.op == mcachefs_journal_op_fsync || entry.op == mcachefs_journal_op_extent)
             continue;
         mcachefs_journal_apply_entry(&entry, path, to);
         Log("\tApply finished.\n");
@@ -532,6 +682,29 @@ mcachefs_journal_apply_updates(const char *journal)
     return (res == 0) ? 0 : -EIO;
 }
 
+static struct mcachefs_journal_sync_file_t *
+mcachefs_journal_get_sync_file(struct mcachefs_journal_sync_file_t **files, const char *path)
+{
+    struct mcachefs_journal_sync_file_t *file;
+
+    for (file = *files; file; file = file->next)
+    {
+        if (strcmp(file->path, path) == 0)
+            return file;
+    }
+    file = (struct mcachefs_journal_sync_file_t *) malloc(sizeof(struct mcachefs_journal_sync_file_t));
+    if (!file)
+    {
+        Bug("OOM.\n");
+    }
+    file->path = strdup(path);
+    file->fsync = 0;
+    mcachefs_extents_init(&(file->extents));
+    file->next = *files;
+    *files = file;
+    return file;
+}
+
 int
 mcachefs_journal_apply_fsync(const char *journal)
 {
@@ -539,8 +712,9 @@ mcachefs_journal_apply_fsync(const char *journal)
     int fd, res, ret;
     char path[PATH_MAX], to[PATH_MAX];
     struct mcachefs_journal_entry_t entry;
+    struct mcachefs_journal_sync_file_t *files = NULL, *file;
 
-    fd = open(journal, O_RDONLY);
+    fd = mcachefs_journal_open(journal, O_RDONLY);
 
     if (fd == -1)
     {
@@ -550,6 +724,9 @@ mcachefs_journal_apply_fsync(const char *journal)
 
     Log("\tStart of journal apply fsync.\n");
 
+    /**
+     * First gather the extents written for each file
+     */
     while (1)
     {
         res = mcachefs_journal_read_entry(fd, &entry, path, to);
@@ -561,30 +738,63 @@ mcachefs_journal_apply_fsync(const char *journal)
             Bug("Could not read entry : err=%d:%s\n", -res, strerror(-res));
             return -EIO;
         }
-        if (entry.op != mcachefs_journal_op_fsync)
-            continue;
-        Log("Fsync : %s\n", path);
-        /**
-         * We are protected by the journal lock here
-         */
-
-        ret = mcachefs_transfer_writeback(path);
-
-        mcachefs_journal_check_locked();
-
-        mcachefs_journal_fsync.total_files++;
-        if (ret == -EEXIST)
+        if (entry.op == mcachefs_journal_op_fsync)
         {
-            mcachefs_journal_fsync.files_ok++;
+            mcachefs_journal_get_sync_file(&files, path)->fsync = 1;
         }
-        else if (ret)
+        else if (entry.op == mcachefs_journal_op_extent)
         {
-            mcachefs_journal_fsync.files_error++;
+            /**
+             * An extent may have been journaled after the fsync entry of its file went to the previous journal
+             */
+            file = mcachefs_journal_get_sync_file(&files, path);
+            file->fsync = 1;
+            if (mcachefs_extents_add(&(file->extents), entry.offset, entry.size))
+            {
+                Bug("OOM.\n");
+            }
         }
     }
 
     close(fd);
 
+    while (files)
+    {
+        file = files;
+        files = file->next;
+
+        if (file->fsync)
+        {
+            Log("Fsync : %s (%d extents)\n", file->path, file->extents.nb);
+            if (file->extents.nb == 0)
+            {
+                /**
+                 * No extent recorded for that file, write it back entirely
+                 */
+                mcachefs_extents_add(&(file->extents), 0, MCACHEFS_EXTENTS_EOF);
+            }
+            /**
+             * We are protected by the journal lock here
+             */
+            ret = mcachefs_transfer_writeback(file->path, &(file->extents));
+
+            mcachefs_journal_check_locked();
+
+            mcachefs_journal_fsync.total_files++;
+            if (ret == -EEXIST)
+            {
+                mcachefs_journal_fsync.files_ok++;
+            }
+            else if (ret)
+            {
+                mcachefs_journal_fsync.files_error++;
+            }
+        }
+        mcachefs_extents_free(&(file->extents));
+        free(file->path);
+        free(file);
+    }
+
     return (res == 0) ? 0 : -EIO;
 }
 
@@ -633,6 +843,7 @@ mcachefs_journal_apply()
     {
         Bug("Could not rename '%s' to '%s' : err=%d:%s\n", mcachefs_config_get_journal(), mcachefs_journal_fsync_path, errno, strerror(errno));
     }
+    __atomic_add_fetch(&mcachefs_journal_generation, 1, __ATOMIC_RELEASE);
 
     if (mcachefs_journal_apply_fsync(mcachefs_journal_fsync_path))
     {
@@ -701,10 +912,10 @@ mcachefs_journal_count_entries()
     struct stat st;
 
     mcachefs_journal_lock();
-    if (stat(mcachefs_config_get_journal(), &st) == 0)
+    if (stat(mcachefs_config_get_journal(), &st) == 0 && st.st_size > (off_t) sizeof(struct mcachefs_journal_header_t))
     {
         mcachefs_journal_unlock();
-        return st.st_size / sizeof(struct mcachefs_journal_entry_t);
+        return (st.st_size - sizeof(struct mcachefs_journal_header_t)) / sizeof(struct mcachefs_journal_entry_t);
     }
     mcachefs_journal_unlock();
     return 0;
@@ -725,7 +936,7 @@ mcachefs_journal_dump(struct mcachefs_file_t *mvops)
 
     Log("\tJournal mutex lock... OK.\n");
 
-    fd = open(mcachefs_config_get_journal(), O_RDONLY);
+    fd = mcachefs_journal_open(mcachefs_config_get_journal(), O_RDONLY);
 
     if (fd == -1)
     {
@@ -748,6 +959,14 @@ mcachefs_journal_dump(struct mcachefs_file_t *mvops)
             break;
         }
 
+        if (entry.op == mcachefs_journal_op_extent)
+        {
+            __VOPS_WRITE(mvops, "[%lu] %s (%x) : path='%s', offset=%lu, length=%lu\n", entry_nb,
+                         mcachefs_journal_op_label[entry.op], entry.op, path, (unsigned long) entry.offset,
+                         (unsigned long) entry.size);
+            entry_nb++;
+            continue;
+        }
         __VOPS_WRITE(mvops,
                      "[%lu] %s (%x) : path='%s', to='%s' : "
                      "mode=%lo, dev=%ld, uid=%ld, gid=%ld, size=%lu, utimebuf=%lu,%lu\n",
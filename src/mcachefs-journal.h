@@ -26,11 +26,26 @@ enum __mcachefs_journal_op
     mcachefs_journal_op_truncate = 0xa,
     mcachefs_journal_op_utime = 0xb,
     mcachefs_journal_op_fsync = 0xc,
-    mcachefs_journal_op_MAX = 0xd
+    mcachefs_journal_op_extent = 0xd,
+    mcachefs_journal_op_MAX = 0xe
 };
 
 typedef enum __mcachefs_journal_op mcachefs_journal_op;
 
+/**
+ * Journal file header, written once at the beginning of the journal
+ * Bump the version each time the layout of struct mcachefs_journal_entry_t changes
+ */
+#define MCACHEFS_JOURNAL_MAGIC "mcachefs-journal"
+#define MCACHEFS_JOURNAL_VERSION 2
+
+struct mcachefs_journal_header_t
+{
+    char magic[24];
+    int version;
+    int entry_size;             // sizeof(struct mcachefs_journal_entry_t)
+};
+
 struct mcachefs_journal_entry_t
 {
     int op;
@@ -40,7 +55,8 @@ struct mcachefs_journal_entry_t
     dev_t rdev;                 // for mknod
     uid_t uid;
     gid_t gid;                  // for chown
-    off_t size;                 // for truncate
+    off_t size;                 // for truncate, length for extent
+    off_t offset;               // for extent
     struct utimbuf utimbuf;     // for utime
 };
 
@@ -50,6 +66,7 @@ struct mcachefs_journal_entry_t
  */
 /**
  * Init journal values, check for pending journals
+ * Refuse to start on a journal written with another format, as its entries can not be applied safely
  */
 void mcachefs_journal_init();
 
@@ -59,6 +76,17 @@ void mcachefs_journal_init();
 void mcachefs_journal_append(mcachefs_journal_op op, const char *path,
                              const char *to, mode_t mode, dev_t rdev, uid_t uid, gid_t gid, off_t size, struct utimbuf *utimbuf);
 
+/**
+ * Record that [offset, offset+length[ of path has been written, and shall be written back along with the fsync of path
+ */
+void mcachefs_journal_append_extent(const char *path, off_t offset, off_t length);
+
+/**
+ * Current journal generation, incremented each time the journal is applied
+ * A file dirtied in an older generation shall be journaled again.
+ */
+int mcachefs_journal_get_generation();
+
 /**
  * Check if a new path was renamed in the journal, ie the provided path is a target in the path rename
  */
@@ -0,0 +1,313 @@
+#include "mcachefs.h"
+#include "mcachefs-kcache.h"
+#include "mcachefs-vops.h"
+
+struct mcachefs_kcache_inval_t
+{
+    mcachefs_metadata_id id;    //< Entry, or directory of name
+    char *name;                 //< Child to invalidate, NULL to invalidate the entry id itself
+    int contents;               //< Also invalidate the page cache of the entry id
+    struct mcachefs_kcache_inval_t *next;
+};
+
+struct mcachefs_kcache_stats_t
+{
+    unsigned long opens_kept;           //< Opens keeping the page cache of the previous ones
+    unsigned long opens_flushed;
+    unsigned long invals_sent;
+    unsigned long invals_unknown;       //< Entries the kernel had forgotten meanwhile
+    unsigned long invals_failed;
+    unsigned long invals_dropped;
+};
+
+/**
+ * The kcache mutex is the innermost lock : no other lock is taken with it held
+ */
+static struct mcachefs_mutex_t mcachefs_kcache_mutex;
+static sem_t mcachefs_kcache_sem;
+static pthread_t mcachefs_kcache_threadid;
+static int mcachefs_kcache_quit = 0;
+
+static struct fuse_session *mcachefs_kcache_session = NULL;
+
+static struct mcachefs_kcache_inval_t *mcachefs_kcache_queue_head = NULL;
+static struct mcachefs_kcache_inval_t *mcachefs_kcache_queue_tail = NULL;
+static int mcachefs_kcache_queue_nb = 0;
+
+static struct mcachefs_kcache_stats_t mcachefs_kcache_stats;
+
+static void
+mcachefs_kcache_lock()
+{
+    mcachefs_mutex_lock(&mcachefs_kcache_mutex, "kcache", __CONTEXT);
+}
+
+static void
+mcachefs_kcache_unlock()
+{
+    mcachefs_mutex_unlock(&mcachefs_kcache_mutex, "kcache", __CONTEXT);
+}
+
+/**
+ * Whether the files served may be cached by the kernel : in the handsup and nocache states, reads go to the source
+ */
+static int
+mcachefs_kcache_enabled()
+{
+    int state = mcachefs_config_get_read_state();
+
+    return state == MCACHEFS_STATE_NORMAL || state == MCACHEFS_STATE_FULL;
+}
+
+double
+mcachefs_kcache_entry_timeout()
+{
+    if (!mcachefs_kcache_enabled())
+        return MCACHEFS_KCACHE_SHORT_TIMEOUT;
+    return (double) mcachefs_config_get_kernel_entry_timeout();
+}
+
+double
+mcachefs_kcache_attr_timeout(struct mcachefs_metadata_t *mdata)
+{
+    struct mcachefs_file_t *mfile;
+    int stable = 1;
+
+    if (!mcachefs_kcache_enabled())
+        return MCACHEFS_KCACHE_SHORT_TIMEOUT;
+
+    if (S_ISREG(mdata->st.st_mode) && mdata->fh)
+    {
+        mfile = mcachefs_file_get(mdata->fh);
+        mcachefs_file_lock_file(mfile);
+        stable = mfile->type == mcachefs_file_type_file && !mfile->dirty && !mfile->writeback_extents.nb;
+        mcachefs_file_unlock_file(mfile);
+    }
+    if (!stable)
+        return MCACHEFS_KCACHE_SHORT_TIMEOUT;
+    return (double) mcachefs_config_get_kernel_attr_timeout();
+}
+
+void
+mcachefs_kcache_open(struct mcachefs_file_t *mfile, struct fuse_file_info *info)
+{
+    int keep;
+
+    if (mfile->type != mcachefs_file_type_file || !mcachefs_config_get_kernel_keep_cache() || !mcachefs_kcache_enabled())
+    {
+        return;
+    }
+
+    mcachefs_file_lock_file(mfile);
+    keep = mfile->cache_status == MCACHEFS_FILE_BACKING_DONE && !mfile->dirty && !mfile->writeback_extents.nb;
+    mcachefs_file_unlock_file(mfile);
+
+    info->keep_cache = keep;
+
+    mcachefs_kcache_lock();
+    if (keep)
+        mcachefs_kcache_stats.opens_kept++;
+    else
+        mcachefs_kcache_stats.opens_flushed++;
+    mcachefs_kcache_unlock();
+}
+
+static void
+mcachefs_kcache_queue(mcachefs_metadata_id id, const char *name, int contents)
+{
+    struct mcachefs_kcache_inval_t *inval, *tail;
+
+    if (!mcachefs_kcache_session)
+        return;
+
+    mcachefs_kcache_lock();
+    tail = mcachefs_kcache_queue_tail;
+    if (!name && tail && !tail->name && tail->id == id && tail->contents >= contents)
+    {
+        /**
+         * Successive writes to a hard linked file
+         */
+        mcachefs_kcache_unlock();
+        return;
+    }
+    if (mcachefs_kcache_queue_nb >= MCACHEFS_KCACHE_QUEUE_MAX)
+    {
+        mcachefs_kcache_stats.invals_dropped++;
+        mcachefs_kcache_unlock();
+        return;
+    }
+    mcachefs_kcache_unlock();
+
+    inval = (struct mcachefs_kcache_inval_t *) malloc(sizeof(struct mcachefs_kcache_inval_t));
+    if (!inval)
+        return;
+    inval->id = id;
+    inval->name = name ? strdup(name) : NULL;
+    inval->contents = contents;
+    inval->next = NULL;
+    if (name && !inval->name)
+    {
+        free(inval);
+        return;
+    }
+
+    mcachefs_kcache_lock();
+    if (mcachefs_kcache_queue_tail)
+        mcachefs_kcache_queue_tail->next = inval;
+    else
+        mcachefs_kcache_queue_head = inval;
+    mcachefs_kcache_queue_tail = inval;
+    mcachefs_kcache_queue_nb++;
+    mcachefs_kcache_unlock();
+
+    sem_post(&mcachefs_kcache_sem);
+}
+
+void
+mcachefs_kcache_invalidate(mcachefs_metadata_id id, int contents)
+{
+    mcachefs_kcache_queue(id, NULL, contents);
+}
+
+void
+mcachefs_kcache_invalidate_entry(mcachefs_metadata_id fatherid, const char *name)
+{
+    mcachefs_kcache_queue(fatherid, name, 0);
+}
+
+void
+mcachefs_kcache_invalidate_hardlinks(struct mcachefs_metadata_t *mdata, int contents)
+{
+    struct mcachefs_metadata_t *next;
+
+    if (!S_ISREG(mdata->st.st_mode) || mdata->st.st_nlink <= 1 || !mdata->hardlink)
+    {
+        return;
+    }
+    for (next = mcachefs_metadata_get(mdata->hardlink); next && next != mdata; next = mcachefs_metadata_get(next->hardlink))
+    {
+        if (mcachefs_metadata_is_remembered(next->id))
+            mcachefs_kcache_invalidate(next->id, contents);
+    }
+}
+
+static struct mcachefs_kcache_inval_t *
+mcachefs_kcache_dequeue()
+{
+    struct mcachefs_kcache_inval_t *inval;
+
+    mcachefs_kcache_lock();
+    if ((inval = mcachefs_kcache_queue_head) != NULL)
+    {
+        mcachefs_kcache_queue_head = inval->next;
+        if (!mcachefs_kcache_queue_head)
+            mcachefs_kcache_queue_tail = NULL;
+        mcachefs_kcache_queue_nb--;
+    }
+    mcachefs_kcache_unlock();
+    return inval;
+}
+
+static void *
+mcachefs_kcache_thread(void *arg)
+{
+    struct mcachefs_kcache_inval_t *inval;
+    int res;
+
+    (void) arg;
+    Info("Kcache thread %lx up and running.\n", (unsigned long) pthread_self());
+
+    while (1)
+    {
+        sem_wait(&mcachefs_kcache_sem);
+        if (mcachefs_kcache_quit)
+            break;
+        if ((inval = mcachefs_kcache_dequeue()) == NULL)
+            continue;
+
+        if (inval->name)
+        {
+            Log("kcache : invalidate entry '%s' of %llu\n", inval->name, (unsigned long long) inval->id);
+            res = fuse_lowlevel_notify_inval_entry(mcachefs_kcache_session, inval->id, inval->name, strlen(inval->name));
+        }
+        else
+        {
+            Log("kcache : invalidate %llu%s\n", (unsigned long long) inval->id, inval->contents ? " and its contents" : "");
+            res = fuse_lowlevel_notify_inval_inode(mcachefs_kcache_session, inval->id, inval->contents ? 0 : -1, 0);
+        }
+        if (res && res != -ENOENT)
+        {
+            Err("Could not invalidate %llu%s%s in the kernel : err=%d:%s\n", (unsigned long long) inval->id, inval->name ? "/" : "",
+                inval->name ? inval->name : "", -res, strerror(-res));
+        }
+
+        mcachefs_kcache_lock();
+        if (res == 0)
+            mcachefs_kcache_stats.invals_sent++;
+        else if (res == -ENOENT)
+            mcachefs_kcache_stats.invals_unknown++;
+        else
+            mcachefs_kcache_stats.invals_failed++;
+        mcachefs_kcache_unlock();
+
+        free(inval->name);
+        free(inval);
+    }
+
+    Log("Interrupting kcache thread %lx\n", (unsigned long) pthread_self());
+    return NULL;
+}
+
+void
+mcachefs_kcache_start_thread(struct fuse_session *session)
+{
+    pthread_attr_t attrs;
+
+    mcachefs_mutex_init(&mcachefs_kcache_mutex);
+    sem_init(&mcachefs_kcache_sem, 0, 0);
+    memset(&mcachefs_kcache_stats, 0, sizeof(mcachefs_kcache_stats));
+    mcachefs_kcache_quit = 0;
+    mcachefs_kcache_session = session;
+
+    pthread_attr_init(&attrs);
+    pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_JOINABLE);
+    pthread_create(&mcachefs_kcache_threadid, &attrs, mcachefs_kcache_thread, NULL);
+}
+
+void
+mcachefs_kcache_stop_thread()
+{
+    struct mcachefs_kcache_inval_t *inval;
+    int res;
+    void *arg;
+
+    mcachefs_kcache_quit = 1;
+    sem_post(&mcachefs_kcache_sem);
+    if ((res = pthread_join(mcachefs_kcache_threadid, &arg)) != 0)
+    {
+        Err("Could not join kcache thread %lx : err=%d:%s\n", mcachefs_kcache_threadid, res, strerror(res));
+    }
+    Info("Kcache thread interrupted.\n");
+
+    mcachefs_kcache_session = NULL;
+    while ((inval = mcachefs_kcache_dequeue()) != NULL)
+    {
+        free(inval->name);
+        free(inval);
+    }
+}
+
+void
+mcachefs_kcache_dump(struct mcachefs_file_t *mvops)
+{
+    struct mcachefs_kcache_stats_t *stats = &mcachefs_kcache_stats;
+
+    mcachefs_kcache_lock();
+    __VOPS_WRITE(mvops, "Kernel cache : %s, entries %ds, attributes %ds, keep cache %s\n",
+                 mcachefs_kcache_enabled() ? "enabled" : "short timeouts in this state", mcachefs_config_get_kernel_entry_timeout(),
+                 mcachefs_config_get_kernel_attr_timeout(), mcachefs_config_get_kernel_keep_cache() ? "enabled" : "disabled");
+    __VOPS_WRITE(mvops, "Opens : %lu kept the page cache, %lu flushed it\n", stats->opens_kept, stats->opens_flushed);
+    __VOPS_WRITE(mvops, "Invalidations : %lu sent, %lu unknown to the kernel, %lu failed, %lu dropped, %d queued\n",
+                 stats->invals_sent, stats->invals_unknown, stats->invals_failed, stats->invals_dropped, mcachefs_kcache_queue_nb);
+    mcachefs_kcache_unlock();
+}
@@ -0,0 +1,69 @@
+#ifndef __MCACHEFS_KCACHE_H
+#define __MCACHEFS_KCACHE_H
+
+/**
+ * ********************* KERNEL CACHE *****************************
+ * Caching of entries, attributes and contents by the kernel : the metadata is the reference for the files mcachefs
+ * serves, and those only change through mcachefs. In the normal and full states, entries and the attributes of stable
+ * files are given the kernel-entry-timeout and kernel-attr-timeout, and the page cache of a file which is fully cached
+ * and clean is kept from an open to the next (keep_cache), so that hot files are read without calling mcachefs.
+ * Files being backed up, dirty or waiting for writeback, and all files in the handsup and nocache states, keep the short
+ * timeouts mcachefs has always used.
+ * The changes the kernel does not see by itself (other hard links of a file written to, truncated or chmod'ed, metadata
+ * flushes) are invalidated with notify_inval, by the kcache thread : the requests causing them may not notify the kernel.
+ */
+
+/**
+ * Timeouts of the entries and attributes which may change behind the kernel, in seconds
+ */
+#define MCACHEFS_KCACHE_SHORT_TIMEOUT 1.0
+
+/**
+ * Maximal number of invalidations waiting for the kcache thread, the kernel then revalidates at the timeouts
+ */
+#define MCACHEFS_KCACHE_QUEUE_MAX     4096
+
+/**
+ * Start the kcache thread, sending the invalidations on session
+ */
+void mcachefs_kcache_start_thread(struct fuse_session *session);
+
+/**
+ * Stop the kcache thread, and drop the invalidations still queued
+ */
+void mcachefs_kcache_stop_thread();
+
+/**
+ * Timeout of the entries given to the kernel
+ */
+double mcachefs_kcache_entry_timeout();
+
+/**
+ * Timeout of the attributes of mdata given to the kernel - metadata lock HELD
+ */
+double mcachefs_kcache_attr_timeout(struct mcachefs_metadata_t *mdata);
+
+/**
+ * Let the kernel keep the page cache of mfile at this open, if its contents are stable - no lock HELD
+ */
+void mcachefs_kcache_open(struct mcachefs_file_t *mfile, struct fuse_file_info *info);
+
+/**
+ * Queue the invalidation of the attributes of the entry id, and of its page cache if contents is set - any lock HELD
+ */
+void mcachefs_kcache_invalidate(mcachefs_metadata_id id, int contents);
+
+/**
+ * Queue the invalidation of the child name of the directory fatherid - any lock HELD
+ */
+void mcachefs_kcache_invalidate_entry(mcachefs_metadata_id fatherid, const char *name);
+
+/**
+ * Queue the invalidation of the other hard links of mdata known by the kernel, after mdata has been updated and
+ * propagated with mcachefs_metadata_notify_update() - metadata lock HELD
+ */
+void mcachefs_kcache_invalidate_hardlinks(struct mcachefs_metadata_t *mdata, int contents);
+
+void mcachefs_kcache_dump(struct mcachefs_file_t *mvops);
+
+#endif // __MCACHEFS_KCACHE_H
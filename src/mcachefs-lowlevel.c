@@ -10,10 +10,18 @@
 /*********************************************************************/
 
 #include "mcachefs.h"
+#include "mcachefs-chunks.h"
+#include "mcachefs-compress.h"
+#include "mcachefs-dedup.h"
 #include "mcachefs-io.h"
 #include "mcachefs-journal.h"
+#include "mcachefs-kcache.h"
+#include "mcachefs-passthrough.h"
+#include "mcachefs-prefetch.h"
+#include "mcachefs-signatures.h"
 #include "mcachefs-transfer.h"
 #include "mcachefs-vops.h"
+#include "mcachefs-warmup.h"
 
 #if 0
 struct stat mcachefs_target_stat;
@@ -32,52 +40,6 @@ __mcachefs_fill_stat(struct stat *st, int type, off_t size)
 #define __MCACHEFS_IS_VOPS_DIR(__path) ( strcmp(path, MCACHEFS_VOPS_DIR) == 0 )
 #define __MCACHEFS_IS_VOPS_FILE(__path) ( strncmp(path, MCACHEFS_VOPS_FILE_PREFIX, 11 ) == 0 )
 
-static int
-mcachefs_getattr(const char *path, struct stat *stbuf)
-{
-    Log("mcachefs_getattr(path = %s, stbuf = ...)\n", path);
-    return mcachefs_metadata_getattr(path, stbuf);
-}
-
-static int
-mcachefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info)
-{
-    int res = 0;
-    struct mcachefs_metadata_t *mfather, *mchild;
-    struct stat st;
-
-    (void) offset;
-    (void) info;
-
-    Log("readdir '%s'\n", path);
-
-    memset(&st, 0, sizeof(struct stat));
-    st.st_mode = S_IFDIR;
-    res = filler(buf, ".", &st, 0);
-    if (res)
-        return res;
-    res = filler(buf, "..", &st, 0);
-    if (res)
-        return res;
-
-    Log("READDIR path='%s'\n", path);
-    mfather = mcachefs_metadata_find(path);
-
-    if (!mfather)
-        return -ENOENT;
-
-    for (mchild = mcachefs_metadata_get_child(mfather); mchild; mchild = mcachefs_metadata_get(mchild->next))
-    {
-        Log("READDIR    '%s' (%p, next=%llu)\n", mchild->d_name, mchild, mchild->next);
-        res = filler(buf, mchild->d_name, &(mchild->st), 0);
-        if (res)
-            break;
-    }
-
-    mcachefs_metadata_release(mfather);
-    return res;
-}
-
 static int
 mcachefs_readlink(const char *path, char *buf, size_t size)
 {
@@ -135,16 +97,16 @@ mcachefs_readlink(const char *path, char *buf, size_t size)
 }
 
 static int
-mcachefs_symlink(const char *path, const char *to)
+mcachefs_symlink(const char *path, const char *to, uid_t uid, gid_t gid)
 {
     Log("mcachefs_symlink(path = %s, to = %s)\n", path, to);
     int res;
     char *backingto;
 
-    if ((res = mcachefs_metadata_make_entry(to, S_IFLNK | 0777, 0)) != 0)
+    if ((res = mcachefs_metadata_make_entry(to, S_IFLNK | 0777, 0, uid, gid)) != 0)
     {
         Err("Could not make symlink entry : err=%d:%s\n", -res, strerror(-res));
-        return -res;
+        return res;
     }
 
     if ((res = mcachefs_createpath_cache(to, 0)) != 0)
@@ -175,19 +137,19 @@ mcachefs_symlink(const char *path, const char *to)
 }
 
 static int
-mcachefs_mknod(const char *path, mode_t mode, dev_t rdev)
+mcachefs_mknod(const char *path, mode_t mode, dev_t rdev, uid_t uid, gid_t gid)
 {
     int res;
 
     Log("mcachefs_mknod(path = %s, mode = %lo, rdev = %ld\n", path, (long) mode, (long) rdev);
 
-    if ((res = mcachefs_metadata_make_entry(path, mode, rdev)) != 0)
+    if ((res = mcachefs_metadata_make_entry(path, mode, rdev, uid, gid)) != 0)
     {
         Err("mknod '%s' : Making metadata entry failed : err=%d:%s\n", path, -res, strerror(-res));
         return res;
     }
 
-    mcachefs_journal_append(mcachefs_journal_op_mknod, path, NULL, mode, rdev, fuse_get_context()->uid, fuse_get_context()->gid, 0, NULL);
+    mcachefs_journal_append(mcachefs_journal_op_mknod, path, NULL, mode, rdev, uid, gid, 0, NULL);
 
     Log("mknod : OK.\n");
 
@@ -206,13 +168,13 @@ mcachefs_mknod(const char *path, mode_t mode, dev_t rdev)
 }
 
 static int
-mcachefs_mkdir(const char *path, mode_t mode)
+mcachefs_mkdir(const char *path, mode_t mode, uid_t uid, gid_t gid)
 {
     int res;
 
     Log("mcachefs_mkdir(path = %s)\n", path);
 
-    if ((res = mcachefs_metadata_make_entry(path, mode | S_IFDIR, 0)) != 0)
+    if ((res = mcachefs_metadata_make_entry(path, mode | S_IFDIR, 0, uid, gid)) != 0)
     {
         Err("mkdir %s : err=%d:%s\n", path, res, strerror(-res));
         return res;
@@ -220,11 +182,35 @@ mcachefs_mkdir(const char *path, mode_t mode)
 
     Log("mkdir : OK.\n");
 
-    mcachefs_journal_append(mcachefs_journal_op_mkdir, path, NULL, mode, 0, fuse_get_context()->uid, fuse_get_context()->gid, 0, NULL);
+    mcachefs_journal_append(mcachefs_journal_op_mkdir, path, NULL, mode, 0, uid, gid, 0, NULL);
 
     return 0;
 }
 
+/**
+ * Abandon the backup of path if it is queued or in progress, as the file is about to be removed or truncated
+ */
+static void
+mcachefs_abandon_backup(const char *path)
+{
+    struct mcachefs_metadata_t *mdata;
+    mcachefs_fh_t fh;
+
+    mdata = mcachefs_metadata_find(path);
+    if (!mdata)
+        return;
+    if (!mdata->fh || !S_ISREG(mdata->st.st_mode) || __MCACHEFS_IS_VOPS_FILE(path))
+    {
+        mcachefs_metadata_release(mdata);
+        return;
+    }
+    fh = mcachefs_fileid_get(mdata, path, mcachefs_file_type_file);
+    mcachefs_metadata_release(mdata);
+
+    mcachefs_transfer_abandon(mcachefs_file_get(fh));
+    mcachefs_fileid_put(fh);
+}
+
 static int
 mcachefs_unlink(const char *path)
 {
@@ -233,12 +219,14 @@ mcachefs_unlink(const char *path)
 
     Log("mcachefs_unlink(path = %s)\n", path);
 
+    mcachefs_abandon_backup(path);
+
     if ((res = mcachefs_metadata_rmdir_unlink(path, 0)) != 0)
     {
         Err("rmdir '%s' : err=%d:%s\n", path, res, strerror(-res));
         return res;
     }
-    if (mcachefs_fileincache(path))
+    if (mcachefs_fileincache(path) || mcachefs_chunks_exist(path))
     {
         backingpath = mcachefs_makepath_cache(path);
         if (unlink(backingpath))
@@ -246,7 +234,9 @@ mcachefs_unlink(const char *path)
             Err("Could not unlink backing path '%s' : err=%d:%s\n", backingpath, errno, strerror(errno));
         }
         free(backingpath);
+        mcachefs_chunks_remove(path);
     }
+    mcachefs_signatures_remove(path);
 
     mcachefs_journal_append(mcachefs_journal_op_unlink, path, NULL, 0, 0, 0, 0, 0, NULL);
     return 0;
@@ -277,6 +267,8 @@ mcachefs_rmdir(const char *path)
         }
         free(backingpath);
     }
+    mcachefs_chunks_remove(path);
+    mcachefs_signatures_remove(path);
 
     Log("rmdir : OK.\n");
 
@@ -299,7 +291,7 @@ mcachefs_rename(const char *path, const char *to)
 
     mcachefs_journal_append(mcachefs_journal_op_rename, path, to, 0, 0, 0, 0, 0, NULL);
 
-    if (mcachefs_fileincache(path))
+    if (mcachefs_fileincache(path) || mcachefs_chunks_exist(path))
     {
         backingpath = mcachefs_makepath_cache(path);
         backingto = mcachefs_makepath_cache(to);
@@ -314,6 +306,8 @@ mcachefs_rename(const char *path, const char *to)
         free(backingpath);
         free(backingto);
     }
+    mcachefs_chunks_rename(path, to);
+    mcachefs_signatures_rename(path, to);
     return 0;
 }
 
@@ -346,14 +340,18 @@ mcachefs_link(const char *from, const char *to)
         return -ENOMEM;
     }
 
-    res = link(backingfrom, backingto);
+    /**
+     * A backing file linked with an object gets its own copy first, as user hard links are never unshared
+     */
+    if ((res = mcachefs_dedup_unshare(from)) == 0)
+        res = link(backingfrom, backingto) ? -errno : 0;
 
     free(backingfrom);
     free(backingto);
-    if (res == -1)
-        return -errno;
+    if (res)
+        return res;
 
-    res = mcachefs_metadata_make_entry(to, fromst.st_mode, fromst.st_dev);
+    res = mcachefs_metadata_make_entry(to, fromst.st_mode, fromst.st_dev, fromst.st_uid, fromst.st_gid);
     if (res)
     {
         return res;
@@ -395,6 +393,7 @@ mcachefs_chmod(const char *path, mode_t mode)
 
     mdata->st.st_mode = ((mdata->st.st_mode & ~umask) | (mode & umask));
     mcachefs_metadata_notify_update(mdata);
+    mcachefs_kcache_invalidate_hardlinks(mdata, 0);
     mcachefs_metadata_release(mdata);
 
     mcachefs_journal_append(mcachefs_journal_op_chmod, path, NULL, mode, 0, 0, 0, 0, NULL);
@@ -426,6 +425,7 @@ mcachefs_chown(const char *path, uid_t uid, gid_t gid)
     else
         mdata->st.st_gid = gid;
     mcachefs_metadata_notify_update(mdata);
+    mcachefs_kcache_invalidate_hardlinks(mdata, 0);
     mcachefs_metadata_release(mdata);
 
     mcachefs_journal_append(mcachefs_journal_op_chown, path, NULL, 0, 0, uid, gid, 0, NULL);
@@ -433,11 +433,64 @@ mcachefs_chown(const char *path, uid_t uid, gid_t gid)
     return 0;
 }
 
+/**
+ * Truncate the backing file of path, which may be compressed or shared : an open file is truncated through its backing
+ * fd, which is then reopened for write and inflated or copied, so that the compress and dedup threads can not swap it
+ * meanwhile
+ */
+static int
+mcachefs_truncate_backing(const char *path, off_t size)
+{
+    struct mcachefs_metadata_t *mdata;
+    struct mcachefs_file_t *mfile;
+    mcachefs_fh_t fh = 0;
+    char *backingpath;
+    int fd, res = 0;
+
+    mdata = mcachefs_metadata_find(path);
+    if (mdata && mdata->fh && S_ISREG(mdata->st.st_mode))
+        fh = mcachefs_fileid_get(mdata, path, mcachefs_file_type_file);
+    if (mdata)
+        mcachefs_metadata_release(mdata);
+
+    if (fh)
+    {
+        mfile = mcachefs_file_get(fh);
+        if (mfile->cache_status == MCACHEFS_FILE_BACKING_DONE)
+        {
+            fd = mcachefs_file_getfd(mfile, 0, O_RDWR);
+            if (fd < 0 || ftruncate(fd, size))
+            {
+                Err("Could not truncate backing fd of '%s', err=%d:%s\n", path, fd < 0 ? -fd : errno, strerror(fd < 0 ? -fd : errno));
+            }
+            if (fd >= 0)
+                mcachefs_file_putfd(mfile, 0);
+            mcachefs_fileid_put(fh);
+            return 0;
+        }
+        mcachefs_fileid_put(fh);
+    }
+
+    if ((res = mcachefs_compress_inflate(path)) != 0 || (res = mcachefs_dedup_unshare(path)) != 0)
+    {
+        Err("Could not prepare cache path of file '%s' for truncate, err=%d:%s\n", path, -res, strerror(-res));
+        return 0;
+    }
+    backingpath = mcachefs_makepath_cache(path);
+    if (!backingpath)
+        return -ENOMEM;
+    if (truncate(backingpath, size))
+    {
+        Err("Could not truncate cache path '%s' for file '%s', err=%d:%s\n", backingpath, path, errno, strerror(errno));
+    }
+    free(backingpath);
+    return 0;
+}
+
 static int
 mcachefs_truncate(const char *path, off_t size)
 {
     struct mcachefs_file_t *mfile;
-    char *backingpath;
     struct mcachefs_metadata_t *mdata;
 
     Log("mcachefs_truncate(path = %s, size = %llu)\n", path, (unsigned long long) size);
@@ -447,6 +500,8 @@ mcachefs_truncate(const char *path, off_t size)
         return -ENOENT;
 
     mdata->st.st_size = size;
+    mcachefs_metadata_notify_update(mdata);
+    mcachefs_kcache_invalidate_hardlinks(mdata, 1);
 
     if (mdata->fh)
     {
@@ -480,6 +535,16 @@ mcachefs_truncate(const char *path, off_t size)
         return 0;
     }
 
+    /*
+     * The chunks copied so far do not match the new size anymore
+     */
+    mcachefs_abandon_backup(path);
+
+    /*
+     * The target will be truncated when applying the journal, the signatures past the new size will not match it
+     */
+    mcachefs_signatures_truncate(path, size);
+
     /*
      * Create the journal entry
      */
@@ -490,14 +555,7 @@ mcachefs_truncate(const char *path, off_t size)
      */
     if (mcachefs_fileincache(path))
     {
-        backingpath = mcachefs_makepath_cache(path);
-        if (!backingpath)
-            return -ENOMEM;
-        if (truncate(backingpath, size))
-        {
-            Err("Could not truncate cache path '%s' for file '%s', err=%d:%s\n", backingpath, path, errno, strerror(errno));
-        }
-        free(backingpath);
+        return mcachefs_truncate_backing(path, size);
     }
     return 0;
 }
@@ -513,6 +571,8 @@ mcachefs_utime(const char *path, struct utimbuf *buf)
 
     mdata->st.st_atime = buf->actime;
     mdata->st.st_mtime = buf->modtime;
+    mcachefs_metadata_notify_update(mdata);
+    mcachefs_kcache_invalidate_hardlinks(mdata, 0);
 
     mcachefs_metadata_release(mdata);
 
@@ -521,34 +581,530 @@ mcachefs_utime(const char *path, struct utimbuf *buf)
     return 0;
 }
 
+/*********************************************************************/
+/*                    FUSE LOW-LEVEL CALLBACKS                       */
+/*********************************************************************/
+
+/**
+ * Inode numbers are metadata ids : the root entry has id 1, which is FUSE_ROOT_ID. Lookups, getattr, open and readdir
+ * dereference the id, only the operations which change the tree or the journal build the path of the entry.
+ * Timeouts and keep_cache are set by the kernel cache policy (see mcachefs-kcache.h)
+ */
+
+/**
+ * Directory contents, built at the first readdir() of an opendir() and sliced by the following ones
+ */
+struct mcachefs_dirbuf_t
+{
+    char *p;
+    size_t size;
+};
+
+/**
+ * Whether mdata is a file of the vops directory - metadata lock HELD
+ */
+static int
+mcachefs_is_vops_entry(struct mcachefs_metadata_t *mdata)
+{
+    struct mcachefs_metadata_t *father;
+
+    if (!mdata->father)
+        return 0;
+    father = mcachefs_metadata_get(mdata->father);
+    return father && father->father == mcachefs_metadata_id_root && strcmp(father->d_name, MCACHEFS_VOPS_DIR + 1) == 0;
+}
+
+/**
+ * Vops files are rebuilt at each open, their attributes are never cached - metadata lock HELD
+ */
+static double
+mcachefs_attr_timeout(struct mcachefs_metadata_t *mdata)
+{
+    if (mcachefs_is_vops_entry(mdata))
+        return 0.0;
+    return mcachefs_kcache_attr_timeout(mdata);
+}
+
+static void
+mcachefs_fill_attr(struct mcachefs_metadata_t *mdata, struct stat *st)
+{
+    memcpy(st, &(mdata->st), sizeof(struct stat));
+    st->st_ino = mdata->id;
+    if (S_ISDIR(st->st_mode) && st->st_size == 0)
+    {
+        st->st_size = 1 << 12;
+    }
+}
+
+/**
+ * Reply mdata as the entry of a lookup, and remember that the kernel knows it - metadata lock HELD, released
+ */
+static void
+mcachefs_reply_entry(fuse_req_t req, struct mcachefs_metadata_t *mdata)
+{
+    struct fuse_entry_param e;
+
+    memset(&e, 0, sizeof(struct fuse_entry_param));
+    e.ino = mdata->id;
+    e.attr_timeout = mcachefs_attr_timeout(mdata);
+    e.entry_timeout = mcachefs_kcache_entry_timeout();
+    mcachefs_fill_attr(mdata, &(e.attr));
+    mcachefs_metadata_remember_locked(mdata);
+    mcachefs_metadata_release(mdata);
+
+    fuse_reply_entry(req, &e);
+}
+
+static void
+mcachefs_reply_child(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct mcachefs_metadata_t *mdata;
+
+    if (!mcachefs_metadata_find_id(parent))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    mdata = mcachefs_metadata_find_child_locked(parent, name);
+    if (!mdata)
+    {
+        mcachefs_metadata_unlock();
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    mcachefs_reply_entry(req, mdata);
+}
+
+/**
+ * Allocate the path of the entry ino, or of its child name if name is not NULL
+ * @return the path, or NULL if ino does not exist anymore
+ */
+static char *
+mcachefs_make_path(fuse_ino_t ino, const char *name)
+{
+    struct mcachefs_metadata_t *mdata;
+    char *path, *childpath;
+
+    mdata = mcachefs_metadata_find_id(ino);
+    if (!mdata)
+        return NULL;
+    path = mcachefs_metadata_get_path(mdata);
+    mcachefs_metadata_release(mdata);
+
+    if (!name)
+    {
+        if (*path)
+            return path;
+        free(path);
+        return strdup("/");
+    }
+    childpath = (char *) malloc(strlen(path) + strlen(name) + 2);
+    if (childpath)
+        sprintf(childpath, "%s/%s", path, name);
+    free(path);
+    return childpath;
+}
+
+static void
+mcachefs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    Log("mcachefs_lookup(parent = %lu, name = %s)\n", (unsigned long) parent, name);
+    mcachefs_reply_child(req, parent, name);
+}
+
+static void
+mcachefs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    mcachefs_metadata_forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void
+mcachefs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+    size_t cur;
+
+    for (cur = 0; cur < count; cur++)
+    {
+        mcachefs_metadata_forget(forgets[cur].ino, forgets[cur].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void
+mcachefs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
+{
+    struct mcachefs_metadata_t *mdata;
+    struct stat st;
+    double timeout;
+
+    /**
+     * An open file is served through its mfile, which keeps its entry once unlinked
+     */
+    if (info)
+        mdata = mcachefs_file_get_metadata(mcachefs_file_get(info->fh));
+    else
+        mdata = mcachefs_metadata_find_id(ino);
+    if (!mdata)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    mcachefs_fill_attr(mdata, &st);
+    timeout = mcachefs_attr_timeout(mdata);
+    mcachefs_metadata_release(mdata);
+
+    fuse_reply_attr(req, &st, timeout);
+}
+
+/**
+ * Apply setattr to an open file whose path has been removed : only its entry and its backing file are left, and
+ * there is nothing to journal
+ */
+static int
+mcachefs_setattr_removed(fuse_ino_t ino, struct stat *attr, int to_set)
+{
+    static const mode_t umask = 0777;
+    struct mcachefs_metadata_t *mdata;
+    struct mcachefs_file_t *mfile = NULL;
+    int fd, res = 0;
+
+    /**
+     * The removed entry keeps the mfile of its opens, directories have none
+     */
+    mcachefs_metadata_lock();
+    mdata = mcachefs_metadata_get(ino);
+    if (S_ISREG(mdata->st.st_mode) && mdata->fh)
+        mfile = mcachefs_file_get(mdata->fh);
+    mcachefs_metadata_unlock();
+    if (!mfile || mfile->type != mcachefs_file_type_file)
+        return -ENOENT;
+    if (to_set & FUSE_SET_ATTR_SIZE)
+    {
+        fd = mcachefs_file_getfd(mfile, 0, O_RDWR);
+        if (fd < 0)
+            return -EIO;
+        if (ftruncate(fd, attr->st_size))
+            res = -errno;
+        mcachefs_file_putfd(mfile, 0);
+        if (res)
+            return res;
+    }
+
+    if ((mdata = mcachefs_file_get_metadata(mfile)) == NULL)
+        return -ENOENT;
+    if (to_set & FUSE_SET_ATTR_MODE)
+        mdata->st.st_mode = ((mdata->st.st_mode & ~umask) | (attr->st_mode & umask));
+    if (to_set & FUSE_SET_ATTR_UID)
+        mdata->st.st_uid = attr->st_uid;
+    if (to_set & FUSE_SET_ATTR_GID)
+        mdata->st.st_gid = attr->st_gid;
+    if (to_set & FUSE_SET_ATTR_SIZE)
+        mdata->st.st_size = attr->st_size;
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+        mdata->st.st_atime = time(NULL);
+    else if (to_set & FUSE_SET_ATTR_ATIME)
+        mdata->st.st_atime = attr->st_atime;
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+        mdata->st.st_mtime = time(NULL);
+    else if (to_set & FUSE_SET_ATTR_MTIME)
+        mdata->st.st_mtime = attr->st_mtime;
+    mcachefs_metadata_release(mdata);
+    return 0;
+}
+
+static void
+mcachefs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *info)
+{
+    struct mcachefs_metadata_t *mdata;
+    struct utimbuf buf;
+    char *path;
+    int res = 0;
+
+    Log("mcachefs_setattr(ino = %lu, to_set = %x)\n", (unsigned long) ino, to_set);
+
+    path = mcachefs_make_path(ino, NULL);
+    if (!path && info)
+    {
+        res = mcachefs_setattr_removed(ino, attr, to_set);
+        if (res)
+            fuse_reply_err(req, -res);
+        else
+            mcachefs_ll_getattr(req, ino, info);
+        return;
+    }
+    if (!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (to_set & FUSE_SET_ATTR_MODE)
+    {
+        res = mcachefs_chmod(path, attr->st_mode);
+    }
+    if (!res && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+    {
+        res = mcachefs_chown(path, (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) - 1,
+                             (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) - 1);
+    }
+    if (!res && (to_set & FUSE_SET_ATTR_SIZE))
+    {
+        res = mcachefs_truncate(path, attr->st_size);
+    }
+    if (!res && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW)))
+    {
+        if ((mdata = mcachefs_metadata_find_id(ino)) == NULL)
+        {
+            res = -ENOENT;
+        }
+        else
+        {
+            buf.actime = mdata->st.st_atime;
+            buf.modtime = mdata->st.st_mtime;
+            mcachefs_metadata_release(mdata);
+
+            if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+                buf.actime = time(NULL);
+            else if (to_set & FUSE_SET_ATTR_ATIME)
+                buf.actime = attr->st_atime;
+            if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+                buf.modtime = time(NULL);
+            else if (to_set & FUSE_SET_ATTR_MTIME)
+                buf.modtime = attr->st_mtime;
+            res = mcachefs_utime(path, &buf);
+        }
+    }
+    free(path);
+
+    if (res)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    mcachefs_ll_getattr(req, ino, info);
+}
+
+static void
+mcachefs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    char buf[PATH_MAX + 1];
+    char *path;
+    int res;
+
+    path = mcachefs_make_path(ino, NULL);
+    if (!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    res = mcachefs_readlink(path, buf, PATH_MAX);
+    free(path);
+
+    if (res)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    buf[PATH_MAX] = '\0';
+    fuse_reply_readlink(req, buf);
+}
+
+static void
+mcachefs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    char *path;
+    int res;
+
+    path = mcachefs_make_path(parent, name);
+    if (!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    res = mcachefs_mknod(path, mode, rdev, ctx->uid, ctx->gid);
+    free(path);
+
+    if (res)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    mcachefs_reply_child(req, parent, name);
+}
+
+static void
+mcachefs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    char *path;
+    int res;
+
+    path = mcachefs_make_path(parent, name);
+    if (!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    res = mcachefs_mkdir(path, mode, ctx->uid, ctx->gid);
+    free(path);
+
+    if (res)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    mcachefs_reply_child(req, parent, name);
+}
+
+static void
+mcachefs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    char *path;
+    int res;
+
+    path = mcachefs_make_path(parent, name);
+    if (!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    res = mcachefs_symlink(link, path, ctx->uid, ctx->gid);
+    free(path);
+
+    if (res)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    mcachefs_reply_child(req, parent, name);
+}
+
+static void
+mcachefs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    char *path;
+    int res;
+
+    path = mcachefs_make_path(parent, name);
+    if (!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    res = mcachefs_unlink(path);
+    free(path);
+    fuse_reply_err(req, -res);
+}
+
+static void
+mcachefs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    char *path;
+    int res;
+
+    path = mcachefs_make_path(parent, name);
+    if (!path)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    res = mcachefs_rmdir(path);
+    free(path);
+    fuse_reply_err(req, -res);
+}
+
+static void
+mcachefs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname,
+                   unsigned int flags)
+{
+    char *path, *to;
+    int res;
+
+    if (flags)
+    {
+        /**
+         * RENAME_EXCHANGE and RENAME_NOREPLACE have no journal operation
+         */
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    path = mcachefs_make_path(parent, name);
+    to = mcachefs_make_path(newparent, newname);
+    if (!path || !to)
+    {
+        free(path);
+        free(to);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    res = mcachefs_rename(path, to);
+    free(path);
+    free(to);
+    fuse_reply_err(req, -res);
+}
+
+static void
+mcachefs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+    char *from, *to;
+    int res;
+
+    from = mcachefs_make_path(ino, NULL);
+    to = mcachefs_make_path(newparent, newname);
+    if (!from || !to)
+    {
+        free(from);
+        free(to);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    res = mcachefs_link(from, to);
+    free(from);
+    free(to);
+
+    if (res)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    mcachefs_reply_child(req, newparent, newname);
+}
+
 /* mcachefs_open() is effectively an existance check. We also take the
  opportunity to fire off a copy process to pull the content into the backing
  store. This will hopefully have pulled the data that the client is going
  to ask for before the client needs it. If it hasn't then we're going
  to have to block... */
-static int
-mcachefs_open(const char *path, struct fuse_file_info *info)
+static void
+mcachefs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
 {
     struct mcachefs_file_t *mfile;
     struct mcachefs_metadata_t *mdata;
+    int res;
 
     mcachefs_file_type_t type = mcachefs_file_type_file;
 
-    mdata = mcachefs_metadata_find(path);
+    mdata = mcachefs_metadata_find_id(ino);
 
     if (mdata == NULL)
     {
-        Err("open(%s) : does not exist\n", path);
-        return -ENOENT;
+        Err("open(%lu) : does not exist\n", (unsigned long) ino);
+        fuse_reply_err(req, ENOENT);
+        return;
     }
     if (!S_ISREG(mdata->st.st_mode))
     {
-        Err("open(%s) : not a regular file !\n", path);
+        Err("open(%s) : not a regular file !\n", mdata->d_name);
         mcachefs_metadata_release(mdata);
-        return -EISDIR;
+        fuse_reply_err(req, EISDIR);
+        return;
     }
 
-    if (__MCACHEFS_IS_VOPS_FILE(path))
+    if (mcachefs_is_vops_entry(mdata))
     {
         type = mcachefs_file_type_vops;
     }
@@ -558,172 +1114,380 @@ mcachefs_open(const char *path, struct fuse_file_info *info)
         if (__IS_WRITE(info->flags))
         {
             mcachefs_metadata_release(mdata);
-            return -EROFS;
+            fuse_reply_err(req, EROFS);
+            return;
         }
 #endif
         type = mcachefs_file_type_file;
     }
 
-    info->fh = mcachefs_fileid_get(mdata, path, type);
+    info->fh = mcachefs_fileid_get(mdata, NULL, type);
     mcachefs_metadata_release(mdata);
 
     mfile = mcachefs_file_get(info->fh);
 
     if (!mfile)
     {
-        return -ENOMEM;
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    res = mcachefs_open_mfile(mfile, info, type);
+    if (res)
+    {
+        fuse_reply_err(req, -res);
+        return;
     }
-    return mcachefs_open_mfile(mfile, info, type);
+    mcachefs_kcache_open(mfile, info);
+    mcachefs_passthrough_open(mfile, info, req);
+    fuse_reply_open(req, info);
 }
 
-static int
-mcachefs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *info)
+static void
+mcachefs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *info)
 {
     struct mcachefs_file_t *mfile;
+    struct fuse_bufvec bufv;
+    char *buf;
+    int fd, res;
 
-    Log("mcachefs_read(path = %s, buf = ..., size = %llu, offset = %llu, fh=%llx)\n", path, (unsigned long long) size,
+    Log("mcachefs_read(ino = %lu, size = %llu, offset = %llu, fh=%llx)\n", (unsigned long) ino, (unsigned long long) size,
         (unsigned long long) offset, (unsigned long long) info->fh);
 
     mfile = mcachefs_file_get(info->fh);
 
     if (!mfile)
     {
-        Err("Invalid descriptor for '%s'\n", path);
-        return -EBADF;
+        Err("Invalid descriptor for %lu\n", (unsigned long) ino);
+        fuse_reply_err(req, EBADF);
+        return;
     }
 
     mcachefs_file_timeslice_freshen(mfile);
 
-#if PARANOID
-    /*
-     * paranoid check !
+    /**
+     * Fully cached files are replied from the backing fd, spliced to /dev/fuse when the kernel allows it :
+     * libfuse replies the error itself if the backing file cannot be read
      */
-    if (strcmp(mfile->path, path))
+    if ((fd = mcachefs_read_mfile_getfd(mfile)) >= 0)
     {
-        Warn("Diverging paths : '%s' != '%s' (file has been renamed ?)\n", path, mfile->path);
+        bufv = FUSE_BUFVEC_INIT(size);
+        bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv.buf[0].fd = fd;
+        bufv.buf[0].pos = offset;
+        fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+        mcachefs_read_mfile_putfd(mfile, size, offset);
+        return;
     }
-#endif
 
-    Log("mfile at %p\n", mfile);
-    return mcachefs_read_mfile(mfile, buf, size, offset);
+    buf = (char *) malloc(size);
+    if (!buf)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    res = mcachefs_read_mfile(mfile, buf, size, offset);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_buf(req, buf, res);
+    free(buf);
 }
 
-static int
-mcachefs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *info)
+static void
+mcachefs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *info)
 {
     struct mcachefs_file_t *mfile;
+    size_t size = fuse_buf_size(bufv);
+    int res;
 
-    Log("mcachefs_write(path = %s, buf = ..., size = %llu, offset = %llu)\n", path, (unsigned long long) size, (unsigned long long) offset);
+    Log("mcachefs_write(ino = %lu, size = %llu, offset = %llu)\n", (unsigned long) ino, (unsigned long long) size,
+        (unsigned long long) offset);
 
     if (size == 0)
     {
-        Err("mcachefs_write() : attempt to write zero bytes in '%s'\n", path);
-        return 0;
+        Err("mcachefs_write() : attempt to write zero bytes in %lu\n", (unsigned long) ino);
+        fuse_reply_write(req, 0);
+        return;
     }
 
     mfile = mcachefs_file_get(info->fh);
 
     if (!mfile)
     {
-        Err("Invalid descriptor for '%s'\n", path);
-        return -EBADF;
+        Err("Invalid descriptor for %lu\n", (unsigned long) ino);
+        fuse_reply_err(req, EBADF);
+        return;
     }
 
     mcachefs_file_timeslice_freshen(mfile);
-    return mcachefs_write_mfile(mfile, buf, size, offset);
+    res = mcachefs_write_mfile_buf(mfile, bufv, offset);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
 }
 
-static int
-mcachefs_fsync(const char *path, int sync, struct fuse_file_info *info)
+static void
+mcachefs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *info)
 {
-    (void) sync;
-
     struct mcachefs_file_t *mfile;
-    Log("mcachefs_fsync (%s, %d, fh=%llu)\n", path, sync, (unsigned long long) info->fh);
+
+    (void) datasync;
+
+    Log("mcachefs_fsync (%lu, %d, fh=%llu)\n", (unsigned long) ino, datasync, (unsigned long long) info->fh);
 
     mfile = mcachefs_file_get(info->fh);
 
     if (!mfile)
     {
-        Err("Invalid descriptor for '%s'\n", path);
-        return -EBADF;
+        Err("Invalid descriptor for %lu\n", (unsigned long) ino);
+        fuse_reply_err(req, EBADF);
+        return;
     }
-    return mcachefs_fsync_mfile(mfile);
+    fuse_reply_err(req, -mcachefs_fsync_mfile(mfile));
 }
 
-static int
-mcachefs_release(const char *path, struct fuse_file_info *info)
+static void
+mcachefs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
 {
-    Log("mcachefs_release (path=%s, flags=%x)\n", path, info->flags);
     struct mcachefs_file_t *mfile;
 
+    Log("mcachefs_release (ino=%lu, flags=%x)\n", (unsigned long) ino, info->flags);
+
     mfile = mcachefs_file_get(info->fh);
 
     if (!mfile)
     {
-        Err("Invalid descriptor for '%s'\n", path);
-        return -EBADF;
+        Err("Invalid descriptor for %lu\n", (unsigned long) ino);
+        fuse_reply_err(req, EBADF);
+        return;
     }
 
-    return mcachefs_release_mfile(mfile, info);
+    mcachefs_passthrough_release(mfile, info, req);
+    fuse_reply_err(req, -mcachefs_release_mfile(mfile, info));
 }
 
-#if 0
-static int
-mcachefs_statfs(const char *path, struct statvfs *fsinfo)
+static void
+mcachefs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
 {
-    (void) path;
-    (void) fsinfo;
-    return -ENOSYS;
+    (void) ino;
+    (void) info;
+    Log("[NOT IMPLEMENTED] mcachefs_flush(%lu,fh=%lx)\n", (unsigned long) ino, (unsigned long) info->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void
+mcachefs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
+{
+    struct mcachefs_metadata_t *mdata;
+    struct mcachefs_dirbuf_t *dirbuf;
+
+    mdata = mcachefs_metadata_find_id(ino);
+    if (!mdata)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (!S_ISDIR(mdata->st.st_mode))
+    {
+        mcachefs_metadata_release(mdata);
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    mcachefs_metadata_release(mdata);
+
+    dirbuf = (struct mcachefs_dirbuf_t *) malloc(sizeof(struct mcachefs_dirbuf_t));
+    if (!dirbuf)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    memset(dirbuf, 0, sizeof(struct mcachefs_dirbuf_t));
+    info->fh = (uint64_t) (unsigned long) dirbuf;
+    fuse_reply_open(req, info);
 }
-#endif
 
 static int
-mcachefs_flush(const char *path, struct fuse_file_info *info)
+mcachefs_dirbuf_add(fuse_req_t req, struct mcachefs_dirbuf_t *dirbuf, const char *name, fuse_ino_t ino, mode_t mode)
 {
-    (void) path;
-    (void) info;
-    Log("[NOT IMPLEMENTED] mcachefs_flush(%s,fh=%lx)\n", path, (unsigned long) info->fh);
+    struct stat st;
+    size_t oldsize = dirbuf->size;
+    char *p;
+
+    memset(&st, 0, sizeof(struct stat));
+    st.st_ino = ino;
+    st.st_mode = mode;
+
+    dirbuf->size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+    p = (char *) realloc(dirbuf->p, dirbuf->size);
+    if (!p)
+    {
+        dirbuf->size = oldsize;
+        return -ENOMEM;
+    }
+    dirbuf->p = p;
+    fuse_add_direntry(req, dirbuf->p + oldsize, dirbuf->size - oldsize, name, &st, dirbuf->size);
     return 0;
 }
 
-static void *
-mcachefs_init(struct fuse_conn_info *conn)
+/**
+ * Build the contents of the directory ino, as of the first readdir() of the opendir()
+ */
+static int
+mcachefs_dirbuf_fill(fuse_req_t req, struct mcachefs_dirbuf_t *dirbuf, fuse_ino_t ino)
 {
-    (void) conn;
+    struct mcachefs_metadata_t *mfather, *mchild;
+    int res;
 
+    free(dirbuf->p);
+    dirbuf->p = NULL;
+    dirbuf->size = 0;
+
+    mfather = mcachefs_metadata_find_id(ino);
+    if (!mfather)
+        return -ENOENT;
+
+    res = mcachefs_dirbuf_add(req, dirbuf, ".", ino, S_IFDIR);
+    if (!res)
+        res = mcachefs_dirbuf_add(req, dirbuf, "..", mfather->father ? mfather->father : ino, S_IFDIR);
+
+    for (mchild = mcachefs_metadata_get_child(mfather); mchild && !res; mchild = mcachefs_metadata_get(mchild->next))
+    {
+        Log("READDIR    '%s' (%p, next=%llu)\n", mchild->d_name, mchild, mchild->next);
+        res = mcachefs_dirbuf_add(req, dirbuf, mchild->d_name, mchild->id, mchild->st.st_mode);
+    }
+    mcachefs_metadata_unlock();
+    return res;
+}
+
+static void
+mcachefs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *info)
+{
+    struct mcachefs_dirbuf_t *dirbuf = (struct mcachefs_dirbuf_t *) (unsigned long) info->fh;
+    int res;
+
+    Log("readdir %lu, offset=%llu\n", (unsigned long) ino, (unsigned long long) offset);
+
+    if (offset == 0 && (res = mcachefs_dirbuf_fill(req, dirbuf, ino)) != 0)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if ((size_t) offset >= dirbuf->size)
+    {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    fuse_reply_buf(req, dirbuf->p + offset, dirbuf->size - offset < size ? dirbuf->size - offset : size);
+}
+
+static void
+mcachefs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *info)
+{
+    struct mcachefs_dirbuf_t *dirbuf = (struct mcachefs_dirbuf_t *) (unsigned long) info->fh;
+
+    (void) ino;
+
+    free(dirbuf->p);
+    free(dirbuf);
+    fuse_reply_err(req, 0);
+}
+
+/**
+ * Negotiate the size of requests and the features of the connection
+ */
+static void
+mcachefs_init_conn(struct fuse_conn_info *conn)
+{
+    unsigned int want = FUSE_CAP_ASYNC_READ | FUSE_CAP_ASYNC_DIO | FUSE_CAP_PARALLEL_DIROPS | FUSE_CAP_AUTO_INVAL_DATA;
+
+    if (mcachefs_config_get_splice())
+    {
+        want |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+        /**
+         * Requests are only read through a pipe when their data can be consumed from it
+         */
+        if (mcachefs_oper.write_buf)
+            want |= FUSE_CAP_SPLICE_READ;
+    }
+    conn->want |= conn->capable & want;
+
+    /**
+     * libfuse lowers max_write to the size of its buffers, and asks the kernel for as many pages per request
+     */
+    conn->max_write = mcachefs_config_get_max_write();
+    conn->max_read = mcachefs_config_get_max_read();
+    if (mcachefs_config_get_max_background())
+    {
+        conn->max_background = mcachefs_config_get_max_background();
+        conn->congestion_threshold = conn->max_background * 3 / 4;
+    }
+    Info("Requests up to %uk read, %uk written, splice %s\n", conn->max_read >> 10, conn->max_write >> 10,
+         (conn->want & FUSE_CAP_SPLICE_WRITE) ? "enabled" : "disabled");
+}
+
+/**
+ * userdata points to the session, on which the kcache thread sends its invalidations
+ */
+static void
+mcachefs_init(void *userdata, struct fuse_conn_info *conn)
+{
+    mcachefs_init_conn(conn);
+    mcachefs_passthrough_init(conn);
+    mcachefs_kcache_start_thread(*(struct fuse_session **) userdata);
     mcachefs_file_start_thread();
+    mcachefs_prefetch_init();
     mcachefs_transfer_start_threads();
+    mcachefs_compress_start_thread();
+    mcachefs_dedup_start_thread();
     mcachefs_journal_init();
+    mcachefs_warmup_start_thread();
 
     Info("Filesystem now serving requests...\n");
-
-    return NULL;
 }
 
 static void
-mcachefs_destroy(void *conn)
+mcachefs_destroy(void *userdata)
 {
-    (void) conn;
+    (void) userdata;
 
     Info("Waiting for mcachefs background threads to end...\n");
     mcachefs_config_set_read_state(MCACHEFS_STATE_QUITTING);
 
     mcachefs_file_stop_thread();
+    mcachefs_warmup_stop_thread();
     mcachefs_transfer_stop_threads();
+    mcachefs_dedup_stop_thread();
+    mcachefs_compress_stop_thread();
+    mcachefs_prefetch_cleanup();
+    mcachefs_kcache_stop_thread();
+    mcachefs_metadata_forget_all();
     mcachefs_config_run_post_umount_cmd();
 }
 
-struct fuse_operations mcachefs_oper = {.getattr = mcachefs_getattr,.readlink = mcachefs_readlink,
-    .getdir = NULL,.mknod = mcachefs_mknod,.mkdir = mcachefs_mkdir,
-    .unlink = mcachefs_unlink,.rmdir = mcachefs_rmdir,.symlink =
-        mcachefs_symlink,.rename = mcachefs_rename,.link =
-        mcachefs_link,.chmod = mcachefs_chmod,.chown = mcachefs_chown,.truncate = mcachefs_truncate,.utime = mcachefs_utime,.open = mcachefs_open,
-    .read = mcachefs_read,.write = mcachefs_write,.statfs = NULL,
-    .flush = mcachefs_flush,.release = mcachefs_release,.fsync = mcachefs_fsync,.setxattr = NULL,.getxattr = NULL,
-    .listxattr = NULL,.opendir = NULL,.readdir = mcachefs_readdir,
-    .fsyncdir = NULL,.init = mcachefs_init,
-    .destroy = mcachefs_destroy,.access = NULL,.create = NULL,
-    .ftruncate = NULL,.fgetattr = NULL,.lock = NULL,.utimens = NULL,
-    .bmap = NULL,
+struct fuse_lowlevel_ops mcachefs_oper = {
+    .init = mcachefs_init,
+    .destroy = mcachefs_destroy,
+    .lookup = mcachefs_ll_lookup,
+    .forget = mcachefs_ll_forget,
+    .forget_multi = mcachefs_ll_forget_multi,
+    .getattr = mcachefs_ll_getattr,
+    .setattr = mcachefs_ll_setattr,
+    .readlink = mcachefs_ll_readlink,
+    .mknod = mcachefs_ll_mknod,
+    .mkdir = mcachefs_ll_mkdir,
+    .unlink = mcachefs_ll_unlink,
+    .rmdir = mcachefs_ll_rmdir,
+    .symlink = mcachefs_ll_symlink,
+    .rename = mcachefs_ll_rename,
+    .link = mcachefs_ll_link,
+    .open = mcachefs_ll_open,
+    .read = mcachefs_ll_read,
+    .write_buf = mcachefs_ll_write_buf,
+    .flush = mcachefs_ll_flush,
+    .release = mcachefs_ll_release,
+    .fsync = mcachefs_ll_fsync,
+    .opendir = mcachefs_ll_opendir,
+    .readdir = mcachefs_ll_readdir,
+    .releasedir = mcachefs_ll_releasedir,
 };
@@ -3,6 +3,7 @@
 #include "mcachefs-vops.h"
 #include "mcachefs-transfer.h"
 #include "mcachefs-journal.h"
+#include "mcachefs-kcache.h"
 
 /**********************************************************************
  Metadata functions
@@ -53,10 +54,16 @@ struct mcachefs_metadata_head_t
 };
 
 static struct mcachefs_metadata_head_t *mcachefs_metadata_head = NULL;
-static const mcachefs_metadata_id mcachefs_metadata_id_root = 1;
 
 static int mcachefs_metadata_fd = -1;
 
+/**
+ * Lookup counts of the entries, indexed by id : the number of times the kernel has been given each entry and has not
+ * forgotten it yet. Removed entries stay allocated until forgotten, so that the kernel never sees their ids reused
+ */
+static unsigned long *mcachefs_metadata_nlookup = NULL;
+static mcachefs_metadata_id mcachefs_metadata_nlookup_sz = 0;
+
 struct mcachefs_metadata_map_t
 {
     struct mcachefs_metadata_t *map;
@@ -381,9 +388,89 @@ mcachefs_metadata_close()
     metadata_map_sz = 0;
 }
 
+/**
+ * Copy the entries the kernel still holds, as placeholders detached from the tree
+ * @param nb set to the number of entries copied, in ascending id order
+ * - metadata lock HELD
+ */
+static struct mcachefs_metadata_t *
+mcachefs_metadata_save_remembered_locked(mcachefs_metadata_id *nb)
+{
+    struct mcachefs_metadata_t *saved = NULL, *metadata;
+    mcachefs_metadata_id id;
+
+    *nb = 0;
+    for (id = 0; id < mcachefs_metadata_nlookup_sz; id++)
+    {
+        if (!mcachefs_metadata_nlookup[id] || id == mcachefs_metadata_id_root)
+            continue;
+        if ((*nb & MCACHEFS_METADATA_BLOCK_ENTRY_MASK) == 0)
+        {
+            saved = (struct mcachefs_metadata_t *) realloc(saved,
+                                                           (*nb + MCACHEFS_METADATA_BLOCK_ENTRY_COUNT) *
+                                                           sizeof(struct mcachefs_metadata_t));
+            if (!saved)
+            {
+                Bug("Could not alloc %llu remembered entries\n", _llu(*nb));
+            }
+        }
+        metadata = &(saved[(*nb)++]);
+        memcpy(metadata, mcachefs_metadata_do_get(id), sizeof(struct mcachefs_metadata_t));
+        metadata->father = metadata->child = metadata->next = 0;
+        metadata->up = metadata->left = metadata->right = 0;
+        metadata->collision_next = metadata->collision_previous = 0;
+        metadata->color = 0;
+        metadata->fh = 0;
+        metadata->hardlink = 0;
+    }
+    return saved;
+}
+
+/**
+ * Put the saved entries back at their ids in the freshly formatted metafile, and rebuild the list of free entries
+ * without them : they are freed by mcachefs_metadata_forget() as removed entries
+ * - metadata lock HELD
+ */
+static void
+mcachefs_metadata_reserve_locked(struct mcachefs_metadata_t *saved, mcachefs_metadata_id nb)
+{
+    struct mcachefs_metadata_t *metadata, *last = NULL;
+    mcachefs_metadata_id id, cur = 0, alloced_nb;
+
+    if (!nb)
+        return;
+    alloced_nb = (saved[nb - 1].id | MCACHEFS_METADATA_BLOCK_ENTRY_MASK) + 1;
+    if (alloced_nb > mcachefs_metadata_head->alloced_nb)
+    {
+        mcachefs_metadata_extend_free_entries(mcachefs_metadata_head->alloced_nb, alloced_nb);
+        mcachefs_metadata_head->alloced_nb = alloced_nb;
+        mcachefs_resize_metadata_map();
+    }
+
+    mcachefs_metadata_head->first_free = 0;
+    for (id = mcachefs_metadata_id_root + 1; id < mcachefs_metadata_head->alloced_nb; id++)
+    {
+        metadata = mcachefs_metadata_do_get(id);
+        if (cur < nb && saved[cur].id == id)
+        {
+            memcpy(metadata, &(saved[cur++]), sizeof(struct mcachefs_metadata_t));
+            continue;
+        }
+        metadata->next = 0;
+        if (last)
+            last->next = id;
+        else
+            mcachefs_metadata_head->first_free = id;
+        last = metadata;
+    }
+    Info("\tReserved %llu entries still known by the kernel\n", _llu(nb));
+}
+
 void
 mcachefs_metadata_flush()
 {
+    struct mcachefs_metadata_t *metadata, *saved;
+    mcachefs_metadata_id id, saved_nb;
     int count_open, count_journal_entries;
 
     count_open = mcachefs_file_timeslices_count_open();
@@ -403,6 +490,23 @@ mcachefs_metadata_flush()
     mcachefs_metadata_lock();
     mcachefs_file_timeslices_clear_metadata_id();
 
+    /**
+     * The ids known by the kernel are about to designate other entries
+     */
+    for (id = 0; id < mcachefs_metadata_nlookup_sz; id++)
+    {
+        if (!mcachefs_metadata_nlookup[id])
+            continue;
+        metadata = mcachefs_metadata_do_get(id);
+        if (metadata->father)
+            mcachefs_kcache_invalidate_entry(metadata->father, metadata->d_name);
+        mcachefs_kcache_invalidate(id, 1);
+    }
+    /**
+     * Until forgotten, they must not be reissued to new entries either
+     */
+    saved = mcachefs_metadata_save_remembered_locked(&saved_nb);
+
     Info("\tClosing metadata...\n");
     mcachefs_metadata_close();
     Info("\tTruncating '%s'\n", mcachefs_config_get_metafile());
@@ -417,7 +521,9 @@ mcachefs_metadata_flush()
     }
     Info("\tRe-openning '%s'\n", mcachefs_config_get_metafile());
     mcachefs_metadata_open();
+    mcachefs_metadata_reserve_locked(saved, saved_nb);
     mcachefs_metadata_unlock();
+    free(saved);
 
     mcachefs_metadata_populate_vops();
 }
@@ -1726,8 +1832,108 @@ mcachefs_metadata_release(struct mcachefs_metadata_t *mdata)
     mcachefs_metadata_unlock();
 }
 
+struct mcachefs_metadata_t *
+mcachefs_metadata_find_id(mcachefs_metadata_id id)
+{
+    struct mcachefs_metadata_t *metadata;
+    mcachefs_metadata_lock();
+
+    if (!id || id >= mcachefs_metadata_head->alloced_nb)
+    {
+        mcachefs_metadata_unlock();
+        return NULL;
+    }
+    metadata = mcachefs_metadata_do_get(id);
+    if (id != mcachefs_metadata_id_root && !metadata->father)
+    {
+        Log("Entry %llu has been removed\n", _llu(id));
+        mcachefs_metadata_unlock();
+        return NULL;
+    }
+    return metadata;
+}
+
+struct mcachefs_metadata_t *
+mcachefs_metadata_find_child_locked(mcachefs_metadata_id fatherid, const char *name)
+{
+    struct mcachefs_metadata_t *father, *current;
+    hash_t hash;
+
+    mcachefs_metadata_check_locked();
+
+    father = mcachefs_metadata_do_get(fatherid);
+    if (!S_ISDIR(father->st.st_mode))
+    {
+        return NULL;
+    }
+    if (!father->child)
+    {
+        /*
+         * get_child may have garbaged father, fetch it again
+         */
+        if (!mcachefs_metadata_get_child(father))
+            return NULL;
+        father = mcachefs_metadata_do_get(fatherid);
+    }
+    if (father->child == mcachefs_metadata_id_EMPTY)
+    {
+        return NULL;
+    }
+
+    hash = father->father ? continueHash(father->hash, "/") : father->hash;
+    hash = continueHash(hash, name);
+
+    current = mcachefs_metadata_get_hash_root();
+    while (current)
+    {
+        if (hash < current->hash)
+        {
+            current = mcachefs_metadata_do_get(current->left);
+            continue;
+        }
+        if (current->hash < hash)
+        {
+            current = mcachefs_metadata_do_get(current->right);
+            continue;
+        }
+        if (current->father == fatherid && strcmp(current->d_name, name) == 0)
+        {
+            return current;
+        }
+        current = mcachefs_metadata_do_get(current->collision_next);
+    }
+    return NULL;
+}
+
 void
-mcachefs_metadata_remove(struct mcachefs_metadata_t *metadata)
+mcachefs_metadata_remember_locked(struct mcachefs_metadata_t *mdata)
+{
+    mcachefs_metadata_id sz;
+
+    mcachefs_metadata_check_locked();
+    if (mdata->id >= mcachefs_metadata_nlookup_sz)
+    {
+        sz = (mdata->id | MCACHEFS_METADATA_BLOCK_ENTRY_MASK) + 1;
+        mcachefs_metadata_nlookup = (unsigned long *) realloc(mcachefs_metadata_nlookup, sz * sizeof(unsigned long));
+        if (!mcachefs_metadata_nlookup)
+        {
+            Bug("Could not alloc lookup counts for %llu entries\n", _llu(sz));
+        }
+        memset(&(mcachefs_metadata_nlookup[mcachefs_metadata_nlookup_sz]), 0,
+               (sz - mcachefs_metadata_nlookup_sz) * sizeof(unsigned long));
+        mcachefs_metadata_nlookup_sz = sz;
+    }
+    mcachefs_metadata_nlookup[mdata->id]++;
+}
+
+int
+mcachefs_metadata_is_remembered(mcachefs_metadata_id id)
+{
+    return id < mcachefs_metadata_nlookup_sz && mcachefs_metadata_nlookup[id];
+}
+
+static void
+mcachefs_metadata_free(struct mcachefs_metadata_t *metadata)
 {
     struct mcachefs_file_t *mfile;
 
@@ -1736,7 +1942,6 @@ mcachefs_metadata_remove(struct mcachefs_metadata_t *metadata)
         mfile = mcachefs_file_get(metadata->fh);
         mfile->metadata_id = 0;
     }
-
     mcachefs_metadata_id id = metadata->id;
     memset(metadata, 0, sizeof(struct mcachefs_metadata_t));
     metadata->id = id;
@@ -1745,6 +1950,76 @@ mcachefs_metadata_remove(struct mcachefs_metadata_t *metadata)
     mcachefs_metadata_head->first_free = metadata->id;
 }
 
+void
+mcachefs_metadata_forget(mcachefs_metadata_id id, unsigned long nlookup)
+{
+    struct mcachefs_metadata_t *metadata;
+
+    mcachefs_metadata_lock();
+    if (!mcachefs_metadata_is_remembered(id))
+    {
+        Err("Forgetting entry %llu, which has not been looked up\n", _llu(id));
+        mcachefs_metadata_unlock();
+        return;
+    }
+    if (mcachefs_metadata_nlookup[id] <= nlookup)
+    {
+        mcachefs_metadata_nlookup[id] = 0;
+        metadata = mcachefs_metadata_do_get(id);
+        if (id != mcachefs_metadata_id_root && !metadata->father)
+        {
+            Log("Freeing removed entry %llu, forgotten\n", _llu(id));
+            mcachefs_metadata_free(metadata);
+        }
+    }
+    else
+    {
+        mcachefs_metadata_nlookup[id] -= nlookup;
+    }
+    mcachefs_metadata_unlock();
+}
+
+void
+mcachefs_metadata_forget_all()
+{
+    struct mcachefs_metadata_t *metadata;
+    mcachefs_metadata_id id;
+
+    mcachefs_metadata_lock();
+    for (id = 0; id < mcachefs_metadata_nlookup_sz; id++)
+    {
+        if (!mcachefs_metadata_nlookup[id])
+            continue;
+        mcachefs_metadata_nlookup[id] = 0;
+        metadata = mcachefs_metadata_do_get(id);
+        if (id != mcachefs_metadata_id_root && !metadata->father)
+        {
+            mcachefs_metadata_free(metadata);
+        }
+    }
+    mcachefs_metadata_unlock();
+}
+
+void
+mcachefs_metadata_remove(struct mcachefs_metadata_t *metadata)
+{
+    if (mcachefs_metadata_is_remembered(metadata->id))
+    {
+        /**
+         * Open files still reach their attributes through it : only detach it from the tree
+         */
+        Log("Keeping removed entry %llu until the kernel forgets it\n", _llu(metadata->id));
+        metadata->father = metadata->child = metadata->next = 0;
+        metadata->up = metadata->left = metadata->right = 0;
+        metadata->collision_next = metadata->collision_previous = 0;
+        metadata->color = 0;
+        metadata->hardlink = 0;
+        metadata->st.st_nlink = 0;
+        return;
+    }
+    mcachefs_metadata_free(metadata);
+}
+
 void
 mcachefs_metadata_clean_fh_locked(mcachefs_metadata_id id)
 {
@@ -1873,7 +2148,7 @@ mcachefs_metadata_getattr(const char *path, struct stat *stbuf)
 }
 
 int
-mcachefs_metadata_make_entry(const char *path, mode_t mode, dev_t rdev)
+mcachefs_metadata_make_entry(const char *path, mode_t mode, dev_t rdev, uid_t uid, gid_t gid)
 {
     char *dpath;
     const char *lname;
@@ -1929,11 +2204,10 @@ mcachefs_metadata_make_entry(const char *path, mode_t mode, dev_t rdev)
      * Now build up the child stat
      */
 
-    Log("In mcachefs_metadata_make_entry : caller=%lu, uid=%lu, gid=%lu\n",
-        (long) fuse_get_context()->pid, (long) fuse_get_context()->uid, (long) fuse_get_context()->gid);
+    Log("In mcachefs_metadata_make_entry : uid=%lu, gid=%lu\n", (long) uid, (long) gid);
 
-    child->st.st_uid = fuse_get_context()->uid;
-    child->st.st_gid = fuse_get_context()->gid;
+    child->st.st_uid = uid;
+    child->st.st_gid = gid;
     child->st.st_nlink = 1;
     child->st.st_mode = mode;
     child->st.st_rdev = rdev;
@@ -2375,7 +2649,7 @@ mcachefs_metadata_schedule_fill_entry(struct mcachefs_metadata_t *metadata)
     mcachefs_fh_t fh = mcachefs_fileid_get(metadata, NULL,
                                            mcachefs_file_type_dir);
     mfile = mcachefs_file_get(fh);
-    mcachefs_transfer_queue_file(mfile, MCACHEFS_TRANSFER_TYPE_METADATA);
+    mcachefs_transfer_queue_file(mfile, MCACHEFS_TRANSFER_TYPE_METADATA, MCACHEFS_TRANSFER_PRIORITY_CRAWL);
 }
 
 void
@@ -10,6 +10,7 @@
 
 static const mcachefs_fh_t mcachefs_fh_t_NULL = ~((mcachefs_fh_t) 0);
 static const mcachefs_metadata_id mcachefs_metadata_id_EMPTY = ~((mcachefs_metadata_id) 0);
+static const mcachefs_metadata_id mcachefs_metadata_id_root = 1;        //< Also the FUSE_ROOT_ID inode number
 
 #define BLACK 0
 #define RED 1
@@ -61,6 +62,22 @@ struct mcachefs_metadata_t *mcachefs_metadata_find_locked(const char *path);
 
 struct mcachefs_metadata_t *mcachefs_metadata_find(const char *path);   // Locks mcachefs_metadata_lock, remains locked
 
+struct mcachefs_metadata_t *mcachefs_metadata_find_id(mcachefs_metadata_id id); // Locks mcachefs_metadata_lock, remains locked if the entry exists
+
+/**
+ * Find the child named name of the directory fatherid, fetching its children from the source if needed
+ */
+struct mcachefs_metadata_t *mcachefs_metadata_find_child_locked(mcachefs_metadata_id fatherid, const char *name);
+
+/**
+ * Kernel lookup counts : an entry given to the kernel is remembered, and a removed entry is only freed once the kernel
+ * has forgotten it, or at unmount (forget_all)
+ */
+void mcachefs_metadata_remember_locked(struct mcachefs_metadata_t *mdata);
+int mcachefs_metadata_is_remembered(mcachefs_metadata_id id);  // Assert that mcachefs_metadata_lock IS locked
+void mcachefs_metadata_forget(mcachefs_metadata_id id, unsigned long nlookup);
+void mcachefs_metadata_forget_all();
+
 void mcachefs_metadata_flush();
 
 void mcachefs_metadata_flush_entry(const char *path);
@@ -69,7 +86,7 @@ int mcachefs_metadata_getattr(const char *path, struct stat *stbuf);
 
 void mcachefs_metadata_dump(struct mcachefs_file_t *mvops);
 
-int mcachefs_metadata_make_entry(const char *path, mode_t mode, dev_t rdev);
+int mcachefs_metadata_make_entry(const char *path, mode_t mode, dev_t rdev, uid_t uid, gid_t gid);
 int mcachefs_metadata_rmdir_unlink(const char *path, int isDir);
 int mcachefs_metadata_rename_entry(const char *path, const char *to);
 int mcachefs_metadata_unlink(const char *path);
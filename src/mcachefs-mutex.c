@@ -45,6 +45,71 @@ mcachefs_mutex_destroy(struct mcachefs_mutex_t *mutex, const char *name)
     }
 }
 
+void
+mcachefs_cond_init(pthread_cond_t *cond)
+{
+    int res;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if ((res = pthread_cond_init(cond, &attr)) != 0)
+    {
+        Bug("Could not init cond : err=%d:%s\n", res, strerror(res));
+    }
+    pthread_condattr_destroy(&attr);
+}
+
+void
+mcachefs_cond_destroy(pthread_cond_t *cond, const char *name)
+{
+    int res;
+    if ((res = pthread_cond_destroy(cond)) != 0)
+    {
+        Err("Could not destroy cond '%s' : err=%d:%s\n", name, res, strerror(res));
+    }
+}
+
+void
+mcachefs_cond_get_deadline(struct timespec *deadline, int timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+int
+mcachefs_cond_wait(pthread_cond_t *cond, struct mcachefs_mutex_t *mutex, const struct timespec *deadline,
+                   const char *name, const char *context)
+{
+    int res;
+
+    (void) name;
+    (void) context;
+    mcachefs_mutex_check_locked(mutex, name, context);
+#ifdef  __MCACHEFS_MUTEX_DEBUG
+    mutex->owner = 0;
+    mutex->context = NULL;
+#endif
+    if (deadline)
+        res = pthread_cond_timedwait(cond, &(mutex->mutex), deadline);
+    else
+        res = pthread_cond_wait(cond, &(mutex->mutex));
+#ifdef  __MCACHEFS_MUTEX_DEBUG
+    mutex->owner = pthread_self();
+    mutex->context = context;
+#endif
+    if (res != 0 && res != ETIMEDOUT)
+    {
+        Bug("Could not wait on cond '%s' at %s : err=%d:%s\n", name, context, res, strerror(res));
+    }
+    return res;
+}
+
 #ifdef  __MCACHEFS_MUTEX_DEBUG
 
 void
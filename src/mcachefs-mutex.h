@@ -22,6 +22,24 @@ void mcachefs_metadata_release_all();
 void mcachefs_mutex_init(struct mcachefs_mutex_t *mutex);
 void mcachefs_mutex_destroy(struct mcachefs_mutex_t *mutex, const char *name);
 
+/**
+ * Condition variables used along with mcachefs mutexes, based on CLOCK_MONOTONIC
+ */
+void mcachefs_cond_init(pthread_cond_t *cond);
+void mcachefs_cond_destroy(pthread_cond_t *cond, const char *name);
+
+/**
+ * Compute a CLOCK_MONOTONIC deadline timeout_ms milliseconds from now
+ */
+void mcachefs_cond_get_deadline(struct timespec *deadline, int timeout_ms);
+
+/**
+ * Wait on cond with mutex HELD, until signaled or until deadline (never times out when deadline is NULL)
+ * @return 0 when woken up, ETIMEDOUT when the deadline has passed
+ */
+int mcachefs_cond_wait(pthread_cond_t *cond, struct mcachefs_mutex_t *mutex, const struct timespec *deadline,
+                       const char *name, const char *context);
+
 #ifdef  __MCACHEFS_MUTEX_DEBUG
 
 void mcachefs_mutex_lock(struct mcachefs_mutex_t *mutex, const char *name, const char *context);
@@ -72,4 +90,10 @@ extern struct mcachefs_mutex_t mcachefs_transfer_mutex;
 #define mcachefs_file_check_locked_file(__mfile) mcachefs_mutex_check_locked ( &(__mfile->mutex), __mfile->path, __CONTEXT )
 #define mcachefs_file_check_unlocked_file(__mfile) mcachefs_mutex_check_unlocked ( &(__mfile->mutex), __mfile->path, __CONTEXT )
 
+/**
+ * Per-file progress notification : waiters are woken up when chunks land or when cache_status changes
+ */
+#define mcachefs_file_wait_file(__mfile,__deadline) mcachefs_cond_wait ( &(__mfile->cond), &(__mfile->mutex), __deadline, __mfile->path, __CONTEXT )
+#define mcachefs_file_notify_file(__mfile) pthread_cond_broadcast ( &(__mfile->cond) )
+
 #endif /* MCACHEFSMUTEX_H_ */
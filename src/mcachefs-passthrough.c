@@ -0,0 +1,230 @@
+#include "mcachefs.h"
+#include "mcachefs-compress.h"
+#include "mcachefs-passthrough.h"
+#include "mcachefs-vops.h"
+
+#define MCACHEFS_PASSTHROUGH_OK         0
+#define MCACHEFS_PASSTHROUGH_PARTIAL    1
+#define MCACHEFS_PASSTHROUGH_DIRTY      2
+#define MCACHEFS_PASSTHROUGH_WRITE      3
+#define MCACHEFS_PASSTHROUGH_COMPRESSED 4
+#define MCACHEFS_PASSTHROUGH_FAILED     5
+#define MCACHEFS_PASSTHROUGH_CACHED     6
+#define MCACHEFS_PASSTHROUGH_REASONS    7
+
+static const char *mcachefs_passthrough_reasons[] = {
+    "passed through", "not fully cached", "dirty or waiting for writeback", "opened for write", "compressed",
+    "failed to register", "open without passthrough"
+};
+
+/**
+ * The passthrough mutex is the innermost lock : no other lock is taken with it held
+ */
+static struct mcachefs_mutex_t mcachefs_passthrough_mutex;
+static int mcachefs_passthrough_supported = 0;
+
+static unsigned long mcachefs_passthrough_opens[MCACHEFS_PASSTHROUGH_REASONS];
+static unsigned long mcachefs_passthrough_registered = 0;
+static unsigned long mcachefs_passthrough_closed = 0;
+
+static void
+mcachefs_passthrough_lock()
+{
+    mcachefs_mutex_lock(&mcachefs_passthrough_mutex, "passthrough", __CONTEXT);
+}
+
+static void
+mcachefs_passthrough_unlock()
+{
+    mcachefs_mutex_unlock(&mcachefs_passthrough_mutex, "passthrough", __CONTEXT);
+}
+
+void
+mcachefs_passthrough_init(struct fuse_conn_info *conn)
+{
+    mcachefs_mutex_init(&mcachefs_passthrough_mutex);
+    memset(mcachefs_passthrough_opens, 0, sizeof(mcachefs_passthrough_opens));
+
+    if (!mcachefs_config_get_passthrough())
+    {
+        return;
+    }
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (conn->capable & FUSE_CAP_PASSTHROUGH)
+    {
+        conn->want |= FUSE_CAP_PASSTHROUGH;
+#ifdef FUSE_CAP_DIRECT_IO_ALLOW_MMAP
+        /**
+         * Opens which are not passed through use direct io, keep mmap working on them
+         */
+        if (conn->capable & FUSE_CAP_DIRECT_IO_ALLOW_MMAP)
+            conn->want |= FUSE_CAP_DIRECT_IO_ALLOW_MMAP;
+#endif
+        mcachefs_passthrough_supported = 1;
+        Info("Kernel passthrough enabled for fully cached files\n");
+        return;
+    }
+#else
+    (void) conn;
+#endif
+    Info("Kernel passthrough not supported, reads of cached files go through mcachefs\n");
+}
+
+/**
+ * Why an open of mfile may not be passed through - mfile lock HELD
+ */
+static int
+mcachefs_passthrough_check(struct mcachefs_file_t *mfile, struct fuse_file_info *info)
+{
+    if (__IS_WRITE(info->flags))
+        return MCACHEFS_PASSTHROUGH_WRITE;
+    if (mfile->cache_status != MCACHEFS_FILE_BACKING_DONE)
+        return MCACHEFS_PASSTHROUGH_PARTIAL;
+    if (mfile->dirty || mfile->writeback_extents.nb)
+        return MCACHEFS_PASSTHROUGH_DIRTY;
+    if (mfile->sources[MCACHEFS_FILE_SOURCE_BACKING].fd != -1 && mfile->sources[MCACHEFS_FILE_SOURCE_BACKING].compressed)
+        return MCACHEFS_PASSTHROUGH_COMPRESSED;
+    /**
+     * The kernel does not mix passthrough and cached opens of an inode, this open is already counted in openers
+     */
+    if (mfile->openers > mfile->passthrough_opens + 1)
+        return MCACHEFS_PASSTHROUGH_CACHED;
+    return MCACHEFS_PASSTHROUGH_OK;
+}
+
+/**
+ * Register the backing file of mfile with the kernel - mfile lock HELD
+ */
+static int
+mcachefs_passthrough_register(struct mcachefs_file_t *mfile, fuse_req_t req)
+{
+    char *backingpath;
+    int fd, id;
+
+    backingpath = mcachefs_makepath_cache(mfile->path);
+    if (!backingpath)
+        return MCACHEFS_PASSTHROUGH_FAILED;
+
+    fd = open(backingpath, O_RDONLY);
+    free(backingpath);
+    if (fd == -1)
+    {
+        Err("Could not open backing file of '%s' for passthrough : %d:%s\n", mfile->path, errno, strerror(errno));
+        return MCACHEFS_PASSTHROUGH_FAILED;
+    }
+    if (mcachefs_compress_is_compressed(fd))
+    {
+        close(fd);
+        return MCACHEFS_PASSTHROUGH_COMPRESSED;
+    }
+#ifdef FUSE_CAP_PASSTHROUGH
+    id = fuse_passthrough_open(req, fd);
+#else
+    (void) req;
+    id = -ENOSYS;
+#endif
+    /**
+     * The kernel holds its own reference to the backing file once registered
+     */
+    close(fd);
+    if (id <= 0)
+    {
+        Err("Could not register backing file of '%s' for passthrough : %d\n", mfile->path, id);
+        return MCACHEFS_PASSTHROUGH_FAILED;
+    }
+    mfile->passthrough_id = id;
+    return MCACHEFS_PASSTHROUGH_OK;
+}
+
+int
+mcachefs_passthrough_open(struct mcachefs_file_t *mfile, struct fuse_file_info *info, fuse_req_t req)
+{
+    int res, registered = 0;
+
+    if (!mcachefs_passthrough_supported || mfile->type != mcachefs_file_type_file)
+    {
+        return 0;
+    }
+
+    mcachefs_file_lock_file(mfile);
+    res = mcachefs_passthrough_check(mfile, info);
+    if (res == MCACHEFS_PASSTHROUGH_OK && mfile->passthrough_opens == 0)
+    {
+        res = mcachefs_passthrough_register(mfile, req);
+        registered = (res == MCACHEFS_PASSTHROUGH_OK);
+    }
+    if (res == MCACHEFS_PASSTHROUGH_OK)
+    {
+        mfile->passthrough_opens++;
+#ifdef FUSE_CAP_PASSTHROUGH
+        info->backing_id = mfile->passthrough_id;
+#endif
+        info->fh |= MCACHEFS_FH_PASSTHROUGH;
+        Log("passthrough open '%s' : backing id %d, %d opens\n", mfile->path, mfile->passthrough_id, mfile->passthrough_opens);
+    }
+    else
+    {
+        /**
+         * Since Linux 6.9 the kernel refuses a passthrough open while cached opens of the inode exist :
+         * opens going through mcachefs use direct io, which does not put the inode in cached io mode
+         */
+        info->direct_io = 1;
+    }
+    mcachefs_file_unlock_file(mfile);
+
+    mcachefs_passthrough_lock();
+    mcachefs_passthrough_opens[res]++;
+    if (registered)
+        mcachefs_passthrough_registered++;
+    mcachefs_passthrough_unlock();
+
+    return res == MCACHEFS_PASSTHROUGH_OK;
+}
+
+void
+mcachefs_passthrough_release(struct mcachefs_file_t *mfile, struct fuse_file_info *info, fuse_req_t req)
+{
+    int id = 0;
+
+    if (!(info->fh & MCACHEFS_FH_PASSTHROUGH))
+    {
+        return;
+    }
+
+    mcachefs_file_lock_file(mfile);
+    if (mfile->passthrough_opens > 0 && --mfile->passthrough_opens == 0)
+    {
+        id = mfile->passthrough_id;
+        mfile->passthrough_id = 0;
+    }
+    mcachefs_file_unlock_file(mfile);
+
+    if (id <= 0)
+    {
+        return;
+    }
+#ifdef FUSE_CAP_PASSTHROUGH
+    fuse_passthrough_close(req, id);
+#else
+    (void) req;
+#endif
+    mcachefs_passthrough_lock();
+    mcachefs_passthrough_closed++;
+    mcachefs_passthrough_unlock();
+}
+
+void
+mcachefs_passthrough_dump(struct mcachefs_file_t *mvops)
+{
+    int reason;
+
+    mcachefs_passthrough_lock();
+    __VOPS_WRITE(mvops, "Passthrough : %s\n",
+                 mcachefs_passthrough_supported ? "enabled" : (mcachefs_config_get_passthrough() ? "not supported" : "disabled"));
+    __VOPS_WRITE(mvops, "Backing files : %lu registered, %lu closed\n", mcachefs_passthrough_registered, mcachefs_passthrough_closed);
+    for (reason = 0; reason < MCACHEFS_PASSTHROUGH_REASONS; reason++)
+    {
+        __VOPS_WRITE(mvops, "Opens %s : %lu\n", mcachefs_passthrough_reasons[reason], mcachefs_passthrough_opens[reason]);
+    }
+    mcachefs_passthrough_unlock();
+}
@@ -0,0 +1,36 @@
+#ifndef __MCACHEFS_PASSTHROUGH_H
+#define __MCACHEFS_PASSTHROUGH_H
+
+/**
+ * ********************* PASSTHROUGH *****************************
+ * Kernel passthrough of fully cached files : when the kernel and libfuse support it (FUSE_CAP_PASSTHROUGH), a read-only
+ * open of a file whose backup is complete registers the backing file with the kernel, which then serves the reads
+ * (and mmap) of that open from the backing file directly, without calling mcachefs at all.
+ * Files which are dirty, waiting for writeback or compressed are read through mcachefs as before, as are all files on
+ * older kernels.
+ * The kernel does not mix passthrough and cached io on an inode : once passthrough is negotiated, opens which are not
+ * passed through use direct io, and passthrough is refused while the file has opens which are not passed through.
+ * The backing id is shared by the passthrough opens of a file, and closed at the release of the last one : passthrough
+ * opens are marked with MCACHEFS_FH_PASSTHROUGH in their fh, so that releasing other opens does not count them.
+ * Backing files which have passthrough opens are neither compressed nor deduplicated, so that they keep their inode.
+ */
+
+/**
+ * Negotiate passthrough with the kernel, at mount time
+ */
+void mcachefs_passthrough_init(struct fuse_conn_info *conn);
+
+/**
+ * Serve the reads of an open of mfile by the kernel, if the file is fully cached - no lock HELD
+ * @return 1 if the open is passed through, 0 if reads go through mcachefs
+ */
+int mcachefs_passthrough_open(struct mcachefs_file_t *mfile, struct fuse_file_info *info, fuse_req_t req);
+
+/**
+ * Release a passthrough open of mfile, if info is one - no lock HELD
+ */
+void mcachefs_passthrough_release(struct mcachefs_file_t *mfile, struct fuse_file_info *info, fuse_req_t req);
+
+void mcachefs_passthrough_dump(struct mcachefs_file_t *mvops);
+
+#endif // __MCACHEFS_PASSTHROUGH_H
@@ -0,0 +1,466 @@
+#include "mcachefs.h"
+#include "mcachefs-prefetch.h"
+#include "mcachefs-transfer.h"
+#include "mcachefs-vops.h"
+
+#define MCACHEFS_PREFETCH_STREAMS_MAX 16
+#define MCACHEFS_PREFETCH_FILES_MAX   64
+
+#define MCACHEFS_PREFETCH_MODE_NONE   0
+#define MCACHEFS_PREFETCH_MODE_LIST   1 //< Directory order
+#define MCACHEFS_PREFETCH_MODE_SORTED 2 //< Name order
+
+static const char *mcachefs_prefetch_mode_names[] = { "none", "directory", "sorted", NULL };
+
+struct mcachefs_prefetch_stream_t
+{
+    mcachefs_metadata_id dir;   //< Directory followed, 0 if the stream is free
+    mcachefs_metadata_id last;  //< Last file opened
+    char last_name[NAME_MAX + 1];
+    mcachefs_metadata_id frontier;      //< Last file prefetched, 0 if none
+    char frontier_name[NAME_MAX + 1];
+    int mode;
+    int hits;                   //< Sequential opens in a row
+    unsigned long used;         //< Last use, to recycle the least recently used stream
+};
+
+struct mcachefs_prefetch_file_t
+{
+    struct mcachefs_file_t *mfile;
+    mcachefs_fh_t fh;           //< Use of mfile held by the prefetcher
+    mcachefs_metadata_id dir;
+    mcachefs_metadata_id id;
+    off_t size;
+    int queued;                 //< Backup has been asked
+    struct mcachefs_prefetch_file_t *next;
+};
+
+static struct mcachefs_mutex_t mcachefs_prefetch_mutex;
+static struct mcachefs_prefetch_stream_t mcachefs_prefetch_streams[MCACHEFS_PREFETCH_STREAMS_MAX];
+static struct mcachefs_prefetch_file_t *mcachefs_prefetch_files = NULL;
+static off_t mcachefs_prefetch_inflight = 0;
+static unsigned long mcachefs_prefetch_clock = 0;
+
+static unsigned long mcachefs_prefetch_queued_nb = 0;
+static unsigned long mcachefs_prefetch_hits_nb = 0;
+static unsigned long mcachefs_prefetch_cancelled_nb = 0;
+
+static void
+mcachefs_prefetch_lock()
+{
+    mcachefs_mutex_lock(&mcachefs_prefetch_mutex, "prefetch", __CONTEXT);
+}
+
+static void
+mcachefs_prefetch_unlock()
+{
+    mcachefs_mutex_unlock(&mcachefs_prefetch_mutex, "prefetch", __CONTEXT);
+}
+
+void
+mcachefs_prefetch_init()
+{
+    mcachefs_mutex_init(&mcachefs_prefetch_mutex);
+    memset(mcachefs_prefetch_streams, 0, sizeof(mcachefs_prefetch_streams));
+}
+
+/**
+ * Find the stream of a directory, recycling the least recently used one if none - prefetch lock HELD
+ */
+static struct mcachefs_prefetch_stream_t *
+mcachefs_prefetch_get_stream_locked(mcachefs_metadata_id dir, int *created)
+{
+    struct mcachefs_prefetch_stream_t *stream, *oldest = NULL;
+    int cur;
+
+    for (cur = 0; cur < MCACHEFS_PREFETCH_STREAMS_MAX; cur++)
+    {
+        stream = &(mcachefs_prefetch_streams[cur]);
+        if (stream->dir == dir)
+        {
+            *created = 0;
+            stream->used = ++mcachefs_prefetch_clock;
+            return stream;
+        }
+        if (!oldest || stream->used < oldest->used)
+            oldest = stream;
+    }
+    memset(oldest, 0, sizeof(struct mcachefs_prefetch_stream_t));
+    oldest->dir = dir;
+    oldest->used = ++mcachefs_prefetch_clock;
+    *created = 1;
+    return oldest;
+}
+
+/**
+ * Move the prefetched files matching to the list dropped, updating the bytes in flight - prefetch lock HELD
+ * With dir set, the queued files of that directory are moved, else the files which are not being backed up anymore.
+ */
+static void
+mcachefs_prefetch_take_files_locked(mcachefs_metadata_id dir, struct mcachefs_prefetch_file_t **dropped)
+{
+    struct mcachefs_prefetch_file_t **pfile = &mcachefs_prefetch_files, *file;
+    int take;
+
+    while ((file = *pfile) != NULL)
+    {
+        if (!file->queued)
+        {
+            take = 0;
+        }
+        else if (dir)
+        {
+            take = (file->dir == dir);
+        }
+        else
+        {
+            mcachefs_file_lock_file(file->mfile);
+            take = (file->mfile->cache_status != MCACHEFS_FILE_BACKING_ASKED
+                    && file->mfile->cache_status != MCACHEFS_FILE_BACKING_IN_PROGRESS);
+            mcachefs_file_unlock_file(file->mfile);
+        }
+        if (!take)
+        {
+            pfile = &(file->next);
+            continue;
+        }
+        *pfile = file->next;
+        mcachefs_prefetch_inflight -= file->size;
+        file->next = *dropped;
+        *dropped = file;
+    }
+}
+
+/**
+ * Take the prefetched entry of a file opened by the application - prefetch lock HELD
+ */
+static void
+mcachefs_prefetch_take_opened_locked(mcachefs_metadata_id id, struct mcachefs_prefetch_file_t **dropped)
+{
+    struct mcachefs_prefetch_file_t **pfile, *file;
+
+    for (pfile = &mcachefs_prefetch_files; (file = *pfile) != NULL; pfile = &(file->next))
+    {
+        if (file->id == id && file->queued)
+        {
+            *pfile = file->next;
+            mcachefs_prefetch_inflight -= file->size;
+            mcachefs_prefetch_hits_nb++;
+            file->next = *dropped;
+            *dropped = file;
+            return;
+        }
+    }
+}
+
+/**
+ * Add a file to prefetch, unless the bytes in flight would exceed the limit - metadata and prefetch locks HELD
+ * @return 0 if added or already prefetched, -1 if the limit has been reached
+ */
+static int
+mcachefs_prefetch_add_locked(mcachefs_metadata_id dir, struct mcachefs_metadata_t *mdata,
+                             struct mcachefs_prefetch_file_t **added, int *added_nb)
+{
+    struct mcachefs_prefetch_file_t *file;
+
+    for (file = mcachefs_prefetch_files; file; file = file->next)
+    {
+        if (file->id == mdata->id)
+            return 0;
+    }
+    if (mcachefs_prefetch_inflight + mdata->st.st_size > mcachefs_config_get_prefetch_max_size())
+    {
+        Log("Prefetch limit reached, not prefetching '%s' (%luk)\n", mdata->d_name, (unsigned long) mdata->st.st_size >> 10);
+        return -1;
+    }
+    file = (struct mcachefs_prefetch_file_t *) malloc(sizeof(struct mcachefs_prefetch_file_t));
+    if (!file)
+    {
+        Err("OOM : could not allocate prefetch entry\n");
+        return -1;
+    }
+    file->fh = mcachefs_fileid_get(mdata, NULL, mcachefs_file_type_file);
+    file->mfile = mcachefs_file_get(file->fh);
+    file->dir = dir;
+    file->id = mdata->id;
+    file->size = mdata->st.st_size;
+    file->queued = 0;
+
+    mcachefs_prefetch_inflight += file->size;
+    mcachefs_prefetch_queued_nb++;
+
+    file->next = mcachefs_prefetch_files;
+    mcachefs_prefetch_files = file;
+
+    added[(*added_nb)++] = file;
+    return 0;
+}
+
+static int
+mcachefs_prefetch_is_candidate(struct mcachefs_metadata_t *mdata)
+{
+    return S_ISREG(mdata->st.st_mode) && mdata->st.st_size > 0;
+}
+
+/**
+ * Prefetch the files following the last one opened in the child list of the directory - metadata and prefetch locks HELD
+ */
+static void
+mcachefs_prefetch_list_locked(struct mcachefs_prefetch_stream_t *stream, int nb, struct mcachefs_prefetch_file_t **added,
+                              int *added_nb)
+{
+    struct mcachefs_metadata_t *mnext;
+    int walked, isnew = (stream->frontier == 0);
+
+    mnext = mcachefs_metadata_get(stream->last);
+    if (!mnext)
+        return;
+    for (walked = 0, mnext = mcachefs_metadata_get(mnext->next); mnext && walked < nb;
+         mnext = mcachefs_metadata_get(mnext->next))
+    {
+        if (!mcachefs_prefetch_is_candidate(mnext))
+            continue;
+        walked++;
+        if (!isnew)
+        {
+            isnew = (mnext->id == stream->frontier);
+            continue;
+        }
+        if (mcachefs_prefetch_add_locked(stream->dir, mnext, added, added_nb))
+            break;
+        stream->frontier = mnext->id;
+    }
+}
+
+/**
+ * Prefetch the files whose names come after the last one opened in the directory - metadata and prefetch locks HELD
+ */
+static void
+mcachefs_prefetch_sorted_locked(struct mcachefs_prefetch_stream_t *stream, int nb, struct mcachefs_prefetch_file_t **added,
+                                int *added_nb)
+{
+    struct mcachefs_metadata_t *next[MCACHEFS_PREFETCH_FILES_MAX], *child;
+    int found = 0, cur;
+
+    /**
+     * Keep the nb smallest names after mdata, sorted by insertion
+     */
+    child = mcachefs_metadata_get(stream->dir);
+    if (!child)
+        return;
+    for (child = mcachefs_metadata_get_child(child); child; child = mcachefs_metadata_get(child->next))
+    {
+        if (!mcachefs_prefetch_is_candidate(child) || strcmp(child->d_name, stream->last_name) <= 0)
+            continue;
+        if (found == nb && strcmp(child->d_name, next[found - 1]->d_name) >= 0)
+            continue;
+        for (cur = (found < nb) ? found++ : found - 1; cur > 0 && strcmp(child->d_name, next[cur - 1]->d_name) < 0; cur--)
+        {
+            next[cur] = next[cur - 1];
+        }
+        next[cur] = child;
+    }
+
+    for (cur = 0; cur < found; cur++)
+    {
+        if (stream->frontier && strcmp(next[cur]->d_name, stream->frontier_name) <= 0)
+            continue;
+        if (mcachefs_prefetch_add_locked(stream->dir, next[cur], added, added_nb))
+            break;
+        stream->frontier = next[cur]->id;
+        memcpy(stream->frontier_name, next[cur]->d_name, NAME_MAX + 1);
+    }
+}
+
+/**
+ * Follow the open of mdata in its stream, and tell if prefetched backups shall be cancelled - metadata and prefetch locks HELD
+ */
+static int
+mcachefs_prefetch_follow_locked(struct mcachefs_prefetch_stream_t *stream, struct mcachefs_metadata_t *mdata)
+{
+    struct mcachefs_metadata_t *mlast;
+    int list, sorted, broken = 0;
+
+    mlast = mcachefs_metadata_get(stream->last);
+    list = (mlast && mlast->father == stream->dir && mlast->next == mdata->id);
+    sorted = (strcmp(mdata->d_name, stream->last_name) > 0);
+
+    if (list && stream->mode != MCACHEFS_PREFETCH_MODE_SORTED)
+    {
+        stream->mode = MCACHEFS_PREFETCH_MODE_LIST;
+        stream->hits++;
+    }
+    else if (sorted && stream->mode != MCACHEFS_PREFETCH_MODE_LIST)
+    {
+        stream->mode = MCACHEFS_PREFETCH_MODE_SORTED;
+        stream->hits++;
+    }
+    else if (list || sorted)
+    {
+        /**
+         * Still sequential, but in the other order
+         */
+        stream->mode = list ? MCACHEFS_PREFETCH_MODE_LIST : MCACHEFS_PREFETCH_MODE_SORTED;
+        stream->hits = 1;
+        stream->frontier = 0;
+        broken = 1;
+    }
+    else
+    {
+        Log("Prefetch : '%s' breaks the pattern after '%s'\n", mdata->d_name, stream->last_name);
+        stream->mode = MCACHEFS_PREFETCH_MODE_NONE;
+        stream->hits = 0;
+        stream->frontier = 0;
+        broken = 1;
+    }
+
+    if (stream->mode == MCACHEFS_PREFETCH_MODE_SORTED && stream->frontier && strcmp(mdata->d_name, stream->frontier_name) >= 0)
+    {
+        stream->frontier = 0;
+    }
+    return broken;
+}
+
+/**
+ * Drop the prefetched files taken from the list, cancelling their backup if asked - no lock HELD
+ */
+static void
+mcachefs_prefetch_drop_files(struct mcachefs_prefetch_file_t *dropped, int cancel)
+{
+    struct mcachefs_prefetch_file_t *file;
+
+    while ((file = dropped) != NULL)
+    {
+        dropped = file->next;
+        if (cancel && mcachefs_transfer_cancel(file->mfile, MCACHEFS_TRANSFER_PRIORITY_PREFETCH) == 0)
+        {
+            mcachefs_prefetch_lock();
+            mcachefs_prefetch_cancelled_nb++;
+            mcachefs_prefetch_unlock();
+        }
+        mcachefs_fileid_put(file->fh);
+        free(file);
+    }
+}
+
+void
+mcachefs_prefetch_open(struct mcachefs_file_t *mfile)
+{
+    struct mcachefs_metadata_t *mdata, *mdir;
+    struct mcachefs_prefetch_stream_t *stream;
+    struct mcachefs_prefetch_file_t *added[MCACHEFS_PREFETCH_FILES_MAX], *dropped = NULL, *cancelled = NULL;
+    int nb = mcachefs_config_get_prefetch_files();
+    int created, added_nb = 0, cur;
+
+    if (nb <= 0)
+        return;
+    if (nb > MCACHEFS_PREFETCH_FILES_MAX)
+        nb = MCACHEFS_PREFETCH_FILES_MAX;
+
+    mdata = mcachefs_file_get_metadata(mfile);
+    if (!mdata)
+        return;
+    mdir = mcachefs_metadata_get(mdata->father);
+    if (!mdir || !S_ISREG(mdata->st.st_mode))
+    {
+        mcachefs_metadata_release(mdata);
+        return;
+    }
+
+    mcachefs_prefetch_lock();
+    mcachefs_prefetch_take_files_locked(0, &dropped);
+    mcachefs_prefetch_take_opened_locked(mdata->id, &dropped);
+
+    stream = mcachefs_prefetch_get_stream_locked(mdir->id, &created);
+    if (!created && stream->last == mdata->id)
+    {
+        mcachefs_prefetch_unlock();
+        mcachefs_metadata_release(mdata);
+        mcachefs_prefetch_drop_files(dropped, 0);
+        return;
+    }
+    if (!created && mcachefs_prefetch_follow_locked(stream, mdata))
+    {
+        mcachefs_prefetch_take_files_locked(mdir->id, &cancelled);
+    }
+    stream->last = mdata->id;
+    memcpy(stream->last_name, mdata->d_name, NAME_MAX + 1);
+
+    /**
+     * Listing the children of the directory may remap the metadata, so mdata and mdir are not used past this point
+     */
+    if (stream->hits >= MCACHEFS_PREFETCH_TRIGGER && mcachefs_config_get_read_state() == MCACHEFS_STATE_NORMAL)
+    {
+        if (stream->mode == MCACHEFS_PREFETCH_MODE_LIST)
+            mcachefs_prefetch_list_locked(stream, nb, added, &added_nb);
+        else
+            mcachefs_prefetch_sorted_locked(stream, nb, added, &added_nb);
+    }
+    mcachefs_prefetch_unlock();
+
+    mcachefs_metadata_release(mdata);
+
+    mcachefs_prefetch_drop_files(cancelled, 1);
+    mcachefs_prefetch_drop_files(dropped, 0);
+
+    /**
+     * mcachefs_transfer_backfile() takes the metadata lock, so entries are only marked queued afterwards. Entries not
+     * queued yet are left alone by the other opens, and those whose backup was not needed are reaped at the next one.
+     */
+    for (cur = 0; cur < added_nb; cur++)
+    {
+        Log("Prefetching '%s'\n", added[cur]->mfile->path);
+        mcachefs_transfer_backfile(added[cur]->mfile, MCACHEFS_TRANSFER_PRIORITY_PREFETCH);
+
+        mcachefs_prefetch_lock();
+        added[cur]->queued = 1;
+        mcachefs_prefetch_unlock();
+    }
+}
+
+void
+mcachefs_prefetch_cleanup()
+{
+    struct mcachefs_prefetch_file_t *dropped;
+
+    mcachefs_prefetch_lock();
+    dropped = mcachefs_prefetch_files;
+    mcachefs_prefetch_files = NULL;
+    mcachefs_prefetch_inflight = 0;
+    mcachefs_prefetch_unlock();
+
+    mcachefs_prefetch_drop_files(dropped, 0);
+}
+
+void
+mcachefs_prefetch_dump(struct mcachefs_file_t *mvops)
+{
+    struct mcachefs_prefetch_stream_t *stream;
+    struct mcachefs_prefetch_file_t *file;
+    int cur;
+
+    mcachefs_prefetch_lock();
+    __VOPS_WRITE(mvops, "Prefetch : %d files ahead, %luk/%luk in flight\n", mcachefs_config_get_prefetch_files(),
+                 (unsigned long) mcachefs_prefetch_inflight >> 10, (unsigned long) mcachefs_config_get_prefetch_max_size() >> 10);
+    __VOPS_WRITE(mvops, "Prefetched %lu files, %lu opened, %lu cancelled\n", mcachefs_prefetch_queued_nb,
+                 mcachefs_prefetch_hits_nb, mcachefs_prefetch_cancelled_nb);
+
+    __VOPS_WRITE(mvops, "\nStreams :\n");
+    for (cur = 0; cur < MCACHEFS_PREFETCH_STREAMS_MAX; cur++)
+    {
+        stream = &(mcachefs_prefetch_streams[cur]);
+        if (!stream->dir)
+            continue;
+        __VOPS_WRITE(mvops, "\tdir=%llu, order=%s, hits=%d, last='%s', frontier='%s'\n", stream->dir,
+                     mcachefs_prefetch_mode_names[stream->mode], stream->hits, stream->last_name,
+                     stream->mode == MCACHEFS_PREFETCH_MODE_SORTED && stream->frontier ? stream->frontier_name : "");
+    }
+
+    __VOPS_WRITE(mvops, "\nFiles :\n");
+    for (file = mcachefs_prefetch_files; file; file = file->next)
+    {
+        __VOPS_WRITE(mvops, "\t%s %luk %s\n", file->queued ? "queued " : "pending", (unsigned long) file->size >> 10,
+                     file->mfile->path);
+    }
+    mcachefs_prefetch_unlock();
+}
@@ -0,0 +1,31 @@
+#ifndef __MCACHEFS_PREFETCH_H
+#define __MCACHEFS_PREFETCH_H
+
+/**
+ * ********************* PREFETCH *****************************
+ * Detection of sequential scans of a directory, to back up the next files before they are opened.
+ * Each directory recently opened from has a stream, which follows the files opened in it : a file is sequential if it
+ * comes right after the previous one in the child list of the directory (directory order), or if its name sorts after
+ * the previous one (name order). After MCACHEFS_PREFETCH_TRIGGER sequential opens, the next prefetch-files files are
+ * queued for backup at MCACHEFS_TRANSFER_PRIORITY_PREFETCH, as long as the prefetched files not backed up yet stay
+ * under prefetch-max-size. When a file breaks the pattern, the prefetched backups of the directory still queued are
+ * cancelled.
+ */
+
+#define MCACHEFS_PREFETCH_TRIGGER 2
+
+void mcachefs_prefetch_init();
+
+/**
+ * Release the files still held by the prefetcher, shall be called once transfer threads are stopped
+ */
+void mcachefs_prefetch_cleanup();
+
+/**
+ * Follow the open of a regular file, and prefetch its next siblings - no lock HELD
+ */
+void mcachefs_prefetch_open(struct mcachefs_file_t *mfile);
+
+void mcachefs_prefetch_dump(struct mcachefs_file_t *mvops);
+
+#endif // __MCACHEFS_PREFETCH_H
@@ -0,0 +1,197 @@
+#include "mcachefs.h"
+#include "mcachefs-ratelimit.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+/**
+ * Longest sleep between two checks of mcachefs state, in nanoseconds
+ */
+static const long long mcachefs_ratelimit_sleep_max = 100000000LL;
+
+/**
+ * Burst allowed after an idle period : a tenth of a second worth of transfer
+ */
+#define MCACHEFS_RATELIMIT_BURST_DIV 10
+
+/**
+ * Rates above 8GB/s are not limited, which keeps rate * nanoseconds within 64 bits
+ */
+#define MCACHEFS_RATELIMIT_RATE_MAX (1LL << 33)
+
+struct mcachefs_ratelimit_bucket_t
+{
+    struct mcachefs_mutex_t mutex;
+    long long tokens;           //< Available bytes, negative when in debt
+    long long carry;            //< Fraction of byte not yet credited, in bytes * nanoseconds
+    long long last;             //< Last refill, in nanoseconds (monotonic)
+    long long consumed;         //< Bytes taken since init, limited or not
+};
+
+static struct mcachefs_ratelimit_bucket_t mcachefs_ratelimit_buckets[MCACHEFS_TRANSFER_TYPES];
+
+static long long
+mcachefs_ratelimit_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((long long) now.tv_sec) * NSEC_PER_SEC + now.tv_nsec;
+}
+
+void
+mcachefs_ratelimit_init()
+{
+    int type;
+
+    for (type = 0; type < MCACHEFS_TRANSFER_TYPES; type++)
+    {
+        memset(&(mcachefs_ratelimit_buckets[type]), 0, sizeof(struct mcachefs_ratelimit_bucket_t));
+        mcachefs_mutex_init(&(mcachefs_ratelimit_buckets[type].mutex));
+        mcachefs_ratelimit_buckets[type].last = mcachefs_ratelimit_now();
+    }
+}
+
+int
+mcachefs_ratelimit_get_rate(int type)
+{
+    switch (type)
+    {
+    case MCACHEFS_TRANSFER_TYPE_BACKUP:
+        return mcachefs_config_get_transfer_max_rate();
+    case MCACHEFS_TRANSFER_TYPE_WRITEBACK:
+        return mcachefs_config_get_writeback_max_rate();
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Credit the bytes earned since the last refill - bucket lock HELD
+ * @return the rate in bytes per second, 0 if unlimited
+ */
+static long long
+mcachefs_ratelimit_refill_locked(struct mcachefs_ratelimit_bucket_t *bucket, int type, long long now)
+{
+    long long rate = ((long long) mcachefs_ratelimit_get_rate(type)) << 10;
+    long long burst, elapsed, earned;
+
+    elapsed = now - bucket->last;
+    bucket->last = now;
+
+    if (rate <= 0 || rate > MCACHEFS_RATELIMIT_RATE_MAX)
+    {
+        bucket->tokens = 0;
+        bucket->carry = 0;
+        return 0;
+    }
+
+    /**
+     * Whole seconds and nanoseconds are credited apart, so that rate * elapsed does not overflow
+     */
+    bucket->tokens += rate * (elapsed / NSEC_PER_SEC);
+    earned = rate * (elapsed % NSEC_PER_SEC) + bucket->carry;
+    bucket->tokens += earned / NSEC_PER_SEC;
+    bucket->carry = earned % NSEC_PER_SEC;
+
+    burst = rate / MCACHEFS_RATELIMIT_BURST_DIV;
+    if (bucket->tokens >= burst)
+    {
+        bucket->tokens = burst;
+        bucket->carry = 0;
+    }
+    return rate;
+}
+
+/**
+ * Time needed to pay back the debt of the bucket, in nanoseconds - bucket lock HELD
+ */
+static long long
+mcachefs_ratelimit_delay_locked(struct mcachefs_ratelimit_bucket_t *bucket, long long rate)
+{
+    if (!rate || bucket->tokens >= 0)
+        return 0;
+    return ((-bucket->tokens) * NSEC_PER_SEC - bucket->carry + rate - 1) / rate;
+}
+
+int
+mcachefs_ratelimit_consume(int type, off_t size)
+{
+    struct mcachefs_ratelimit_bucket_t *bucket = &(mcachefs_ratelimit_buckets[type]);
+    struct timespec deadline;
+    long long now, rate, delay, until;
+
+    now = mcachefs_ratelimit_now();
+
+    mcachefs_mutex_lock(&(bucket->mutex), "ratelimit", __CONTEXT);
+    rate = mcachefs_ratelimit_refill_locked(bucket, type, now);
+    if (rate)
+    {
+        bucket->tokens -= size;
+    }
+    bucket->consumed += size;
+    delay = mcachefs_ratelimit_delay_locked(bucket, rate);
+    mcachefs_mutex_unlock(&(bucket->mutex), "ratelimit", __CONTEXT);
+
+    /**
+     * Wait for our own debt only : transfers taken after this one are paid by their own threads
+     */
+    until = now + delay;
+    while (delay > 0)
+    {
+        if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
+        {
+            return -EINTR;
+        }
+        if (delay > mcachefs_ratelimit_sleep_max)
+        {
+            delay = mcachefs_ratelimit_sleep_max;
+        }
+        now += delay;
+        deadline.tv_sec = now / NSEC_PER_SEC;
+        deadline.tv_nsec = now % NSEC_PER_SEC;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+
+        now = mcachefs_ratelimit_now();
+        delay = until - now;
+    }
+    return 0;
+}
+
+long long
+mcachefs_ratelimit_delay(int type)
+{
+    struct mcachefs_ratelimit_bucket_t *bucket = &(mcachefs_ratelimit_buckets[type]);
+    long long rate, delay;
+
+    mcachefs_mutex_lock(&(bucket->mutex), "ratelimit", __CONTEXT);
+    rate = mcachefs_ratelimit_refill_locked(bucket, type, mcachefs_ratelimit_now());
+    delay = mcachefs_ratelimit_delay_locked(bucket, rate);
+    mcachefs_mutex_unlock(&(bucket->mutex), "ratelimit", __CONTEXT);
+    return delay;
+}
+
+void
+mcachefs_ratelimit_take(int type, off_t size)
+{
+    struct mcachefs_ratelimit_bucket_t *bucket = &(mcachefs_ratelimit_buckets[type]);
+
+    mcachefs_mutex_lock(&(bucket->mutex), "ratelimit", __CONTEXT);
+    if (mcachefs_ratelimit_refill_locked(bucket, type, mcachefs_ratelimit_now()))
+    {
+        bucket->tokens -= size;
+    }
+    bucket->consumed += size;
+    mcachefs_mutex_unlock(&(bucket->mutex), "ratelimit", __CONTEXT);
+}
+
+long long
+mcachefs_ratelimit_get_consumed(int type)
+{
+    struct mcachefs_ratelimit_bucket_t *bucket = &(mcachefs_ratelimit_buckets[type]);
+    long long consumed;
+
+    mcachefs_mutex_lock(&(bucket->mutex), "ratelimit", __CONTEXT);
+    consumed = bucket->consumed;
+    mcachefs_mutex_unlock(&(bucket->mutex), "ratelimit", __CONTEXT);
+    return consumed;
+}
@@ -0,0 +1,41 @@
+#ifndef __MCACHEFS_RATELIMIT_H
+#define __MCACHEFS_RATELIMIT_H
+
+/**
+ * ********************* RATE LIMIT *****************************
+ * One token bucket per transfer type, shared by all the transfer threads of that type, so that the configured
+ * rate is the aggregate rate of all threads. Buckets are filled in bytes from CLOCK_MONOTONIC, and a transfer
+ * may overdraw the bucket : the debt is paid back by waiting before the next transfer of the same type.
+ * The rate is read from the configuration at each refill, so it can be changed at run time (0 means unlimited).
+ */
+
+/**
+ * Initialize the buckets, shall be called before any transfer thread starts
+ */
+void mcachefs_ratelimit_init();
+
+/**
+ * Take size bytes from the bucket of type, waiting for the bucket to be refilled if needed
+ * @return 0 when the bytes may be transfered, -EINTR if mcachefs is quitting
+ */
+int mcachefs_ratelimit_consume(int type, off_t size);
+
+/**
+ * Non blocking interface, for threads that can not sleep (uring engine)
+ * mcachefs_ratelimit_delay() returns how long to wait before the bucket of type is not in debt anymore,
+ * in nanoseconds (0 if bytes can be taken right now), and mcachefs_ratelimit_take() takes size bytes regardless.
+ */
+long long mcachefs_ratelimit_delay(int type);
+void mcachefs_ratelimit_take(int type, off_t size);
+
+/**
+ * Configured rate of type, in kilobytes per second, 0 if unlimited
+ */
+int mcachefs_ratelimit_get_rate(int type);
+
+/**
+ * Bytes taken from the bucket of type since init, used to measure the throughput of the transfer threads
+ */
+long long mcachefs_ratelimit_get_consumed(int type);
+
+#endif // __MCACHEFS_RATELIMIT_H
@@ -0,0 +1,241 @@
+#include "mcachefs.h"
+#include "mcachefs-hash.h"
+#include "mcachefs-signatures.h"
+
+/**
+ * Signatures file : a fixed header followed by one CRC64 per block
+ */
+#define MCACHEFS_SIGNATURES_MAGIC "mcachefs-signatures-1"
+
+struct mcachefs_signatures_header_t
+{
+    char magic[24];
+    off_t block_size;
+};
+
+static char *
+mcachefs_signatures_makepath(const char *path)
+{
+    char *signaturespath, *sigpath;
+
+    signaturespath = mcachefs_makepath(path, MCACHEFS_SIGNATURES_DIR);
+    if (!signaturespath)
+        return NULL;
+    sigpath = mcachefs_makepath_cache(signaturespath);
+    free(signaturespath);
+    return sigpath;
+}
+
+static int
+mcachefs_signatures_create(const char *path)
+{
+    char *signaturespath;
+    int res;
+
+    signaturespath = mcachefs_makepath(path, MCACHEFS_SIGNATURES_DIR);
+    if (!signaturespath)
+        return -ENOMEM;
+    res = mcachefs_createpath_cache(signaturespath, 0);
+    free(signaturespath);
+    return res;
+}
+
+int
+mcachefs_signatures_open(const char *path, int create)
+{
+    struct mcachefs_signatures_header_t header;
+    char *sigpath;
+    int fd, res;
+
+    if (create && (res = mcachefs_signatures_create(path)) != 0)
+    {
+        Err("Could not create signatures path for '%s' : err=%d\n", path, res);
+        return res < 0 ? res : -EIO;
+    }
+    sigpath = mcachefs_signatures_makepath(path);
+    if (!sigpath)
+        return -ENOMEM;
+
+    fd = open(sigpath, create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+    if (fd == -1)
+    {
+        res = -errno;
+        if (errno != ENOENT)
+            Err("Could not open signatures '%s' : err=%d:%s\n", sigpath, errno, strerror(errno));
+        free(sigpath);
+        return res;
+    }
+
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && strncmp(header.magic, MCACHEFS_SIGNATURES_MAGIC, sizeof(header.magic)) == 0
+        && header.block_size == MCACHEFS_SIGNATURES_BLOCK_SIZE)
+    {
+        free(sigpath);
+        return fd;
+    }
+    if (!create)
+    {
+        Log("Ignoring invalid signatures '%s'\n", sigpath);
+        close(fd);
+        free(sigpath);
+        return -EINVAL;
+    }
+
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, MCACHEFS_SIGNATURES_MAGIC, sizeof(header.magic));
+    header.block_size = MCACHEFS_SIGNATURES_BLOCK_SIZE;
+
+    if (ftruncate(fd, 0) || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        res = errno ? -errno : -EIO;
+        Err("Could not initialize signatures '%s' : err=%d:%s\n", sigpath, errno, strerror(errno));
+        close(fd);
+        unlink(sigpath);
+        free(sigpath);
+        return res;
+    }
+    free(sigpath);
+    return fd;
+}
+
+unsigned long long
+mcachefs_signatures_compute(const void *block, size_t size)
+{
+    /**
+     * Seeded so that a block of zeroes does not get the 'no signature' value
+     */
+    return mcachefs_crc64(~0ULL, block, size);
+}
+
+void
+mcachefs_signatures_record(int fd, int backing_fd, off_t offset, off_t length, off_t size)
+{
+    off_t block = (offset + MCACHEFS_SIGNATURES_BLOCK_SIZE - 1) / MCACHEFS_SIGNATURES_BLOCK_SIZE;
+    off_t block_offset, block_size, end = offset + length;
+    unsigned long long signature;
+    char *buffer;
+
+    buffer = (char *) malloc(MCACHEFS_SIGNATURES_BLOCK_SIZE);
+    if (!buffer)
+    {
+        Err("OOM : could not allocate signature block\n");
+        return;
+    }
+    for (; (block_offset = block * MCACHEFS_SIGNATURES_BLOCK_SIZE) < end; block++)
+    {
+        block_size = size - block_offset;
+        if (block_size > MCACHEFS_SIGNATURES_BLOCK_SIZE)
+            block_size = MCACHEFS_SIGNATURES_BLOCK_SIZE;
+        if (block_size <= 0 || block_offset + block_size > end)
+            break;
+
+        if (pread(backing_fd, buffer, block_size, block_offset) == block_size)
+            signature = mcachefs_signatures_compute(buffer, block_size);
+        else
+            signature = 0;
+        if (mcachefs_signatures_set(fd, block, signature))
+            break;
+    }
+    free(buffer);
+}
+
+unsigned long long
+mcachefs_signatures_get(int fd, off_t block)
+{
+    unsigned long long signature;
+
+    if (pread(fd, &signature, sizeof(signature), sizeof(struct mcachefs_signatures_header_t) + block * sizeof(signature))
+        != sizeof(signature))
+        return 0;
+    return signature;
+}
+
+int
+mcachefs_signatures_set(int fd, off_t block, unsigned long long signature)
+{
+    if (pwrite(fd, &signature, sizeof(signature), sizeof(struct mcachefs_signatures_header_t) + block * sizeof(signature))
+        != sizeof(signature))
+    {
+        Err("Could not write signature of block %lu : err=%d:%s\n", (unsigned long) block, errno, strerror(errno));
+        return -EIO;
+    }
+    return 0;
+}
+
+int
+mcachefs_signatures_truncate(const char *path, off_t size)
+{
+    off_t blocks = size / MCACHEFS_SIGNATURES_BLOCK_SIZE;
+    struct stat st;
+    int fd, res = 0;
+
+    fd = mcachefs_signatures_open(path, 0);
+    if (fd == -ENOENT)
+        return 0;
+    if (fd < 0)
+        return mcachefs_signatures_remove(path);
+
+    if (fstat(fd, &st) == 0
+        && st.st_size > (off_t) (sizeof(struct mcachefs_signatures_header_t) + blocks * sizeof(unsigned long long))
+        && ftruncate(fd, sizeof(struct mcachefs_signatures_header_t) + blocks * sizeof(unsigned long long)))
+    {
+        res = -errno;
+        Err("Could not truncate signatures of '%s' : err=%d:%s\n", path, errno, strerror(errno));
+    }
+    close(fd);
+    return res ? mcachefs_signatures_remove(path) : 0;
+}
+
+int
+mcachefs_signatures_remove(const char *path)
+{
+    char *sigpath;
+    int res = 0;
+
+    sigpath = mcachefs_signatures_makepath(path);
+    if (!sigpath)
+        return -ENOMEM;
+    if (remove(sigpath) && errno != ENOENT)
+    {
+        res = -errno;
+        Err("Could not remove signatures '%s' : err=%d:%s\n", sigpath, errno, strerror(errno));
+    }
+    free(sigpath);
+    return res;
+}
+
+int
+mcachefs_signatures_rename(const char *path, const char *to)
+{
+    char *sigpath, *sigto;
+    struct stat st;
+    int res = 0;
+
+    sigpath = mcachefs_signatures_makepath(path);
+    if (!sigpath)
+        return -ENOMEM;
+    if (lstat(sigpath, &st))
+    {
+        free(sigpath);
+        /**
+         * Nothing to rename, but signatures left at the destination do not match the renamed file
+         */
+        return mcachefs_signatures_remove(to);
+    }
+    sigto = mcachefs_signatures_makepath(to);
+    if (!sigto || mcachefs_signatures_create(to))
+    {
+        Err("Could not create signatures path for '%s'\n", to);
+        free(sigpath);
+        free(sigto);
+        return -EIO;
+    }
+    if (rename(sigpath, sigto))
+    {
+        res = -errno;
+        Err("Could not rename signatures '%s' to '%s' : err=%d:%s\n", sigpath, sigto, errno, strerror(errno));
+    }
+    free(sigpath);
+    free(sigto);
+    return res;
+}
@@ -0,0 +1,65 @@
+#ifndef __MCACHEFS_SIGNATURES_H
+#define __MCACHEFS_SIGNATURES_H
+
+/**
+ * ********************* SIGNATURES *****************************
+ * Delta writeback compares the blocks of the backing file to the CRC64 signatures of the blocks of the target.
+ * These are recorded when the data comes in (backup or fetch), and updated each time a block is written back,
+ * so that writeback only reads the backing file and never reads the target over the link.
+ * Signatures are stored under MCACHEFS_SIGNATURES_DIR in the cache, with the same path as the backing file :
+ * a fixed header followed by one signature per block, 0 meaning the block has no signature.
+ */
+
+/**
+ * Where signatures are stored, relative to the cache root.
+ */
+#define MCACHEFS_SIGNATURES_DIR "/.mcachefs/signatures"
+
+/**
+ * Size of the blocks signed
+ */
+#define MCACHEFS_SIGNATURES_BLOCK_SIZE (64 << 10)
+
+/**
+ * Open the signatures of a path, creating them if asked
+ * @return the fd, or -errno (-ENOENT if the path has no signatures and create is not set)
+ */
+int mcachefs_signatures_open(const char *path, int create);
+
+/**
+ * Signature of a block
+ */
+unsigned long long mcachefs_signatures_compute(const void *block, size_t size);
+
+/**
+ * Read back the blocks of [offset, offset+length[ from the backing fd and record their signatures
+ * Only blocks entirely in the range are signed, the last block of a file of the given size being complete at its end.
+ */
+void mcachefs_signatures_record(int fd, int backing_fd, off_t offset, off_t length, off_t size);
+
+/**
+ * Get the signature of a block, 0 if the block has none
+ */
+unsigned long long mcachefs_signatures_get(int fd, off_t block);
+
+/**
+ * Set the signature of a block
+ */
+int mcachefs_signatures_set(int fd, off_t block, unsigned long long signature);
+
+/**
+ * Drop the signatures of the blocks not entirely below size, when the target is truncated
+ */
+int mcachefs_signatures_truncate(const char *path, off_t size);
+
+/**
+ * Remove the signatures of a path (or the signature directory of a directory), if any
+ */
+int mcachefs_signatures_remove(const char *path);
+
+/**
+ * Rename the signatures of a path (or the signature directory of a directory), if any
+ */
+int mcachefs_signatures_rename(const char *path, const char *to);
+
+#endif // __MCACHEFS_SIGNATURES_H
@@ -1,56 +1,278 @@
+/* For copy_file_range() and splice() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "mcachefs.h"
+#include "mcachefs-chunks.h"
+#include "mcachefs-compress.h"
+#include "mcachefs-dedup.h"
+#include "mcachefs-extents.h"
+#include "mcachefs-hash.h"
 #include "mcachefs-journal.h"
+#include "mcachefs-ratelimit.h"
+#include "mcachefs-signatures.h"
 #include "mcachefs-transfer.h"
+#include "mcachefs-uring.h"
 #include "mcachefs-vops.h"
-
-#include <sys/sendfile.h>
+#include "mcachefs-window.h"
 
 // #define  __MCACHEFS_TRANSFER_DO_FTRUNCATE_TARGET
 
-static const off_t mcachefs_transfer_window_size_min = 4 * (1 << 10);
-static const off_t mcachefs_transfer_window_size_max = 128 * (1 << 10);
+/**
+ * Size of the reads and writes submitted by the uring engine
+ */
+static const off_t mcachefs_transfer_uring_slot_size = 128 * (1 << 10);
+
+/**
+ * Delta writeback statistics, in bytes - transfer lock HELD
+ */
+static off_t mcachefs_transfer_delta_compared = 0;
+static off_t mcachefs_transfer_delta_saved = 0;
+
+/**
+ * Statistics of abandoned backups
+ */
+static unsigned long mcachefs_transfer_abandoned = 0;
+static off_t mcachefs_transfer_abandoned_kept = 0;
+
+struct mcachefs_transfer_uring_engine_t;
+
+#define MCACHEFS_TRANSFER_THREAD_FREE    0
+#define MCACHEFS_TRANSFER_THREAD_RUNNING 1
 
 struct mcachefs_transfer_thread_t
 {
     pthread_t threadid;
+    int state;
     struct mcachefs_file_t *currentfile;
     int type;
+    int serving;                //< Type of the current transfer, another type than type when stolen
+    int stream;
+    struct mcachefs_transfer_uring_engine_t *uring;     //< Set when the thread runs the uring engine
 };
 
+/**
+ * Thread slots, as many as the maximal number of threads of all types
+ */
 static struct mcachefs_transfer_thread_t *mcachefs_transfer_threads;
 
 int mcachefs_transfer_threads_nb = 0;
 
+/**
+ * Elastic thread pools - transfer lock HELD
+ * Each type runs between its minimal and maximal number of threads. A thread is started when transfers are queued
+ * while no thread of their type is idle, and a thread idle for mcachefs_transfer_pool_idle_max exits. A thread which
+ * waited mcachefs_transfer_pool_wait without any transfer of its type steals the transfers queued for other types.
+ * Every mcachefs_transfer_pool_period, the throughput of each type is taken from the rate limiter : when the threads
+ * started during the period did not bring an eighth more throughput while transfers got an eighth slower, the source
+ * is saturated. The threads above the count of the previous period exit after their transfer, and no thread is
+ * started for mcachefs_transfer_pool_hold.
+ */
+static const long long mcachefs_transfer_pool_wait = 1000;
+static const long long mcachefs_transfer_pool_idle_max = 30 * 1000;
+static const long long mcachefs_transfer_pool_grow_period = 250;
+static const long long mcachefs_transfer_pool_period = 2 * 1000;
+static const long long mcachefs_transfer_pool_hold = 30 * 1000;
+
+struct mcachefs_transfer_pool_t
+{
+    int min;
+    int max;
+    int limit;                  //< Threads above this count exit after their transfer, max unless saturated
+    int live;                   //< Threads started and not exited
+    int idle;                   //< Threads waiting for a transfer
+    long long last_grow;        //< Last thread started, in milliseconds (monotonic)
+    long long hold_until;       //< No thread is started before, in milliseconds (monotonic)
+
+    /**
+     * Measures of the current period
+     */
+    long long period_start;
+    long long consumed;         //< Bytes taken from the rate limiter at period start
+    int live_start;
+    long long latency_start;
+
+    long long rate;             //< Throughput of the last period, in bytes per second
+    long long latency;          //< Moving average of the duration of a transfer, in milliseconds
+
+    unsigned long started;
+    unsigned long exited;
+    unsigned long stolen;       //< Transfers of this type served by threads of other types
+};
+
+static struct mcachefs_transfer_pool_t mcachefs_transfer_pools[MCACHEFS_TRANSFER_TYPES];
+
 struct mcachefs_transfer_queue_t
 {
     int type;
+    int priority;               //< Class of the transfer, see MCACHEFS_TRANSFER_PRIORITY_*
+    int stream;                 //< Additional stream of a backup already in progress
+    long long queued_at;        //< When the transfer has been queued, in milliseconds (monotonic)
     struct mcachefs_file_t *mfile;
+    struct mcachefs_transfer_queue_t *prev;
     struct mcachefs_transfer_queue_t *next;
 };
 
-struct mcachefs_transfer_queue_t *mcachefs_transfer_queue_head = NULL, *mcachefs_transfer_queue_tail = NULL;
+/**
+ * One FIFO per transfer type and per priority class, so that enqueue and dequeue are constant time - transfer lock HELD
+ * Duplicates are detected with mfile->queued instead of walking the queues, which also allows promoting a queued file.
+ */
+struct mcachefs_transfer_queue_list_t
+{
+    struct mcachefs_transfer_queue_t *head;
+    struct mcachefs_transfer_queue_t *tail;
+    int nb;
+
+    /**
+     * Statistics of the transfers taken from this queue, in milliseconds
+     */
+    unsigned long dequeued;
+    long long wait_total;
+    long long wait_max;
+};
+
+static struct mcachefs_transfer_queue_list_t mcachefs_transfer_queues[MCACHEFS_TRANSFER_TYPES][MCACHEFS_TRANSFER_PRIORITIES];
+
+const char *mcachefs_transfer_priority_names[MCACHEFS_TRANSFER_PRIORITIES] = { "foreground", "writeback", "prefetch", "crawl" };
+
+/**
+ * A queued transfer gains one priority class every aging period, so that background work never starves
+ */
+static const long long mcachefs_transfer_aging_period = 10 * 1000;
+
+/**
+ * Queue entries are taken from a pool, grown by blocks and never freed
+ */
+#define MCACHEFS_TRANSFER_QUEUE_POOL_BLOCK 1024
+
+static struct mcachefs_transfer_queue_t *mcachefs_transfer_queue_pool = NULL;
 
 sem_t mcachefs_transfer_sem[MCACHEFS_TRANSFER_TYPES];
 
-struct mcachefs_file_t *mcachefs_transfer_get_next_file_to_back_locked(int transfer_type);
-void mcachefs_transfer_do_transfer(struct mcachefs_file_t *mfile, int transfer_type);
+struct mcachefs_file_t *mcachefs_transfer_get_next_file_to_back_locked(int transfer_type, int *stream);
+void mcachefs_transfer_do_transfer(struct mcachefs_file_t *mfile, int transfer_type, int stream);
 void *mcachefs_transfer_thread(void *arg);
+#ifdef MCACHEFS_HAVE_URING
+static int mcachefs_transfer_uring_thread(struct mcachefs_transfer_thread_t *me);
+#endif
+static long long mcachefs_transfer_now_ms();
 
 #define TIME_DIFF(NOW, LAST) ((NOW.tv_sec-LAST.tv_sec)*1000000 + (NOW.tv_usec-LAST.tv_usec))
 
 /**
- * Backing frontend
+ * Prepare the sparse backing file and its chunk map - mfile lock HELD
+ * The chunks left by an interrupted backup of the same source (same size and mtime) are kept.
  */
-int
-mcachefs_transfer_backfile(struct mcachefs_file_t *mfile)
+static int
+mcachefs_transfer_prepare_backing(struct mcachefs_file_t *mfile, off_t size, time_t mtime)
 {
+    char *backingpath;
+    struct stat st;
+    int res;
+
+    mcachefs_file_check_locked_file(mfile);
+
+    backingpath = mcachefs_makepath_cache(mfile->path);
+    if (!backingpath)
+    {
+        return -ENOMEM;
+    }
+
+    res = mcachefs_chunks_open(mfile, size, mtime);
+    if (res == 1 && (lstat(backingpath, &st) || !S_ISREG(st.st_mode)))
+    {
+        Log("Backing file '%s' vanished, dropping its chunk map\n", backingpath);
+        mcachefs_chunks_close(mfile);
+        mcachefs_chunks_remove(mfile->path);
+        res = mcachefs_chunks_open(mfile, size, mtime);
+    }
+    else if (res == 1)
+    {
+        Info("Resuming backup of '%s' : %lu/%lu chunks already present\n", mfile->path,
+             (unsigned long) mfile->chunks.present, (unsigned long) mfile->chunks.nb);
+    }
+    if (res < 0)
+    {
+        Err("Could not open chunk map for '%s' : err=%d:%s\n", mfile->path, -res, strerror(-res));
+        free(backingpath);
+        return res;
+    }
+    if (res == 0)
+    {
+        /**
+         * Signatures left by a previous backup are the ones of an older version of the target
+         */
+        mcachefs_signatures_remove(mfile->path);
+    }
+    if (res == 0 && mcachefs_createfile_cache(mfile->path, 0644))
+    {
+        Err("Could not create backing path for '%s' !\n", mfile->path);
+        mcachefs_chunks_close(mfile);
+        free(backingpath);
+        return -EIO;
+    }
+
     /**
-     * Called from mcachefs.c : mcachefs_fileid_get() with the mcachefs_file_lock held
+     * Backing file has its final size from the start, chunks not fetched yet are holes
      */
+    if (truncate(backingpath, size))
+    {
+        res = -errno;
+        Err("Could not truncate '%s' to %lu : err=%d:%s\n", backingpath, (unsigned long) size, errno, strerror(errno));
+        mcachefs_chunks_close(mfile);
+        free(backingpath);
+        return res;
+    }
+    free(backingpath);
+
+    mfile->transfer.total_size = size;
+    mfile->transfer.transfered_size = mcachefs_chunks_get_present_size(mfile);
+    return 0;
+}
+
+/**
+ * Backing frontend
+ */
+int
+mcachefs_transfer_backfile(struct mcachefs_file_t *mfile, int priority)
+{
+    struct mcachefs_metadata_t *mdata;
+    off_t size;
+    time_t mtime;
+
+    mdata = mcachefs_file_get_metadata(mfile);
+    if (!mdata)
+    {
+        Err("Could not get metadata for '%s'\n", mfile->path);
+        return -ENOENT;
+    }
+    size = mdata->st.st_size;
+    mtime = mdata->st.st_mtime;
+    mcachefs_metadata_release(mdata);
+
     mcachefs_file_lock_file(mfile);
 
-    if (mfile->cache_status == MCACHEFS_FILE_BACKING_ASKED
-        || mfile->cache_status == MCACHEFS_FILE_BACKING_IN_PROGRESS || mfile->cache_status == MCACHEFS_FILE_BACKING_DONE)
+    if (mfile->cache_status == MCACHEFS_FILE_BACKING_ASKED)
+    {
+        Log("Backing already asked for file '%s'\n", mfile->path);
+        mfile->transfer.cancelled = 0;
+        mcachefs_file_unlock_file(mfile);
+        mcachefs_transfer_promote(mfile, priority);
+        return 0;
+    }
+    if (mfile->cache_status == MCACHEFS_FILE_BACKING_IN_PROGRESS && mfile->transfer.cancelled)
+    {
+        /**
+         * The streams may have seen the cancellation already : let the backup end, and queue it again from there
+         */
+        Log("Backing of file '%s' being abandoned, will queue it again\n", mfile->path);
+        if (mfile->transfer.requeue < 0 || mfile->transfer.requeue > priority)
+            mfile->transfer.requeue = priority;
+        mcachefs_file_unlock_file(mfile);
+        return 0;
+    }
+    if (mfile->cache_status == MCACHEFS_FILE_BACKING_IN_PROGRESS || mfile->cache_status == MCACHEFS_FILE_BACKING_DONE)
     {
         Log("Backing in progress for file '%s'\n", mfile->path);
         mcachefs_file_unlock_file(mfile);
@@ -60,6 +282,7 @@ mcachefs_transfer_backfile(struct mcachefs_file_t *mfile)
     if (mcachefs_fileincache(mfile->path))
     {
         mfile->cache_status = MCACHEFS_FILE_BACKING_DONE;
+        mcachefs_file_notify_file(mfile);
         Log("Backing ok for file '%s' (status set to %d)\n", mfile->path, mfile->cache_status);
         mcachefs_file_unlock_file(mfile);
         return 0;
@@ -67,11 +290,22 @@ mcachefs_transfer_backfile(struct mcachefs_file_t *mfile)
 
     Log("Asking backing for file '%s'\n", mfile->path);
 
+    /**
+     * Load the chunk map now, so that reads can be served from the chunks already there
+     */
+    if (mcachefs_transfer_prepare_backing(mfile, size, mtime))
+    {
+        mfile->cache_status = MCACHEFS_FILE_BACKING_ERROR;
+        mcachefs_file_notify_file(mfile);
+        mcachefs_file_unlock_file(mfile);
+        return -EIO;
+    }
+
     mfile->cache_status = MCACHEFS_FILE_BACKING_ASKED;
     mfile->use++;
     mcachefs_file_unlock_file(mfile);
 
-    mcachefs_transfer_queue_file(mfile, MCACHEFS_TRANSFER_TYPE_BACKUP);
+    mcachefs_transfer_queue_file(mfile, MCACHEFS_TRANSFER_TYPE_BACKUP, priority);
     return 0;
 }
 
@@ -79,7 +313,7 @@ mcachefs_transfer_backfile(struct mcachefs_file_t *mfile)
  * Writeback frontend
  */
 int
-mcachefs_transfer_writeback(const char *path)
+mcachefs_transfer_writeback(const char *path, struct mcachefs_extents_t *extents)
 {
     struct mcachefs_metadata_t *mdata;
     struct mcachefs_file_t *mfile;
@@ -113,17 +347,190 @@ mcachefs_transfer_writeback(const char *path)
     {
         Bug("Error ! mfile=%s has backing=%d\n", mfile->path, mfile->cache_status);
     }
-    return mcachefs_transfer_queue_file(mfile, MCACHEFS_TRANSFER_TYPE_WRITEBACK);
+
+    /**
+     * If a writeback of that file is still queued, it will write back these extents as well
+     */
+    mcachefs_file_lock_file(mfile);
+    if (mcachefs_extents_merge(&(mfile->writeback_extents), extents))
+    {
+        mcachefs_extents_free(&(mfile->writeback_extents));
+        mcachefs_extents_add(&(mfile->writeback_extents), 0, MCACHEFS_EXTENTS_EOF);
+    }
+    mcachefs_file_unlock_file(mfile);
+
+    return mcachefs_transfer_queue_file(mfile, MCACHEFS_TRANSFER_TYPE_WRITEBACK, MCACHEFS_TRANSFER_PRIORITY_WRITEBACK);
+}
+
+/**
+ * Number of transfers queued for type - transfer lock HELD
+ */
+static int
+mcachefs_transfer_queued_locked(int type)
+{
+    int priority, nb = 0;
+
+    for (priority = 0; priority < MCACHEFS_TRANSFER_PRIORITIES; priority++)
+    {
+        nb += mcachefs_transfer_queues[type][priority].nb;
+    }
+    return nb;
+}
+
+/**
+ * Start a thread of type in a free slot - transfer lock HELD
+ */
+static int
+mcachefs_transfer_pool_start_thread_locked(int type)
+{
+    struct mcachefs_transfer_pool_t *pool = &(mcachefs_transfer_pools[type]);
+    struct mcachefs_transfer_thread_t *thread = NULL;
+    pthread_attr_t attrs;
+    int cur, res;
+
+    for (cur = 0; cur < mcachefs_transfer_threads_nb; cur++)
+    {
+        if (mcachefs_transfer_threads[cur].state == MCACHEFS_TRANSFER_THREAD_FREE)
+        {
+            thread = &(mcachefs_transfer_threads[cur]);
+            break;
+        }
+    }
+    if (!thread)
+    {
+        Err("No slot left to start a %s thread\n", mcachefs_transfer_type_names[type]);
+        return -ENOSPC;
+    }
+    memset(thread, 0, sizeof(struct mcachefs_transfer_thread_t));
+    thread->type = type;
+    thread->serving = type;
+    thread->state = MCACHEFS_TRANSFER_THREAD_RUNNING;
+
+    pthread_attr_init(&attrs);
+    pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_JOINABLE);
+    if ((res = pthread_create(&(thread->threadid), &attrs, mcachefs_transfer_thread, thread)) != 0)
+    {
+        Err("Could not start a %s thread : err=%d:%s\n", mcachefs_transfer_type_names[type], res, strerror(res));
+        thread->state = MCACHEFS_TRANSFER_THREAD_FREE;
+        thread->threadid = 0;
+        return -res;
+    }
+    pool->live++;
+    pool->started++;
+    Log("Created new thread %lx, slot=%d, type=%d, %d threads of that type\n", thread->threadid, cur, type, pool->live);
+    return 0;
+}
+
+/**
+ * Mark a thread exiting on its own, which must hold no file and take no lock afterwards - transfer lock HELD
+ * The thread detaches itself and frees its slot : joining it from the threads growing the pool would block them
+ * on the locks they hold (metadata lock in mcachefs_metadata_schedule_fill_child_entries()) until it returns.
+ * Once quitting, the slot is kept for mcachefs_transfer_stop_threads() to join it.
+ */
+static void
+mcachefs_transfer_pool_exit_locked(struct mcachefs_transfer_thread_t *me)
+{
+    struct mcachefs_transfer_pool_t *pool = &(mcachefs_transfer_pools[me->type]);
+    int res;
+
+    pool->live--;
+    pool->exited++;
+    if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
+    {
+        Log("Transfer thread %lx (type=%d) exits while quitting\n", (unsigned long) pthread_self(), me->type);
+        return;
+    }
+    if ((res = pthread_detach(pthread_self())) != 0)
+    {
+        Err("Could not detach transfer thread %lx : err=%d:%s\n", (unsigned long) pthread_self(), res, strerror(res));
+    }
+    me->state = MCACHEFS_TRANSFER_THREAD_FREE;
+    me->threadid = 0;
+    Log("Transfer thread %lx (type=%d) exits, %d threads of that type left\n", (unsigned long) pthread_self(), me->type,
+        pool->live);
+}
+
+/**
+ * Start a thread of type if its transfers are waiting for one - transfer lock HELD
+ */
+static void
+mcachefs_transfer_pool_grow_locked(int type, long long now)
+{
+    struct mcachefs_transfer_pool_t *pool = &(mcachefs_transfer_pools[type]);
+
+    if (pool->live >= pool->limit || now < pool->hold_until || now - pool->last_grow < mcachefs_transfer_pool_grow_period)
+        return;
+    if (mcachefs_transfer_queued_locked(type) <= pool->idle || mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
+        return;
+    if (mcachefs_transfer_pool_start_thread_locked(type) == 0)
+    {
+        pool->last_grow = now;
+    }
+}
+
+/**
+ * Close the measure period of type, and detect a saturated source - transfer lock HELD
+ */
+static void
+mcachefs_transfer_pool_measure_locked(int type, long long now, long long consumed)
+{
+    struct mcachefs_transfer_pool_t *pool = &(mcachefs_transfer_pools[type]);
+    long long rate;
+
+    if (now - pool->period_start < mcachefs_transfer_pool_period)
+        return;
+
+    rate = ((consumed - pool->consumed) * 1000) / (now - pool->period_start);
+    if (pool->live > pool->live_start && pool->rate && mcachefs_transfer_queued_locked(type)
+        && rate < pool->rate + pool->rate / 8 && pool->latency > pool->latency_start + pool->latency_start / 8)
+    {
+        pool->limit = pool->live_start > pool->min ? pool->live_start : pool->min;
+        pool->hold_until = now + mcachefs_transfer_pool_hold;
+        Log("Source of %s saturated at %d threads (rate=%lldkb/s, latency=%lldms), limiting to %d threads\n",
+            mcachefs_transfer_type_names[type], pool->live, rate >> 10, pool->latency, pool->limit);
+    }
+    else if (now >= pool->hold_until)
+    {
+        pool->limit = pool->max;
+    }
+    pool->rate = rate;
+    pool->consumed = consumed;
+    pool->period_start = now;
+    pool->live_start = pool->live;
+    pool->latency_start = pool->latency;
+}
+
+void
+mcachefs_transfer_pool_adjust()
+{
+    long long consumed[MCACHEFS_TRANSFER_TYPES];
+    long long now = mcachefs_transfer_now_ms();
+    int type;
+
+    for (type = 0; type < MCACHEFS_TRANSFER_TYPES; type++)
+    {
+        consumed[type] = mcachefs_ratelimit_get_consumed(type);
+    }
+
+    mcachefs_transfer_lock();
+    for (type = 0; type < MCACHEFS_TRANSFER_TYPES; type++)
+    {
+        mcachefs_transfer_pool_measure_locked(type, now, consumed[type]);
+        mcachefs_transfer_pool_grow_locked(type, now);
+    }
+    mcachefs_transfer_unlock();
 }
 
 void
 mcachefs_transfer_start_threads()
 {
+    struct mcachefs_transfer_pool_t *pool;
+    long long now = mcachefs_transfer_now_ms();
     int cur;
-    int curt;
     int type;
 
     mcachefs_transfer_threads_nb = 0;
+    mcachefs_ratelimit_init();
 
     for (type = 0; type < MCACHEFS_TRANSFER_TYPES; type++)
     {
@@ -132,6 +539,12 @@ mcachefs_transfer_start_threads()
 
     Info("Total threads : %d\n", mcachefs_transfer_threads_nb);
 
+    if (mcachefs_config_get_transfer_engine() == MCACHEFS_TRANSFER_ENGINE_URING && !mcachefs_uring_supported())
+    {
+        Err("Can not use the uring transfer engine, falling back to sync transfers.\n");
+        mcachefs_config_set_transfer_engine(MCACHEFS_TRANSFER_ENGINE_SYNC);
+    }
+
 
     mcachefs_transfer_threads = (struct mcachefs_transfer_thread_t *) malloc(sizeof(struct mcachefs_transfer_thread_t) * mcachefs_transfer_threads_nb);
     memset(mcachefs_transfer_threads, 0, sizeof(struct mcachefs_transfer_thread_t) * mcachefs_transfer_threads_nb);
@@ -141,30 +554,36 @@ mcachefs_transfer_start_threads()
         sem_init(&(mcachefs_transfer_sem[type]), 0, 0);
     }
 
-    pthread_t thid;
-    pthread_attr_t attrs;
-    pthread_attr_init(&attrs);
-    pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_JOINABLE);
-
-    cur = 0;
+    mcachefs_transfer_lock();
     for (type = 0; type < MCACHEFS_TRANSFER_TYPES; type++)
     {
-        for (curt = 0; curt < mcachefs_config_get_transfer_threads_nb(type); curt++)
+        pool = &(mcachefs_transfer_pools[type]);
+        memset(pool, 0, sizeof(struct mcachefs_transfer_pool_t));
+        pool->max = mcachefs_config_get_transfer_threads_nb(type);
+        pool->min = mcachefs_config_get_transfer_threads_min(type);
+        pool->limit = pool->max;
+        pool->period_start = now;
+
+        /**
+         * The threads of the uring engine each serve many files, they are all started
+         */
+        if (type == MCACHEFS_TRANSFER_TYPE_BACKUP && mcachefs_config_get_transfer_engine() == MCACHEFS_TRANSFER_ENGINE_URING)
         {
-            mcachefs_transfer_threads[cur].type = type;
-            pthread_create(&thid, &attrs, mcachefs_transfer_thread, &(mcachefs_transfer_threads[cur]));
-            mcachefs_transfer_threads[cur].threadid = thid;
-            Log("Created new thread %lx, cur=%d, type=%d\n", thid, cur, type);
-            cur++;
+            pool->min = pool->max;
+        }
+        for (cur = 0; cur < pool->min; cur++)
+        {
+            mcachefs_transfer_pool_start_thread_locked(type);
         }
     }
+    mcachefs_transfer_unlock();
 }
 
 void
 mcachefs_transfer_stop_threads()
 {
-    int cur, res;
-    pthread_t thid;
+    pthread_t *thids;
+    int cur, nb = 0, live, type, res;
     void *arg;
 
     if (mcachefs_config_get_read_state() != MCACHEFS_STATE_QUITTING)
@@ -172,123 +591,376 @@ mcachefs_transfer_stop_threads()
         Bug("Shall have set state to QUITTING !\n");
     }
 
+    /**
+     * No thread is started once quitting, and waiting threads also check the state when their wait times out.
+     * Threads exiting from now on keep their slot, so the snapshot only holds threads left to join.
+     */
+    thids = (pthread_t *) malloc(sizeof(pthread_t) * (mcachefs_transfer_threads_nb + 1));
+    if (!thids)
+    {
+        Bug("Could not alloc %d thread ids\n", mcachefs_transfer_threads_nb);
+    }
+    mcachefs_transfer_lock();
     for (cur = 0; cur < mcachefs_transfer_threads_nb; cur++)
     {
-
-        thid = mcachefs_transfer_threads[cur].threadid;
-        if (thid == 0)
-        {
-            Err("Invalid thid=0 for cur=%d, type=%d\n", cur, mcachefs_transfer_threads[cur].type);
+        if (mcachefs_transfer_threads[cur].state != MCACHEFS_TRANSFER_THREAD_RUNNING)
             continue;
-        }
         Log("Posting STOP for thid=%lx, type=%d\n", mcachefs_transfer_threads[cur].threadid, mcachefs_transfer_threads[cur].type);
         sem_post(&(mcachefs_transfer_sem[mcachefs_transfer_threads[cur].type]));
+        thids[nb++] = mcachefs_transfer_threads[cur].threadid;
     }
-    for (cur = 0; cur < mcachefs_transfer_threads_nb; cur++)
+    mcachefs_transfer_unlock();
+
+    for (cur = 0; cur < nb; cur++)
     {
-        thid = mcachefs_transfer_threads[cur].threadid;
-        if (thid == 0)
-            continue;
-        Info("Waiting for thread %lx\n", thid);
-        if ((res = pthread_join(thid, &arg)) != 0)
+        Info("Waiting for thread %lx\n", (unsigned long) thids[cur]);
+        if ((res = pthread_join(thids[cur], &arg)) != 0)
+        {
+            Err("Could not join transfer thread %lx : err=%d:%s\n", (unsigned long) thids[cur], res, strerror(res));
+        }
+    }
+    free(thids);
+
+    /**
+     * Threads which detached before quitting may still be on their way out
+     */
+    while (1)
+    {
+        mcachefs_transfer_lock();
+        for (type = 0, live = 0; type < MCACHEFS_TRANSFER_TYPES; type++)
+            live += mcachefs_transfer_pools[type].live;
+        if (live == 0)
         {
-            Err("Could not join transfer thread %lx : err=%d:%s\n", thid, res, strerror(res));
+            for (cur = 0; cur < mcachefs_transfer_threads_nb; cur++)
+                mcachefs_transfer_threads[cur].state = MCACHEFS_TRANSFER_THREAD_FREE;
         }
+        mcachefs_transfer_unlock();
+        if (live == 0)
+            break;
+        Log("Waiting for %d transfer threads to exit\n", live);
+        usleep(10000);
     }
     Info("Transfer threads interrupted.\n");
 }
 
-void *
-mcachefs_transfer_thread(void *arg)
+/**
+ * Take the next file to transfer from the queue, and mark its backup in progress - transfer lock HELD
+ */
+static struct mcachefs_file_t *
+mcachefs_transfer_dequeue_locked(int type, int *stream)
 {
-    struct mcachefs_file_t *mfile = NULL;
-    struct mcachefs_transfer_thread_t *me = (struct mcachefs_transfer_thread_t *) arg;
-    int type = ~0;
+    struct mcachefs_file_t *mfile;
 
-    if (me == NULL)
+    mfile = mcachefs_transfer_get_next_file_to_back_locked(type, stream);
+
+    if (!mfile)
     {
-        Bug("Invalid NULL me !");
+        Bug("Could not locate which file to back !\n");
     }
 
-    type = me->type;
+    Log("Locked Transfer lock. file to transfer '%s', locking...\n", mfile->path);
 
-    Info("Transfer thread %lx (type=%d) up and running.\n", (unsigned long) pthread_self(), type);
+    mcachefs_file_lock_file(mfile);
 
-    while (1)
+    Log("File locked.\n");
+
+    if (mfile->cache_status == MCACHEFS_FILE_BACKING_ASKED)
     {
-        sem_wait(&(mcachefs_transfer_sem[type]));
-        Log("Waking up transfer thread !\n");
+        mfile->cache_status = MCACHEFS_FILE_BACKING_IN_PROGRESS;
+        mcachefs_file_notify_file(mfile);
+    }
+    mcachefs_file_unlock_file(mfile);
+    return mfile;
+}
 
-        if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
-        {
-            Log("Interrupting transfer thread %lx\n", (unsigned long) pthread_self());
-            return NULL;
-        }
+/**
+ * Take a transfer queued for another type than type, if its own threads do not keep up - transfer lock HELD
+ * @return the type of the transfer taken, -1 if none
+ */
+static int
+mcachefs_transfer_steal_locked(int type)
+{
+    int other;
+
+    for (other = 0; other < MCACHEFS_TRANSFER_TYPES; other++)
+    {
+        if (other == type || mcachefs_transfer_queued_locked(other) <= mcachefs_transfer_pools[other].idle)
+            continue;
+        if (sem_trywait(&(mcachefs_transfer_sem[other])) == 0)
+        {
+            mcachefs_transfer_pools[other].stolen++;
+            return other;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Wait for a transfer of the type of the thread, or steal one from another type when none came for a while
+ * @return the type of the transfer to serve, -1 if the thread shall exit
+ */
+static int
+mcachefs_transfer_wait(struct mcachefs_transfer_thread_t *me)
+{
+    struct mcachefs_transfer_pool_t *pool = &(mcachefs_transfer_pools[me->type]);
+    struct timespec deadline;
+    long long idle_since = mcachefs_transfer_now_ms();
+    int res, type;
+
+    while (1)
+    {
+        mcachefs_transfer_lock();
+        pool->idle++;
+        mcachefs_transfer_unlock();
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += mcachefs_transfer_pool_wait / 1000;
+        res = sem_timedwait(&(mcachefs_transfer_sem[me->type]), &deadline);
 
         mcachefs_transfer_lock();
-        mfile = mcachefs_transfer_get_next_file_to_back_locked(type);
+        pool->idle--;
+        type = (res == 0) ? me->type : mcachefs_transfer_steal_locked(me->type);
 
-        if (!mfile)
+        if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
+        {
+            Log("Interrupting transfer thread %lx\n", (unsigned long) pthread_self());
+            if (type >= 0 && type != me->type)
+            {
+                /**
+                 * Give back what was stolen : it may be the stop posted for a thread of that type
+                 */
+                mcachefs_transfer_pools[type].stolen--;
+                sem_post(&(mcachefs_transfer_sem[type]));
+            }
+            pool->live--;
+            mcachefs_transfer_unlock();
+            return -1;
+        }
+        if (type >= 0)
+        {
+            mcachefs_transfer_unlock();
+            return type;
+        }
+        if (mcachefs_transfer_now_ms() - idle_since >= mcachefs_transfer_pool_idle_max && pool->live > pool->min)
         {
-            Bug("Could not locate which file to back !\n");
+            mcachefs_transfer_pool_exit_locked(me);
+            mcachefs_transfer_unlock();
+            return -1;
         }
+        mcachefs_transfer_unlock();
+    }
+}
 
-        Log("Locked Transfer lock. file to transfer '%s', locking...\n", mfile->path);
+void *
+mcachefs_transfer_thread(void *arg)
+{
+    struct mcachefs_file_t *mfile = NULL;
+    struct mcachefs_transfer_thread_t *me = (struct mcachefs_transfer_thread_t *) arg;
+    struct mcachefs_transfer_pool_t *pool;
+    long long started, elapsed;
+    int type = ~0;
+    int stream, quit;
 
-        mcachefs_file_lock_file(mfile);
+    if (me == NULL)
+    {
+        Bug("Invalid NULL me !");
+    }
 
-        Log("File locked.\n");
+    type = me->type;
+    pool = &(mcachefs_transfer_pools[type]);
 
-        if (mfile->cache_status == MCACHEFS_FILE_BACKING_ASKED)
+    Info("Transfer thread %lx (type=%d) up and running.\n", (unsigned long) pthread_self(), type);
+
+#ifdef MCACHEFS_HAVE_URING
+    if (type == MCACHEFS_TRANSFER_TYPE_BACKUP && mcachefs_config_get_transfer_engine() == MCACHEFS_TRANSFER_ENGINE_URING
+        && mcachefs_transfer_uring_thread(me) == 0)
+    {
+        return NULL;
+    }
+#endif
+
+    while (1)
+    {
+        type = mcachefs_transfer_wait(me);
+        if (type < 0)
         {
-            mfile->cache_status = MCACHEFS_FILE_BACKING_IN_PROGRESS;
+            return NULL;
         }
-        mcachefs_file_unlock_file(mfile);
+        Log("Waking up transfer thread !\n");
+
+        mcachefs_transfer_lock();
+        mfile = mcachefs_transfer_dequeue_locked(type, &stream);
         me->currentfile = mfile;
+        me->stream = stream;
+        me->serving = type;
         mcachefs_transfer_unlock();
 
-        Log("Transfer file '%s'\n", mfile->path);
+        Log("Transfer file '%s'%s\n", mfile->path, stream ? " (additional stream)" : "");
+
+        started = mcachefs_transfer_now_ms();
+        mcachefs_transfer_do_transfer(mfile, type, stream);
+        elapsed = mcachefs_transfer_now_ms() - started;
 
-        mcachefs_transfer_do_transfer(mfile, type);
         mcachefs_transfer_lock();
         me->currentfile = NULL;
+        me->stream = 0;
+        me->serving = me->type;
+        mcachefs_transfer_pools[type].latency += (elapsed - mcachefs_transfer_pools[type].latency) / 4;
         mcachefs_transfer_unlock();
         mcachefs_file_release(mfile);
+
+        /**
+         * Threads above the limit of a saturated source leave
+         */
+        mcachefs_transfer_lock();
+        quit = (pool->live > pool->limit && pool->live > pool->min);
+        if (quit)
+        {
+            mcachefs_transfer_pool_exit_locked(me);
+        }
+        mcachefs_transfer_unlock();
+
+        if (quit)
+        {
+            return NULL;
+        }
     }
     return NULL;
 }
 
-int
-mcachefs_transfer_queue_file(struct mcachefs_file_t *mfile, int type)
+static struct mcachefs_transfer_queue_t *
+mcachefs_transfer_queue_alloc_locked()
 {
     struct mcachefs_transfer_queue_t *transfer;
-    mcachefs_transfer_lock();
+    int cur;
 
-    for (transfer = mcachefs_transfer_queue_head; transfer; transfer = transfer->next)
+    if (!mcachefs_transfer_queue_pool)
     {
-        if (transfer->mfile == mfile)
+        transfer = (struct mcachefs_transfer_queue_t *) malloc(sizeof(struct mcachefs_transfer_queue_t) * MCACHEFS_TRANSFER_QUEUE_POOL_BLOCK);
+        if (!transfer)
         {
-            Err("Already asked transfer for file '%s', type=%d\n", mfile->path, type);
-            mcachefs_transfer_unlock();
-            return -EEXIST;
+            Bug("OOM : could not grow transfer queue pool\n");
+        }
+        for (cur = 0; cur < MCACHEFS_TRANSFER_QUEUE_POOL_BLOCK; cur++)
+        {
+            transfer[cur].next = cur + 1 < MCACHEFS_TRANSFER_QUEUE_POOL_BLOCK ? &(transfer[cur + 1]) : NULL;
         }
+        mcachefs_transfer_queue_pool = transfer;
     }
+    transfer = mcachefs_transfer_queue_pool;
+    mcachefs_transfer_queue_pool = transfer->next;
+    return transfer;
+}
+
+static void
+mcachefs_transfer_queue_free_locked(struct mcachefs_transfer_queue_t *transfer)
+{
+    transfer->mfile = NULL;
+    transfer->next = mcachefs_transfer_queue_pool;
+    mcachefs_transfer_queue_pool = transfer;
+}
+
+static long long
+mcachefs_transfer_now_ms()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((long long) now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+static void
+mcachefs_transfer_queue_link_locked(struct mcachefs_transfer_queue_t *transfer)
+{
+    struct mcachefs_transfer_queue_list_t *queue = &(mcachefs_transfer_queues[transfer->type][transfer->priority]);
 
-    transfer = (struct mcachefs_transfer_queue_t *) malloc(sizeof(struct mcachefs_transfer_queue_t));
-    transfer->mfile = mfile;
     transfer->next = NULL;
-    transfer->type = type;
+    transfer->prev = queue->tail;
+    if (queue->tail)
+    {
+        queue->tail->next = transfer;
+    }
+    else
+    {
+        queue->head = transfer;
+    }
+    queue->tail = transfer;
+    queue->nb++;
+}
+
+static void
+mcachefs_transfer_queue_unlink_locked(struct mcachefs_transfer_queue_t *transfer)
+{
+    struct mcachefs_transfer_queue_list_t *queue = &(mcachefs_transfer_queues[transfer->type][transfer->priority]);
 
-    if (mcachefs_transfer_queue_tail)
+    if (transfer->prev)
     {
-        mcachefs_transfer_queue_tail->next = transfer;
-        mcachefs_transfer_queue_tail = transfer;
+        transfer->prev->next = transfer->next;
     }
     else
     {
-        mcachefs_transfer_queue_head = transfer;
-        mcachefs_transfer_queue_tail = transfer;
+        if (queue->head != transfer)
+        {
+            Bug("Head=%p is not transfer=%p, but prev is NULL !", queue->head, transfer);
+        }
+        queue->head = transfer->next;
+    }
+    if (transfer->next)
+    {
+        transfer->next->prev = transfer->prev;
+    }
+    else
+    {
+        if (queue->tail != transfer)
+        {
+            Bug("Tail=%p is not transfer=%p, but next is NULL !", queue->tail, transfer);
+        }
+        queue->tail = transfer->prev;
+    }
+    queue->nb--;
+}
+
+/**
+ * Append a new transfer at the tail of the queue of its type and class - transfer lock HELD
+ */
+static void
+mcachefs_transfer_queue_append_locked(struct mcachefs_file_t *mfile, int type, int priority, int stream)
+{
+    struct mcachefs_transfer_queue_t *transfer;
+
+    transfer = mcachefs_transfer_queue_alloc_locked();
+    transfer->mfile = mfile;
+    transfer->type = type;
+    transfer->priority = priority;
+    transfer->stream = stream;
+    transfer->queued_at = mcachefs_transfer_now_ms();
+
+    mcachefs_transfer_queue_link_locked(transfer);
+    if (!stream)
+    {
+        mfile->queued = transfer;
+    }
+}
+
+int
+mcachefs_transfer_queue_file(struct mcachefs_file_t *mfile, int type, int priority)
+{
+    if (priority < 0 || priority >= MCACHEFS_TRANSFER_PRIORITIES)
+    {
+        Bug("Invalid transfer priority %d for '%s'\n", priority, mfile->path);
+    }
+
+    mcachefs_transfer_lock();
+
+    if (mfile->queued)
+    {
+        Err("Already asked transfer for file '%s', type=%d\n", mfile->path, type);
+        mcachefs_transfer_unlock();
+        return -EEXIST;
     }
+
+    mcachefs_transfer_queue_append_locked(mfile, type, priority, 0);
+    mcachefs_transfer_pool_grow_locked(type, mfile->queued->queued_at);
     mcachefs_transfer_unlock();
 
     Log("USECNT %s => %d\n", mfile->path, mfile->use);
@@ -296,98 +968,257 @@ mcachefs_transfer_queue_file(struct mcachefs_file_t *mfile, int type)
     return 0;
 }
 
-struct mcachefs_file_t *
-mcachefs_transfer_get_next_file_to_back_locked(int type)
+void
+mcachefs_transfer_promote(struct mcachefs_file_t *mfile, int priority)
 {
-    struct mcachefs_file_t *mfile;
-    struct mcachefs_transfer_queue_t *transfer, *last = NULL;
+    struct mcachefs_transfer_queue_t *transfer;
 
-    if (mcachefs_transfer_queue_head == NULL)
+    mcachefs_transfer_lock();
+    transfer = mfile->queued;
+    if (transfer && transfer->priority > priority)
     {
-        Bug("NULL HEAD !\n");
+        Log("Promote transfer of '%s' from %s to %s\n", mfile->path,
+            mcachefs_transfer_priority_names[transfer->priority], mcachefs_transfer_priority_names[priority]);
+        mcachefs_transfer_queue_unlink_locked(transfer);
+        transfer->priority = priority;
+        mcachefs_transfer_queue_link_locked(transfer);
     }
+    mcachefs_transfer_unlock();
+}
+
+int
+mcachefs_transfer_cancel(struct mcachefs_file_t *mfile, int priority)
+{
+    struct mcachefs_transfer_queue_t *transfer;
+
+    mcachefs_transfer_lock();
+    transfer = mfile->queued;
 
-    for (transfer = mcachefs_transfer_queue_head; transfer; transfer = transfer->next)
+    /**
+     * The semaphore must be taken back too : if no count is left, a thread is about to dequeue and needs this transfer
+     */
+    if (!transfer || transfer->type != MCACHEFS_TRANSFER_TYPE_BACKUP || transfer->priority < priority
+        || sem_trywait(&(mcachefs_transfer_sem[MCACHEFS_TRANSFER_TYPE_BACKUP])))
     {
-        if (transfer->type == type)
-            break;
-        last = transfer;
+        mcachefs_transfer_unlock();
+        return -EBUSY;
     }
+    mcachefs_transfer_queue_unlink_locked(transfer);
+    mcachefs_transfer_queue_free_locked(transfer);
+    mfile->queued = NULL;
 
-    if (!transfer)
+    mcachefs_file_lock_file(mfile);
+    if (mfile->cache_status == MCACHEFS_FILE_BACKING_ASKED)
     {
-        Bug("No transfer set for type=%d\n", type);
+        mcachefs_chunks_close(mfile);
+        mfile->cache_status = MCACHEFS_FILE_BACKING_NONE;
+        mcachefs_file_notify_file(mfile);
     }
+    mcachefs_file_unlock_file(mfile);
+    mcachefs_transfer_unlock();
 
+    Log("Cancelled backup of '%s'\n", mfile->path);
 
-    mfile = transfer->mfile;
+    /**
+     * Use taken by mcachefs_transfer_backfile()
+     */
+    mcachefs_file_release(mfile);
+    return 0;
+}
+
+void
+mcachefs_transfer_abandon(struct mcachefs_file_t *mfile)
+{
+    if (mcachefs_transfer_cancel(mfile, MCACHEFS_TRANSFER_PRIORITY_FOREGROUND) == 0)
+    {
+        mcachefs_transfer_abandoned++;
+        return;
+    }
+
+    mcachefs_file_lock_file(mfile);
+    if ((mfile->cache_status == MCACHEFS_FILE_BACKING_ASKED || mfile->cache_status == MCACHEFS_FILE_BACKING_IN_PROGRESS)
+        && !mfile->transfer.cancelled)
+    {
+        Log("Abandoning backup of '%s' at %luk/%luk\n", mfile->path, (unsigned long) mfile->transfer.transfered_size >> 10,
+            (unsigned long) mfile->transfer.total_size >> 10);
+        mfile->transfer.cancelled = 1;
+        mfile->transfer.requeue = -1;
+    }
+    mcachefs_file_unlock_file(mfile);
+}
 
-    Log("[NEXT : %s (type=%d, asked=%d)\n", mfile->path, transfer->type, type);
+void
+mcachefs_transfer_release(struct mcachefs_file_t *mfile)
+{
+    int percent = mcachefs_config_get_abandon_percent();
+    int abandon = 0;
+
+    if (!percent)
+        return;
 
-    if (last)
+    mcachefs_file_lock_file(mfile);
+    if (!mfile->openers && !mfile->dirty)
     {
-        last->next = transfer->next;
-        if (!transfer->next)
+        if (mfile->cache_status == MCACHEFS_FILE_BACKING_ASKED)
         {
-            if (mcachefs_transfer_queue_tail != transfer)
-            {
-                Bug("Tail=%p is not transfer=%p, but next is NULL !", mcachefs_transfer_queue_tail, transfer);
-            }
-            mcachefs_transfer_queue_tail = last;
+            abandon = 1;
+        }
+        else if (mfile->cache_status == MCACHEFS_FILE_BACKING_IN_PROGRESS && mfile->chunks.map)
+        {
+            abandon = (mcachefs_chunks_get_present_size(mfile) * 100 < mfile->transfer.total_size * percent);
         }
     }
-    else
+    mcachefs_file_unlock_file(mfile);
+
+    if (abandon)
+    {
+        mcachefs_transfer_abandon(mfile);
+    }
+}
+
+/**
+ * Queue additional streams for a backup in progress, each one holding its own use of mfile
+ */
+static void
+mcachefs_transfer_queue_streams(struct mcachefs_file_t *mfile, int nb)
+{
+    int cur;
+
+    mcachefs_file_lock();
+    mcachefs_file_lock_file(mfile);
+    mfile->use += nb;
+    mcachefs_file_unlock_file(mfile);
+    mcachefs_file_unlock();
+
+    mcachefs_transfer_lock();
+    for (cur = 0; cur < nb; cur++)
+    {
+        mcachefs_transfer_queue_append_locked(mfile, MCACHEFS_TRANSFER_TYPE_BACKUP, mfile->transfer.priority, 1);
+    }
+    mcachefs_transfer_pool_grow_locked(MCACHEFS_TRANSFER_TYPE_BACKUP, mcachefs_transfer_now_ms());
+    mcachefs_transfer_unlock();
+
+    Log("Queued %d additional streams for '%s'\n", nb, mfile->path);
+    for (cur = 0; cur < nb; cur++)
+    {
+        sem_post(&(mcachefs_transfer_sem[MCACHEFS_TRANSFER_TYPE_BACKUP]));
+    }
+}
+
+/**
+ * Pick the class to serve next : the highest class wins, unless the head of a lower class has waited long enough
+ * to overtake it (one class per aging period). Only heads are considered, as they are the oldest of their class.
+ */
+static int
+mcachefs_transfer_pick_priority_locked(int type, long long now)
+{
+    struct mcachefs_transfer_queue_t *head;
+    long long score, best_score = 0;
+    int priority, best = -1;
+
+    for (priority = 0; priority < MCACHEFS_TRANSFER_PRIORITIES; priority++)
     {
-        mcachefs_transfer_queue_head = transfer->next;
-        if (!transfer->next)
+        head = mcachefs_transfer_queues[type][priority].head;
+        if (!head)
+            continue;
+        score = priority - (now - head->queued_at) / mcachefs_transfer_aging_period;
+        if (best == -1 || score < best_score)
         {
-            if (mcachefs_transfer_queue_tail != transfer)
-            {
-                Bug("Tail=%p is not transfer=%p, but next is NULL !", mcachefs_transfer_queue_tail, transfer);
-            }
-            mcachefs_transfer_queue_tail = NULL;
+            best = priority;
+            best_score = score;
         }
     }
-    free(transfer);
+    return best;
+}
+
+struct mcachefs_file_t *
+mcachefs_transfer_get_next_file_to_back_locked(int type, int *stream)
+{
+    struct mcachefs_transfer_queue_list_t *queue;
+    struct mcachefs_transfer_queue_t *transfer;
+    struct mcachefs_file_t *mfile;
+    long long now = mcachefs_transfer_now_ms(), wait;
+    int priority;
+
+    priority = mcachefs_transfer_pick_priority_locked(type, now);
+    if (priority == -1)
+    {
+        Bug("No transfer set for type=%d\n", type);
+    }
+    queue = &(mcachefs_transfer_queues[type][priority]);
+    transfer = queue->head;
+
+    mcachefs_transfer_queue_unlink_locked(transfer);
+
+    wait = now - transfer->queued_at;
+    queue->dequeued++;
+    queue->wait_total += wait;
+    if (wait > queue->wait_max)
+    {
+        queue->wait_max = wait;
+    }
+
+    mfile = transfer->mfile;
+    *stream = transfer->stream;
+    if (!transfer->stream)
+    {
+        mfile->queued = NULL;
+        mfile->transfer.priority = transfer->priority;
+    }
+
+    Log("[NEXT : %s (type=%d, asked=%d, priority=%s, waited %lldms)\n", mfile->path, transfer->type, type,
+        mcachefs_transfer_priority_names[priority], wait);
+
+    mcachefs_transfer_queue_free_locked(transfer);
 
     return mfile;
 }
 
-void mcachefs_transfer_do_backing(struct mcachefs_file_t *mfile);
+static int mcachefs_transfer_backing_begin(struct mcachefs_file_t *mfile);
+static int mcachefs_transfer_stream_begin(struct mcachefs_file_t *mfile);
+static void mcachefs_transfer_backup_end(struct mcachefs_file_t *mfile, int res);
 
 void mcachefs_transfer_do_writeback(struct mcachefs_file_t *mfile, struct utimbuf *timbuf);
 int mcachefs_transfer_file(struct mcachefs_file_t *mfile, int tobacking);
 
-void
-mcachefs_transfer_do_transfer(struct mcachefs_file_t *mfile, int transfer_type)
+/**
+ * Prepare a transfer taken from the queue
+ * @return 1 if the file shall be copied, 0 if there is nothing (left) to do
+ */
+static int
+mcachefs_transfer_begin(struct mcachefs_file_t *mfile, int transfer_type, int stream, struct utimbuf *timbuf)
 {
     off_t size;
     struct mcachefs_metadata_t *mdata;
-    struct utimbuf timbuf;
 
     if (mcachefs_config_get_read_state() == MCACHEFS_STATE_HANDSUP)
     {
         Err("While backing file for '%s' : mcachefs state set to HANDSUP.\n", mfile->path);
-        return;
+        return 0;
     }
 
     if (mfile->type == mcachefs_file_type_dir)
     {
         Log("Filling entry : '%s'\n", mfile->path);
         mcachefs_metadata_fill_entry(mfile);
-        return;
+        return 0;
+    }
+
+    if (stream)
+    {
+        return mcachefs_transfer_stream_begin(mfile);
     }
 
     mdata = mcachefs_file_get_metadata(mfile);
     if (!mdata)
     {
         Err("Could not get stat for '%s'\n", mfile->path);
-        return;
+        return 0;
     }
 
     size = mdata->st.st_size;
-    timbuf.actime = mdata->st.st_atime;
-    timbuf.modtime = mdata->st.st_mtime;
+    timbuf->actime = mdata->st.st_atime;
+    timbuf->modtime = mdata->st.st_mtime;
 
     mcachefs_metadata_release(mdata);
 
@@ -395,70 +1226,214 @@ mcachefs_transfer_do_transfer(struct mcachefs_file_t *mfile, int transfer_type)
 
     mfile->transfer.tobacking = (transfer_type == MCACHEFS_TRANSFER_TYPE_BACKUP);
     mfile->transfer.total_size = size;
+    mfile->transfer.mtime = timbuf->modtime;
     mfile->transfer.transfered_size = 0;
     mfile->transfer.rate = 0;
     mfile->transfer.total_time = 0;
+    mfile->transfer.copied = 0;
+    gettimeofday(&(mfile->transfer.begin), NULL);
     mcachefs_file_unlock_file(mfile);
 
     if (transfer_type == MCACHEFS_TRANSFER_TYPE_BACKUP)
     {
-        mcachefs_transfer_do_backing(mfile);
+        return mcachefs_transfer_backing_begin(mfile);
     }
     else if (transfer_type == MCACHEFS_TRANSFER_TYPE_WRITEBACK)
     {
-        mcachefs_transfer_do_writeback(mfile, &timbuf);
-    }
-    else
-    {
-        Err("Invalid transfer for path='%s', cache_status=%d, transfer_type=%d\n", mfile->path, mfile->cache_status, transfer_type);
+        return 1;
     }
+    Err("Invalid transfer for path='%s', cache_status=%d, transfer_type=%d\n", mfile->path, mfile->cache_status, transfer_type);
+    return 0;
 }
 
 void
-mcachefs_transfer_do_backing(struct mcachefs_file_t *mfile)
+mcachefs_transfer_do_transfer(struct mcachefs_file_t *mfile, int transfer_type, int stream)
 {
-    char *backingpath;
+    struct utimbuf timbuf;
 
-    if (mcachefs_fileincache(mfile->path))
+    if (!mcachefs_transfer_begin(mfile, transfer_type, stream, &timbuf))
     {
-        Err("File '%s' already in cache !\n", mfile->path);
         return;
     }
-    if (mcachefs_createfile_cache(mfile->path, 0644))
+
+    if (transfer_type == MCACHEFS_TRANSFER_TYPE_BACKUP)
     {
-        Err("Could not create backing path for '%s' !\n", mfile->path);
-        return;
+        mcachefs_transfer_backup_end(mfile, mcachefs_transfer_file(mfile, 1));
     }
+    else
+    {
+        mcachefs_transfer_do_writeback(mfile, &timbuf);
+    }
+}
+
+/**
+ * End of a backup stream : the last stream to end completes the backup, or keeps the partial backing file
+ */
+static void
+mcachefs_transfer_backup_end(struct mcachefs_file_t *mfile, int res)
+{
+    int requeue;
 
-    Log("Create backing file OK, now transfering...\n");
-
-    if (mcachefs_transfer_file(mfile, 1) == 0)
+    mcachefs_file_lock_file(mfile);
+    if (res && !mfile->transfer.error)
+    {
+        mfile->transfer.error = res;
+    }
+    mfile->transfer.streams--;
+    if (mfile->transfer.streams > 0)
+    {
+        Log("Stream ended for '%s', %d streams left\n", mfile->path, mfile->transfer.streams);
+        mcachefs_file_unlock_file(mfile);
+        return;
+    }
+    /**
+     * Once the map is removed, the backing file is trusted complete : its data shall be on disk first
+     */
+    if (!mfile->transfer.error && mcachefs_chunks_complete(mfile))
+    {
+        mfile->transfer.error = mcachefs_chunks_sync(mfile);
+    }
+    if (!mfile->transfer.error && mcachefs_chunks_complete(mfile))
+    {
+        mcachefs_chunks_close(mfile);
+        mcachefs_chunks_remove(mfile->path);
+        mfile->transfer.transfered_size = mfile->transfer.total_size;
+        mfile->transfer.cancelled = 0;
+        mfile->cache_status = MCACHEFS_FILE_BACKING_DONE;
+        mcachefs_file_notify_file(mfile);
+        mcachefs_file_unlock_file(mfile);
+        if (mcachefs_config_get_dedup())
+            mcachefs_dedup_queue(mfile);
+        else
+            mcachefs_compress_queue(mfile);
+        return;
+    }
+    if (mfile->transfer.cancelled)
     {
+        /**
+         * Abandoned : the partial backing file and its chunk map are kept as for an error, but the next open queues
+         * the backup again
+         */
+        Log("Abandoned backup of '%s', keeping %lu/%lu chunks\n", mfile->path, (unsigned long) mfile->chunks.present,
+            (unsigned long) mfile->chunks.nb);
+        mcachefs_transfer_abandoned++;
+        mcachefs_transfer_abandoned_kept += mcachefs_chunks_get_present_size(mfile);
+        mfile->transfer.cancelled = 0;
+        requeue = mfile->transfer.requeue;
+        mfile->cache_status = MCACHEFS_FILE_BACKING_NONE;
+        mcachefs_file_notify_file(mfile);
+        mcachefs_chunks_close(mfile);
+        mcachefs_file_unlock_file(mfile);
+
+        if (requeue >= 0)
+        {
+            mcachefs_transfer_backfile(mfile, requeue);
+        }
         return;
     }
+    if (!mfile->transfer.error)
+    {
+        Err("Backup of '%s' ended with %lu/%lu chunks present !\n", mfile->path,
+            (unsigned long) mfile->chunks.present, (unsigned long) mfile->chunks.nb);
+    }
+    /**
+     * Keep the partial backing file and its chunk map : the next attempt, or the next mount, resumes from there
+     */
+    mfile->cache_status = MCACHEFS_FILE_BACKING_ERROR;
+    mcachefs_file_notify_file(mfile);
+    Err("Could not backup '%s' : err=%d, keeping %lu/%lu chunks for later\n", mfile->path, mfile->transfer.error,
+        (unsigned long) mfile->chunks.present, (unsigned long) mfile->chunks.nb);
+    mcachefs_chunks_close(mfile);
+    mcachefs_file_unlock_file(mfile);
+}
+
+/**
+ * Prepare the backing file and count the first stream in
+ * @return 1 if the file shall be copied, 0 if it is already in cache or could not be prepared
+ */
+static int
+mcachefs_transfer_backing_begin(struct mcachefs_file_t *mfile)
+{
+    struct stat source;
+    int res, streams = 0;
+    off_t missing;
 
-    mcachefs_file_check_unlocked_file(mfile);
+    /**
+     * Stat the source before locking the file, as it may be slow
+     */
+    mcachefs_dedup_stat_source(mfile, &source);
 
     mcachefs_file_lock_file(mfile);
-    mfile->cache_status = MCACHEFS_FILE_BACKING_ERROR;
-    mfile->transfer.transfered_size = 0;
+    mfile->transfer.source = source;
+    if (mcachefs_fileincache(mfile->path))
+    {
+        Err("File '%s' already in cache !\n", mfile->path);
+        mfile->cache_status = MCACHEFS_FILE_BACKING_DONE;
+        mcachefs_file_notify_file(mfile);
+        mcachefs_file_unlock_file(mfile);
+        return 0;
+    }
+    if (!mfile->transfer.cancelled && mcachefs_dedup_link_known(mfile))
+    {
+        mfile->transfer.transfered_size = mfile->transfer.total_size;
+        mfile->cache_status = MCACHEFS_FILE_BACKING_DONE;
+        mcachefs_file_notify_file(mfile);
+        mcachefs_file_unlock_file(mfile);
+        return 0;
+    }
+    mfile->transfer.streams = 1;
+    mfile->transfer.error = 0;
+    if (mfile->transfer.cancelled)
+    {
+        Log("Backup of '%s' abandoned before it started.\n", mfile->path);
+        mcachefs_file_unlock_file(mfile);
+        mcachefs_transfer_backup_end(mfile, 0);
+        return 0;
+    }
+    res = mcachefs_transfer_prepare_backing(mfile, mfile->transfer.total_size, mfile->transfer.mtime);
+    if (res == 0 && mfile->transfer.total_size >= mcachefs_config_get_stream_min_size())
+    {
+        /**
+         * Large files are copied by several streams, each one claiming chunks from the map
+         */
+        streams = mcachefs_config_get_backup_streams() - 1;
+        missing = mfile->chunks.nb - mfile->chunks.present;
+        if (streams > missing - 1)
+            streams = missing > 1 ? missing - 1 : 0;
+    }
     mcachefs_file_unlock_file(mfile);
 
-    Err("Could not backup that file !\n");
-    backingpath = mcachefs_makepath_cache(mfile->path);
-    if (!backingpath)
+    if (res)
     {
-        Err("OOM : Could not allocate backing path.\n");
+        mcachefs_transfer_backup_end(mfile, res);
+        return 0;
     }
-    else
+    if (streams > 0)
     {
-        if (unlink(backingpath))
-        {
-            Err("Could not unlink(%s) : err=%d:%s\n", backingpath, errno, strerror(errno));
-        }
-        free(backingpath);
+        mcachefs_transfer_queue_streams(mfile, streams);
+    }
+    Log("Backing file ready, now transfering...\n");
+    return 1;
+}
+
+/**
+ * Count an additional stream in, only while the first stream of the backup is still running
+ * @return 1 if the stream shall copy chunks, 0 otherwise
+ */
+static int
+mcachefs_transfer_stream_begin(struct mcachefs_file_t *mfile)
+{
+    mcachefs_file_lock_file(mfile);
+    if (!mfile->chunks.map || mfile->cache_status != MCACHEFS_FILE_BACKING_IN_PROGRESS
+        || mfile->transfer.streams == 0 || mfile->transfer.error || mfile->transfer.cancelled)
+    {
+        Log("Backup of '%s' not running anymore, stream not needed.\n", mfile->path);
+        mcachefs_file_unlock_file(mfile);
+        return 0;
     }
-    return;
+    mfile->transfer.streams++;
+    mcachefs_file_unlock_file(mfile);
+    return 1;
 }
 
 void
@@ -509,243 +1484,1514 @@ mcachefs_transfer_do_writeback(struct mcachefs_file_t *mfile, struct utimbuf *ti
     free(realpath);
 }
 
-int
-mcachefs_transfer_file(struct mcachefs_file_t *mfile, int tobacking)
-{
-    int source_fd, target_fd;
-    off_t size = mfile->transfer.total_size;
-    off_t offset, remains, rate, global_rate, adjusted_rate, sendfile_offset;
-    ssize_t tocopy, copied;
-    off_t window_size = mcachefs_transfer_window_size_min;
-    off_t window_size_alloced = window_size;
-    off_t window_size_max = mcachefs_transfer_window_size_max;
-    char *window = NULL;
-    struct timeval now, last, begin_copy, before;
-    time_t interval, copy_interval, global_interval;
-    struct stat source_stat;
-    struct timespec penalty;
+/**
+ * Methods to copy data from source to target, from the cheapest to the most portable one.
+ * The method which works, and the last window size, are remembered for each pair of source and target devices.
+ */
+#define MCACHEFS_TRANSFER_METHOD_COPY_RANGE 0
+#define MCACHEFS_TRANSFER_METHOD_SPLICE     1
+#define MCACHEFS_TRANSFER_METHOD_READWRITE  2
 
-    Log("Acquiring fd...\n");
+static const char *mcachefs_transfer_method_names[] = { "copy_file_range", "splice", "read/write", NULL };
 
-    source_fd = mcachefs_file_getfd(mfile, tobacking ? 1 : 0, O_RDONLY);
+#define MCACHEFS_TRANSFER_METHODS_MAX 32
 
-    Log("Got source_fd=%d\n", source_fd);
+struct mcachefs_transfer_method_t
+{
+    dev_t source;
+    dev_t target;
+    int method;
+    struct mcachefs_window_t window;
+};
 
-    if (source_fd < 0)
+static struct mcachefs_transfer_method_t mcachefs_transfer_methods[MCACHEFS_TRANSFER_METHODS_MAX];
+static int mcachefs_transfer_methods_nb = 0;
+
+/**
+ * Find the entry of a pair of devices, creating it when create is set - transfer lock HELD
+ * @return the entry, NULL if not found or if the table is full
+ */
+static struct mcachefs_transfer_method_t *
+mcachefs_transfer_lookup_method_locked(dev_t source, dev_t target, int create)
+{
+    struct mcachefs_transfer_method_t *entry;
+    int cur;
+
+    for (cur = 0; cur < mcachefs_transfer_methods_nb; cur++)
     {
-        Err("Could not get source_fd !\n");
-        return -EIO;
+        if (mcachefs_transfer_methods[cur].source == source && mcachefs_transfer_methods[cur].target == target)
+            return &(mcachefs_transfer_methods[cur]);
     }
+    if (!create || cur == MCACHEFS_TRANSFER_METHODS_MAX)
+        return NULL;
+
+    entry = &(mcachefs_transfer_methods[mcachefs_transfer_methods_nb++]);
+    entry->source = source;
+    entry->target = target;
+    entry->method = MCACHEFS_TRANSFER_METHOD_COPY_RANGE;
+    mcachefs_window_init(&(entry->window));
+    return entry;
+}
+
+/**
+ * Get the method to use between two devices - transfer lock NOT HELD
+ */
+static int
+mcachefs_transfer_get_method(dev_t source, dev_t target)
+{
+    struct mcachefs_transfer_method_t *entry;
+    int method = MCACHEFS_TRANSFER_METHOD_COPY_RANGE;
 
-    target_fd = mcachefs_file_getfd(mfile, tobacking ? 0 : 1, O_RDWR);
+    mcachefs_transfer_lock();
+    entry = mcachefs_transfer_lookup_method_locked(source, target, 0);
+    if (entry)
+        method = entry->method;
+    mcachefs_transfer_unlock();
+    return method;
+}
 
-    Log("Got target_fd=%d\n", target_fd);
+/**
+ * Remember the method to use between two devices - transfer lock NOT HELD
+ */
+static void
+mcachefs_transfer_set_method(dev_t source, dev_t target, int method)
+{
+    struct mcachefs_transfer_method_t *entry;
 
-    if (target_fd < 0)
+    mcachefs_transfer_lock();
+    entry = mcachefs_transfer_lookup_method_locked(source, target, 1);
+    if (!entry)
     {
-        Err("Could not get target_fd !\n");
-        mcachefs_file_putfd(mfile, tobacking ? 1 : 0);
-        return -EIO;
+        Err("Too many device pairs, will not remember method %s\n", mcachefs_transfer_method_names[method]);
     }
-
-    if (fstat(source_fd, &source_stat))
+    else if (entry->method < method)
     {
-        Bug("Could not get source stat !\n");
+        entry->method = method;
     }
+    mcachefs_transfer_unlock();
+    Info("Copying from device %lx to device %lx with %s\n", (unsigned long) source, (unsigned long) target,
+         mcachefs_transfer_method_names[method]);
+}
+
+/**
+ * Get the last window used between two devices, the smallest one if none - transfer lock NOT HELD
+ */
+static void
+mcachefs_transfer_get_window(dev_t source, dev_t target, struct mcachefs_window_t *window)
+{
+    struct mcachefs_transfer_method_t *entry;
+
+    mcachefs_transfer_lock();
+    entry = mcachefs_transfer_lookup_method_locked(source, target, 0);
+    if (entry)
+        *window = entry->window;
+    else
+        mcachefs_window_init(window);
+    mcachefs_transfer_unlock();
+}
+
+/**
+ * Remember the window reached by a transfer between two devices, to start the next one from it - transfer lock NOT HELD
+ */
+static void
+mcachefs_transfer_set_window(dev_t source, dev_t target, struct mcachefs_window_t *window)
+{
+    struct mcachefs_transfer_method_t *entry;
+
+    mcachefs_transfer_lock();
+    entry = mcachefs_transfer_lookup_method_locked(source, target, 1);
+    if (entry)
+        entry->window = *window;
+    mcachefs_transfer_unlock();
+}
+
+/**
+ * Copy window, shared by all the ranges copied for a given transfer
+ */
+struct mcachefs_transfer_window_t
+{
+    struct mcachefs_window_t control;   //< Size of the next copies, see mcachefs-window.h
+    off_t alloced;
+    char *buffer;               //< Used by read/write copies, grown up to the window size
+    struct timeval begin;
+    off_t copied;
+    int method;                 //< Copy method, -1 until the first copy
+    dev_t source_dev;
+    dev_t target_dev;
+    int seeded;                 //< Control has been seeded from the devices, and shall be saved back for them
+    int pipe[2];                //< Pipe used by splice(), opened on first use
+};
 
-    if (source_stat.st_size != size)
+static int
+mcachefs_transfer_window_init(struct mcachefs_transfer_window_t *window)
+{
+    mcachefs_window_init(&(window->control));
+    window->alloced = window->control.size;
+    window->buffer = (char *) malloc(window->alloced);
+    window->copied = 0;
+    window->method = -1;
+    window->seeded = 0;
+    window->pipe[0] = -1;
+    window->pipe[1] = -1;
+    gettimeofday(&(window->begin), NULL);
+    if (window->buffer == NULL)
     {
-      /**
-       * This situation can be normal at backup, when we already performed a truncate() on that file :
-       * this changed metadata, but not the real file yet (waiting for apply)
-       */
-        Err("Diverging sizes for %s : source size=%lu, asked size=%lu\n", mfile->path, (unsigned long) source_stat.st_size, (unsigned long) size);
-        size = size < source_stat.st_size ? size : source_stat.st_size;
-        Err("Corrected size to %lu\n", (unsigned long) size);
+        Err("OOM : could not allocate window of size=%lu\n", (unsigned long) window->alloced);
+        return -ENOMEM;
     }
-#ifdef __MCACHEFS_TRANSFER_DO_FTRUNCATE_TARGET
-    if (ftruncate(target_fd, size) < 0)
+    return 0;
+}
+
+static void
+mcachefs_transfer_window_close_pipe(struct mcachefs_transfer_window_t *window)
+{
+    if (window->pipe[0] == -1)
+        return;
+    close(window->pipe[0]);
+    close(window->pipe[1]);
+    window->pipe[0] = -1;
+    window->pipe[1] = -1;
+}
+
+static void
+mcachefs_transfer_window_free(struct mcachefs_transfer_window_t *window)
+{
+    if (window->seeded)
     {
-        Err("Transfer : couldn't allocate space for transfer of data for '%s' (fd=%d) : err=%d:%s\n", mfile->path, target_fd, errno, strerror(errno));
-        goto copyerr;
+        mcachefs_transfer_set_window(window->source_dev, window->target_dev, &(window->control));
     }
-#endif
-    gettimeofday(&last, NULL);
-    begin_copy = last;
+    mcachefs_transfer_window_close_pipe(window);
+    free(window->buffer);
+    window->buffer = NULL;
+}
 
-    remains = size;
-    offset = 0;
+/**
+ * Errors telling that a copy method can not be used between two files
+ */
+static int
+mcachefs_transfer_method_error(int err)
+{
+    if (err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == EBADF)
+        return -EOPNOTSUPP;
+    return -err;
+}
 
-    window = (char *) malloc(window_size_alloced);
+static int
+mcachefs_transfer_copy_window_copy_range(int source_fd, int target_fd, off_t offset, off_t tocopy)
+{
+    loff_t off_in = offset, off_out = offset;
+    ssize_t res;
 
-    while (1)
+    while (tocopy)
     {
-        if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
+        res = copy_file_range(source_fd, &off_in, target_fd, &off_out, tocopy, 0);
+        if (res < 0)
+            return mcachefs_transfer_method_error(errno);
+        if (res == 0)
         {
-            Err("Interrupting transfer !\n");
-            goto copyerr;
+            Err("Could not copy_file_range !! : source ended %lu bytes early\n", (unsigned long) tocopy);
+            return -EIO;
         }
+        tocopy -= res;
+    }
+    return 0;
+}
 
-        gettimeofday(&before, NULL);
-
-        tocopy = remains > window_size ? window_size : remains;
+static int
+mcachefs_transfer_copy_window_splice(struct mcachefs_transfer_window_t *window, int source_fd, int target_fd,
+                                     off_t offset, off_t tocopy)
+{
+    loff_t off_in = offset, off_out = offset;
+    ssize_t res, inpipe;
+    int err;
 
-        if (0)
+    if (window->pipe[0] == -1 && pipe(window->pipe))
+    {
+        window->pipe[0] = -1;
+        window->pipe[1] = -1;
+        return mcachefs_transfer_method_error(errno);
+    }
+    while (tocopy)
+    {
+        res = splice(source_fd, &off_in, window->pipe[1], NULL, tocopy, SPLICE_F_MOVE);
+        if (res <= 0)
         {
-            /*
-             * Do not even try to use sendfile() for the moment
-             */
-            sendfile_offset = offset;
-            copied = sendfile(target_fd, source_fd, &sendfile_offset, tocopy);
-            if (copied == -1)
-            {
-                Err("Could not copy ! err=%d:%s\n", errno, strerror(errno));
-                goto copyerr;
-            }
-            if (copied != tocopy)
-            {
-                Err("Could not write !! : copied=%ld tocopy=%ld, err=%d:%s\n", (unsigned long) copied, (unsigned long) tocopy, errno, strerror(errno));
-                goto copyerr;
-            }
+            err = res < 0 ? mcachefs_transfer_method_error(errno) : -EIO;
+            goto reset;
         }
-        else
+        tocopy -= res;
+        for (inpipe = res; inpipe; inpipe -= res)
         {
-            Log("tocopy=%ld\n", (unsigned long) tocopy);
-            copied = pread(source_fd, window, tocopy, offset);
-            if (tocopy != copied)
-            {
-                Err("Could not read !! : copied=%ld tocopy=%ld, err=%d:%s\n", (unsigned long) copied, (unsigned long) tocopy, errno, strerror(errno));
-                goto copyerr;
-            }
-            if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
+            res = splice(window->pipe[0], NULL, target_fd, &off_out, inpipe, SPLICE_F_MOVE);
+            if (res <= 0)
             {
-                Err("Interrupting copy of '%s'\n", mfile->path);
-                goto copyerr;
+                err = res < 0 ? mcachefs_transfer_method_error(errno) : -EIO;
+                goto reset;
             }
+        }
+    }
+    return 0;
 
-            copied = pwrite(target_fd, window, tocopy, offset);
-            if (tocopy != copied)
-            {
-                Err("Could not write !! : copied=%ld tocopy=%ld, err=%d:%s\n", (unsigned long) copied, (unsigned long) tocopy, errno, strerror(errno));
-                goto copyerr;
-            }
+  reset:
+    /**
+     * Drop whatever is left in the pipe, the whole window will be copied again
+     */
+    mcachefs_transfer_window_close_pipe(window);
+    return err;
+}
 
-        }
+static int
+mcachefs_transfer_copy_window_readwrite(struct mcachefs_transfer_window_t *window, int source_fd, int target_fd,
+                                        off_t offset, off_t tocopy)
+{
+    ssize_t copied;
+    char *buffer;
 
-        if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
+    if (window->alloced < tocopy)
+    {
+        buffer = (char *) realloc(window->buffer, tocopy);
+        if (buffer == NULL)
         {
-            Err("Interrupting copy of '%s'\n", mfile->path);
-            goto copyerr;
+            Err("OOM : could not realloc window up to size=%lu\n", (unsigned long) tocopy);
+            return -ENOMEM;
         }
+        window->buffer = buffer;
+        window->alloced = tocopy;
+    }
 
-        offset += copied;
-        remains -= copied;
+    copied = pread(source_fd, window->buffer, tocopy, offset);
+    if (tocopy != copied)
+    {
+        Err("Could not read !! : copied=%ld tocopy=%ld, err=%d:%s\n", (unsigned long) copied, (unsigned long) tocopy, errno, strerror(errno));
+        return -EIO;
+    }
+    copied = pwrite(target_fd, window->buffer, tocopy, offset);
+    if (tocopy != copied)
+    {
+        Err("Could not write !! : copied=%ld tocopy=%ld, err=%d:%s\n", (unsigned long) copied, (unsigned long) tocopy, errno, strerror(errno));
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * Copy one window worth of data, falling back to the next method when the current one is not supported
+ */
+static int
+mcachefs_transfer_copy_window(struct mcachefs_transfer_window_t *window, int source_fd, int target_fd,
+                              off_t offset, off_t tocopy)
+{
+    struct stat source_stat, target_stat;
+    int res;
+
+    if (window->method == -1)
+    {
+        if (fstat(source_fd, &source_stat) || fstat(target_fd, &target_stat))
+        {
+            Err("Could not stat transfer fds : err=%d:%s\n", errno, strerror(errno));
+            window->method = MCACHEFS_TRANSFER_METHOD_READWRITE;
+        }
+        else
+        {
+            window->source_dev = source_stat.st_dev;
+            window->target_dev = target_stat.st_dev;
+            window->method = mcachefs_transfer_get_method(window->source_dev, window->target_dev);
+            mcachefs_transfer_get_window(window->source_dev, window->target_dev, &(window->control));
+            window->seeded = 1;
+        }
+    }
 
-        if (!remains)
+    while (1)
+    {
+        switch (window->method)
+        {
+        case MCACHEFS_TRANSFER_METHOD_COPY_RANGE:
+            res = mcachefs_transfer_copy_window_copy_range(source_fd, target_fd, offset, tocopy);
             break;
+        case MCACHEFS_TRANSFER_METHOD_SPLICE:
+            res = mcachefs_transfer_copy_window_splice(window, source_fd, target_fd, offset, tocopy);
+            break;
+        default:
+            return mcachefs_transfer_copy_window_readwrite(window, source_fd, target_fd, offset, tocopy);
+        }
+        if (res != -EOPNOTSUPP)
+            return res;
 
-        gettimeofday(&now, NULL);
-        interval = TIME_DIFF(now, last);
-        global_interval = TIME_DIFF(now, begin_copy);
+        Log("Method %s not supported, falling back\n", mcachefs_transfer_method_names[window->method]);
+        window->method++;
+        mcachefs_transfer_set_method(window->source_dev, window->target_dev, window->method);
+    }
+}
 
-        last = now;
-        rate = (copied * 1000) / interval;
-        global_rate = (offset * 1000) / global_interval;
+/**
+ * Account copied bytes in the statistics of the file, which are shared by all the streams copying it - mfile lock HELD
+ */
+static void
+mcachefs_transfer_account_locked(struct mcachefs_file_t *mfile, off_t copied, struct timeval *now)
+{
+    mfile->transfer.copied += copied;
+    mfile->transfer.total_time = TIME_DIFF((*now), mfile->transfer.begin);
+    mfile->transfer.rate = mfile->transfer.total_time ? (mfile->transfer.copied * 1000) / mfile->transfer.total_time : 0;
+}
 
-        adjusted_rate = (global_rate + rate) / 2;
+/**
+ * Copy a range from source_fd to target_fd
+ * When background is set, the copy is throttled by the rate limiter of its direction and updates transfer statistics of mfile.
+ */
+static int
+mcachefs_transfer_copy_range(struct mcachefs_file_t *mfile, int source_fd, int target_fd, off_t offset, off_t size,
+                             struct mcachefs_transfer_window_t *window, int background)
+{
+    off_t remains = size;
+    ssize_t tocopy, copied;
+    struct timeval now;
+    struct timespec begin, end;
+    long long elapsed;
+    int res;
 
-        if (mcachefs_config_get_transfer_max_rate() && adjusted_rate >= mcachefs_config_get_transfer_max_rate())
+    while (remains)
+    {
+        if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
         {
-          /**
-           * rate = max kb/s
-           * window_size / rate = time that should have been spent copying
-           * interval = time spent to copy window_size worth of data
-           * ( window_size / max rate ) - interval
-           */
-            copy_interval = TIME_DIFF(now, before);
-
-            penalty.tv_sec = 0;
-            Log("window_size=%lu, max_rate=%lu\n", (unsigned long) window_size, (unsigned long) mcachefs_config_get_transfer_max_rate());
-            penalty.tv_nsec = ((window_size << 20) / mcachefs_config_get_transfer_max_rate());
-            Log("penalty raw=%ldns, copy_interval=%ldns\n", penalty.tv_nsec, (long) copy_interval << 10);
-            if (penalty.tv_nsec > (copy_interval << 10))
-                penalty.tv_nsec -= (copy_interval << 10);
-            if (penalty.tv_nsec > 900000000)
-                penalty.tv_nsec = 900000000;
-            Log("penalty : %lu\n", (unsigned long) penalty.tv_nsec);
-            nanosleep(&penalty, NULL);
+            Err("Interrupting transfer !\n");
+            return -EINTR;
         }
 
-        Log("Transfered %luk of %luk (%lu%%), rate current=%lukb/s, global=%lukb/s, adjusted=%lukb/s, window size=%lu\n", ((unsigned long) offset) >> 10,
-            ((unsigned long) size) >> 10, (unsigned long) (offset * 100 / size), (unsigned long) rate, (unsigned long) global_rate,
-            (unsigned long) adjusted_rate, (unsigned long) window_size);
+        tocopy = remains > window->control.size ? window->control.size : remains;
 
-        if (global_rate < 10 && window_size > 1 << 12)
+        if (background
+            && mcachefs_ratelimit_consume(mfile->transfer.tobacking ? MCACHEFS_TRANSFER_TYPE_BACKUP : MCACHEFS_TRANSFER_TYPE_WRITEBACK, tocopy))
         {
-            window_size = window_size / 2;
-            Log("Reducing window size to %lu, interval=%lu\n", (unsigned long) window_size, (unsigned long) interval);
+            Err("Interrupting transfer !\n");
+            return -EINTR;
         }
-        else if (global_rate > 100 && window_size < window_size_max)
+
+        Log("tocopy=%ld\n", (unsigned long) tocopy);
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if ((res = mcachefs_transfer_copy_window(window, source_fd, target_fd, offset, tocopy)) != 0)
         {
-            window_size = window_size * 2;
-            Log("Augmenting window size to %lu, interval=%lu\n", (unsigned long) window_size, (unsigned long) interval);
-            if (window_size_alloced < window_size)
-            {
-                window = (char *) realloc(window, window_size);
-                if (window == NULL)
-                {
-                    Err("OOM : could not realloc window up to size=%lu\n", (unsigned long) window_size);
-                    goto copyerr;
-                }
-                window_size_alloced = window_size;
-            }
+            Err("Could not copy %lu bytes at %lu of '%s' : err=%d:%s\n", (unsigned long) tocopy, (unsigned long) offset,
+                mfile->path, -res, strerror(-res));
+            return res;
         }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        copied = tocopy;
+
+        offset += copied;
+        remains -= copied;
+        window->copied += copied;
+
+        elapsed = ((long long) (end.tv_sec - begin.tv_sec)) * 1000000000LL + (end.tv_nsec - begin.tv_nsec);
+        mcachefs_window_update(&(window->control), copied, elapsed);
+
+        Log("Transfered %luk at offset %luk in %lldus, window size=%luk\n", ((unsigned long) window->copied) >> 10,
+            ((unsigned long) offset) >> 10, elapsed / 1000, (unsigned long) window->control.size >> 10);
+
+        gettimeofday(&now, NULL);
+
+        if (!background)
+            continue;
 
         Log("Locking file '%s' to update stats\n", mfile->path);
         mcachefs_file_lock_file(mfile);
         Log("Locked file.\n");
-        mfile->transfer.transfered_size = offset;
-        mfile->transfer.rate = adjusted_rate;
-        mfile->transfer.total_time = global_interval;
+        if (!mfile->transfer.tobacking)
+            mfile->transfer.transfered_size += copied;
+        mcachefs_transfer_account_locked(mfile, copied, &now);
+        res = (mfile->transfer.tobacking && mfile->transfer.cancelled) ? -ECANCELED : 0;
         mcachefs_file_unlock_file(mfile);
         Log("Released file for stats update\n");
+        if (res)
+        {
+            Log("Backup of '%s' abandoned at %luk\n", mfile->path, (unsigned long) offset >> 10);
+            return res;
+        }
     }
+    return 0;
+}
 
-    free(window);
-    window = NULL;
+/**
+ * Leave a hole of the source in the target - punched when punch is set, as the target may hold older data there
+ * @return 0, -EOPNOTSUPP when the hole can not be punched and shall be copied instead
+ */
+static int
+mcachefs_transfer_skip_hole(struct mcachefs_file_t *mfile, int target_fd, off_t offset, off_t size, int background, int punch)
+{
+    if (punch)
+    {
+#ifdef FALLOC_FL_PUNCH_HOLE
+        if (fallocate(target_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size))
+            return mcachefs_transfer_method_error(errno);
+#else
+        return -EOPNOTSUPP;
+#endif
+    }
+
+    Log("Skipped hole of '%s' : offset=%luk, length=%luk\n", mfile->path, (unsigned long) offset >> 10, (unsigned long) size >> 10);
+
+    if (background && !mfile->transfer.tobacking)
+    {
+        mcachefs_file_lock_file(mfile);
+        mfile->transfer.transfered_size += size;
+        mcachefs_file_unlock_file(mfile);
+    }
+    return 0;
+}
+
+/**
+ * Copy a range from source_fd to target_fd, only copying the data extents of the source found with SEEK_DATA and SEEK_HOLE
+ * Holes are skipped (or punched, see mcachefs_transfer_skip_hole()), the whole range is copied when the source can not be probed.
+ */
+static int
+mcachefs_transfer_copy_sparse(struct mcachefs_file_t *mfile, int source_fd, int target_fd, off_t offset, off_t size,
+                              struct mcachefs_transfer_window_t *window, int background, int punch)
+{
+#ifdef SEEK_DATA
+    off_t end = offset + size, data, hole;
+    int res;
+
+    while (offset < end)
+    {
+        data = lseek(source_fd, offset, SEEK_DATA);
+        if (data < 0 && errno != ENXIO)
+        {
+            Log("Could not probe holes of '%s' : err=%d:%s\n", mfile->path, errno, strerror(errno));
+            return mcachefs_transfer_copy_range(mfile, source_fd, target_fd, offset, end - offset, window, background);
+        }
+        if (data < 0 || data > end)
+        {
+            /**
+             * No data up to the end of the range
+             */
+            data = end;
+        }
+        if (data > offset)
+        {
+            res = mcachefs_transfer_skip_hole(mfile, target_fd, offset, data - offset, background, punch);
+            if (res == -EOPNOTSUPP)
+                res = mcachefs_transfer_copy_range(mfile, source_fd, target_fd, offset, data - offset, window, background);
+            if (res)
+                return res;
+            offset = data;
+            if (offset == end)
+                break;
+        }
+
+        hole = lseek(source_fd, offset, SEEK_HOLE);
+        if (hole < 0 || hole > end)
+            hole = end;
+        if ((res = mcachefs_transfer_copy_range(mfile, source_fd, target_fd, offset, hole - offset, window, background)) != 0)
+            return res;
+        offset = hole;
+    }
+    return 0;
+#else
+    return mcachefs_transfer_copy_range(mfile, source_fd, target_fd, offset, size, window, background);
+#endif
+}
+
+/**
+ * Record the signatures of a range just copied from the target, for the delta writeback of large files
+ */
+static void
+mcachefs_transfer_sign_range(struct mcachefs_file_t *mfile, int backing_fd, off_t offset, off_t length, off_t size)
+{
+    off_t delta_min_size = mcachefs_config_get_delta_min_size();
+    int fd;
+
+    if (!delta_min_size || size < delta_min_size)
+        return;
+
+    fd = mcachefs_signatures_open(mfile->path, 1);
+    if (fd < 0)
+        return;
+    mcachefs_signatures_record(fd, backing_fd, offset, length, size);
+    close(fd);
+}
+
+/**
+ * Fill the missing chunks of the backing file : urgent ranges first, then sequentially
+ * Chunks are claimed one at a time, so that several streams can run on the same file.
+ */
+static int
+mcachefs_transfer_backup_chunks(struct mcachefs_file_t *mfile, int source_fd, int target_fd, off_t size,
+                                struct mcachefs_transfer_window_t *window)
+{
+    off_t chunk, offset, length;
+    int res;
+
+    while (1)
+    {
+        mcachefs_file_lock_file(mfile);
+        if (mfile->transfer.error || mfile->transfer.cancelled)
+        {
+            Log("Backup of '%s' failed in another stream or abandoned, stopping.\n", mfile->path);
+            mcachefs_file_unlock_file(mfile);
+            return 0;
+        }
+        chunk = mcachefs_chunks_claim(mfile);
+        if (chunk == -1)
+        {
+            mcachefs_file_unlock_file(mfile);
+            return 0;
+        }
+        mcachefs_chunks_get_range(mfile, chunk, &offset, &length);
+        mcachefs_file_unlock_file(mfile);
+
+        if (offset + length > size)
+        {
+            length = offset < size ? size - offset : 0;
+        }
+
+        if ((res = mcachefs_transfer_copy_sparse(mfile, source_fd, target_fd, offset, length, window, 1, 0)) != 0)
+        {
+            mcachefs_file_lock_file(mfile);
+            mcachefs_chunks_unclaim(mfile, chunk);
+            mcachefs_file_unlock_file(mfile);
+            return res == -ECANCELED ? 0 : res;
+        }
+        mcachefs_transfer_sign_range(mfile, target_fd, offset, length, size);
+
+        mcachefs_file_lock_file(mfile);
+        mcachefs_chunks_set_present(mfile, chunk);
+        mcachefs_chunks_unclaim(mfile, chunk);
+        mfile->transfer.transfered_size = mcachefs_chunks_get_present_size(mfile);
+        mcachefs_file_unlock_file(mfile);
+    }
+}
+
+int
+mcachefs_transfer_fetch_range(struct mcachefs_file_t *mfile, off_t offset, size_t size)
+{
+    int source_fd, target_fd, res = 0;
+    off_t chunk, last, chunk_offset, chunk_length, file_size;
+    struct mcachefs_transfer_window_t window;
+
+    source_fd = mcachefs_file_getfd(mfile, 1, O_RDONLY);
+    if (source_fd < 0)
+    {
+        Err("Could not get source_fd !\n");
+        return -EIO;
+    }
+    target_fd = mcachefs_file_getfd(mfile, 0, O_RDWR);
+    if (target_fd < 0)
+    {
+        Err("Could not get target_fd !\n");
+        mcachefs_file_putfd(mfile, MCACHEFS_FILE_SOURCE_REAL);
+        return -EIO;
+    }
+    if ((res = mcachefs_transfer_window_init(&window)) != 0)
+    {
+        goto end;
+    }
+
+    mcachefs_file_lock_file(mfile);
+    if (!mfile->chunks.map || size == 0)
+    {
+        mcachefs_file_unlock_file(mfile);
+        goto end;
+    }
+    chunk = offset / mfile->chunks.chunk_size;
+    last = (offset + (off_t) size - 1) / mfile->chunks.chunk_size;
+    if (last >= mfile->chunks.nb)
+        last = mfile->chunks.nb - 1;
+    mcachefs_file_unlock_file(mfile);
+
+    for (; chunk <= last; chunk++)
+    {
+        mcachefs_file_lock_file(mfile);
+        if (!mfile->chunks.map)
+        {
+            /**
+             * Backup has been completed meanwhile
+             */
+            mcachefs_file_unlock_file(mfile);
+            break;
+        }
+        if (mcachefs_chunks_is_present(mfile, chunk))
+        {
+            mcachefs_file_unlock_file(mfile);
+            continue;
+        }
+        mcachefs_chunks_get_range(mfile, chunk, &chunk_offset, &chunk_length);
+        file_size = mfile->chunks.size;
+        mcachefs_file_unlock_file(mfile);
+
+        Log("Fetching chunk %lu of '%s' : offset=%luk, length=%luk\n", (unsigned long) chunk, mfile->path,
+            (unsigned long) chunk_offset >> 10, (unsigned long) chunk_length >> 10);
+
+        if ((res = mcachefs_transfer_copy_sparse(mfile, source_fd, target_fd, chunk_offset, chunk_length, &window, 0, 0)) != 0)
+        {
+            break;
+        }
+        mcachefs_transfer_sign_range(mfile, target_fd, chunk_offset, chunk_length, file_size);
+
+        mcachefs_file_lock_file(mfile);
+        if (mfile->chunks.map)
+        {
+            mcachefs_chunks_set_present(mfile, chunk);
+            mfile->transfer.transfered_size = mcachefs_chunks_get_present_size(mfile);
+        }
+        mcachefs_file_unlock_file(mfile);
+    }
+
+  end:
+    mcachefs_transfer_window_free(&window);
+    mcachefs_file_putfd(mfile, MCACHEFS_FILE_SOURCE_REAL);
+    mcachefs_file_putfd(mfile, MCACHEFS_FILE_SOURCE_BACKING);
+    return res;
+}
+
+/**
+ * Write back a range block by block, only writing the blocks whose signature differs from the one recorded for the target
+ * Only the backing file is read : the signatures of the target are the ones recorded when its data came in,
+ * updated for each block written back. Blocks without signature are always written.
+ * Blocks are aligned on offsets, as writes to the cache do not move data within the file.
+ */
+static int
+mcachefs_transfer_delta_range(struct mcachefs_file_t *mfile, int source_fd, int target_fd, int signatures_fd,
+                              off_t offset, off_t size, off_t file_size)
+{
+    off_t block, end, compared = 0, saved = 0;
+    ssize_t tocopy, source_read;
+    unsigned long long signature;
+    char *source_block;
+    struct timeval now;
+    int res = 0;
+
+    /**
+     * Signatures cover whole blocks : extend the range to the blocks it touches
+     */
+    block = offset / MCACHEFS_SIGNATURES_BLOCK_SIZE;
+    end = offset + size;
+    offset = block * MCACHEFS_SIGNATURES_BLOCK_SIZE;
+    if (end > file_size)
+        end = file_size;
+
+    source_block = (char *) malloc(MCACHEFS_SIGNATURES_BLOCK_SIZE);
+    if (source_block == NULL)
+    {
+        Err("OOM : could not allocate delta block\n");
+        return -ENOMEM;
+    }
+
+    for (; offset < end; offset += tocopy, block++)
+    {
+        if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
+        {
+            Err("Interrupting transfer !\n");
+            res = -EINTR;
+            break;
+        }
+
+        tocopy = file_size - offset > MCACHEFS_SIGNATURES_BLOCK_SIZE ? MCACHEFS_SIGNATURES_BLOCK_SIZE : file_size - offset;
+
+        source_read = pread(source_fd, source_block, tocopy, offset);
+        if (source_read != tocopy)
+        {
+            Err("Could not read !! : read=%ld tocopy=%ld, err=%d:%s\n", (long) source_read, (long) tocopy, errno, strerror(errno));
+            res = -EIO;
+            break;
+        }
+        signature = mcachefs_signatures_compute(source_block, tocopy);
+
+        if (signatures_fd >= 0 && mcachefs_signatures_get(signatures_fd, block) == signature)
+        {
+            saved += tocopy;
+        }
+        else
+        {
+            if (mcachefs_ratelimit_consume(MCACHEFS_TRANSFER_TYPE_WRITEBACK, tocopy))
+            {
+                Err("Interrupting transfer !\n");
+                res = -EINTR;
+                break;
+            }
+            if (pwrite(target_fd, source_block, tocopy, offset) != tocopy)
+            {
+                Err("Could not write !! : tocopy=%ld, err=%d:%s\n", (long) tocopy, errno, strerror(errno));
+                res = -EIO;
+                break;
+            }
+            if (signatures_fd >= 0)
+                mcachefs_signatures_set(signatures_fd, block, signature);
+        }
+        compared += tocopy;
+
+        gettimeofday(&now, NULL);
+        mcachefs_file_lock_file(mfile);
+        mfile->transfer.transfered_size += tocopy;
+        mcachefs_transfer_account_locked(mfile, tocopy, &now);
+        mcachefs_file_unlock_file(mfile);
+    }
+    free(source_block);
+
+    Log("Delta writeback of '%s' : compared %lu bytes, %lu unchanged\n", mfile->path,
+        (unsigned long) compared, (unsigned long) saved);
+
+    mcachefs_transfer_lock();
+    mcachefs_transfer_delta_compared += compared;
+    mcachefs_transfer_delta_saved += saved;
+    mcachefs_transfer_unlock();
+    return res;
+}
+
+/**
+ * Write back the extents asked by mcachefs_transfer_writeback(), then set the size of the target to the one of the backing file
+ */
+static int
+mcachefs_transfer_writeback_extents(struct mcachefs_file_t *mfile, int source_fd, int target_fd, off_t size,
+                                    struct mcachefs_transfer_window_t *window)
+{
+    struct mcachefs_extents_t extents;
+    off_t delta_min_size = mcachefs_config_get_delta_min_size();
+    int cur, signatures_fd = -1, res = 0;
+
+    mcachefs_extents_init(&extents);
+
+    mcachefs_file_lock_file(mfile);
+    mcachefs_extents_move(&extents, &(mfile->writeback_extents));
+    mcachefs_extents_clip(&extents, size);
+    mfile->transfer.total_size = mcachefs_extents_get_size(&extents);
+    mcachefs_file_unlock_file(mfile);
+
+    Log("Writeback of '%s' : %d extents, %lu bytes of %lu\n", mfile->path, extents.nb,
+        (unsigned long) mfile->transfer.total_size, (unsigned long) size);
+
+    if (delta_min_size && size >= delta_min_size)
+    {
+        signatures_fd = mcachefs_signatures_open(mfile->path, 1);
+    }
+    else
+    {
+        /**
+         * Blocks written without delta would leave the signatures stale
+         */
+        mcachefs_signatures_remove(mfile->path);
+        delta_min_size = 0;
+    }
+
+    for (cur = 0; cur < extents.nb; cur++)
+    {
+        if (delta_min_size)
+            res = mcachefs_transfer_delta_range(mfile, source_fd, target_fd, signatures_fd, extents.extents[cur].offset,
+                                                extents.extents[cur].length, size);
+        else
+            res = mcachefs_transfer_copy_sparse(mfile, source_fd, target_fd, extents.extents[cur].offset,
+                                                extents.extents[cur].length, window, 1, 1);
+        if (res)
+            break;
+    }
+    if (signatures_fd >= 0)
+    {
+        close(signatures_fd);
+    }
+    if (res == 0 && ftruncate(target_fd, size))
+    {
+        res = -errno;
+        Err("Could not set size of '%s' to %lu : err=%d:%s\n", mfile->path, (unsigned long) size, errno, strerror(errno));
+    }
+    else if (res == 0 && delta_min_size)
+    {
+        /**
+         * The last block has been signed with its actual size, only drop the blocks past it
+         */
+        mcachefs_signatures_truncate(mfile->path,
+                                     (size + MCACHEFS_SIGNATURES_BLOCK_SIZE - 1) / MCACHEFS_SIGNATURES_BLOCK_SIZE * MCACHEFS_SIGNATURES_BLOCK_SIZE);
+    }
+    if (res)
+    {
+        /**
+         * Keep the extents for the next attempt
+         */
+        mcachefs_file_lock_file(mfile);
+        mcachefs_extents_merge(&(mfile->writeback_extents), &extents);
+        mcachefs_file_unlock_file(mfile);
+    }
+    mcachefs_extents_free(&extents);
+    return res;
+}
+
+/**
+ * Get the source and target fds of a transfer, and the size to copy
+ */
+static int
+mcachefs_transfer_open(struct mcachefs_file_t *mfile, int tobacking, int *source_fd, int *target_fd, off_t *size)
+{
+    struct stat source_stat;
+
+    Log("Acquiring fd...\n");
+
+    *source_fd = mcachefs_file_getfd(mfile, tobacking ? 1 : 0, O_RDONLY);
+
+    Log("Got source_fd=%d\n", *source_fd);
+
+    if (*source_fd < 0)
+    {
+        Err("Could not get source_fd !\n");
+        return -EIO;
+    }
+    if (!tobacking && mfile->sources[MCACHEFS_FILE_SOURCE_BACKING].compressed)
+    {
+        /**
+         * Files written to are inflated at open time, so this is not expected ; never copy frames to the target
+         */
+        Err("Backing file of '%s' is compressed, can not write it back\n", mfile->path);
+        mcachefs_file_putfd(mfile, 0);
+        return -EIO;
+    }
+
+    *target_fd = mcachefs_file_getfd(mfile, tobacking ? 0 : 1, O_RDWR);
+
+    Log("Got target_fd=%d\n", *target_fd);
+
+    if (*target_fd < 0)
+    {
+        Err("Could not get target_fd !\n");
+        mcachefs_file_putfd(mfile, tobacking ? 1 : 0);
+        return -EIO;
+    }
+
+    if (fstat(*source_fd, &source_stat))
+    {
+        Bug("Could not get source stat !\n");
+    }
+
+    *size = mfile->transfer.total_size;
+    if (source_stat.st_size != *size)
+    {
+      /**
+       * This situation can be normal at backup, when we already performed a truncate() on that file :
+       * this changed metadata, but not the real file yet (waiting for apply)
+       */
+        Err("Diverging sizes for %s : source size=%lu, asked size=%lu\n", mfile->path, (unsigned long) source_stat.st_size, (unsigned long) *size);
+        *size = *size < source_stat.st_size ? *size : source_stat.st_size;
+        Err("Corrected size to %lu\n", (unsigned long) *size);
+    }
+    return 0;
+}
+
+/**
+ * Release the fds of a transfer, closing the source fd if nobody else uses it
+ */
+static void
+mcachefs_transfer_close(struct mcachefs_file_t *mfile)
+{
+    mcachefs_file_putfd(mfile, MCACHEFS_FILE_SOURCE_REAL);
+    mcachefs_file_putfd(mfile, MCACHEFS_FILE_SOURCE_BACKING);
+
+    mcachefs_file_lock_file(mfile);
+    if (mfile->sources[MCACHEFS_FILE_SOURCE_REAL].use == 0 && mfile->sources[MCACHEFS_FILE_SOURCE_REAL].fd != -1)
+    {
+        close(mfile->sources[MCACHEFS_FILE_SOURCE_REAL].fd);
+        mfile->sources[MCACHEFS_FILE_SOURCE_REAL].fd = -1;
+    }
+    mcachefs_file_unlock_file(mfile);
+}
+
+int
+mcachefs_transfer_file(struct mcachefs_file_t *mfile, int tobacking)
+{
+    int source_fd, target_fd, res;
+    off_t size;
+    struct mcachefs_transfer_window_t window;
+    struct timeval now;
+
+    if (mcachefs_transfer_open(mfile, tobacking, &source_fd, &target_fd, &size))
+    {
+        return -EIO;
+    }
+#ifdef __MCACHEFS_TRANSFER_DO_FTRUNCATE_TARGET
+    if (!tobacking && ftruncate(target_fd, size) < 0)
+    {
+        Err("Transfer : couldn't allocate space for transfer of data for '%s' (fd=%d) : err=%d:%s\n", mfile->path, target_fd, errno, strerror(errno));
+        goto copyerr;
+    }
+#endif
+
+    if (mcachefs_transfer_window_init(&window))
+    {
+        goto copyerr;
+    }
+
+    if (tobacking)
+    {
+        res = mcachefs_transfer_backup_chunks(mfile, source_fd, target_fd, size, &window);
+    }
+    else
+    {
+        res = mcachefs_transfer_writeback_extents(mfile, source_fd, target_fd, size, &window);
+    }
+
+    mcachefs_transfer_window_free(&window);
+
+    if (res)
+    {
+        goto copyerr;
+    }
+
+    gettimeofday(&now, NULL);
+    Log("End of transfer (to %s) for '%s' : %ld usec, copied '%lu', rate=%lu kb/sec\n", tobacking ? "cache" : "source",
+        mfile->path, (long) TIME_DIFF(now, window.begin), (unsigned long) window.copied,
+        (unsigned long) ((window.copied * 1000) / (TIME_DIFF(now, window.begin) + 1)));
+
+    mcachefs_transfer_close(mfile);
+    return 0;
+
+  copyerr:
+    Err("Could not backup file '%s'\n", mfile->path);
+
+    mcachefs_file_putfd(mfile, MCACHEFS_FILE_SOURCE_REAL);
+    mcachefs_file_putfd(mfile, MCACHEFS_FILE_SOURCE_BACKING);
+    return -EIO;
+}
+
+#ifdef MCACHEFS_HAVE_URING
+
+/**
+ * ********************* URING ENGINE *****************************
+ * A backup thread running the uring engine copies several files at once : each chunk claimed is split in
+ * window-sized reads from the source, each one linked to the write of the same buffer to the backing file,
+ * and up to uring-depth of these pairs are kept in flight.
+ */
+#define MCACHEFS_TRANSFER_URING_FILES_MAX 16
+
+struct mcachefs_transfer_uring_chunk_t
+{
+    off_t chunk;
+    off_t start;
+    off_t offset;               //< Next offset to submit
+    off_t end;
+    int pending;                //< Pairs of read and write in flight
+    int error;
+};
+
+struct mcachefs_transfer_uring_file_t
+{
+    struct mcachefs_file_t *mfile;
+    int stream;
+    int source_fd;
+    int target_fd;
+    off_t size;
+    struct mcachefs_transfer_uring_chunk_t *current;    //< Chunk being submitted
+    int inflight;
+    int done;                   //< No chunk left to claim
+    int error;
+};
+
+struct mcachefs_transfer_uring_slot_t
+{
+    struct mcachefs_transfer_uring_file_t *file;
+    struct mcachefs_transfer_uring_chunk_t *chunk;
+    char *buffer;
+    off_t length;
+    int error;
+    int next_free;
+};
 
-    gettimeofday(&now, NULL);
-    interval = TIME_DIFF(now, begin_copy);
-    Log("End of transfer (to %s) for '%s' : %ld usec, copied '%lu', rate=%lu kb/sec\n", tobacking ? "cache" : "source",
-        mfile->path, interval, (unsigned long) size, (unsigned long) ((size * 1000) / interval));
+struct mcachefs_transfer_uring_engine_t
+{
+    struct mcachefs_uring_t ring;
+    int depth;
+    int inflight;
+    struct mcachefs_transfer_uring_slot_t *slots;
+    char *buffers;
+    int free_slot;              //< First free slot, -1 if none
+    struct mcachefs_transfer_uring_file_t *files[MCACHEFS_TRANSFER_URING_FILES_MAX];
+    int files_nb;
+    int next_file;
+};
 
-    mcachefs_file_putfd(mfile, MCACHEFS_FILE_SOURCE_REAL);
-    mcachefs_file_putfd(mfile, MCACHEFS_FILE_SOURCE_BACKING);
+static void
+mcachefs_transfer_uring_free(struct mcachefs_transfer_uring_engine_t *engine)
+{
+    mcachefs_uring_exit(&(engine->ring));
+    free(engine->buffers);
+    free(engine->slots);
+    free(engine);
+}
+
+static struct mcachefs_transfer_uring_engine_t *
+mcachefs_transfer_uring_alloc(int depth)
+{
+    struct mcachefs_transfer_uring_engine_t *engine;
+    int cur;
+
+    engine = (struct mcachefs_transfer_uring_engine_t *) malloc(sizeof(struct mcachefs_transfer_uring_engine_t));
+    if (!engine)
+        return NULL;
+    memset(engine, 0, sizeof(struct mcachefs_transfer_uring_engine_t));
+    engine->ring.fd = -1;
+    engine->depth = depth;
+    engine->slots = (struct mcachefs_transfer_uring_slot_t *) malloc(sizeof(struct mcachefs_transfer_uring_slot_t) * depth);
+    engine->buffers = (char *) malloc(mcachefs_transfer_uring_slot_size * depth);
+    if (!engine->slots || !engine->buffers || mcachefs_uring_init(&(engine->ring), 2 * depth))
+    {
+        mcachefs_transfer_uring_free(engine);
+        return NULL;
+    }
+    for (cur = 0; cur < depth; cur++)
+    {
+        engine->slots[cur].buffer = engine->buffers + cur * mcachefs_transfer_uring_slot_size;
+        engine->slots[cur].next_free = cur + 1 < depth ? cur + 1 : -1;
+    }
+    engine->free_slot = 0;
+    return engine;
+}
+
+/**
+ * Take the next file from the queue, and start copying it
+ * @return 0 when mcachefs is quitting, 1 otherwise
+ */
+static int
+mcachefs_transfer_uring_take(struct mcachefs_transfer_thread_t *me, struct mcachefs_transfer_uring_engine_t *engine)
+{
+    struct mcachefs_transfer_uring_file_t *file;
+    struct mcachefs_file_t *mfile;
+    struct utimbuf timbuf;
+    int stream;
+
+    if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
+    {
+        Log("Interrupting transfer thread %lx\n", (unsigned long) pthread_self());
+        return 0;
+    }
+
+    mcachefs_transfer_lock();
+    mfile = mcachefs_transfer_dequeue_locked(me->type, &stream);
+    mcachefs_transfer_unlock();
+
+    Log("Transfer file '%s'%s with uring\n", mfile->path, stream ? " (additional stream)" : "");
+
+    if (!mcachefs_transfer_begin(mfile, me->type, stream, &timbuf))
+    {
+        mcachefs_file_release(mfile);
+        return 1;
+    }
+
+    file = (struct mcachefs_transfer_uring_file_t *) malloc(sizeof(struct mcachefs_transfer_uring_file_t));
+    if (!file)
+    {
+        Err("OOM : could not allocate uring transfer for '%s'\n", mfile->path);
+        mcachefs_transfer_backup_end(mfile, -ENOMEM);
+        mcachefs_file_release(mfile);
+        return 1;
+    }
+    memset(file, 0, sizeof(struct mcachefs_transfer_uring_file_t));
+    file->mfile = mfile;
+    file->stream = stream;
+    if (mcachefs_transfer_open(mfile, 1, &(file->source_fd), &(file->target_fd), &(file->size)))
+    {
+        mcachefs_transfer_backup_end(mfile, -EIO);
+        mcachefs_file_release(mfile);
+        free(file);
+        return 1;
+    }
+
+    mcachefs_transfer_lock();
+    engine->files[engine->files_nb++] = file;
+    mcachefs_transfer_unlock();
+    return 1;
+}
+
+/**
+ * A chunk has no more pairs in flight : mark it present if it has been copied entirely, and release it
+ */
+static void
+mcachefs_transfer_uring_chunk_end(struct mcachefs_transfer_uring_file_t *file, struct mcachefs_transfer_uring_chunk_t *chunk)
+{
+    struct mcachefs_file_t *mfile = file->mfile;
+
+    if (file->current == chunk)
+        file->current = NULL;
+
+    if (!chunk->error && chunk->offset == chunk->end)
+    {
+        mcachefs_transfer_sign_range(mfile, file->target_fd, chunk->start, chunk->end - chunk->start, file->size);
+    }
 
     mcachefs_file_lock_file(mfile);
-    if (tobacking)
-        mfile->cache_status = MCACHEFS_FILE_BACKING_DONE;
-    if (mfile->sources[MCACHEFS_FILE_SOURCE_REAL].use == 0)
+    if (!chunk->error && chunk->offset == chunk->end)
     {
-        close(mfile->sources[MCACHEFS_FILE_SOURCE_REAL].fd);
-        mfile->sources[MCACHEFS_FILE_SOURCE_REAL].fd = -1;
+        mcachefs_chunks_set_present(mfile, chunk->chunk);
+        mfile->transfer.transfered_size = mcachefs_chunks_get_present_size(mfile);
     }
+    mcachefs_chunks_unclaim(mfile, chunk->chunk);
     mcachefs_file_unlock_file(mfile);
+    free(chunk);
+}
 
-    return 0;
-  copyerr:
-    Err("Could not backup file '%s'\n", mfile->path);
+/**
+ * Claim the next chunk of a file
+ * @return 1 if file->current is set, 0 if the file has nothing left to submit
+ */
+static int
+mcachefs_transfer_uring_claim(struct mcachefs_transfer_uring_file_t *file)
+{
+    struct mcachefs_file_t *mfile = file->mfile;
+    struct mcachefs_transfer_uring_chunk_t *chunk;
+    off_t index, offset, length;
 
-    mcachefs_file_putfd(mfile, MCACHEFS_FILE_SOURCE_REAL);
-    mcachefs_file_putfd(mfile, MCACHEFS_FILE_SOURCE_BACKING);
-    return -EIO;
+    while (!file->current)
+    {
+        mcachefs_file_lock_file(mfile);
+        if (mfile->transfer.error || mfile->transfer.cancelled)
+        {
+            Log("Backup of '%s' failed in another stream or abandoned, stopping.\n", mfile->path);
+            index = -1;
+        }
+        else
+        {
+            index = mcachefs_chunks_claim(mfile);
+        }
+        if (index != -1)
+        {
+            mcachefs_chunks_get_range(mfile, index, &offset, &length);
+        }
+        mcachefs_file_unlock_file(mfile);
+
+        if (index == -1)
+        {
+            file->done = 1;
+            return 0;
+        }
+        if (offset + length > file->size)
+        {
+            length = offset < file->size ? file->size - offset : 0;
+        }
+
+        chunk = (struct mcachefs_transfer_uring_chunk_t *) malloc(sizeof(struct mcachefs_transfer_uring_chunk_t));
+        if (!chunk)
+        {
+            Err("OOM : could not allocate uring chunk for '%s'\n", mfile->path);
+            mcachefs_file_lock_file(mfile);
+            mcachefs_chunks_unclaim(mfile, index);
+            mcachefs_file_unlock_file(mfile);
+            file->error = -ENOMEM;
+            return 0;
+        }
+        chunk->chunk = index;
+        chunk->start = offset;
+        chunk->offset = offset;
+        chunk->end = offset + length;
+        chunk->pending = 0;
+        chunk->error = 0;
+        file->current = chunk;
+        if (length == 0)
+        {
+            mcachefs_transfer_uring_chunk_end(file, chunk);
+        }
+    }
+    return 1;
+}
+
+/**
+ * Submit pairs of linked read and write, round-robin over the files, until depth is reached
+ */
+static void
+mcachefs_transfer_uring_fill(struct mcachefs_transfer_uring_engine_t *engine)
+{
+    struct mcachefs_transfer_uring_file_t *file;
+    struct mcachefs_transfer_uring_chunk_t *chunk;
+    struct mcachefs_transfer_uring_slot_t *slot;
+    struct io_uring_sqe *read_sqe, *write_sqe;
+    int idle = 0, index;
+    off_t length;
+
+    while (engine->free_slot != -1 && engine->files_nb && idle < engine->files_nb)
+    {
+        if (mcachefs_ratelimit_delay(MCACHEFS_TRANSFER_TYPE_BACKUP))
+        {
+            break;
+        }
+        engine->next_file = (engine->next_file + 1) % engine->files_nb;
+        file = engine->files[engine->next_file];
+        if (file->done || file->error || !mcachefs_transfer_uring_claim(file))
+        {
+            idle++;
+            continue;
+        }
+        idle = 0;
+        chunk = file->current;
+
+        read_sqe = mcachefs_uring_get_sqe(&(engine->ring));
+        write_sqe = mcachefs_uring_get_sqe(&(engine->ring));
+        if (!read_sqe || !write_sqe)
+        {
+            Bug("Submission queue full with %d pairs in flight !\n", engine->inflight);
+        }
+
+        index = engine->free_slot;
+        slot = &(engine->slots[index]);
+        engine->free_slot = slot->next_free;
+
+        length = chunk->end - chunk->offset;
+        if (length > mcachefs_transfer_uring_slot_size)
+            length = mcachefs_transfer_uring_slot_size;
+        mcachefs_ratelimit_take(MCACHEFS_TRANSFER_TYPE_BACKUP, length);
+
+        slot->file = file;
+        slot->chunk = chunk;
+        slot->length = length;
+        slot->error = 0;
+
+        mcachefs_uring_prep_rw(read_sqe, IORING_OP_READ, file->source_fd, slot->buffer, length, chunk->offset,
+                               ((unsigned long long) index) << 1, IOSQE_IO_LINK);
+        mcachefs_uring_prep_rw(write_sqe, IORING_OP_WRITE, file->target_fd, slot->buffer, length, chunk->offset,
+                               (((unsigned long long) index) << 1) | 1, 0);
+
+        chunk->offset += length;
+        chunk->pending++;
+        file->inflight++;
+        engine->inflight++;
+        if (chunk->offset == chunk->end)
+        {
+            /**
+             * Chunk fully submitted, it will be marked present when its last write completes
+             */
+            file->current = NULL;
+        }
+    }
+}
+
+/**
+ * Handle all the available completions
+ */
+static void
+mcachefs_transfer_uring_complete(struct mcachefs_transfer_uring_engine_t *engine)
+{
+    struct io_uring_cqe *cqe;
+    struct mcachefs_transfer_uring_slot_t *slot;
+    struct mcachefs_transfer_uring_chunk_t *chunk;
+    struct mcachefs_transfer_uring_file_t *file;
+    struct timeval now;
+    int index, write, res;
+
+    while ((cqe = mcachefs_uring_peek_cqe(&(engine->ring))) != NULL)
+    {
+        index = (int) (cqe->user_data >> 1);
+        write = (int) (cqe->user_data & 1);
+        res = cqe->res;
+        mcachefs_uring_cqe_seen(&(engine->ring));
+
+        slot = &(engine->slots[index]);
+        if (!slot->error && res != slot->length)
+        {
+            /**
+             * A failed or short read cancels the linked write, whose completion still comes
+             */
+            slot->error = res < 0 ? res : -EIO;
+            Err("Could not %s %lu bytes of '%s' : res=%d\n", write ? "write" : "read", (unsigned long) slot->length,
+                slot->file->mfile->path, res);
+        }
+        if (!write)
+            continue;
+
+        file = slot->file;
+        chunk = slot->chunk;
+        chunk->pending--;
+        file->inflight--;
+        engine->inflight--;
+
+        if (slot->error)
+        {
+            chunk->error = slot->error;
+            file->error = slot->error;
+        }
+        else
+        {
+            gettimeofday(&now, NULL);
+            mcachefs_file_lock_file(file->mfile);
+            mcachefs_transfer_account_locked(file->mfile, slot->length, &now);
+            mcachefs_file_unlock_file(file->mfile);
+        }
+
+        slot->next_free = engine->free_slot;
+        engine->free_slot = index;
+
+        if (chunk->pending == 0 && (chunk->offset == chunk->end || chunk->error))
+        {
+            mcachefs_transfer_uring_chunk_end(file, chunk);
+        }
+    }
+}
+
+/**
+ * End the files which have nothing left in flight and nothing more to submit
+ */
+static void
+mcachefs_transfer_uring_reap(struct mcachefs_transfer_uring_engine_t *engine, int force)
+{
+    struct mcachefs_transfer_uring_file_t *file;
+    int cur;
+
+    for (cur = 0; cur < engine->files_nb;)
+    {
+        file = engine->files[cur];
+        if (file->inflight || (!file->done && !file->error && !force))
+        {
+            cur++;
+            continue;
+        }
+        if (file->current)
+        {
+            file->current->error = -EINTR;
+            mcachefs_transfer_uring_chunk_end(file, file->current);
+        }
+        if (force && !file->done && !file->error)
+        {
+            file->error = -EINTR;
+        }
+
+        mcachefs_transfer_lock();
+        engine->files[cur] = engine->files[--engine->files_nb];
+        mcachefs_transfer_unlock();
+
+        Log("End of uring transfer for '%s', err=%d\n", file->mfile->path, file->error);
+        mcachefs_transfer_close(file->mfile);
+        mcachefs_transfer_backup_end(file->mfile, file->error);
+        mcachefs_file_release(file->mfile);
+        free(file);
+    }
+}
+
+/**
+ * Main loop of a backup thread running the uring engine
+ * @return 0 when mcachefs is quitting, -errno if the engine could not be started
+ */
+static int
+mcachefs_transfer_uring_thread(struct mcachefs_transfer_thread_t *me)
+{
+    struct mcachefs_transfer_uring_engine_t *engine;
+    struct timespec pause = { 0, 10000000 };
+    long long delay;
+    int type = me->type;
+
+    engine = mcachefs_transfer_uring_alloc(mcachefs_config_get_uring_depth());
+    if (!engine)
+    {
+        Err("Could not start uring engine, thread %lx falls back to sync transfers\n", (unsigned long) pthread_self());
+        return -ENOMEM;
+    }
+    mcachefs_transfer_lock();
+    me->uring = engine;
+    mcachefs_transfer_unlock();
+
+    Info("Transfer thread %lx uses the uring engine, depth=%d\n", (unsigned long) pthread_self(), engine->depth);
+
+    while (1)
+    {
+        if (engine->files_nb == 0)
+        {
+            sem_wait(&(mcachefs_transfer_sem[type]));
+            if (!mcachefs_transfer_uring_take(me, engine))
+                break;
+        }
+        while (engine->files_nb < MCACHEFS_TRANSFER_URING_FILES_MAX && sem_trywait(&(mcachefs_transfer_sem[type])) == 0)
+        {
+            if (!mcachefs_transfer_uring_take(me, engine))
+                goto quit;
+        }
+        if (mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING)
+            break;
+
+        mcachefs_transfer_uring_fill(engine);
+        mcachefs_transfer_uring_reap(engine, 0);
+
+        if (engine->inflight == 0)
+        {
+            if (engine->files_nb)
+            {
+                /**
+                 * Throttled by the rate limiter, or waiting for chunks claimed by other streams
+                 */
+                delay = mcachefs_ratelimit_delay(MCACHEFS_TRANSFER_TYPE_BACKUP);
+                if (delay > 0 && delay < pause.tv_nsec)
+                    pause.tv_nsec = delay;
+                nanosleep(&pause, NULL);
+                pause.tv_nsec = 10000000;
+            }
+            continue;
+        }
+        if (mcachefs_uring_submit_and_wait(&(engine->ring), 1) < 0)
+        {
+            Bug("Could not submit to io_uring with %d pairs in flight !\n", engine->inflight);
+        }
+        mcachefs_transfer_uring_complete(engine);
+    }
+
+  quit:
+    Log("Interrupting uring transfer thread %lx, %d pairs in flight\n", (unsigned long) pthread_self(), engine->inflight);
+    while (engine->inflight)
+    {
+        if (mcachefs_uring_submit_and_wait(&(engine->ring), 1) < 0)
+            break;
+        mcachefs_transfer_uring_complete(engine);
+    }
+    mcachefs_transfer_uring_reap(engine, 1);
+
+    mcachefs_transfer_lock();
+    me->uring = NULL;
+    mcachefs_transfer_pools[type].live--;
+    mcachefs_transfer_unlock();
+    mcachefs_transfer_uring_free(engine);
+    return 0;
 }
 
+#endif // MCACHEFS_HAVE_URING
+
 /**
  * Must be in line with MCACHEFS_TRANSFER_TYPE_*
  */
 const char *mcachefs_transfer_type_names[] = { "backup", "writeback", "metadata", NULL };
 
+/**
+ * Dump a file being transfered, and account it in the totals - transfer lock HELD
+ */
+static void
+mcachefs_transfer_dump_file(struct mcachefs_file_t *mvops, struct mcachefs_file_t *mfile, int stream,
+                            off_t *total_transfered, off_t *total_size, off_t *total_rate)
+{
+    int tobacking, streams;
+    off_t offset, size, rate;
+
+    if (mfile->type == mcachefs_file_type_dir)
+    {
+        __VOPS_WRITE(mvops, "\t%s %s\n", "Fill meta", mfile->path);
+        return;
+    }
+    if (stream)
+    {
+        /**
+         * Statistics are shown (and accounted) by the first stream of the file
+         */
+        __VOPS_WRITE(mvops, "\t%s %s\n", "Stream   ", mfile->path);
+        return;
+    }
+
+    mcachefs_file_lock_file(mfile);
+    offset = mfile->transfer.transfered_size;
+    *total_transfered += offset;
+    size = mfile->transfer.total_size;
+    *total_size += size;
+    rate = mfile->transfer.rate;
+    *total_rate += rate;
+    tobacking = (mfile->cache_status == MCACHEFS_FILE_BACKING_IN_PROGRESS || mfile->cache_status == MCACHEFS_FILE_BACKING_ASKED);
+    streams = mfile->transfer.streams;
+    mcachefs_file_unlock_file(mfile);
+
+    __VOPS_WRITE(mvops,
+                 "\t%s %s : %luk/%luk (%lu%%), rate=%lukb/s",
+                 (tobacking ? "Backup   " : "Writeback"),
+                 mfile->path, ((unsigned long) offset) >> 10,
+                 ((unsigned long) size) >> 10, size ? (unsigned long) (offset * 100 / size) : 0, (unsigned long) rate);
+    if (tobacking && streams > 1)
+    {
+        __VOPS_WRITE(mvops, ", streams=%d", streams);
+    }
+    __VOPS_WRITE(mvops, "\n");
+}
+
 void
 mcachefs_transfer_dump(struct mcachefs_file_t *mvops)
 {
@@ -753,45 +2999,52 @@ mcachefs_transfer_dump(struct mcachefs_file_t *mvops)
     int tobacking;
     int totaltotransfer = 0;
     struct mcachefs_file_t *mfile;
+#ifdef MCACHEFS_HAVE_URING
+    struct mcachefs_transfer_uring_engine_t *engine;
+    int curfile;
+#endif
 
     struct mcachefs_transfer_queue_t *mqueue;
-    off_t offset, size, rate;
+    struct mcachefs_transfer_queue_list_t *queue;
+    struct mcachefs_transfer_method_t *method;
+    struct mcachefs_transfer_pool_t *pool;
+    int type, priority;
+    long long now;
     off_t total_transfered = 0, total_size = 0, total_rate = 0;
     mcachefs_transfer_lock();
     __VOPS_WRITE(mvops, "Current transfers :\n");
 
     for (cur = 0; cur < mcachefs_transfer_threads_nb; cur++)
     {
-        __VOPS_WRITE(mvops, "[Thread %lx, type=%s]\n",
+        if (mcachefs_transfer_threads[cur].state != MCACHEFS_TRANSFER_THREAD_RUNNING)
+            continue;
+        __VOPS_WRITE(mvops, "[Thread %lx, type=%s",
                      mcachefs_transfer_threads[cur].threadid,
                      (mcachefs_transfer_threads[cur].type < MCACHEFS_TRANSFER_TYPES) ?
                      mcachefs_transfer_type_names[mcachefs_transfer_threads[cur].type] : "Unknown");
-        mfile = mcachefs_transfer_threads[cur].currentfile;
-        if (mfile == NULL)
-            continue;
-
-        if (mfile->type == mcachefs_file_type_dir)
+        if (mcachefs_transfer_threads[cur].serving != mcachefs_transfer_threads[cur].type)
         {
-            __VOPS_WRITE(mvops, "\t%s %s\n", "Fill meta", mfile->path);
+            __VOPS_WRITE(mvops, ", serving %s", mcachefs_transfer_type_names[mcachefs_transfer_threads[cur].serving]);
         }
-        else
+        __VOPS_WRITE(mvops, "]\n");
+#ifdef MCACHEFS_HAVE_URING
+        engine = mcachefs_transfer_threads[cur].uring;
+        if (engine)
         {
-            mcachefs_file_lock_file(mfile);
-            offset = mfile->transfer.transfered_size;
-            total_transfered += offset;
-            size = mfile->transfer.total_size;
-            total_size += size;
-            rate = mfile->transfer.rate;
-            total_rate += rate;
-            tobacking = (mfile->cache_status == MCACHEFS_FILE_BACKING_IN_PROGRESS || mfile->cache_status == MCACHEFS_FILE_BACKING_ASKED);
-            mcachefs_file_unlock_file(mfile);
-
-            __VOPS_WRITE(mvops,
-                         "\t%s %s : %luk/%luk (%lu%%), rate=%lukb/s\n",
-                         (tobacking ? "Backup   " : "Writeback"),
-                         mfile->path, ((unsigned long) offset) >> 10,
-                         ((unsigned long) size) >> 10, size ? (unsigned long) (offset * 100 / size) : 0, (unsigned long) rate);
+            __VOPS_WRITE(mvops, "\turing : %d/%d reads and writes in flight\n", engine->inflight, engine->depth);
+            for (curfile = 0; curfile < engine->files_nb; curfile++)
+            {
+                mcachefs_transfer_dump_file(mvops, engine->files[curfile]->mfile, engine->files[curfile]->stream,
+                                            &total_transfered, &total_size, &total_rate);
+            }
+            continue;
         }
+#endif
+        mfile = mcachefs_transfer_threads[cur].currentfile;
+        if (mfile == NULL)
+            continue;
+
+        mcachefs_transfer_dump_file(mvops, mfile, mcachefs_transfer_threads[cur].stream, &total_transfered, &total_size, &total_rate);
     }
     if (total_size)
     {
@@ -800,19 +3053,74 @@ mcachefs_transfer_dump(struct mcachefs_file_t *mvops)
                      ((unsigned long) total_transfered) >> 10,
                      ((unsigned long) total_size) >> 10, (unsigned long) (total_transfered * 100 / total_size), (unsigned long) total_rate);
     }
-    for (mqueue = mcachefs_transfer_queue_head; mqueue; mqueue = mqueue->next)
+    if (mcachefs_transfer_delta_compared)
+    {
+        __VOPS_WRITE(mvops, "Delta writeback : compared %luk, unchanged %luk (%lu%%)\n",
+                     ((unsigned long) mcachefs_transfer_delta_compared) >> 10, ((unsigned long) mcachefs_transfer_delta_saved) >> 10,
+                     (unsigned long) (mcachefs_transfer_delta_saved * 100 / mcachefs_transfer_delta_compared));
+    }
+    if (mcachefs_transfer_abandoned)
+    {
+        __VOPS_WRITE(mvops, "Abandoned backups : %lu, kept %luk\n", mcachefs_transfer_abandoned,
+                     ((unsigned long) mcachefs_transfer_abandoned_kept) >> 10);
+    }
+    if (mcachefs_transfer_methods_nb)
+    {
+        __VOPS_WRITE(mvops, "\nDevices :\n");
+    }
+    for (cur = 0; cur < mcachefs_transfer_methods_nb; cur++)
+    {
+        method = &(mcachefs_transfer_methods[cur]);
+        __VOPS_WRITE(mvops, "\t%lx -> %lx : %s, window=%luk, ssthresh=%luk, best=%lukb/s\n",
+                     (unsigned long) method->source, (unsigned long) method->target, mcachefs_transfer_method_names[method->method],
+                     (unsigned long) method->window.size >> 10, (unsigned long) method->window.ssthresh >> 10,
+                     (unsigned long) (method->window.best_rate >> 10));
+    }
+    now = mcachefs_transfer_now_ms();
+    __VOPS_WRITE(mvops, "\nThreads :\n");
+    for (type = 0; type < MCACHEFS_TRANSFER_TYPES; type++)
+    {
+        pool = &(mcachefs_transfer_pools[type]);
+        __VOPS_WRITE(mvops, "\t%-9s : live=%d (min=%d, max=%d), idle=%d, rate=%lldkb/s, latency=%lldms, started=%lu, exited=%lu, stolen=%lu",
+                     mcachefs_transfer_type_names[type], pool->live, pool->min, pool->max, pool->idle, pool->rate >> 10,
+                     pool->latency, pool->started, pool->exited, pool->stolen);
+        if (now < pool->hold_until)
+        {
+            __VOPS_WRITE(mvops, ", saturated at %d threads for %llds", pool->limit, (pool->hold_until - now) / 1000);
+        }
+        __VOPS_WRITE(mvops, "\n");
+    }
+    __VOPS_WRITE(mvops, "\nQueues :\n");
+    for (type = 0; type < MCACHEFS_TRANSFER_TYPES; type++)
     {
-        totaltotransfer++;
+        for (priority = 0; priority < MCACHEFS_TRANSFER_PRIORITIES; priority++)
+        {
+            queue = &(mcachefs_transfer_queues[type][priority]);
+            totaltotransfer += queue->nb;
+            if (!queue->nb && !queue->dequeued)
+                continue;
+            __VOPS_WRITE(mvops, "\t%-9s %-10s : depth=%d, oldest=%lldms, dequeued=%lu, wait avg=%lldms, max=%lldms\n",
+                         mcachefs_transfer_type_names[type], mcachefs_transfer_priority_names[priority], queue->nb,
+                         queue->head ? now - queue->head->queued_at : 0, queue->dequeued,
+                         queue->dequeued ? queue->wait_total / (long long) queue->dequeued : 0, queue->wait_max);
+        }
     }
-    if (mcachefs_transfer_queue_head)
+    if (totaltotransfer)
     {
         __VOPS_WRITE(mvops, "\nFiles to be transfered (%d files) :\n", totaltotransfer);
     }
-    for (mqueue = mcachefs_transfer_queue_head; mqueue; mqueue = mqueue->next)
+    for (type = 0; type < MCACHEFS_TRANSFER_TYPES; type++)
     {
-        tobacking = (mqueue->mfile->cache_status != MCACHEFS_FILE_BACKING_DONE);
-        __VOPS_WRITE(mvops, "\t%s %s\n",
-                     (mqueue->mfile->type == mcachefs_file_type_dir) ? "Fill meta" : (tobacking ? "Backup   " : "Writeback"), mqueue->mfile->path);
+        for (priority = 0; priority < MCACHEFS_TRANSFER_PRIORITIES; priority++)
+        {
+            for (mqueue = mcachefs_transfer_queues[type][priority].head; mqueue; mqueue = mqueue->next)
+            {
+                tobacking = (mqueue->mfile->cache_status != MCACHEFS_FILE_BACKING_DONE);
+                __VOPS_WRITE(mvops, "\t%s %-10s %s\n",
+                             (mqueue->mfile->type == mcachefs_file_type_dir) ? "Fill meta" : (mqueue->stream ? "Stream   " : (tobacking ? "Backup   " : "Writeback")),
+                             mcachefs_transfer_priority_names[priority], mqueue->mfile->path);
+            }
+        }
     }
     mcachefs_transfer_unlock();
 }
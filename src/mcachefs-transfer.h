@@ -19,20 +19,36 @@
 extern sem_t mcachefs_backing_sem;
 
 /**
- * Maximum number of concurrent threads
+ * Priority classes of transfers, from the most urgent to the least one
+ * Within a type, higher classes are served first ; a queued transfer gains a class every aging period.
  */
-#define MCACHEFS_TRANSFER_THREADS_MAX_NUMBER 64
+#define MCACHEFS_TRANSFER_PRIORITIES 4
+#define MCACHEFS_TRANSFER_PRIORITY_FOREGROUND 0 //< Interactive open() and read()
+#define MCACHEFS_TRANSFER_PRIORITY_WRITEBACK  1 //< Writeback of the journal, fsync()
+#define MCACHEFS_TRANSFER_PRIORITY_PREFETCH   2 //< Background prefetch
+#define MCACHEFS_TRANSFER_PRIORITY_CRAWL      3 //< Metadata crawl
+
+extern const char *mcachefs_transfer_type_names[];
+extern const char *mcachefs_transfer_priority_names[MCACHEFS_TRANSFER_PRIORITIES];
 
 /**
  * Transfer backing frontend
  * Call for file backup. If the backup exists and is fresh enough, do nothing, otherwise wakeup the backingthread.
+ * If the backup is still queued with a lower priority, it is promoted to priority.
  */
-int mcachefs_transfer_backfile(struct mcachefs_file_t *mfile);
+int mcachefs_transfer_backfile(struct mcachefs_file_t *mfile, int priority);
 
 /**
- * Writeback frontend
+ * Fetch the missing chunks covering [offset, offset+size[ of a partially backed file, from the calling thread
+ * returns 0 if the range is now present in the backing file
  */
-int mcachefs_transfer_writeback(const char *path);
+int mcachefs_transfer_fetch_range(struct mcachefs_file_t *mfile, off_t offset, size_t size);
+
+/**
+ * Writeback frontend : write back the given extents of path (use MCACHEFS_EXTENTS_EOF to write back the whole file),
+ * then set the size of the target to the one of the backing file
+ */
+int mcachefs_transfer_writeback(const char *path, struct mcachefs_extents_t *extents);
 
 /**
  * Queue a file for transfer
@@ -41,7 +57,31 @@ int mcachefs_transfer_writeback(const char *path);
  * - MCACHEFS_FILE_BACKING_DONE means file is aimed at being written back
  * returns 0 if queued, -EEXIST if already in queue.
  */
-int mcachefs_transfer_queue_file(struct mcachefs_file_t *mfile, int type);
+int mcachefs_transfer_queue_file(struct mcachefs_file_t *mfile, int type, int priority);
+
+/**
+ * Move a queued transfer to a higher priority class, do nothing if it is not queued or already higher
+ */
+void mcachefs_transfer_promote(struct mcachefs_file_t *mfile, int priority);
+
+/**
+ * Cancel the backup of mfile if it is still queued, and has not been promoted above priority
+ * The partial backing file and its chunk map are kept, and status set back to MCACHEFS_FILE_BACKING_NONE.
+ * @return 0 if cancelled, -EBUSY if the backup is not queued anymore (or was promoted)
+ */
+int mcachefs_transfer_cancel(struct mcachefs_file_t *mfile, int priority);
+
+/**
+ * Abandon the backup of mfile, queued or in progress : its streams stop before their next window, the chunks copied
+ * are kept, and status is set back to MCACHEFS_FILE_BACKING_NONE so that the next open queues it again - no lock HELD
+ */
+void mcachefs_transfer_abandon(struct mcachefs_file_t *mfile);
+
+/**
+ * Called when the last opener of mfile released it : abandon its backup while less than abandon-percent of the file
+ * is in cache - no lock HELD
+ */
+void mcachefs_transfer_release(struct mcachefs_file_t *mfile);
 
 /**
  * Generic transfer function :
@@ -60,6 +100,12 @@ void mcachefs_transfer_start_threads();
  */
 void mcachefs_transfer_stop_threads();
 
+/**
+ * Measure the throughput of each thread pool, and start threads for the transfers waiting for one
+ * Shall be called periodically, no lock HELD
+ */
+void mcachefs_transfer_pool_adjust();
+
 
 /**
  * Dump the files currently being transfered
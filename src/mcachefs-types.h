@@ -9,6 +9,7 @@
 #define __MCACHEFS_TYPES_H_
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 // #define __MCACHEFS_HASH_USE_CRC32
 //#define __MCACHEFS_HASH_USE_CRC64
@@ -19,6 +20,12 @@
  */
 typedef unsigned long long mcachefs_fh_t;
 
+/**
+ * Flags of the open carried in the fh given to Fuse, in the low bits left free by the alignment of the file
+ */
+#define MCACHEFS_FH_PASSTHROUGH 0x1ULL          //< Reads of this open are served by the kernel
+#define MCACHEFS_FH_FLAGS       0x1ULL
+
 /**
  * Unique identifier for metadata Id
  */
@@ -77,9 +84,18 @@ struct mcachefs_file_transfer_t
 {
     int tobacking;
     off_t total_size;
+    time_t mtime;               //< Modification time of the source when the transfer started
+    struct stat source;         //< Identity of the source of the last backup keying its dedup hint, st_ino 0 if none
     off_t transfered_size;
     off_t rate;
     time_t total_time;
+    struct timeval begin;       //< When the transfer started
+    off_t copied;               //< Bytes copied since begin, by all streams
+    int streams;                //< Number of streams currently backing up the file
+    int error;                  //< Set when a stream failed, to stop the others
+    int priority;               //< Class the transfer has been taken from
+    int cancelled;              //< Set to abandon the backup, streams stop before their next window
+    int requeue;                //< Class to queue the backup again at once abandoned, -1 if none
 };
 
 /**
@@ -90,15 +106,68 @@ struct mcachefs_file_source_t
     int fd;                     //< The file descriptor to use
     int use;                    //< Number of concurrent accesses to this fd
     int wr;                     //< Set to TRUE to indicate that fd is openned wr
+    int compressed;             //< Set when fd is a compressed backing file, see mcachefs-compress.h
     size_t bytesrd;             // Number of bytes read
     size_t nbrd;                // Number of read accesses
     size_t byteswr;             // Number of bytes written
     size_t nbwr;                // Number of write accesses
 };
 
+/**
+ * Range of chunks asked by a reader, to be backed up before the sequential fill goes on
+ */
+struct mcachefs_file_chunks_urgent_t
+{
+    off_t first;
+    off_t last;
+};
+
+#define MCACHEFS_FILE_CHUNKS_URGENT_MAX 8
+
+/**
+ * Presence map of the chunks of a backing file, see mcachefs-chunks.h
+ */
+struct mcachefs_file_chunks_t
+{
+    int fd;                     //< The persistent map file descriptor
+    int data_fd;                //< The backing file, synced before the chunks are persisted as present, -1 until then
+    off_t chunk_size;           //< Size of a chunk, in bytes
+    off_t size;                 //< Size of the file the map has been built for
+    time_t mtime;               //< Modification time of the source the map has been built for
+    off_t nb;                   //< Total number of chunks
+    off_t present;              //< Number of chunks present in the backing file
+    off_t cursor;               //< Next chunk to look at for sequential fill
+    unsigned char *map;         //< One bit per chunk, NULL when no map is loaded
+    unsigned char *inflight;    //< One bit per chunk being copied by a transfer
+    off_t unsynced;             //< Chunks marked present in map, not persisted yet
+    off_t unsynced_first;       //< First and last bytes of map holding them
+    off_t unsynced_last;
+    int syncing;                //< Set while the backing file is synced with the mfile lock released
+    int urgent_nb;              //< Number of pending urgent ranges
+    struct mcachefs_file_chunks_urgent_t urgent[MCACHEFS_FILE_CHUNKS_URGENT_MAX];
+};
+
+/**
+ * Set of byte ranges, sorted and merged (no two extents overlap or touch)
+ */
+struct mcachefs_extent_t
+{
+    off_t offset;
+    off_t length;
+};
+
+struct mcachefs_extents_t
+{
+    int nb;
+    int alloced;
+    struct mcachefs_extent_t *extents;
+};
+
 #define MCACHEFS_FILE_SOURCE_BACKING 0
 #define MCACHEFS_FILE_SOURCE_REAL    1
 
+struct mcachefs_transfer_queue_t;
+
 /**
  * Openned file structure, which can be a regular file, a dir, or a vops file
  */
@@ -115,14 +184,18 @@ struct mcachefs_file_t
     /**
      * Global usage :
      * use : may not be destroyed if use is non-zero
+     * openers : number of open() not released yet, protected by mutex ; transfers and prefetch hold uses, not opens
      * ttl : explicitly indicated the time-to-live of the file (unused)
      * mutex : an internal protection lock for fds, metadata, ...
+     * cond : progress notification of the backing, protected by mutex
      * mcachefs_file_lock has a lock precedence over each fd_lock :
      *    if a thread has locked a fd_lock, it shall not try to lock mcachefs_file_lock at all
      */
     int use;
+    int openers;
     time_t ttl;
     struct mcachefs_mutex_t mutex;
+    pthread_cond_t cond;        //< Broadcast with mutex held when chunks land or cache_status changes
 
     /**
      * File descriptor accessors
@@ -133,13 +206,27 @@ struct mcachefs_file_t
      * Backing part
      */
     int cache_status;           //< Indicate the state of the backing : asked, in progress, done
-    int dirty;                  //< If the file has been written, this flag indicates the backing file is fresher than the real one
+    int dirty;                  //< Journal generation the file has been written in, the backing file is then fresher than the real one
+    struct mcachefs_extents_t dirty_extents;    //< Ranges written (and journaled) in that generation
+    struct mcachefs_extents_t writeback_extents;        //< Ranges to write back, set by mcachefs_transfer_writeback()
     // off_t backed_size; //< How many bytes have been backed now, only available when backing == IN_PROGRESS
 
     /**
      * Transfer information
      */
     struct mcachefs_file_transfer_t transfer;
+    struct mcachefs_transfer_queue_t *queued;   //< Entry while waiting in a transfer queue, protected by the transfer lock
+
+    /**
+     * Kernel passthrough, see mcachefs-passthrough.h, protected by mutex
+     */
+    int passthrough_id;         //< Backing id registered with the kernel, valid while passthrough_opens is non-zero
+    int passthrough_opens;      //< Number of opens whose reads are served by the kernel
+
+    /**
+     * Chunks present in the backing file, only loaded while backing is partial
+     */
+    struct mcachefs_file_chunks_t chunks;
 
     /**
      * VOPS stuff
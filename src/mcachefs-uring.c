@@ -0,0 +1,245 @@
+#include "mcachefs.h"
+#include "mcachefs-uring.h"
+
+#ifdef MCACHEFS_HAVE_URING
+
+#include <sys/syscall.h>
+
+static int
+mcachefs_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+mcachefs_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int
+mcachefs_uring_supported()
+{
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    int fd, supported = 0;
+
+    memset(&params, 0, sizeof(params));
+    fd = mcachefs_uring_setup(2, &params);
+    if (fd < 0)
+    {
+        Err("io_uring not available : err=%d:%s\n", errno, strerror(errno));
+        return 0;
+    }
+
+    probe = (struct io_uring_probe *) malloc(probe_size);
+    if (probe)
+    {
+        memset(probe, 0, probe_size);
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0
+            && probe->last_op >= IORING_OP_WRITE
+            && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+            && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED))
+        {
+            supported = 1;
+        }
+        else
+        {
+            Err("io_uring does not support read and write operations\n");
+        }
+        free(probe);
+    }
+    close(fd);
+    return supported;
+}
+
+int
+mcachefs_uring_init(struct mcachefs_uring_t *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    int res;
+
+    memset(ring, 0, sizeof(struct mcachefs_uring_t));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = mcachefs_uring_setup(entries, &params);
+    if (ring->fd < 0)
+    {
+        res = -errno;
+        Err("Could not setup io_uring of %u entries : err=%d:%s\n", entries, errno, strerror(errno));
+        return res;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = 0;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        goto err;
+    }
+    if (ring->cq_size)
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+        {
+            ring->cq_ptr = NULL;
+            goto err;
+        }
+    }
+    else
+    {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                              ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        goto err;
+    }
+
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) ((char *) ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) ((char *) ring->sq_ptr + params.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) ((char *) ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + params.cq_off.cqes);
+
+    Log("Created io_uring fd=%d, sq entries=%u, cq entries=%u\n", ring->fd, params.sq_entries, params.cq_entries);
+    return 0;
+
+  err:
+    res = -errno;
+    Err("Could not map io_uring : err=%d:%s\n", errno, strerror(errno));
+    if (ring->sq_ptr == MAP_FAILED)
+        ring->sq_ptr = NULL;
+    mcachefs_uring_exit(ring);
+    return res;
+}
+
+void
+mcachefs_uring_exit(struct mcachefs_uring_t *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(struct mcachefs_uring_t));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *
+mcachefs_uring_get_sqe(struct mcachefs_uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned index;
+
+    if (ring->sqe_tail - head >= ring->entries)
+        return NULL;
+
+    index = ring->sqe_tail & ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+
+    sqe = &(ring->sqes[index]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+void
+mcachefs_uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, void *buffer, size_t length, off_t offset,
+                       unsigned long long user_data, int flags)
+{
+    sqe->opcode = op;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+}
+
+int
+mcachefs_uring_submit_and_wait(struct mcachefs_uring_t *ring, unsigned wait_nr)
+{
+    unsigned to_submit;
+    int res;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (!to_submit && !wait_nr)
+        return 0;
+    do
+    {
+        res = mcachefs_uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    }
+    while (res < 0 && errno == EINTR);
+
+    if (res < 0)
+    {
+        res = -errno;
+        Err("Could not enter io_uring : err=%d:%s\n", errno, strerror(errno));
+    }
+    return res;
+}
+
+struct io_uring_cqe *
+mcachefs_uring_peek_cqe(struct mcachefs_uring_t *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &(ring->cqes[head & ring->cq_mask]);
+}
+
+void
+mcachefs_uring_cqe_seen(struct mcachefs_uring_t *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#else
+
+int
+mcachefs_uring_supported()
+{
+    Err("mcachefs has been built without io_uring support\n");
+    return 0;
+}
+
+int
+mcachefs_uring_init(struct mcachefs_uring_t *ring, unsigned entries)
+{
+    (void) entries;
+    ring->fd = -1;
+    return -ENOSYS;
+}
+
+void
+mcachefs_uring_exit(struct mcachefs_uring_t *ring)
+{
+    (void) ring;
+}
+
+#endif
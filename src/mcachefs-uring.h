@@ -0,0 +1,95 @@
+#ifndef __MCACHEFS_URING_H
+#define __MCACHEFS_URING_H
+
+/**
+ * ********************* URING *****************************
+ * Minimal io_uring interface, on top of the raw system calls (no liburing needed).
+ * A ring is owned by a single thread, and is not protected by any lock.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define MCACHEFS_HAVE_URING 1
+#endif
+#endif
+
+#ifdef MCACHEFS_HAVE_URING
+
+#include <linux/io_uring.h>
+
+struct mcachefs_uring_t
+{
+    int fd;
+    unsigned entries;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned sqe_tail;          //< Local tail, published to sq_tail at submit
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+#else
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct mcachefs_uring_t
+{
+    int fd;
+};
+
+#endif
+
+/**
+ * Check that the kernel provides io_uring, with read and write operations
+ */
+int mcachefs_uring_supported();
+
+/**
+ * Create a ring with (at least) entries submission entries
+ * @return 0 on success, -errno on error
+ */
+int mcachefs_uring_init(struct mcachefs_uring_t *ring, unsigned entries);
+
+/**
+ * Destroy a ring, all submitted requests shall have completed
+ */
+void mcachefs_uring_exit(struct mcachefs_uring_t *ring);
+
+/**
+ * Get a zeroed submission entry, or NULL if the submission queue is full
+ */
+struct io_uring_sqe *mcachefs_uring_get_sqe(struct mcachefs_uring_t *ring);
+
+/**
+ * Prepare a read or a write of length bytes at offset of fd, from or into buffer
+ */
+void mcachefs_uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd, void *buffer, size_t length, off_t offset,
+                            unsigned long long user_data, int flags);
+
+/**
+ * Submit the pending entries, and wait for at least wait_nr completions
+ * @return the number of entries submitted, -errno on error
+ */
+int mcachefs_uring_submit_and_wait(struct mcachefs_uring_t *ring, unsigned wait_nr);
+
+/**
+ * Get the next completion, or NULL if there is none ; call mcachefs_uring_cqe_seen() once it has been handled
+ */
+struct io_uring_cqe *mcachefs_uring_peek_cqe(struct mcachefs_uring_t *ring);
+void mcachefs_uring_cqe_seen(struct mcachefs_uring_t *ring);
+
+#endif // __MCACHEFS_URING_H
@@ -1,4 +1,5 @@
 #include "mcachefs.h"
+#include "mcachefs-chunks.h"
 
 #include <libgen.h>
 
@@ -62,7 +63,10 @@ mcachefs_fileincache(const char *path)
     cachepath = mcachefs_makepath_cache(path);
     res = lstat(cachepath, &st);
     free(cachepath);
-    return res == 0;
+    /**
+     * A backing file with a chunk map is only partially filled
+     */
+    return res == 0 && !mcachefs_chunks_exist(path);
 }
 
 int
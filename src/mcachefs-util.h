@@ -31,7 +31,7 @@ int mcachefs_createpath_cache(const char *path, int lastIsDir);
 int mcachefs_createfile_cache(const char *path, mode_t mode);
 
 /**
- * Checks if the file is in cache
+ * Checks if the file is fully in cache (partially backed files are not)
  * Returns 0 if not in cache, non-zero if in cache
  */
 int mcachefs_fileincache(const char *path);
@@ -1,7 +1,13 @@
 #include "mcachefs.h"
+#include "mcachefs-compress.h"
+#include "mcachefs-dedup.h"
 #include "mcachefs-journal.h"
+#include "mcachefs-kcache.h"
+#include "mcachefs-passthrough.h"
+#include "mcachefs-prefetch.h"
 #include "mcachefs-transfer.h"
 #include "mcachefs-vops.h"
+#include "mcachefs-warmup.h"
 
 void
 mcachefs_vops_cleanup_vops(struct mcachefs_file_t *mvops)
@@ -77,8 +83,27 @@ struct mcachefs_vops_proc vops_procs[] = {
     {"transfer_max_rate", &mcachefs_config_get_transfer_max_rate,
      &mcachefs_config_set_transfer_max_rate, NULL, NULL,
      NULL, NULL},
+    {"writeback_max_rate", &mcachefs_config_get_writeback_max_rate,
+     &mcachefs_config_set_writeback_max_rate, NULL, NULL,
+     NULL, NULL},
+    {"abandon_percent", &mcachefs_config_get_abandon_percent,
+     &mcachefs_config_set_abandon_percent, NULL, NULL, NULL, NULL},
+    {"prefetch_files", &mcachefs_config_get_prefetch_files,
+     &mcachefs_config_set_prefetch_files, NULL, NULL, NULL, NULL},
     {"transfer", NULL, NULL, NULL, NULL, NULL,
      &mcachefs_transfer_dump},
+    {"prefetch", NULL, NULL, NULL, NULL, NULL,
+     &mcachefs_prefetch_dump},
+    {"warmup", NULL, NULL, NULL, NULL, NULL,
+     &mcachefs_warmup_dump},
+    {"compress", NULL, NULL, NULL, NULL, NULL,
+     &mcachefs_compress_dump},
+    {"dedup", NULL, NULL, NULL, NULL, NULL,
+     &mcachefs_dedup_dump},
+    {"passthrough", NULL, NULL, NULL, NULL, NULL,
+     &mcachefs_passthrough_dump},
+    {"kernel_cache", NULL, NULL, NULL, NULL, NULL,
+     &mcachefs_kcache_dump},
     {"journal", NULL, NULL, NULL, NULL, NULL,
      &mcachefs_journal_dump},
     {"metadata", NULL, NULL, NULL, NULL, NULL,
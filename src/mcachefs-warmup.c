@@ -0,0 +1,636 @@
+#include "mcachefs.h"
+#include "mcachefs-hash.h"
+#include "mcachefs-transfer.h"
+#include "mcachefs-vops.h"
+#include "mcachefs-warmup.h"
+
+#define MCACHEFS_WARMUP_HASH_SIZE 1024
+#define MCACHEFS_WARMUP_MAGIC     "mcachefs.hist.1"
+
+#define MCACHEFS_WARMUP_STATE_IDLE     0
+#define MCACHEFS_WARMUP_STATE_RUNNING  1
+#define MCACHEFS_WARMUP_STATE_WAITING  2
+#define MCACHEFS_WARMUP_STATE_DONE     3
+#define MCACHEFS_WARMUP_STATE_TIMEOUT  4
+#define MCACHEFS_WARMUP_STATE_DISABLED 5
+
+static const char *mcachefs_warmup_state_names[] = { "idle", "queueing", "waiting", "done", "timed out", "disabled", NULL };
+
+struct mcachefs_warmup_entry_t
+{
+    hash_t hash;
+    unsigned int hits;
+    time_t last;                //< Last open
+    char *path;
+    struct mcachefs_warmup_entry_t *next;
+};
+
+/**
+ * History file layout : a header, then for each path a record followed by the path
+ */
+struct mcachefs_warmup_header_t
+{
+    char magic[16];
+    int count;
+};
+
+struct mcachefs_warmup_record_t
+{
+    unsigned int hits;
+    int path_sz;
+    time_t last;
+};
+
+/**
+ * A file backed up by the warmup, held until its backup ends
+ */
+struct mcachefs_warmup_file_t
+{
+    mcachefs_fh_t fh;
+    struct mcachefs_file_t *mfile;
+    off_t size;
+    int finished;
+};
+
+struct mcachefs_warmup_progress_t
+{
+    int state;
+    time_t started;
+    time_t ended;
+    int files_selected;
+    int files_queued;
+    int files_cached;           //< Already in cache
+    int files_skipped;          //< Missing, not a regular file or over the size limit
+    int files_done;
+    int files_failed;
+    int files_cancelled;
+    off_t bytes_queued;
+    off_t bytes_done;
+};
+
+static struct mcachefs_mutex_t mcachefs_warmup_mutex;
+static struct mcachefs_warmup_entry_t *mcachefs_warmup_history[MCACHEFS_WARMUP_HASH_SIZE];
+static int mcachefs_warmup_history_nb = 0;
+static int mcachefs_warmup_dirty = 0;
+static struct mcachefs_warmup_progress_t mcachefs_warmup_progress;
+
+static pthread_t mcachefs_warmup_threadid;
+
+static void
+mcachefs_warmup_lock()
+{
+    mcachefs_mutex_lock(&mcachefs_warmup_mutex, "warmup", __CONTEXT);
+}
+
+static void
+mcachefs_warmup_unlock()
+{
+    mcachefs_mutex_unlock(&mcachefs_warmup_mutex, "warmup", __CONTEXT);
+}
+
+static unsigned int
+mcachefs_warmup_score(struct mcachefs_warmup_entry_t *entry, time_t now)
+{
+    time_t halves = (now - entry->last) / MCACHEFS_WARMUP_HALF_LIFE;
+
+    if (halves <= 0)
+        return entry->hits;
+    if (halves >= 32)
+        return 0;
+    return entry->hits >> halves;
+}
+
+/**
+ * Sort by decreasing hotness, the most recent open first on ties
+ */
+static time_t mcachefs_warmup_sort_now;
+
+static int
+mcachefs_warmup_compare(const void *a, const void *b)
+{
+    struct mcachefs_warmup_entry_t *ea = *(struct mcachefs_warmup_entry_t **) a;
+    struct mcachefs_warmup_entry_t *eb = *(struct mcachefs_warmup_entry_t **) b;
+    unsigned int sa = mcachefs_warmup_score(ea, mcachefs_warmup_sort_now);
+    unsigned int sb = mcachefs_warmup_score(eb, mcachefs_warmup_sort_now);
+
+    if (sa != sb)
+        return sa > sb ? -1 : 1;
+    if (ea->last != eb->last)
+        return ea->last > eb->last ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Snapshot of the history entries, hottest first - warmup lock HELD
+ * @return the entries, to be freed (not the entries themselves), or NULL if the history is empty
+ */
+static struct mcachefs_warmup_entry_t **
+mcachefs_warmup_sorted_locked()
+{
+    struct mcachefs_warmup_entry_t **sorted, *entry;
+    int cur, nb = 0;
+
+    if (!mcachefs_warmup_history_nb)
+        return NULL;
+    sorted = (struct mcachefs_warmup_entry_t **) malloc(sizeof(struct mcachefs_warmup_entry_t *) * mcachefs_warmup_history_nb);
+    if (!sorted)
+    {
+        Err("OOM : could not sort history\n");
+        return NULL;
+    }
+    for (cur = 0; cur < MCACHEFS_WARMUP_HASH_SIZE; cur++)
+    {
+        for (entry = mcachefs_warmup_history[cur]; entry; entry = entry->next)
+        {
+            sorted[nb++] = entry;
+        }
+    }
+    mcachefs_warmup_sort_now = time(NULL);
+    qsort(sorted, nb, sizeof(struct mcachefs_warmup_entry_t *), mcachefs_warmup_compare);
+    return sorted;
+}
+
+/**
+ * Forget the coldest eighth of the history - warmup lock HELD
+ */
+static void
+mcachefs_warmup_trim_locked()
+{
+    struct mcachefs_warmup_entry_t **sorted, **pentry, *entry;
+    int cur;
+
+    sorted = mcachefs_warmup_sorted_locked();
+    if (!sorted)
+        return;
+
+    /**
+     * Entries always have a hit, so the ones to forget are marked with none
+     */
+    for (cur = mcachefs_warmup_history_nb - mcachefs_warmup_history_nb / 8; cur < mcachefs_warmup_history_nb; cur++)
+    {
+        sorted[cur]->hits = 0;
+    }
+    free(sorted);
+
+    for (cur = 0; cur < MCACHEFS_WARMUP_HASH_SIZE; cur++)
+    {
+        pentry = &(mcachefs_warmup_history[cur]);
+        while ((entry = *pentry) != NULL)
+        {
+            if (entry->hits)
+            {
+                pentry = &(entry->next);
+                continue;
+            }
+            *pentry = entry->next;
+            free(entry->path);
+            free(entry);
+            mcachefs_warmup_history_nb--;
+        }
+    }
+    Log("History trimmed to %d entries\n", mcachefs_warmup_history_nb);
+}
+
+/**
+ * Add hits opens of path, the last one at last - warmup lock HELD
+ */
+static void
+mcachefs_warmup_add_locked(const char *path, unsigned int hits, time_t last)
+{
+    struct mcachefs_warmup_entry_t *entry;
+    hash_t hash = doHash(path);
+    int bucket = hash % MCACHEFS_WARMUP_HASH_SIZE;
+
+    for (entry = mcachefs_warmup_history[bucket]; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0)
+        {
+            entry->hits += hits;
+            if (last > entry->last)
+                entry->last = last;
+            return;
+        }
+    }
+
+    if (mcachefs_warmup_history_nb >= MCACHEFS_WARMUP_HISTORY_MAX)
+    {
+        mcachefs_warmup_trim_locked();
+    }
+
+    entry = (struct mcachefs_warmup_entry_t *) malloc(sizeof(struct mcachefs_warmup_entry_t));
+    if (!entry || !(entry->path = strdup(path)))
+    {
+        Err("OOM : could not record '%s' in history\n", path);
+        free(entry);
+        return;
+    }
+    entry->hash = hash;
+    entry->hits = hits;
+    entry->last = last;
+    entry->next = mcachefs_warmup_history[bucket];
+    mcachefs_warmup_history[bucket] = entry;
+    mcachefs_warmup_history_nb++;
+}
+
+void
+mcachefs_warmup_record(const char *path)
+{
+    mcachefs_warmup_lock();
+    mcachefs_warmup_add_locked(path, 1, time(NULL));
+    mcachefs_warmup_dirty = 1;
+    mcachefs_warmup_unlock();
+}
+
+static void
+mcachefs_warmup_load()
+{
+    struct mcachefs_warmup_header_t header;
+    struct mcachefs_warmup_record_t record;
+    char path[PATH_MAX];
+    int fd, cur;
+
+    fd = open(mcachefs_config_get_history(), O_RDONLY);
+    if (fd == -1)
+    {
+        Log("No history in '%s' : err=%d:%s\n", mcachefs_config_get_history(), errno, strerror(errno));
+        return;
+    }
+    if (read(fd, &header, sizeof(header)) != (ssize_t) sizeof(header)
+        || strncmp(header.magic, MCACHEFS_WARMUP_MAGIC, sizeof(header.magic)) != 0)
+    {
+        Err("Invalid history file '%s', ignoring it\n", mcachefs_config_get_history());
+        close(fd);
+        return;
+    }
+
+    mcachefs_warmup_lock();
+    for (cur = 0; cur < header.count; cur++)
+    {
+        if (read(fd, &record, sizeof(record)) != (ssize_t) sizeof(record)
+            || record.path_sz <= 0 || record.path_sz >= PATH_MAX
+            || read(fd, path, record.path_sz) != (ssize_t) record.path_sz)
+        {
+            Err("Truncated history file '%s', read %d entries out of %d\n", mcachefs_config_get_history(), cur, header.count);
+            break;
+        }
+        path[record.path_sz] = '\0';
+        mcachefs_warmup_add_locked(path, record.hits, record.last);
+    }
+    mcachefs_warmup_dirty = 0;
+    Info("Loaded %d entries of history from '%s'\n", mcachefs_warmup_history_nb, mcachefs_config_get_history());
+    mcachefs_warmup_unlock();
+    close(fd);
+}
+
+/**
+ * Write the history to a temporary file, renamed over the history file once complete
+ */
+static void
+mcachefs_warmup_save()
+{
+    struct mcachefs_warmup_header_t header;
+    struct mcachefs_warmup_record_t record;
+    struct mcachefs_warmup_entry_t *entry;
+    char *tmppath;
+    int fd, cur, res = 0;
+
+    tmppath = mcachefs_makepath(".tmp", mcachefs_config_get_history());
+    if (!tmppath)
+        return;
+
+    mcachefs_warmup_lock();
+    if (!mcachefs_warmup_dirty)
+    {
+        mcachefs_warmup_unlock();
+        free(tmppath);
+        return;
+    }
+
+    fd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+    {
+        Err("Could not create history '%s' : err=%d:%s\n", tmppath, errno, strerror(errno));
+        mcachefs_warmup_unlock();
+        free(tmppath);
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, MCACHEFS_WARMUP_MAGIC, sizeof(header.magic));
+    header.count = mcachefs_warmup_history_nb;
+    if (write(fd, &header, sizeof(header)) != (ssize_t) sizeof(header))
+        res = -EIO;
+
+    for (cur = 0; cur < MCACHEFS_WARMUP_HASH_SIZE && !res; cur++)
+    {
+        for (entry = mcachefs_warmup_history[cur]; entry && !res; entry = entry->next)
+        {
+            record.hits = entry->hits;
+            record.path_sz = strlen(entry->path);
+            record.last = entry->last;
+            if (write(fd, &record, sizeof(record)) != (ssize_t) sizeof(record)
+                || write(fd, entry->path, record.path_sz) != (ssize_t) record.path_sz)
+                res = -EIO;
+        }
+    }
+    if (close(fd))
+        res = -EIO;
+
+    if (res || rename(tmppath, mcachefs_config_get_history()))
+    {
+        Err("Could not save history '%s' : err=%d:%s\n", mcachefs_config_get_history(), errno, strerror(errno));
+        unlink(tmppath);
+    }
+    else
+    {
+        mcachefs_warmup_dirty = 0;
+        Log("Saved %d entries of history\n", mcachefs_warmup_history_nb);
+    }
+    mcachefs_warmup_unlock();
+    free(tmppath);
+}
+
+static int
+mcachefs_warmup_quitting()
+{
+    return mcachefs_config_get_read_state() == MCACHEFS_STATE_QUITTING;
+}
+
+/**
+ * Queue the backup of a file of the history, unless it is missing, already cached or over the remaining size
+ * @return 0 if queued, 1 if already cached, -1 if skipped
+ */
+static int
+mcachefs_warmup_queue(const char *path, off_t maxsize, struct mcachefs_warmup_file_t *file)
+{
+    struct mcachefs_metadata_t *mdata;
+    int cached;
+
+    mdata = mcachefs_metadata_find(path);
+    if (!mdata)
+    {
+        Log("Warmup : '%s' does not exist anymore\n", path);
+        return -1;
+    }
+    if (!S_ISREG(mdata->st.st_mode) || mdata->st.st_size > maxsize)
+    {
+        mcachefs_metadata_release(mdata);
+        return -1;
+    }
+    file->size = mdata->st.st_size;
+    file->fh = mcachefs_fileid_get(mdata, NULL, mcachefs_file_type_file);
+    file->mfile = mcachefs_file_get(file->fh);
+    file->finished = 0;
+    mcachefs_metadata_release(mdata);
+
+    mcachefs_transfer_backfile(file->mfile, MCACHEFS_TRANSFER_PRIORITY_PREFETCH);
+
+    mcachefs_file_lock_file(file->mfile);
+    cached = (file->mfile->cache_status == MCACHEFS_FILE_BACKING_DONE);
+    mcachefs_file_unlock_file(file->mfile);
+
+    if (cached)
+    {
+        mcachefs_fileid_put(file->fh);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Account the backups which ended
+ * @return the number of backups still running
+ */
+static int
+mcachefs_warmup_check(struct mcachefs_warmup_file_t *files, int nb)
+{
+    int cur, status, running = 0;
+
+    for (cur = 0; cur < nb; cur++)
+    {
+        if (files[cur].finished)
+            continue;
+
+        mcachefs_file_lock_file(files[cur].mfile);
+        status = files[cur].mfile->cache_status;
+        mcachefs_file_unlock_file(files[cur].mfile);
+
+        if (status == MCACHEFS_FILE_BACKING_ASKED || status == MCACHEFS_FILE_BACKING_IN_PROGRESS)
+        {
+            running++;
+            continue;
+        }
+        files[cur].finished = 1;
+        mcachefs_warmup_lock();
+        if (status == MCACHEFS_FILE_BACKING_DONE)
+        {
+            mcachefs_warmup_progress.files_done++;
+            mcachefs_warmup_progress.bytes_done += files[cur].size;
+        }
+        else
+        {
+            mcachefs_warmup_progress.files_failed++;
+        }
+        mcachefs_warmup_unlock();
+    }
+    return running;
+}
+
+static void
+mcachefs_warmup_run()
+{
+    struct mcachefs_warmup_entry_t **sorted;
+    struct mcachefs_warmup_file_t *files;
+    char **paths;
+    int cur, nb = 0, queued = 0, res;
+    off_t maxsize = mcachefs_config_get_warmup_max_size(), bytes = 0;
+    time_t deadline = time(NULL) + mcachefs_config_get_warmup_max_time();
+
+    /**
+     * Copy the paths of the hottest files, as the history changes with the opens served meanwhile
+     */
+    mcachefs_warmup_lock();
+    mcachefs_warmup_progress.started = time(NULL);
+    sorted = mcachefs_warmup_sorted_locked();
+    if (sorted)
+    {
+        nb = mcachefs_config_get_warmup_files();
+        if (nb > mcachefs_warmup_history_nb)
+            nb = mcachefs_warmup_history_nb;
+    }
+    paths = (char **) malloc(sizeof(char *) * (nb + 1));
+    files = (struct mcachefs_warmup_file_t *) malloc(sizeof(struct mcachefs_warmup_file_t) * (nb + 1));
+    if (!paths || !files)
+    {
+        Err("OOM : could not run warmup\n");
+        nb = 0;
+    }
+    for (cur = 0; cur < nb; cur++)
+    {
+        paths[cur] = strdup(sorted[cur]->path);
+    }
+    free(sorted);
+    mcachefs_warmup_progress.files_selected = nb;
+    mcachefs_warmup_progress.state = MCACHEFS_WARMUP_STATE_RUNNING;
+    mcachefs_warmup_unlock();
+
+    Info("Warming up the %d most accessed files (up to %luM)\n", nb, (unsigned long) maxsize >> 20);
+
+    for (cur = 0; cur < nb && !mcachefs_warmup_quitting() && time(NULL) < deadline; cur++)
+    {
+        res = paths[cur] ? mcachefs_warmup_queue(paths[cur], maxsize - bytes, &(files[queued])) : -1;
+
+        mcachefs_warmup_lock();
+        if (res == 0)
+        {
+            bytes += files[queued].size;
+            mcachefs_warmup_progress.files_queued++;
+            mcachefs_warmup_progress.bytes_queued = bytes;
+            queued++;
+        }
+        else if (res == 1)
+        {
+            mcachefs_warmup_progress.files_cached++;
+        }
+        else
+        {
+            mcachefs_warmup_progress.files_skipped++;
+        }
+        mcachefs_warmup_unlock();
+    }
+
+    mcachefs_warmup_lock();
+    mcachefs_warmup_progress.state = MCACHEFS_WARMUP_STATE_WAITING;
+    mcachefs_warmup_unlock();
+
+    while (mcachefs_warmup_check(files, queued) && !mcachefs_warmup_quitting() && time(NULL) < deadline)
+    {
+        sleep(1);
+    }
+
+    /**
+     * Backups still queued are cancelled, the ones being copied are left to complete
+     */
+    for (cur = 0; cur < queued; cur++)
+    {
+        if (!files[cur].finished && mcachefs_transfer_cancel(files[cur].mfile, MCACHEFS_TRANSFER_PRIORITY_PREFETCH) == 0)
+        {
+            mcachefs_warmup_lock();
+            mcachefs_warmup_progress.files_cancelled++;
+            mcachefs_warmup_unlock();
+        }
+        mcachefs_fileid_put(files[cur].fh);
+    }
+
+    mcachefs_warmup_lock();
+    mcachefs_warmup_progress.ended = time(NULL);
+    mcachefs_warmup_progress.state = (time(NULL) < deadline) ? MCACHEFS_WARMUP_STATE_DONE : MCACHEFS_WARMUP_STATE_TIMEOUT;
+    Info("Warmup %s : %d files backed up (%luM), %d already cached, %d skipped, %d failed, %d cancelled\n",
+         mcachefs_warmup_state_names[mcachefs_warmup_progress.state], mcachefs_warmup_progress.files_done,
+         (unsigned long) mcachefs_warmup_progress.bytes_done >> 20, mcachefs_warmup_progress.files_cached,
+         mcachefs_warmup_progress.files_skipped, mcachefs_warmup_progress.files_failed,
+         mcachefs_warmup_progress.files_cancelled);
+    mcachefs_warmup_unlock();
+
+    for (cur = 0; cur < nb; cur++)
+    {
+        free(paths[cur]);
+    }
+    free(paths);
+    free(files);
+}
+
+static void *
+mcachefs_warmup_thread(void *arg)
+{
+    int elapsed = 0;
+
+    (void) arg;
+    Info("Warmup thread %lx up and running.\n", (unsigned long) pthread_self());
+
+    if (mcachefs_config_get_warmup_files() > 0 && mcachefs_config_get_read_state() == MCACHEFS_STATE_NORMAL)
+    {
+        mcachefs_warmup_run();
+    }
+    else
+    {
+        mcachefs_warmup_lock();
+        mcachefs_warmup_progress.state = MCACHEFS_WARMUP_STATE_DISABLED;
+        mcachefs_warmup_unlock();
+    }
+
+    while (!mcachefs_warmup_quitting())
+    {
+        sleep(1);
+        if (++elapsed >= MCACHEFS_WARMUP_SAVE_INTERVAL)
+        {
+            mcachefs_warmup_save();
+            elapsed = 0;
+        }
+    }
+    Log("Interrupting warmup thread %lx\n", (unsigned long) pthread_self());
+    return NULL;
+}
+
+void
+mcachefs_warmup_start_thread()
+{
+    pthread_attr_t attrs;
+
+    mcachefs_mutex_init(&mcachefs_warmup_mutex);
+    memset(mcachefs_warmup_history, 0, sizeof(mcachefs_warmup_history));
+    memset(&mcachefs_warmup_progress, 0, sizeof(mcachefs_warmup_progress));
+
+    mcachefs_warmup_load();
+
+    pthread_attr_init(&attrs);
+    pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_JOINABLE);
+    pthread_create(&mcachefs_warmup_threadid, &attrs, mcachefs_warmup_thread, NULL);
+}
+
+void
+mcachefs_warmup_stop_thread()
+{
+    int res;
+    void *arg;
+    if ((res = pthread_join(mcachefs_warmup_threadid, &arg)) != 0)
+    {
+        Err("Could not join warmup thread %lx : err=%d:%s\n", mcachefs_warmup_threadid, res, strerror(res));
+    }
+    Info("Warmup thread interrupted.\n");
+    mcachefs_warmup_save();
+}
+
+void
+mcachefs_warmup_dump(struct mcachefs_file_t *mvops)
+{
+    struct mcachefs_warmup_progress_t *progress = &mcachefs_warmup_progress;
+    struct mcachefs_warmup_entry_t **sorted;
+    time_t now = time(NULL);
+    int cur, nb = mcachefs_config_get_warmup_files() > 0 ? mcachefs_config_get_warmup_files() : 16;
+
+    mcachefs_warmup_lock();
+    __VOPS_WRITE(mvops, "Warmup : %s", mcachefs_warmup_state_names[progress->state]);
+    if (progress->started)
+    {
+        __VOPS_WRITE(mvops, " (%lds out of %ds)", (long) ((progress->ended ? progress->ended : now) - progress->started),
+                     mcachefs_config_get_warmup_max_time());
+    }
+    __VOPS_WRITE(mvops, "\n");
+    __VOPS_WRITE(mvops, "Files : %d selected, %d queued, %d backed up, %d already cached, %d skipped, %d failed, %d cancelled\n",
+                 progress->files_selected, progress->files_queued, progress->files_done, progress->files_cached,
+                 progress->files_skipped, progress->files_failed, progress->files_cancelled);
+    __VOPS_WRITE(mvops, "Bytes : %luk backed up out of %luk queued (limit %luk)\n", (unsigned long) progress->bytes_done >> 10,
+                 (unsigned long) progress->bytes_queued >> 10, (unsigned long) mcachefs_config_get_warmup_max_size() >> 10);
+
+    __VOPS_WRITE(mvops, "\nHistory : %d files%s\n", mcachefs_warmup_history_nb, mcachefs_warmup_dirty ? " (not saved)" : "");
+    __VOPS_WRITE(mvops, "\t%8s %8s %10s %s\n", "score", "hits", "last", "path");
+    sorted = mcachefs_warmup_sorted_locked();
+    for (cur = 0; sorted && cur < mcachefs_warmup_history_nb && cur < nb; cur++)
+    {
+        __VOPS_WRITE(mvops, "\t%8u %8u %10lu %s\n", mcachefs_warmup_score(sorted[cur], now), sorted[cur]->hits,
+                     (unsigned long) sorted[cur]->last, sorted[cur]->path);
+    }
+    free(sorted);
+    mcachefs_warmup_unlock();
+}
@@ -0,0 +1,36 @@
+#ifndef __MCACHEFS_WARMUP_H
+#define __MCACHEFS_WARMUP_H
+
+/**
+ * ********************* WARMUP *****************************
+ * Access history of the files opened, kept in the history file next to the metafile, and replayed at mount time.
+ * Each path has a hit count and the time of its last open ; its hotness is the hit count halved for every
+ * MCACHEFS_WARMUP_HALF_LIFE elapsed since the last open. At most MCACHEFS_WARMUP_HISTORY_MAX paths are kept, the
+ * coldest ones being forgotten first.
+ * At mount time, the warmup thread backs up the warmup-files hottest files at MCACHEFS_TRANSFER_PRIORITY_PREFETCH,
+ * skipping those which would exceed warmup-max-size, and cancels the backups still queued after warmup-max-time.
+ * The thread then saves the history every MCACHEFS_WARMUP_SAVE_INTERVAL, and a last time at umount.
+ */
+
+#define MCACHEFS_WARMUP_HISTORY_MAX   8192
+#define MCACHEFS_WARMUP_HALF_LIFE     (7 * 24 * 3600)
+#define MCACHEFS_WARMUP_SAVE_INTERVAL 300
+
+/**
+ * Load the history file, and start the warmup thread
+ */
+void mcachefs_warmup_start_thread();
+
+/**
+ * Stop the warmup thread, and save the history file
+ */
+void mcachefs_warmup_stop_thread();
+
+/**
+ * Record an open of path in the history - no lock HELD
+ */
+void mcachefs_warmup_record(const char *path);
+
+void mcachefs_warmup_dump(struct mcachefs_file_t *mvops);
+
+#endif // __MCACHEFS_WARMUP_H
@@ -0,0 +1,115 @@
+#include "mcachefs.h"
+#include "mcachefs-window.h"
+
+void
+mcachefs_window_init(struct mcachefs_window_t *window)
+{
+    window->size = MCACHEFS_WINDOW_SIZE_MIN;
+    window->ssthresh = MCACHEFS_WINDOW_SIZE_MAX;
+    window->best_size = MCACHEFS_WINDOW_SIZE_MIN;
+    window->best_rate = 0;
+    window->smooth_rate = 0;
+    window->samples = 0;
+}
+
+/**
+ * Halve the window, which becomes the reference for the following samples, and leave slow start
+ */
+static void
+mcachefs_window_reduce(struct mcachefs_window_t *window, long long rate)
+{
+    window->size /= 2;
+    if (window->size < MCACHEFS_WINDOW_SIZE_MIN)
+        window->size = MCACHEFS_WINDOW_SIZE_MIN;
+    window->ssthresh = window->size;
+    window->best_size = window->size;
+    window->best_rate = rate;
+    window->smooth_rate = rate;
+    window->samples = 0;
+}
+
+void
+mcachefs_window_update(struct mcachefs_window_t *window, off_t copied, long long elapsed)
+{
+    long long rate;
+
+    if (copied <= 0 || copied < window->size)
+        return;
+
+    if (elapsed <= 0)
+        elapsed = 1;
+    rate = (((long long) copied) * 1000000000LL) / elapsed;
+    window->smooth_rate = window->smooth_rate ? window->smooth_rate + (rate - window->smooth_rate) / 4 : rate;
+
+    if (elapsed > MCACHEFS_WINDOW_LATENCY_MAX)
+    {
+        mcachefs_window_reduce(window, rate);
+        Log("Call took %lldms, reducing window to %luk\n", elapsed / 1000000, (unsigned long) window->size >> 10);
+    }
+    else if (window->size < window->ssthresh)
+    {
+        if (rate >= window->best_rate + window->best_rate / 4)
+            window->samples = 0;
+        else
+            window->samples++;
+        if (rate > window->best_rate)
+        {
+            window->best_rate = rate;
+            window->best_size = window->size;
+        }
+
+        if (window->samples >= 3)
+        {
+            window->size = window->best_size;
+            window->ssthresh = window->size;
+            window->samples = 0;
+            Log("End of slow start at window %luk, rate=%lldkb/s\n", (unsigned long) window->size >> 10,
+                window->best_rate >> 10);
+        }
+        else
+        {
+            window->size *= 2;
+        }
+    }
+    else if (window->size != window->best_size)
+    {
+        /**
+         * A larger window is kept unless it does worse than the best one
+         */
+        if (rate >= window->best_rate - window->best_rate / 16)
+        {
+            window->best_size = window->size;
+            if (rate > window->best_rate)
+                window->best_rate = rate;
+        }
+        else
+        {
+            window->size = window->best_size;
+        }
+    }
+    else if (rate > window->best_rate)
+    {
+        window->best_rate = rate;
+    }
+    else if (window->smooth_rate < window->best_rate - window->best_rate / 4)
+    {
+        mcachefs_window_reduce(window, rate);
+        Log("Congestion (rate=%lldkb/s), reducing window to %luk\n", window->smooth_rate >> 10, (unsigned long) window->size >> 10);
+    }
+    else
+    {
+        /**
+         * The best throughput slowly drifts down to the current one, so that a source which got slower is learnt again,
+         * and a larger window is tried every few samples
+         */
+        window->best_rate -= (window->best_rate - rate) >> 4;
+        if (++window->samples >= MCACHEFS_WINDOW_PROBE_SAMPLES)
+        {
+            window->samples = 0;
+            window->size += window->size / 8;
+        }
+    }
+
+    if (window->size > MCACHEFS_WINDOW_SIZE_MAX)
+        window->size = MCACHEFS_WINDOW_SIZE_MAX;
+}
@@ -0,0 +1,48 @@
+#ifndef __MCACHEFS_WINDOW_H
+#define __MCACHEFS_WINDOW_H
+
+/**
+ * ********************* WINDOW *****************************
+ * Congestion-style control of the amount of data copied per call by a transfer, driven by the throughput of each call.
+ * The window doubles from its start size (slow start) until three doublings in a row did not improve the throughput
+ * by a quarter, then goes back to the window which gave the best throughput. Every few samples, a window one eighth
+ * larger is tried, and kept unless it does worse. The window is halved when the smoothed throughput falls below three
+ * quarters of the best one, or when a single call takes longer than MCACHEFS_WINDOW_LATENCY_MAX.
+ * Only calls which copied a whole window are sampled, as the fixed cost of a call skews the throughput of short ones.
+ * The controller has no lock : each transfer has its own, seeded from the one remembered for its devices.
+ */
+
+#define MCACHEFS_WINDOW_SIZE_MIN (4LL << 10)
+#define MCACHEFS_WINDOW_SIZE_MAX (8LL << 20)
+
+/**
+ * Samples at the best window between two tries of a larger one
+ */
+#define MCACHEFS_WINDOW_PROBE_SAMPLES 4
+
+/**
+ * Longest call before the window is reduced, in nanoseconds, so that transfers stay responsive to cancellation
+ */
+#define MCACHEFS_WINDOW_LATENCY_MAX 1000000000LL
+
+struct mcachefs_window_t
+{
+    off_t size;                 //< Bytes to copy per call
+    off_t ssthresh;             //< Slow start threshold, the window doubles below it
+    off_t best_size;            //< Window which gave the best throughput
+    long long best_rate;        //< Best throughput seen, in bytes per second
+    long long smooth_rate;      //< Moving average of the throughput, in bytes per second
+    int samples;                //< Doublings without gain in slow start, samples since the last try afterwards
+};
+
+/**
+ * Start from the smallest window, in slow start
+ */
+void mcachefs_window_init(struct mcachefs_window_t *window);
+
+/**
+ * Account a call which copied copied bytes in elapsed nanoseconds, and adapt the window size
+ */
+void mcachefs_window_update(struct mcachefs_window_t *window, off_t copied, long long elapsed);
+
+#endif // __MCACHEFS_WINDOW_H
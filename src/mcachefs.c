@@ -54,11 +54,74 @@ main(int argc, char *argv[])
     Info("Serving read-write !\n");
 #endif
 
-    void *user_data = NULL;
-    int fuse_argc = config->fuse_args.argc;
-    char **fuse_argv = config->fuse_args.argv;
-    fuse_main(fuse_argc, fuse_argv, &mcachefs_oper, user_data);
+    struct fuse_args fuse_args = FUSE_ARGS_INIT(0, NULL);
+    struct fuse_cmdline_opts opts;
+    struct fuse_loop_config *loop_config;
+    struct fuse_session *session;
+    char max_read[32];
+    int arg, res = 1;
+
+    /**
+     * The kernel only takes max_read from the mount options, the init callback sets the same value in the connection
+     */
+    snprintf(max_read, sizeof(max_read), "-omax_read=%u", mcachefs_config_get_max_read());
+    for (arg = 0; arg < config->fuse_args.argc; arg++)
+    {
+        if (fuse_opt_add_arg(&fuse_args, config->fuse_args.argv[arg]) == -1)
+            return 1;
+    }
+    if (fuse_opt_add_arg(&fuse_args, max_read) == -1 || fuse_parse_cmdline(&fuse_args, &opts) == -1)
+    {
+        fuse_opt_free_args(&fuse_args);
+        return 1;
+    }
+    if (opts.show_help || opts.show_version)
+    {
+        if (opts.show_help)
+            fuse_cmdline_help();
+        fuse_lowlevel_version();
+        free(opts.mountpoint);
+        fuse_opt_free_args(&fuse_args);
+        return 0;
+    }
+
+    /**
+     * The session is given to the callbacks as userdata, for the kcache thread to send invalidations on
+     */
+    session = fuse_session_new(&fuse_args, &mcachefs_oper, sizeof(mcachefs_oper), &session);
+    if (session != NULL)
+    {
+        if (fuse_set_signal_handlers(session) == 0)
+        {
+            if (fuse_session_mount(session, opts.mountpoint) == 0)
+            {
+                fuse_daemonize(opts.foreground);
+                if (opts.singlethread)
+                {
+                    res = fuse_session_loop(session);
+                }
+                else if ((loop_config = fuse_loop_cfg_create()) != NULL)
+                {
+                    fuse_loop_cfg_set_clone_fd(loop_config, opts.clone_fd);
+                    fuse_loop_cfg_set_idle_threads(loop_config, opts.max_idle_threads);
+                    fuse_loop_cfg_set_max_threads(loop_config, opts.max_threads);
+                    Info("Serving with up to %u threads%s\n", opts.max_threads, opts.clone_fd ? ", one fd each" : "");
+                    res = fuse_session_loop_mt(session, loop_config);
+                    fuse_loop_cfg_destroy(loop_config);
+                }
+                fuse_session_unmount(session);
+            }
+            else
+            {
+                Err("Could not mount '%s'\n", opts.mountpoint);
+            }
+            fuse_remove_signal_handlers(session);
+        }
+        fuse_session_destroy(session);
+    }
+    free(opts.mountpoint);
+    fuse_opt_free_args(&fuse_args);
 
     Info("Serving finished !\n");
-    return 0;
+    return res ? 1 : 0;
 }
@@ -3,7 +3,10 @@
 
 #define __MCACHEFS_VERSION__ "0.6.0"
 
-#define FUSE_USE_VERSION 29
+/**
+ * libfuse 3.12 or later : loop configuration (fuse_loop_cfg_*) and max_threads
+ */
+#define FUSE_USE_VERSION 312
 
 #ifndef _DEFAULT_SOURCE
 #define _DEFAULT_SOURCE
@@ -18,7 +21,7 @@
 #define __USE_GNU
 #endif
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -50,7 +53,7 @@
 #include "mcachefs-metadata.h"
 #include "mcachefs-util.h"
 
-extern struct fuse_operations mcachefs_oper;
+extern struct fuse_lowlevel_ops mcachefs_oper;
 
 extern struct stat mcachefs_target_stat;
 
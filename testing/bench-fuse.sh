@@ -0,0 +1,138 @@
+#!/bin/bash
+#
+# Benchmark of the FUSE front end : stat of many small files, and sequential reads of a large file, through one or
+# two mcachefs binaries (typically built before and after a change), or the same binary with other options.
+#
+# Run from the top directory :
+#   testing/bench-fuse.sh [binary-before [binary-after]]
+# Binaries default to src/mcachefs. BENCH_FILES (default 5000), BENCH_SIZE_MB (default 1024), and BENCH_OPTS,
+# BENCH_OPTS_BEFORE, BENCH_OPTS_AFTER (extra options, e.g. "-o max_threads=16,clone_fd") tune the runs.
+# Page cache drops between reads need root, hot reads are served by the page cache otherwise.
+
+BEFORE=${1:-src/mcachefs}
+AFTER=${2:-$BEFORE}
+
+BENCH_FILES=${BENCH_FILES:-5000}
+BENCH_SIZE_MB=${BENCH_SIZE_MB:-1024}
+
+BASEPATH=/tmp/mcachefs.bench
+TARGET=$BASEPATH/target
+LOCAL=$BASEPATH/local
+
+function now() {
+    date +%s.%N
+}
+
+function elapsed() {
+    echo "$1 $(now)" | awk '{ printf "%.3f", $2 - $1 }'
+}
+
+function drop_caches() {
+    sync
+    if [ -w /proc/sys/vm/drop_caches ] ; then
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+}
+
+function unmount_local() {
+    fusermount3 -u $LOCAL 2> /dev/null || fusermount -u $LOCAL 2> /dev/null
+    sleep 1
+}
+
+function make_target() {
+    if [ -r $TARGET/.bench-$BENCH_FILES-$BENCH_SIZE_MB ] ; then
+        return
+    fi
+    echo "[INFO] Creating $BENCH_FILES small files and a ${BENCH_SIZE_MB}M file in $TARGET"
+    rm -rf $TARGET
+    mkdir -p $TARGET/big
+    for d in $(seq 0 $(( (BENCH_FILES - 1) / 100 ))) ; do
+        mkdir -p $TARGET/small/$d
+        for f in $(seq 0 99) ; do
+            echo "small file $d/$f" > $TARGET/small/$d/$f
+        done
+    done
+    dd if=/dev/urandom of=$TARGET/big/file bs=1M count=$BENCH_SIZE_MB 2> /dev/null
+    touch $TARGET/.bench-$BENCH_FILES-$BENCH_SIZE_MB
+}
+
+function wait_backup() {
+    local size=$(stat -c %s $TARGET/big/file)
+    local i
+    for i in $(seq 1 600) ; do
+        if [ "$(stat -c %s $BASEPATH/cache/big/file 2> /dev/null)" == "$size" ] \
+            && ! grep -q "big/file" $LOCAL/.mcachefs/transfer 2> /dev/null ; then
+            return
+        fi
+        sleep 1
+    done
+    echo "[ERR] Backup of big/file not complete after 600s"
+}
+
+function run_bench() {
+    local NAME=$1
+    local BINARY=$2
+    local OPTS=$3
+
+    unmount_local
+    rm -rf $BASEPATH/cache $BASEPATH/metafile $BASEPATH/journal $BASEPATH/history
+    mkdir -p $BASEPATH/cache $LOCAL
+
+    $BINARY -f $TARGET $LOCAL -o metafile=$BASEPATH/metafile,journal=$BASEPATH/journal,history=$BASEPATH/history,cache=$BASEPATH/cache/ \
+        $BENCH_OPTS $OPTS 2> $BASEPATH/log.$NAME &
+    local i
+    for i in $(seq 1 30) ; do
+        if [ -r $LOCAL/.mcachefs/action ] ; then
+            break
+        fi
+        sleep 1
+    done
+    if [ ! -r $LOCAL/.mcachefs/action ] ; then
+        echo "[ERR] $BINARY did not mount $LOCAL, see $BASEPATH/log.$NAME"
+        exit 1
+    fi
+
+    local start
+
+    drop_caches
+    start=$(now)
+    find $LOCAL/small -type f -print0 | xargs -0 stat > /dev/null
+    local stat_cold=$(elapsed $start)
+
+    drop_caches
+    start=$(now)
+    find $LOCAL/small -type f -print0 | xargs -0 stat > /dev/null
+    local stat_warm=$(elapsed $start)
+
+    drop_caches
+    start=$(now)
+    dd if=$LOCAL/big/file of=/dev/null bs=1M 2> /dev/null
+    local read_cold=$(elapsed $start)
+
+    wait_backup
+
+    drop_caches
+    start=$(now)
+    dd if=$LOCAL/big/file of=/dev/null bs=1M 2> /dev/null
+    local read_cached=$(elapsed $start)
+
+    start=$(now)
+    dd if=$LOCAL/big/file of=/dev/null bs=1M 2> /dev/null
+    local read_hot=$(elapsed $start)
+
+    unmount_local
+
+    echo "$NAME $stat_cold $stat_warm $read_cold $read_cached $read_hot" | awk -v files=$BENCH_FILES -v mb=$BENCH_SIZE_MB \
+        '{ printf "%-8s stat %8.0f/s cold %8.0f/s warm   read %7.1fM/s cold %7.1fM/s cached %7.1fM/s hot\n", \
+               $1, files / $2, files / $3, mb / $4, mb / $5, mb / $6 }'
+}
+
+mkdir -p $BASEPATH
+make_target
+
+if [ ! -w /proc/sys/vm/drop_caches ] ; then
+    echo "[INFO] Not root : page cache is not dropped between runs"
+fi
+
+run_bench before $BEFORE "$BENCH_OPTS_BEFORE"
+run_bench after $AFTER "$BENCH_OPTS_AFTER"
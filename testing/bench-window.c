@@ -0,0 +1,101 @@
+/**
+ * Convergence benchmark of the transfer window controller (src/mcachefs-window.c)
+ *
+ * The source is simulated with a deterministic clock, so that runs are repeatable : a call copying size bytes takes
+ * latency + size / bandwidth, and the part of the call above the buffer of the source is served three times slower,
+ * as a throttling server or a congested link would.
+ *
+ * Build and run from src/ : make bench-window && ./bench-window [latency_us bandwidth_kbs buffer_kb]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "mcachefs-window.h"
+
+FILE *LOG_FD;
+
+struct bench_source_t
+{
+    const char *name;
+    long long latency;          //< Fixed cost of a call, in nanoseconds
+    long long bandwidth;        //< In bytes per second
+    long long buffer;           //< Bytes served at full bandwidth per call, 0 for no limit
+};
+
+static long long
+bench_elapsed(struct bench_source_t *source, off_t size)
+{
+    long long fast = size, slow = 0;
+
+    if (source->buffer && fast > source->buffer)
+    {
+        slow = fast - source->buffer;
+        fast = source->buffer;
+    }
+    return source->latency + ((fast + 3 * slow) * 1000000000LL) / source->bandwidth;
+}
+
+static void
+bench_run(struct bench_source_t *source, off_t total)
+{
+    struct mcachefs_window_t window;
+    long long clock = 0, elapsed;
+    off_t copied = 0, tocopy;
+    int calls = 0;
+
+    mcachefs_window_init(&window);
+
+    printf("%s : latency=%lldus, bandwidth=%lldkb/s, buffer=%lldk\n", source->name, source->latency / 1000,
+           source->bandwidth >> 10, source->buffer >> 10);
+    printf("\t%8s %10s %10s %10s %12s\n", "calls", "time(ms)", "copied(k)", "window(k)", "rate(kb/s)");
+
+    while (copied < total)
+    {
+        tocopy = total - copied < window.size ? total - copied : window.size;
+        elapsed = bench_elapsed(source, tocopy);
+        mcachefs_window_update(&window, tocopy, elapsed);
+        clock += elapsed;
+        copied += tocopy;
+        calls++;
+
+        if ((calls & (calls - 1)) == 0 || copied == total)
+        {
+            printf("\t%8d %10lld %10lu %10lu %12lld\n", calls, clock / 1000000, (unsigned long) copied >> 10,
+                   (unsigned long) window.size >> 10, (tocopy * 1000000000LL / elapsed) >> 10);
+        }
+    }
+    printf("\tAverage rate : %lldkb/s (%.1f%% of bandwidth)\n\n", (((long long) copied) * 1000000000LL / clock) >> 10,
+           (100.0 * copied * 1000000000.0 / clock) / source->bandwidth);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct bench_source_t sources[] = {
+        {"Local disc", 100000LL, 200LL << 20, 0},
+        {"LAN", 500000LL, 100LL << 20, 0},
+        {"WAN", 40000000LL, 10LL << 20, 0},
+        {"Throttled, 1M buffer", 2000000LL, 20LL << 20, 1LL << 20},
+        {"Throttled, 64k buffer", 2000000LL, 1LL << 20, 64LL << 10},
+    };
+    struct bench_source_t custom;
+    unsigned int cur;
+
+    LOG_FD = stderr;
+
+    if (argc == 4)
+    {
+        custom.name = "Custom";
+        custom.latency = atoll(argv[1]) * 1000;
+        custom.bandwidth = atoll(argv[2]) << 10;
+        custom.buffer = atoll(argv[3]) << 10;
+        bench_run(&custom, 256LL << 20);
+        return 0;
+    }
+    for (cur = 0; cur < sizeof(sources) / sizeof(sources[0]); cur++)
+    {
+        bench_run(&sources[cur], 256LL << 20);
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+. testing/testing-common.sh
+
+cleanup_testing
+
+LOCAL=$BASEPATH/local
+TARGET=$BASEPATH/target
+
+mkdir -p $LOCAL
+mkdir -p $TARGET
+
+dd if=/dev/urandom of=$TARGET/bigfile bs=1M count=32 2> /dev/null
+
+run_mcachefs $TARGET $LOCAL
+
+echo "[Test] Reading the tail of a file before it is backed up"
+
+dd if=$TARGET/bigfile of=$BASEPATH/tail.target bs=1M skip=30 count=2 2> /dev/null
+dd if=$LOCAL/bigfile of=$BASEPATH/tail.local bs=1M skip=30 count=2 2> /dev/null
+
+compare_files $BASEPATH/tail.target $BASEPATH/tail.local
+
+echo "[Test] Reading the whole file"
+
+compare_files $TARGET/bigfile $LOCAL/bigfile
+
+sleep 2
+
+echo "[Test] Backing file is complete"
+
+compare_files $TARGET/bigfile $CACHE/bigfile
+check_file_notexists $CACHE/.mcachefs/chunks/bigfile
+
+echo "[OK] All tests OK!"
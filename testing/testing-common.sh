@@ -34,13 +34,22 @@ function cleanup_testing {
 function run_mcachefs() {
     TARGET=$1
     LOCAL=$2
+    OPTIONS=$3
     
     echo "Mounting $TARGET $LOCAL"
-    ./$MCACHEFS -f $TARGET $LOCAL -o metafile=$METAFILE,journal=$JOURNAL,cache=$CACHE/ 2> $BASEPATH/log &
+    ./$MCACHEFS -f $TARGET $LOCAL -o metafile=$METAFILE,journal=$JOURNAL,cache=$CACHE/${OPTIONS:+,$OPTIONS} 2>> $BASEPATH/log &
     echo "[INFO] Mounting $TARGET $LOCAL Done !"
     sleep 1
 }
 
+function stop_mcachefs() {
+    LOCAL=$1
+
+    echo "Unmounting $LOCAL"
+    fusermount -u $LOCAL
+    sleep 1
+}
+
 function compare_files() {
     FILE1=$1
     FILE2=$2
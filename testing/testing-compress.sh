@@ -0,0 +1,54 @@
+#!/bin/bash
+
+. testing/testing-common.sh
+
+cleanup_testing
+
+LOCAL=$BASEPATH/local
+TARGET=$BASEPATH/target
+
+mkdir -p $LOCAL
+mkdir -p $TARGET
+
+seq 1 500000 > $TARGET/text
+
+run_mcachefs $TARGET $LOCAL compress=lz4
+
+echo "[Test] Testing file fetching to cache"
+
+compare_files $TARGET/text $LOCAL/text
+
+sleep 3
+
+echo "[Test] Backing file is compressed"
+
+compare_files_different $TARGET/text $CACHE/text
+if which getfattr > /dev/null 2>&1 ; then
+    if ! getfattr -n user.mcachefs.compressed $CACHE/text > /dev/null 2>&1 ; then
+        echo "[ERR] Backing file $CACHE/text is not marked as compressed !"
+        exit 1
+    fi
+    echo "[OK] Backing file $CACHE/text is marked as compressed"
+fi
+cat $LOCAL/.mcachefs/compress
+
+echo "[Test] Reading back a compressed file after a remount"
+
+stop_mcachefs $LOCAL
+run_mcachefs $TARGET $LOCAL compress=lz4
+
+compare_files $TARGET/text $LOCAL/text
+
+echo "[Test] Writing to a compressed file inflates it back"
+
+echo "Appended to text" >> $LOCAL/text
+
+compare_files_different $TARGET/text $LOCAL/text
+tail -n 1 $LOCAL/text | grep -q "^Appended to text$" || { echo "[ERR] Append to $LOCAL/text lost !" ; exit 1 ; }
+echo "[OK] Append to $LOCAL/text kept"
+
+stop_mcachefs $LOCAL
+
+echo "[OK] All tests OK!"
+
+# cleanup_testing
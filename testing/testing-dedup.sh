@@ -0,0 +1,81 @@
+#!/bin/bash
+
+. testing/testing-common.sh
+
+cleanup_testing
+
+LOCAL=$BASEPATH/local
+TARGET=$BASEPATH/target
+
+mkdir -p $LOCAL
+mkdir -p $TARGET
+
+dd if=/dev/urandom of=$TARGET/file1 bs=1M count=2 2> /dev/null
+cp $TARGET/file1 $TARGET/copy1
+ln $TARGET/file1 $TARGET/link1
+
+run_mcachefs $TARGET $LOCAL dedup=1
+
+echo "[Test] Testing file fetching to cache"
+
+compare_files $TARGET/file1 $LOCAL/file1
+
+sleep 2
+
+echo "[Test] Identical file is deduplicated"
+
+compare_files $TARGET/copy1 $LOCAL/copy1
+
+sleep 2
+
+echo "[Test] Hard link on the target is linked from its known object"
+
+compare_files $TARGET/link1 $LOCAL/link1
+
+sleep 2
+
+NLINK=$(stat -c %h $CACHE/file1)
+if [ $NLINK -lt 4 ] ; then
+    echo "[ERR] Backing file $CACHE/file1 has $NLINK links, expected at least 4 !"
+    exit 1
+fi
+echo "[OK] Backing file $CACHE/file1 is shared ($NLINK links)"
+cat $LOCAL/.mcachefs/dedup
+
+echo "[Test] Reading back deduplicated files after a remount"
+
+stop_mcachefs $LOCAL
+run_mcachefs $TARGET $LOCAL dedup=1
+
+compare_files $TARGET/file1 $LOCAL/file1
+compare_files $TARGET/copy1 $LOCAL/copy1
+compare_files $TARGET/link1 $LOCAL/link1
+
+echo "[Test] Writing to a deduplicated file leaves the others untouched"
+
+echo "Appended to copy 1" >> $LOCAL/copy1
+
+compare_files_different $TARGET/copy1 $LOCAL/copy1
+compare_files $TARGET/file1 $LOCAL/file1
+compare_files $TARGET/link1 $LOCAL/link1
+
+echo "[Test] Hard link made through the mount stays shared after a write"
+
+ln $LOCAL/copy1 $LOCAL/ulink1
+echo "Appended to user link 1" >> $LOCAL/ulink1
+
+compare_files $LOCAL/copy1 $LOCAL/ulink1
+compare_files $TARGET/file1 $LOCAL/file1
+
+NLINK=$(stat -c %h $CACHE/copy1)
+if [ $NLINK -ne 2 ] ; then
+    echo "[ERR] Backing file $CACHE/copy1 has $NLINK links, expected 2 !"
+    exit 1
+fi
+echo "[OK] Backing file $CACHE/copy1 is linked with $CACHE/ulink1"
+
+stop_mcachefs $LOCAL
+
+echo "[OK] All tests OK!"
+
+# cleanup_testing
@@ -0,0 +1,69 @@
+#!/bin/bash
+
+. testing/testing-common.sh
+
+LOCAL=$BASEPATH/local
+TARGET=$BASEPATH/target
+
+#
+# Run once with plain writeback, and once with delta writeback of the files over 1M
+#
+for OPTIONS in "" "delta-min-size=1" ; do
+
+    cleanup_testing
+
+    mkdir -p $LOCAL
+    mkdir -p $TARGET
+
+    dd if=/dev/urandom of=$TARGET/file1 bs=1M count=4 2> /dev/null
+    dd if=/dev/urandom of=$TARGET/file2 bs=1M count=4 2> /dev/null
+
+    run_mcachefs $TARGET $LOCAL $OPTIONS
+
+    echo "[Test] Testing file fetching to cache (options : '$OPTIONS')"
+
+    compare_files $TARGET/file1 $LOCAL/file1
+    compare_files $TARGET/file2 $LOCAL/file2
+
+    sleep 2
+
+    echo "[Test] Writing into the middle of a file"
+
+    echo "Written in the middle of file 1" | dd of=$LOCAL/file1 bs=1 seek=1500000 conv=notrunc 2> /dev/null
+    compare_files_different $TARGET/file1 $LOCAL/file1
+
+    echo "[Test] Appending to a file"
+
+    echo "Appended to file 1" >> $LOCAL/file1
+
+    echo "[Test] Truncating a file, then writing past the truncation"
+
+    truncate -s 1000000 $LOCAL/file2
+    echo "Written past the truncation of file 2" | dd of=$LOCAL/file2 bs=1 seek=2000000 conv=notrunc 2> /dev/null
+    compare_files_different $TARGET/file2 $LOCAL/file2
+
+    echo "[Test] Apply journal"
+
+    echo apply_journal > $LOCAL/.mcachefs/action
+    sleep 2
+
+    compare_files $TARGET/file1 $LOCAL/file1
+    compare_files $TARGET/file2 $LOCAL/file2
+
+    echo "[Test] Writing into the middle of a file again"
+
+    echo "Written again in the middle of file 1" | dd of=$LOCAL/file1 bs=1 seek=3000000 conv=notrunc 2> /dev/null
+
+    echo "[Test] Apply journal"
+
+    echo apply_journal > $LOCAL/.mcachefs/action
+    sleep 2
+
+    compare_files $TARGET/file1 $LOCAL/file1
+
+    cat $LOCAL/.mcachefs/transfer
+
+    stop_mcachefs $LOCAL
+done
+
+echo "[OK] All tests OK!"